@@ -0,0 +1,203 @@
+/*
+ * usb_bench_main.c
+ *
+ *  Runs the benchmark matrix of usb_benchmark.h on the host build. The disk image is formatted
+ *  before each run, so all runs start from the same state.
+ *
+ *  usage: usb_bench <image> [-hs] [-virtual] [-exfat] [-ramdisk] [-size <MB>] [-cluster <bytes>] [-sector <bytes>] [-load <KB/s>] [-page <KB>]
+ *                   [-optimal <KB>] [-tune] [-seek <MB>]
+ *
+ *  -hs       attach the simulated device as high speed device
+ *  -virtual  exclude the CPU time of the host, results are reproducible
+ *  -exfat    format the image with exFAT instead of FAT32
+ *  -ramdisk  use RAMDISK_Driver on the mapped image instead of the simulated USB device,
+ *            the time base is the CPU time of the host (-hs and -virtual are ignored)
+ *  -sector   logical block size of the simulated device or sector size of the RAM disk (512 to 4096)
+ *  -load     measure the interrupt load at the given throughput instead of running the benchmark matrix,
+ *            the simulated interrupt handling times are the estimates for the STM32F429 (needs USB_IRQ_STATS=ON)
+ *  -page     flash page size of the simulated device, writes which cover a page partially are slower
+ *  -optimal  the simulated device reports this optimal transfer length and the page size as granularity in the
+ *            Block Limits VPD page, uncalibrated transfers and the formatted volume follow them
+ *  -tune     calibrate the transfer size and alignment before the benchmark (USB_CalibrateTransfers)
+ *  -seek     instead of the benchmark matrix, compare the seek time in a preallocated file of the given size on
+ *            FAT32 and exFAT, both formatted on the same image with the same cluster size (USB_BENCH_RunSeek)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usb_handler.h"
+#include "usb_benchmark.h"
+#include "ramdisk_diskio.h"
+#include "usb_sim.h"
+#include "ff.h"
+
+#define USB_BENCH_DEFAULT_IMAGE_SIZE	512		/* MB */
+#define USB_BENCH_DEFAULT_CLUSTER_SIZE	4096
+#define USB_BENCH_LOAD_DURATION			2000	/* ms per phase of the load test */
+#define USB_BENCH_TUNING_BUFFER_SIZE	(128 * 1024)	/* Largest probed transfer size */
+#define USB_BENCH_SEEK_OPS				256		/* Seeks per file system and mode of the seek test */
+
+/** Internally defined **/
+static int USB_BENCH_CheckError(const char *step, USB_ERROR err);
+
+
+int main(int argc, char **argv)
+{
+	USB_BENCH_Config benchConfig;
+	USB_MS_Handle usbHandle;
+	BOOL highSpeed = FALSE, virtualTime = FALSE, ramDisk = FALSE, tune = FALSE;
+	USB_FS_TYPE fsType = USB_FS_FAT32;
+	uint64_t imageSize = USB_BENCH_DEFAULT_IMAGE_SIZE;
+	uint32_t clusterSize = USB_BENCH_DEFAULT_CLUSTER_SIZE;
+	uint32_t loadRate = 0;
+	uint32_t pageSize = 0;
+	uint32_t optimalTransfer = 0;
+	uint64_t seekSize = 0;
+	uint32_t sectorSize = USB_SIM_DEFAULT_BLOCK_SIZE;
+	USB_SIM_Stats simStats;
+
+	if(argc < 2)
+	{
+		printf("usage: %s <image> [-hs] [-virtual] [-exfat] [-ramdisk] [-size <MB>] [-cluster <bytes>] [-sector <bytes>] [-load <KB/s>] [-page <KB>] [-optimal <KB>] [-tune] [-seek <MB>]\n", argv[0]);
+		return 1;
+	}
+	for(int i = 2; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-hs") == 0)
+			highSpeed = TRUE;
+		else if(strcmp(argv[i], "-virtual") == 0)
+			virtualTime = TRUE;
+		else if(strcmp(argv[i], "-exfat") == 0)
+			fsType = USB_FS_EXFAT;
+		else if(strcmp(argv[i], "-ramdisk") == 0)
+			ramDisk = TRUE;
+		else if(strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+			imageSize = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-cluster") == 0 && i + 1 < argc)
+			clusterSize = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-sector") == 0 && i + 1 < argc)
+			sectorSize = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-load") == 0 && i + 1 < argc)
+			loadRate = strtoul(argv[++i], NULL, 10) * 1024;
+		else if(strcmp(argv[i], "-page") == 0 && i + 1 < argc)
+			pageSize = strtoul(argv[++i], NULL, 10) * 1024;
+		else if(strcmp(argv[i], "-optimal") == 0 && i + 1 < argc)
+			optimalTransfer = strtoul(argv[++i], NULL, 10) * 1024;
+		else if(strcmp(argv[i], "-tune") == 0)
+			tune = TRUE;
+		else if(strcmp(argv[i], "-seek") == 0 && i + 1 < argc)
+			seekSize = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+		else
+		{
+			printf("unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if(ramDisk)
+	{
+		RAMDISK_Config ramConfig;
+		memset(&ramConfig, 0x00, sizeof(RAMDISK_Config));
+		ramConfig.m_ImagePath = argv[1];
+		ramConfig.m_SectorCount = (uint32_t)(imageSize * 1024 * 1024 / sectorSize);
+		ramConfig.m_SectorSize = (uint16_t)sectorSize;
+		if(USB_BENCH_CheckError("RAMDISK_Init", RAMDISK_Init(&ramConfig)))
+			return 1;
+		memset(&usbHandle, 0x00, sizeof(USB_MS_Handle));
+		usbHandle.m_FileHandle = malloc(sizeof(FIL));
+		if(FATFS_LinkDriver(&RAMDISK_Driver, usbHandle.m_USBDISKPath) != 0)
+			return 1;
+	}
+	else
+	{
+		USB_SIM_Config simConfig;
+		USB_SIM_GetDefaultConfig(&simConfig);
+		simConfig.m_VirtualTimeOnly = virtualTime;
+		simConfig.m_HighSpeed = highSpeed;
+		simConfig.m_ImagePath = argv[1];
+		simConfig.m_ImageSize = imageSize * 1024 * 1024;
+		simConfig.m_BlockSize = sectorSize;
+		simConfig.m_WritePageBytes = pageSize;
+		simConfig.m_OptimalTransferBytes = optimalTransfer;
+		if(loadRate)
+		{
+			simConfig.m_IRQNsPerPacket = USB_SIM_F429_IRQ_NS_PER_PACKET;
+			simConfig.m_IRQNsPerKB = USB_SIM_F429_IRQ_NS_PER_KB;
+		}
+		if(USB_BENCH_CheckError("USB_SIM_Init", USB_SIM_Init(&simConfig)))
+			return 1;
+		if(USB_BENCH_CheckError("USB_InitConnection", USB_InitConnection(&usbHandle)))
+			return 1;
+		if(USB_BENCH_CheckError("USB_ExecuteStateMachine", USB_ExecuteStateMachine(&usbHandle, 10000)))
+			return 1;
+	}
+
+	if(USB_BENCH_CheckError("USB_FormatDrive", USB_FormatDrive(fsType, clusterSize)))
+		return 1;
+
+	printf("%s, %s, %llu MB, cluster size %lu, sector size %lu\n", ramDisk ? "RAM disk" : (highSpeed ? "high speed" : "full speed"),
+			(fsType == USB_FS_EXFAT) ? "exFAT" : "FAT32", (unsigned long long)imageSize, (unsigned long)clusterSize,
+			(unsigned long)sectorSize);
+	if(tune && !ramDisk)
+	{
+		if(USB_BENCH_CheckError("USB_BENCH_RunCalibration", USB_BENCH_RunCalibration(USB_BENCH_TUNING_BUFFER_SIZE)))
+			return 1;
+	}
+	if(loadRate)
+	{
+		if(USB_BENCH_CheckError("USB_BENCH_RunCpuLoad", USB_BENCH_RunCpuLoad(&usbHandle, loadRate, USB_BENCH_LOAD_DURATION)))
+			return 1;
+	}
+	else if(seekSize)
+	{
+		// Both file systems on the same image with the same cluster size
+		static const USB_FS_TYPE seekTypes[] = { USB_FS_FAT32, USB_FS_EXFAT };
+		for(uint32_t i = 0; i < sizeof(seekTypes) / sizeof(seekTypes[0]); i++)
+		{
+			if(USB_BENCH_CheckError("USB_FormatDrive", USB_FormatDrive(seekTypes[i], clusterSize)))
+				return 1;
+			printf("%s, %llu MB file\n", (seekTypes[i] == USB_FS_EXFAT) ? "exFAT" : "FAT32", (unsigned long long)(seekSize / 1024 / 1024));
+			if(USB_BENCH_CheckError("USB_BENCH_RunSeek", USB_BENCH_RunSeek(&usbHandle, seekSize, USB_BENCH_SEEK_OPS)))
+				return 1;
+		}
+	}
+	else
+	{
+		USB_BENCH_GetDefaultConfig(&benchConfig);
+		if(!ramDisk)
+			USB_SIM_ResetStats();
+		if(USB_BENCH_CheckError("USB_BENCH_Run", USB_BENCH_Run(&usbHandle, &benchConfig)))
+			return 1;
+		if(!ramDisk)
+		{
+			// Payload per command grows with the block size, FatFs transfers at least one sector
+			USB_SIM_GetStats(&simStats);
+			printf("media commands: read %llu, write %llu, %.1f KB per command\n",
+					(unsigned long long)simStats.m_ReadCommands, (unsigned long long)simStats.m_WriteCommands,
+					(simStats.m_ReadCommands + simStats.m_WriteCommands) ? (double)(simStats.m_BytesRead + simStats.m_BytesWritten)
+					/ 1024.0 / (double)(simStats.m_ReadCommands + simStats.m_WriteCommands) : 0.0);
+		}
+	}
+
+	if(ramDisk)
+	{
+		FATFS_UnLinkDriver(usbHandle.m_USBDISKPath);
+		free(usbHandle.m_FileHandle);
+		RAMDISK_DeInit();
+	}
+	else
+	{
+		USB_DeInitConnection(&usbHandle);
+		USB_SIM_DeInit();
+	}
+	return 0;
+}
+
+static int USB_BENCH_CheckError(const char *step, USB_ERROR err)
+{
+	if(err.m_ErrCode == USB_NO_ERROR)
+		return 0;
+	printf("%s: %s\n", step, USB_ReturnErrorCodeStr(err));
+	return 1;
+}
@@ -0,0 +1,961 @@
+/*
+ * usb_msc_sim.c
+ *
+ *  Simulated USB mass storage device (bulk only transport, SCSI transparent command set) backed by
+ *  a disk image file. Handles the standard requests required for enumeration, the BOT class requests
+ *  and the SCSI commands issued by the MSC class of the USB host library.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "usb_sim.h"
+
+#define USB_SIM_FS_MPS				64
+#define USB_SIM_HS_MPS				512
+#define USB_SIM_EP0_MPS				64
+#define USB_SIM_BULK_IN_EP			0x81
+#define USB_SIM_BULK_OUT_EP			0x01
+
+#define USB_SIM_CBW_SIGNATURE		0x43425355
+#define USB_SIM_CSW_SIGNATURE		0x53425355
+#define USB_SIM_CBW_LENGTH			31
+#define USB_SIM_CSW_LENGTH			13
+
+#define USB_SIM_CSW_PASSED			0x00
+#define USB_SIM_CSW_FAILED			0x01
+#define USB_SIM_CSW_PHASE_ERROR		0x02
+
+/* Sense keys and additional sense codes */
+#define USB_SIM_SENSE_NO_SENSE			0x00
+#define USB_SIM_SENSE_ILLEGAL_REQUEST	0x05
+#define USB_SIM_SENSE_MEDIUM_ERROR		0x03
+#define USB_SIM_SENSE_UNIT_ATTENTION	0x06
+#define USB_SIM_ASC_INVALID_OPCODE		0x20
+#define USB_SIM_ASC_LBA_OUT_OF_RANGE	0x21
+#define USB_SIM_ASC_INVALID_FIELD_IN_CDB	0x24
+#define USB_SIM_ASC_UNRECOVERED_READ_ERROR	0x11
+#define USB_SIM_ASC_WRITE_ERROR			0x0C
+#define USB_SIM_ASC_MEDIUM_CHANGED		0x28
+
+/* SCSI operation codes */
+#define USB_SIM_SCSI_TEST_UNIT_READY	0x00
+#define USB_SIM_SCSI_REQUEST_SENSE		0x03
+#define USB_SIM_SCSI_INQUIRY			0x12
+#define USB_SIM_SCSI_MODE_SENSE6		0x1A
+#define USB_SIM_SCSI_START_STOP_UNIT	0x1B
+#define USB_SIM_SCSI_PREVENT_ALLOW		0x1E
+#define USB_SIM_SCSI_READ_CAPACITY10	0x25
+#define USB_SIM_SCSI_READ10				0x28
+#define USB_SIM_SCSI_WRITE10			0x2A
+#define USB_SIM_SCSI_VERIFY10			0x2F
+#define USB_SIM_SCSI_SYNCHRONIZE_CACHE10	0x35
+#define USB_SIM_SCSI_UNMAP				0x42
+#define USB_SIM_SCSI_READ16				0x88
+#define USB_SIM_SCSI_WRITE16			0x8A
+#define USB_SIM_SCSI_SERVICE_ACTION_IN16	0x9E
+#define USB_SIM_SA_READ_CAPACITY16		0x10
+#define USB_SIM_WRITE_FUA				0x08
+#define USB_SIM_INQUIRY_EVPD			0x01
+
+/* VPD pages */
+#define USB_SIM_VPD_SUPPORTED			0x00
+#define USB_SIM_VPD_BLOCK_LIMITS		0xB0
+#define USB_SIM_VPD_BLOCK_CHARACTERISTICS	0xB1
+#define USB_SIM_VPD_PROVISIONING		0xB2
+#define USB_SIM_VPD_PAGE_LENGTH			0x3C
+
+/* Mode pages */
+#define USB_SIM_MODE_PAGE_CACHING		0x08
+#define USB_SIM_MODE_ALL_PAGES			0x3F
+#define USB_SIM_MODE_DPOFUA				0x10
+#define USB_SIM_CACHING_WCE				0x04
+
+/* Write cache with m_WriteCache: writing the cached data to the flash and the additional time of a write with FUA */
+#define USB_SIM_CACHE_FLUSH_NS			2000000
+#define USB_SIM_FUA_WRITE_NS			500000
+
+/* Unmap limits of the Block Limits page */
+#define USB_SIM_MAX_UNMAP_BLOCKS		0x10000
+#define USB_SIM_MAX_UNMAP_DESCRIPTORS	4
+
+/* Size of the response buffer of commands which do not access the media. */
+#define USB_SIM_RESPONSE_SIZE		256
+
+typedef enum {
+	USB_SIM_BOT_CBW,
+	USB_SIM_BOT_DATA_IN,
+	USB_SIM_BOT_DATA_OUT,
+	USB_SIM_BOT_CSW
+} USB_SIM_BOT_STATE;
+
+typedef struct {
+	/* Control endpoint */
+	uint8_t m_Setup[8];
+	uint8_t m_CtrlData[USB_SIM_RESPONSE_SIZE];
+	uint32_t m_CtrlLen;
+	uint32_t m_CtrlPos;
+	BOOL m_CtrlStall;
+
+	/* Bulk only transport */
+	USB_SIM_BOT_STATE m_BotState;
+	BOOL m_InHalted;
+	BOOL m_OutHalted;
+	BOOL m_ResetRequired;		/* CLEAR_FEATURE does not clear the halts until the Bulk-Only Mass Storage Reset */
+	BOOL m_PortResetRequired;	/* Neither CLEAR_FEATURE nor the Bulk-Only Mass Storage Reset clear the halts */
+	uint32_t m_Tag;
+	uint32_t m_DataLength;		/* dCBWDataTransferLength of the current command */
+	uint32_t m_DataPos;
+	uint8_t m_Status;
+
+	/* Current command */
+	uint8_t m_Opcode;
+	uint64_t m_MediaOffset;		/* Image offset of READ10/WRITE10 */
+	uint32_t m_MediaLength;		/* Bytes of the data phase which access the media */
+	uint8_t m_Response[USB_SIM_RESPONSE_SIZE];
+	uint32_t m_ResponseLen;
+
+	/* Sense data of the last failed command */
+	uint8_t m_SenseKey;
+	uint8_t m_ASC;
+	uint8_t m_ASCQ;
+} USB_SIM_Device;
+
+static USB_SIM_Config simConfig;
+static USB_SIM_Stats simStats;
+static USB_SIM_Device simDevice;
+static int simImage = -1;
+static uint64_t simBlockCount = 0;
+static uint64_t simMediaCBWs = 0;		/* READ10/WRITE10 CBWs received, selects the injected faults */
+static BOOL simMediumChanged = FALSE;	/* UNIT ATTENTION pending, survives bus resets */
+static BOOL simCacheDirty = FALSE;		/* Data written without FUA since the last SYNCHRONIZE CACHE */
+
+/** Internally defined **/
+static USB_SIM_XFER_RESULT USB_SIM_ControlTransfer(uint8_t epAddr, BOOL setup, uint8_t *buffer, uint32_t length, uint32_t *xferCount);
+static BOOL USB_SIM_HandleSetup();
+static uint32_t USB_SIM_GetDescriptor(uint8_t type, uint8_t index, uint8_t *buffer);
+static USB_SIM_XFER_RESULT USB_SIM_BulkOut(uint8_t *buffer, uint32_t length, uint32_t *xferCount);
+static USB_SIM_XFER_RESULT USB_SIM_BulkIn(uint8_t *buffer, uint32_t length, uint32_t *xferCount);
+static void USB_SIM_ExecuteCommand(const uint8_t *cb);
+static void USB_SIM_InquiryVPD(uint8_t page, uint8_t *response);
+static void USB_SIM_Unmap(const uint8_t *parameters, uint32_t length);
+static void USB_SIM_SetSense(uint8_t senseKey, uint8_t asc, uint8_t ascq);
+static BOOL USB_SIM_InjectFault(const uint8_t *cbw);
+static void USB_SIM_AddDeviceTime(uint64_t ns);
+static uint64_t USB_SIM_PartialPageNs(uint64_t offset, uint32_t length);
+
+/** Helper functions **/
+static uint32_t USB_SIM_GetBE32(const uint8_t *buffer);
+static void USB_SIM_SetBE32(uint8_t *buffer, uint32_t value);
+static uint32_t USB_SIM_GetLE32(const uint8_t *buffer);
+static void USB_SIM_SetLE32(uint8_t *buffer, uint32_t value);
+
+
+/**
+ * @brief Fills a configuration with the default parameters: full speed device like the embedded PHY of the
+ * 		  STM32F429-DISC1, 512 byte blocks and latencies of a typical USB flash drive.
+ * @param config configuration to fill.
+ */
+void USB_SIM_GetDefaultConfig(USB_SIM_Config *config)
+{
+	if(!config)
+		return;
+	memset(config, 0x00, sizeof(USB_SIM_Config));
+	config->m_BlockSize = USB_SIM_DEFAULT_BLOCK_SIZE;
+	config->m_HighSpeed = FALSE;
+	config->m_CommandLatencyNs = 200000;
+	config->m_ReadNsPerKB = 40000;
+	config->m_WriteNsPerKB = 100000;
+	config->m_VirtualTimeOnly = FALSE;
+}
+
+/**
+ * @brief Opens the disk image and plugs in the simulated device. Must be called before USB_InitConnection.
+ * @param config configuration of the simulation, m_ImagePath is required.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_SIM_Init(const USB_SIM_Config *config)
+{
+	struct stat imageStat;
+
+	if(!config || !config->m_ImagePath)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(config->m_BlockSize != 0 && (config->m_BlockSize < 512 || (config->m_BlockSize & (config->m_BlockSize - 1))))
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(simImage >= 0)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+
+	simConfig = *config;
+	if(simConfig.m_BlockSize == 0)
+		simConfig.m_BlockSize = USB_SIM_DEFAULT_BLOCK_SIZE;
+
+	simImage = open(simConfig.m_ImagePath, O_RDWR | O_CREAT, 0644);
+	if(simImage < 0)
+		return (USB_ERROR) {USB_FILE_UNAVAILABLE, __LINE__};
+
+	if(fstat(simImage, &imageStat) != 0)
+	{
+		USB_SIM_DeInit();
+		return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+	}
+	uint64_t imageSize = (uint64_t)imageStat.st_size;
+	if(simConfig.m_ImageSize > imageSize)
+	{
+		// Sparse extension, unwritten blocks read as zero
+		if(ftruncate(simImage, (off_t)simConfig.m_ImageSize) != 0)
+		{
+			USB_SIM_DeInit();
+			return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+		}
+		imageSize = simConfig.m_ImageSize;
+	}
+
+	simBlockCount = imageSize / simConfig.m_BlockSize;
+	if(simBlockCount == 0)
+	{
+		USB_SIM_DeInit();
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	}
+
+	simMediaCBWs = 0;
+	simCacheDirty = FALSE;
+	USB_SIM_ResetStats();
+	USB_SIM_DeviceReset();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Unplugs the simulated device and closes the disk image.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_SIM_DeInit()
+{
+	if(simImage < 0)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+	int ret = close(simImage);
+	simImage = -1;
+	simConfig.m_ImagePath = NULL;
+	if(ret != 0)
+		return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Returns the counters of the simulated device and bus since the last reset.
+ * @param stats returns the counters.
+ */
+void USB_SIM_GetStats(USB_SIM_Stats *stats)
+{
+	if(stats)
+		*stats = simStats;
+}
+
+void USB_SIM_ResetStats()
+{
+	memset(&simStats, 0x00, sizeof(USB_SIM_Stats));
+}
+
+const USB_SIM_Config *USB_SIM_GetConfig()
+{
+	return &simConfig;
+}
+
+USB_SIM_Stats *USB_SIM_GetStatsRef()
+{
+	return &simStats;
+}
+
+/**
+ * @brief Bus reset, the device returns to the default state. Sense data survives the reset.
+ */
+void USB_SIM_DeviceReset()
+{
+	uint8_t senseKey = simDevice.m_SenseKey, asc = simDevice.m_ASC, ascq = simDevice.m_ASCQ;
+	memset(&simDevice, 0x00, sizeof(USB_SIM_Device));
+	simDevice.m_BotState = USB_SIM_BOT_CBW;
+	USB_SIM_SetSense(senseKey, asc, ascq);
+}
+
+/**
+ * @brief Simulates the exchange of the medium. The next command except INQUIRY and REQUEST SENSE fails with
+ * 		  UNIT ATTENTION "medium may have changed", the image stays the same.
+ */
+void USB_SIM_ChangeMedium()
+{
+	simMediumChanged = TRUE;
+}
+
+uint16_t USB_SIM_DeviceMaxPacketSize()
+{
+	return simConfig.m_HighSpeed ? USB_SIM_HS_MPS : USB_SIM_FS_MPS;
+}
+
+/**
+ * @brief Transfers the data of an URB between host controller and device.
+ * @param epAddr endpoint address, bit 7 is set for IN transfers.
+ * @param setup TRUE if the URB is the setup stage of a control transfer.
+ * @param buffer data to send or buffer to receive data.
+ * @param length length of the URB.
+ * @param xferCount returns the number of transferred bytes.
+ * @return result of the transfer.
+ */
+USB_SIM_XFER_RESULT USB_SIM_DeviceTransfer(uint8_t epAddr, BOOL setup, uint8_t *buffer, uint32_t length, uint32_t *xferCount)
+{
+	*xferCount = 0;
+	if(simImage < 0)
+		return USB_SIM_XFER_NAK;
+
+	if((epAddr & 0x7F) == 0)
+		return USB_SIM_ControlTransfer(epAddr, setup, buffer, length, xferCount);
+	if(epAddr == USB_SIM_BULK_OUT_EP)
+		return simDevice.m_OutHalted ? USB_SIM_XFER_STALL : USB_SIM_BulkOut(buffer, length, xferCount);
+	if(epAddr == USB_SIM_BULK_IN_EP)
+		return simDevice.m_InHalted ? USB_SIM_XFER_STALL : USB_SIM_BulkIn(buffer, length, xferCount);
+	return USB_SIM_XFER_STALL;
+}
+
+/**
+ * @brief Handles the setup, data and status stages of control transfers.
+ */
+static USB_SIM_XFER_RESULT USB_SIM_ControlTransfer(uint8_t epAddr, BOOL setup, uint8_t *buffer, uint32_t length, uint32_t *xferCount)
+{
+	if(setup)
+	{
+		if(length != 8)
+			return USB_SIM_XFER_STALL;
+		memcpy(simDevice.m_Setup, buffer, 8);
+		simDevice.m_CtrlPos = 0;
+		simDevice.m_CtrlLen = 0;
+		simDevice.m_CtrlStall = !USB_SIM_HandleSetup();
+		*xferCount = 8;
+		return USB_SIM_XFER_DONE;
+	}
+
+	if(simDevice.m_CtrlStall)
+		return USB_SIM_XFER_STALL;
+
+	BOOL deviceToHost = (simDevice.m_Setup[0] & 0x80) != 0;
+	if((epAddr & 0x80) && deviceToHost && simDevice.m_CtrlPos < simDevice.m_CtrlLen)
+	{
+		// Data stage
+		uint32_t len = simDevice.m_CtrlLen - simDevice.m_CtrlPos;
+		if(len > length)
+			len = length;
+		memcpy(buffer, &simDevice.m_CtrlData[simDevice.m_CtrlPos], len);
+		simDevice.m_CtrlPos += len;
+		*xferCount = len;
+		return USB_SIM_XFER_DONE;
+	}
+
+	// Status stage or OUT data stage (no supported request carries OUT data)
+	*xferCount = (epAddr & 0x80) ? 0 : length;
+	return USB_SIM_XFER_DONE;
+}
+
+/**
+ * @brief Executes a standard or class request.
+ * @return FALSE if the request is not supported and the control endpoint has to be stalled.
+ */
+static BOOL USB_SIM_HandleSetup()
+{
+	uint8_t requestType = simDevice.m_Setup[0];
+	uint8_t request = simDevice.m_Setup[1];
+	uint16_t value = simDevice.m_Setup[2] | (simDevice.m_Setup[3] << 8);
+	uint16_t index = simDevice.m_Setup[4] | (simDevice.m_Setup[5] << 8);
+	uint16_t length = simDevice.m_Setup[6] | (simDevice.m_Setup[7] << 8);
+	uint32_t len = 0;
+
+	switch(requestType)
+	{
+	case 0x80: // Standard, device to host, device
+		if(request == 0x06) // GET_DESCRIPTOR
+			len = USB_SIM_GetDescriptor(value >> 8, value & 0xFF, simDevice.m_CtrlData);
+		else if(request == 0x08) // GET_CONFIGURATION
+		{
+			simDevice.m_CtrlData[0] = 1;
+			len = 1;
+		}
+		else if(request == 0x00) // GET_STATUS
+		{
+			memset(simDevice.m_CtrlData, 0x00, 2);
+			len = 2;
+		}
+		if(len == 0)
+			return FALSE;
+		break;
+	case 0x00: // Standard, host to device, device
+		if(request != 0x05 && request != 0x09 && request != 0x03) // SET_ADDRESS, SET_CONFIGURATION, SET_FEATURE
+			return FALSE;
+		break;
+	case 0x01: // Standard, host to device, interface
+		if(request != 0x0B) // SET_INTERFACE
+			return FALSE;
+		break;
+	case 0x02: // Standard, host to device, endpoint
+		if(request == 0x01 && value == 0) // CLEAR_FEATURE(ENDPOINT_HALT)
+		{
+			if(simDevice.m_ResetRequired || simDevice.m_PortResetRequired)
+				break;
+			if((index & 0xFF) == USB_SIM_BULK_IN_EP)
+				simDevice.m_InHalted = FALSE;
+			else if((index & 0xFF) == USB_SIM_BULK_OUT_EP)
+				simDevice.m_OutHalted = FALSE;
+		}
+		else if(request == 0x03 && value == 0) // SET_FEATURE(ENDPOINT_HALT)
+		{
+			if((index & 0xFF) == USB_SIM_BULK_IN_EP)
+				simDevice.m_InHalted = TRUE;
+			else if((index & 0xFF) == USB_SIM_BULK_OUT_EP)
+				simDevice.m_OutHalted = TRUE;
+		}
+		else
+			return FALSE;
+		break;
+	case 0xA1: // Class, device to host, interface
+		if(request != 0xFE) // GET_MAX_LUN
+			return FALSE;
+		simDevice.m_CtrlData[0] = 0;
+		len = 1;
+		break;
+	case 0x21: // Class, host to device, interface
+		if(request != 0xFF) // Bulk-Only Mass Storage Reset
+			return FALSE;
+		simDevice.m_BotState = USB_SIM_BOT_CBW;
+		simDevice.m_ResetRequired = FALSE;
+		break;
+	default:
+		return FALSE;
+	}
+
+	simDevice.m_CtrlLen = (len < length) ? len : length;
+	return TRUE;
+}
+
+/**
+ * @brief Builds the device, configuration and string descriptors.
+ * @return length of the descriptor, 0 if the descriptor does not exist.
+ */
+static uint32_t USB_SIM_GetDescriptor(uint8_t type, uint8_t index, uint8_t *buffer)
+{
+	static const char *strings[] = { NULL, "STMicroelectronics", "STM32 USB Lib simulated disk", "000000000001" };
+	uint16_t mps = USB_SIM_DeviceMaxPacketSize();
+
+	if(type == 0x01) // Device
+	{
+		const uint8_t device[18] = { 18, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, USB_SIM_EP0_MPS,
+				0x83, 0x04, 0x20, 0x57, 0x00, 0x01, 1, 2, 3, 1 };
+		memcpy(buffer, device, sizeof(device));
+		return sizeof(device);
+	}
+	if(type == 0x02) // Configuration, interface and endpoints
+	{
+		const uint8_t config[32] = {
+				9, 0x02, 32, 0, 1, 1, 0, 0x80, 50,
+				9, 0x04, 0, 0, 2, 0x08, 0x06, 0x50, 0,
+				7, 0x05, USB_SIM_BULK_IN_EP, 0x02, mps & 0xFF, mps >> 8, 0,
+				7, 0x05, USB_SIM_BULK_OUT_EP, 0x02, mps & 0xFF, mps >> 8, 0 };
+		memcpy(buffer, config, sizeof(config));
+		return sizeof(config);
+	}
+	if(type == 0x03) // String
+	{
+		if(index == 0)
+		{
+			const uint8_t languages[4] = { 4, 0x03, 0x09, 0x04 };
+			memcpy(buffer, languages, sizeof(languages));
+			return sizeof(languages);
+		}
+		if(index >= sizeof(strings) / sizeof(strings[0]))
+			return 0;
+		uint32_t len = strlen(strings[index]);
+		buffer[0] = (uint8_t)(2 + 2 * len);
+		buffer[1] = 0x03;
+		for(uint32_t i = 0; i < len; i++)
+		{
+			buffer[2 + 2 * i] = strings[index][i];
+			buffer[3 + 2 * i] = 0;
+		}
+		return buffer[0];
+	}
+	return 0;
+}
+
+/**
+ * @brief Receives a CBW or the data of the OUT data phase.
+ */
+static USB_SIM_XFER_RESULT USB_SIM_BulkOut(uint8_t *buffer, uint32_t length, uint32_t *xferCount)
+{
+	if(simDevice.m_BotState == USB_SIM_BOT_CBW)
+	{
+		if(length != USB_SIM_CBW_LENGTH || USB_SIM_GetLE32(buffer) != USB_SIM_CBW_SIGNATURE)
+		{
+			// Invalid CBW, both endpoints stay halted until the reset recovery
+			simDevice.m_InHalted = TRUE;
+			simDevice.m_OutHalted = TRUE;
+			simDevice.m_ResetRequired = TRUE;
+			return USB_SIM_XFER_STALL;
+		}
+		if(USB_SIM_InjectFault(buffer))
+			return USB_SIM_XFER_STALL;
+		simDevice.m_Tag = USB_SIM_GetLE32(&buffer[4]);
+		simDevice.m_DataLength = USB_SIM_GetLE32(&buffer[8]);
+		simDevice.m_DataPos = 0;
+		*xferCount = length;
+
+		if(buffer[13] != 0)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			simDevice.m_MediaLength = 0;
+			simDevice.m_ResponseLen = 0;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+		}
+		else
+			USB_SIM_ExecuteCommand(&buffer[15]);
+
+		if(simDevice.m_DataLength == 0)
+			simDevice.m_BotState = USB_SIM_BOT_CSW;
+		else
+			simDevice.m_BotState = (buffer[12] & 0x80) ? USB_SIM_BOT_DATA_IN : USB_SIM_BOT_DATA_OUT;
+		return USB_SIM_XFER_DONE;
+	}
+
+	if(simDevice.m_BotState != USB_SIM_BOT_DATA_OUT)
+		return USB_SIM_XFER_NAK;
+
+	uint32_t len = simDevice.m_DataLength - simDevice.m_DataPos;
+	if(len > length)
+		len = length;
+	if(simDevice.m_DataPos < simDevice.m_MediaLength)
+	{
+		uint32_t mediaLen = simDevice.m_MediaLength - simDevice.m_DataPos;
+		if(mediaLen > len)
+			mediaLen = len;
+		if(pwrite(simImage, buffer, mediaLen, (off_t)(simDevice.m_MediaOffset + simDevice.m_DataPos)) != (ssize_t)mediaLen)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_MEDIUM_ERROR, USB_SIM_ASC_WRITE_ERROR, 0);
+		}
+		simStats.m_BytesWritten += mediaLen;
+		USB_SIM_AddDeviceTime((uint64_t)mediaLen * simConfig.m_WriteNsPerKB / 1024);
+	}
+	else if(simDevice.m_MediaLength == 0 && simDevice.m_DataPos < USB_SIM_RESPONSE_SIZE)
+	{
+		// Parameter list, e.g. of UNMAP
+		uint32_t paramLen = USB_SIM_RESPONSE_SIZE - simDevice.m_DataPos;
+		memcpy(&simDevice.m_Response[simDevice.m_DataPos], buffer, (paramLen < len) ? paramLen : len);
+	}
+	simDevice.m_DataPos += len;
+	*xferCount = len;
+	if(simDevice.m_DataPos >= simDevice.m_DataLength)
+	{
+		simDevice.m_BotState = USB_SIM_BOT_CSW;
+		if(simDevice.m_Opcode == USB_SIM_SCSI_UNMAP && simDevice.m_Status == USB_SIM_CSW_PASSED)
+			USB_SIM_Unmap(simDevice.m_Response, simDevice.m_DataLength);
+	}
+	return USB_SIM_XFER_DONE;
+}
+
+/**
+ * @brief Sends the data of the IN data phase or the CSW. Responses shorter than the requested
+ * 		  length are padded with zeros, the MSC class of the host library expects the full length.
+ */
+static USB_SIM_XFER_RESULT USB_SIM_BulkIn(uint8_t *buffer, uint32_t length, uint32_t *xferCount)
+{
+	if(simDevice.m_BotState == USB_SIM_BOT_CSW)
+	{
+		if(length < USB_SIM_CSW_LENGTH)
+			return USB_SIM_XFER_STALL;
+		USB_SIM_SetLE32(&buffer[0], USB_SIM_CSW_SIGNATURE);
+		USB_SIM_SetLE32(&buffer[4], simDevice.m_Tag);
+		USB_SIM_SetLE32(&buffer[8], 0);
+		buffer[12] = simDevice.m_Status;
+		simDevice.m_BotState = USB_SIM_BOT_CBW;
+		*xferCount = USB_SIM_CSW_LENGTH;
+		return USB_SIM_XFER_DONE;
+	}
+
+	if(simDevice.m_BotState != USB_SIM_BOT_DATA_IN)
+		return USB_SIM_XFER_NAK;
+
+	uint32_t len = simDevice.m_DataLength - simDevice.m_DataPos;
+	if(len > length)
+		len = length;
+	memset(buffer, 0x00, len);
+	if(simDevice.m_MediaLength > 0)
+	{
+		if(simDevice.m_DataPos < simDevice.m_MediaLength)
+		{
+			uint32_t mediaLen = simDevice.m_MediaLength - simDevice.m_DataPos;
+			if(mediaLen > len)
+				mediaLen = len;
+			if(pread(simImage, buffer, mediaLen, (off_t)(simDevice.m_MediaOffset + simDevice.m_DataPos)) < 0)
+			{
+				simDevice.m_Status = USB_SIM_CSW_FAILED;
+				USB_SIM_SetSense(USB_SIM_SENSE_MEDIUM_ERROR, USB_SIM_ASC_UNRECOVERED_READ_ERROR, 0);
+			}
+			simStats.m_BytesRead += mediaLen;
+			USB_SIM_AddDeviceTime((uint64_t)mediaLen * simConfig.m_ReadNsPerKB / 1024);
+		}
+	}
+	else if(simDevice.m_DataPos < simDevice.m_ResponseLen)
+	{
+		uint32_t responseLen = simDevice.m_ResponseLen - simDevice.m_DataPos;
+		memcpy(buffer, &simDevice.m_Response[simDevice.m_DataPos], (responseLen < len) ? responseLen : len);
+	}
+	simDevice.m_DataPos += len;
+	*xferCount = len;
+	if(simDevice.m_DataPos >= simDevice.m_DataLength)
+		simDevice.m_BotState = USB_SIM_BOT_CSW;
+	return USB_SIM_XFER_DONE;
+}
+
+/**
+ * @brief Decodes a command block and prepares the data phase and the status of the CSW.
+ * @param cb command block of the CBW.
+ */
+static void USB_SIM_ExecuteCommand(const uint8_t *cb)
+{
+	uint8_t *response = simDevice.m_Response;
+
+	simDevice.m_Opcode = cb[0];
+	simDevice.m_Status = USB_SIM_CSW_PASSED;
+	simDevice.m_MediaOffset = 0;
+	simDevice.m_MediaLength = 0;
+	simDevice.m_ResponseLen = 0;
+	memset(response, 0x00, USB_SIM_RESPONSE_SIZE);
+
+	simStats.m_Commands++;
+	USB_SIM_AddDeviceTime(simConfig.m_CommandLatencyNs);
+
+	if(simMediumChanged && cb[0] != USB_SIM_SCSI_INQUIRY && cb[0] != USB_SIM_SCSI_REQUEST_SENSE)
+	{
+		// No data is transferred to or from the media
+		simMediumChanged = FALSE;
+		simDevice.m_Status = USB_SIM_CSW_FAILED;
+		USB_SIM_SetSense(USB_SIM_SENSE_UNIT_ATTENTION, USB_SIM_ASC_MEDIUM_CHANGED, 0);
+		simStats.m_FailedCommands++;
+		return;
+	}
+
+	switch(cb[0])
+	{
+	case USB_SIM_SCSI_TEST_UNIT_READY:
+	case USB_SIM_SCSI_START_STOP_UNIT:
+	case USB_SIM_SCSI_PREVENT_ALLOW:
+	case USB_SIM_SCSI_VERIFY10:
+		break;
+
+	case USB_SIM_SCSI_SYNCHRONIZE_CACHE10:
+		if(simConfig.m_WriteCache && simCacheDirty)
+		{
+			simCacheDirty = FALSE;
+			simStats.m_CacheFlushes++;
+			USB_SIM_AddDeviceTime(USB_SIM_CACHE_FLUSH_NS);
+		}
+		break;
+
+	case USB_SIM_SCSI_REQUEST_SENSE:
+		response[0] = 0x70;
+		response[2] = simDevice.m_SenseKey;
+		response[7] = 10;
+		response[12] = simDevice.m_ASC;
+		response[13] = simDevice.m_ASCQ;
+		simDevice.m_ResponseLen = 18;
+		USB_SIM_SetSense(USB_SIM_SENSE_NO_SENSE, 0, 0);
+		return;
+
+	case USB_SIM_SCSI_INQUIRY:
+		if(cb[1] & USB_SIM_INQUIRY_EVPD)
+		{
+			USB_SIM_InquiryVPD(cb[2], response);
+			break;
+		}
+		response[0] = 0x00;	// Direct access block device
+		response[1] = 0x80;	// Removable medium
+		response[2] = simConfig.m_OptimalTransferBytes ? 0x05 : 0x04;	// SPC-3 or SPC-2
+		response[3] = 0x02;
+		response[4] = 31;
+		memcpy(&response[8], "STM32SIM", 8);
+		memcpy(&response[16], "Disk Image      ", 16);
+		memcpy(&response[32], "0001", 4);
+		simDevice.m_ResponseLen = 36;
+		break;
+
+	case USB_SIM_SCSI_UNMAP:
+		// Logical block provisioning is reported with the VPD pages of an SPC-3 device
+		if(!simConfig.m_OptimalTransferBytes)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_OPCODE, 0);
+		}
+		else if((uint32_t)((cb[7] << 8) | cb[8]) > USB_SIM_RESPONSE_SIZE)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+		}
+		break;
+
+	case USB_SIM_SCSI_MODE_SENSE6:
+		response[0] = 3;
+		simDevice.m_ResponseLen = 4;
+		if(!simConfig.m_WriteCache)
+			break;
+		response[2] = USB_SIM_MODE_DPOFUA;
+		if((cb[2] & 0x3F) == USB_SIM_MODE_PAGE_CACHING || (cb[2] & 0x3F) == USB_SIM_MODE_ALL_PAGES)
+		{
+			response[4] = USB_SIM_MODE_PAGE_CACHING;
+			response[5] = 0x12;
+			response[6] = USB_SIM_CACHING_WCE;
+			response[0] = 3 + 20;
+			simDevice.m_ResponseLen = 4 + 20;
+		}
+		break;
+
+	case USB_SIM_SCSI_READ_CAPACITY10:
+		USB_SIM_SetBE32(&response[0], (simBlockCount - 1 > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)(simBlockCount - 1));
+		USB_SIM_SetBE32(&response[4], simConfig.m_BlockSize);
+		simDevice.m_ResponseLen = 8;
+		break;
+
+	case USB_SIM_SCSI_SERVICE_ACTION_IN16:
+		if((cb[1] & 0x1F) != USB_SIM_SA_READ_CAPACITY16)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+			break;
+		}
+		USB_SIM_SetBE32(&response[0], (uint32_t)((simBlockCount - 1) >> 32));
+		USB_SIM_SetBE32(&response[4], (uint32_t)(simBlockCount - 1));
+		USB_SIM_SetBE32(&response[8], simConfig.m_BlockSize);
+		simDevice.m_ResponseLen = 32;
+		break;
+
+	case USB_SIM_SCSI_READ10:
+	case USB_SIM_SCSI_WRITE10:
+	case USB_SIM_SCSI_READ16:
+	case USB_SIM_SCSI_WRITE16:
+	{
+		BOOL cdb16 = (cb[0] == USB_SIM_SCSI_READ16 || cb[0] == USB_SIM_SCSI_WRITE16);
+		uint64_t lba = cdb16 ? ((uint64_t)USB_SIM_GetBE32(&cb[2]) << 32) | USB_SIM_GetBE32(&cb[6]) : USB_SIM_GetBE32(&cb[2]);
+		uint32_t blocks = cdb16 ? USB_SIM_GetBE32(&cb[10]) : (uint32_t)((cb[7] << 8) | cb[8]);
+		if(lba + blocks > simBlockCount)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_LBA_OUT_OF_RANGE, 0);
+			break;
+		}
+		simDevice.m_MediaOffset = lba * simConfig.m_BlockSize;
+		simDevice.m_MediaLength = blocks * simConfig.m_BlockSize;
+		if(simDevice.m_MediaLength > simDevice.m_DataLength)
+		{
+			// Host expects less data than the command transfers
+			simDevice.m_MediaLength = simDevice.m_DataLength;
+			simDevice.m_Status = USB_SIM_CSW_PHASE_ERROR;
+		}
+		if(cb[0] == USB_SIM_SCSI_READ10 || cb[0] == USB_SIM_SCSI_READ16)
+			simStats.m_ReadCommands++;
+		else
+		{
+			simStats.m_WriteCommands++;
+			USB_SIM_AddDeviceTime(USB_SIM_PartialPageNs(simDevice.m_MediaOffset, simDevice.m_MediaLength));
+			if(cb[1] & USB_SIM_WRITE_FUA)
+			{
+				simStats.m_FUAWrites++;
+				if(simConfig.m_WriteCache)
+					USB_SIM_AddDeviceTime(USB_SIM_FUA_WRITE_NS);
+			}
+			else
+				simCacheDirty = TRUE;
+		}
+		break;
+	}
+
+	default:
+		simDevice.m_Status = USB_SIM_CSW_FAILED;
+		USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_OPCODE, 0);
+		break;
+	}
+
+	if(simDevice.m_Status != USB_SIM_CSW_PASSED)
+		simStats.m_FailedCommands++;
+	else
+		USB_SIM_SetSense(USB_SIM_SENSE_NO_SENSE, 0, 0);
+}
+
+/**
+ * @brief Prepares a VPD page of an INQUIRY with EVPD. An SPC-2 device, i.e. without m_OptimalTransferBytes,
+ * 		  and unknown pages fail with ILLEGAL REQUEST.
+ * @param page page code of the CDB.
+ * @param response response buffer of the data phase.
+ */
+static void USB_SIM_InquiryVPD(uint8_t page, uint8_t *response)
+{
+	if(!simConfig.m_OptimalTransferBytes || (page != USB_SIM_VPD_SUPPORTED && page != USB_SIM_VPD_BLOCK_LIMITS
+			&& page != USB_SIM_VPD_BLOCK_CHARACTERISTICS && page != USB_SIM_VPD_PROVISIONING))
+	{
+		simDevice.m_Status = USB_SIM_CSW_FAILED;
+		USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+		return;
+	}
+
+	response[1] = page;
+	switch(page)
+	{
+	case USB_SIM_VPD_SUPPORTED:
+		response[3] = 4;
+		response[4] = USB_SIM_VPD_SUPPORTED;
+		response[5] = USB_SIM_VPD_BLOCK_LIMITS;
+		response[6] = USB_SIM_VPD_BLOCK_CHARACTERISTICS;
+		response[7] = USB_SIM_VPD_PROVISIONING;
+		simDevice.m_ResponseLen = 8;
+		return;
+	case USB_SIM_VPD_BLOCK_LIMITS:
+	{
+		uint32_t granularity = simConfig.m_WritePageBytes / simConfig.m_BlockSize;
+		response[3] = USB_SIM_VPD_PAGE_LENGTH;
+		response[6] = (uint8_t)(granularity >> 8);
+		response[7] = (uint8_t)granularity;
+		USB_SIM_SetBE32(&response[12], simConfig.m_OptimalTransferBytes / simConfig.m_BlockSize);
+		USB_SIM_SetBE32(&response[20], USB_SIM_MAX_UNMAP_BLOCKS);
+		USB_SIM_SetBE32(&response[24], USB_SIM_MAX_UNMAP_DESCRIPTORS);
+		USB_SIM_SetBE32(&response[28], granularity);
+		break;
+	}
+	case USB_SIM_VPD_PROVISIONING:
+		response[3] = USB_SIM_VPD_PAGE_LENGTH;
+		response[5] = 0x80;	// LBPU, UNMAP is supported
+		break;
+	default:
+		response[3] = USB_SIM_VPD_PAGE_LENGTH;
+		response[5] = 1;	// Non rotating medium
+		break;
+	}
+	simDevice.m_ResponseLen = 4 + USB_SIM_VPD_PAGE_LENGTH;
+}
+
+/**
+ * @brief Executes the parameter list of an UNMAP. The image is not changed, unmapped blocks keep their data
+ * 		  like on a device which does not report LBPRZ.
+ * @param parameters received parameter list.
+ * @param length length of the data phase.
+ */
+static void USB_SIM_Unmap(const uint8_t *parameters, uint32_t length)
+{
+	uint32_t descLength = (uint32_t)((parameters[2] << 8) | parameters[3]);
+	uint32_t count = descLength / 16;
+	uint64_t blocks = 0;
+
+	if(length > USB_SIM_RESPONSE_SIZE)
+		length = USB_SIM_RESPONSE_SIZE;
+	if(length < 8 || 8 + descLength > length || count > USB_SIM_MAX_UNMAP_DESCRIPTORS)
+	{
+		simDevice.m_Status = USB_SIM_CSW_FAILED;
+		USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+		simStats.m_FailedCommands++;
+		return;
+	}
+	for(uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t *desc = &parameters[8 + i * 16];
+		uint64_t lba = ((uint64_t)USB_SIM_GetBE32(&desc[0]) << 32) | USB_SIM_GetBE32(&desc[4]);
+		uint32_t len = USB_SIM_GetBE32(&desc[8]);
+		if(lba + len > simBlockCount)
+		{
+			simDevice.m_Status = USB_SIM_CSW_FAILED;
+			USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_LBA_OUT_OF_RANGE, 0);
+			simStats.m_FailedCommands++;
+			return;
+		}
+		blocks += len;
+	}
+	if(blocks > USB_SIM_MAX_UNMAP_BLOCKS)
+	{
+		simDevice.m_Status = USB_SIM_CSW_FAILED;
+		USB_SIM_SetSense(USB_SIM_SENSE_ILLEGAL_REQUEST, USB_SIM_ASC_INVALID_FIELD_IN_CDB, 0);
+		simStats.m_FailedCommands++;
+		return;
+	}
+	simStats.m_UnmapCommands++;
+	simStats.m_UnmappedBlocks += blocks;
+}
+
+static void USB_SIM_SetSense(uint8_t senseKey, uint8_t asc, uint8_t ascq)
+{
+	simDevice.m_SenseKey = senseKey;
+	simDevice.m_ASC = asc;
+	simDevice.m_ASCQ = ascq;
+}
+
+/**
+ * @brief Halts both bulk endpoints on every m_FaultInterval-th READ10/WRITE10 CBW, like a device which lost the
+ * 		  synchronization with the host.
+ * @param cbw received CBW.
+ * @return TRUE if the CBW is stalled.
+ */
+static BOOL USB_SIM_InjectFault(const uint8_t *cbw)
+{
+	if(simConfig.m_FaultInterval == 0 || (cbw[15] != USB_SIM_SCSI_READ10 && cbw[15] != USB_SIM_SCSI_WRITE10))
+		return FALSE;
+	if(++simMediaCBWs % simConfig.m_FaultInterval != 0)
+		return FALSE;
+
+	simDevice.m_InHalted = TRUE;
+	simDevice.m_OutHalted = TRUE;
+	simDevice.m_ResetRequired = TRUE;
+	simDevice.m_PortResetRequired = simConfig.m_FaultNeedsPortReset;
+	simStats.m_InjectedFaults++;
+	return TRUE;
+}
+
+static void USB_SIM_AddDeviceTime(uint64_t ns)
+{
+	simStats.m_DeviceTimeNs += ns;
+	USB_SIM_AdvanceTime(ns);
+}
+
+/**
+ * @brief Read-modify-write time of the flash pages which a write covers only partially.
+ * @param offset byte offset of the write.
+ * @param length bytes written.
+ */
+static uint64_t USB_SIM_PartialPageNs(uint64_t offset, uint32_t length)
+{
+	uint32_t page = simConfig.m_WritePageBytes;
+	if(page == 0 || length == 0)
+		return 0;
+
+	uint32_t partialPages = 0;
+	uint64_t end = offset + length;
+	if(offset % page)
+		partialPages++;
+	if(end % page && (offset % page == 0 || end / page != offset / page))
+		partialPages++;
+	return (uint64_t)partialPages * page * (simConfig.m_ReadNsPerKB + simConfig.m_WriteNsPerKB) / 1024;
+}
+
+static uint32_t USB_SIM_GetBE32(const uint8_t *buffer)
+{
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+static void USB_SIM_SetBE32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = (uint8_t)(value >> 24);
+	buffer[1] = (uint8_t)(value >> 16);
+	buffer[2] = (uint8_t)(value >> 8);
+	buffer[3] = (uint8_t)value;
+}
+
+static uint32_t USB_SIM_GetLE32(const uint8_t *buffer)
+{
+	return buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static void USB_SIM_SetLE32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = (uint8_t)value;
+	buffer[1] = (uint8_t)(value >> 8);
+	buffer[2] = (uint8_t)(value >> 16);
+	buffer[3] = (uint8_t)(value >> 24);
+}
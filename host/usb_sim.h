@@ -0,0 +1,88 @@
+/*
+ * usb_sim.h
+ *
+ *  Simulation of the OTG host controller and of a BOT mass storage device for the host build (HOST_BUILD).
+ *  The simulation replaces usbh_conf.c at the USBH_LL_* boundary, everything above (USB host library,
+ *  MSC class, diskio, FatFs and usb_handler.c) is compiled from the same sources as the target build.
+ *  The device is backed by a disk image file. Bus transfers, device latencies and delays advance a
+ *  simulated time base which is used by HAL_GetTick, USB_GetTimer and the host library timer.
+ */
+
+#ifndef HOST_USB_SIM_H_
+#define HOST_USB_SIM_H_
+
+#include "usb_defines.h"
+
+/* Logical block size used if no block size is configured. */
+#define USB_SIM_DEFAULT_BLOCK_SIZE		512
+
+/* Rough interrupt handling times of the STM32F429 at 168 MHz without DMA, for m_IRQNsPerPacket and
+ * m_IRQNsPerKB: channel interrupt (XFRC/NAK and halt) per packet and FIFO copy of received data. */
+#define USB_SIM_F429_IRQ_NS_PER_PACKET	2000
+#define USB_SIM_F429_IRQ_NS_PER_KB		6000
+
+typedef struct {
+	const char *m_ImagePath;		/* Disk image backing the simulated device. */
+	uint64_t m_ImageSize;			/* Size of the image in bytes, the image is created or extended if it is smaller. 0 uses the existing size. */
+	uint32_t m_BlockSize;			/* Logical block size reported by READ CAPACITY. */
+	BOOL m_HighSpeed;				/* Attach as high speed device with 512 byte bulk packets instead of full speed with 64 byte packets. */
+	uint32_t m_CommandLatencyNs;	/* Processing time of the device for each SCSI command. */
+	uint32_t m_ReadNsPerKB;			/* Media access time of the device per KB read. */
+	uint32_t m_WriteNsPerKB;		/* Media access time of the device per KB written. */
+	uint32_t m_WritePageBytes;		/* Flash page size, partially written pages are read and written again. 0 disables the model. */
+	uint32_t m_OptimalTransferBytes;	/* Reports SPC-3 with the Block Limits VPD page: this optimal transfer length and m_WritePageBytes as granularity, and UNMAP support. 0 reports SPC-2 without VPD pages. */
+	BOOL m_VirtualTimeOnly;			/* Exclude the CPU time of the host from the time base, measurements become fully deterministic. */
+	uint32_t m_IRQNsPerPacket;		/* Modeled CPU time of the channel interrupt of each packet, NAK or STALL. */
+	uint32_t m_IRQNsPerKB;			/* Modeled CPU time of copying received data out of the FIFO per KB. */
+	uint32_t m_FaultInterval;		/* Every n-th READ10/WRITE10 CBW is stalled and both bulk endpoints stay halted until the reset recovery. 0 disables faults. */
+	BOOL m_FaultNeedsPortReset;		/* Injected faults survive the reset recovery and are only cleared by a port reset. */
+	BOOL m_WriteCache;				/* Reports the caching mode page with WCE and DPOFUA, flushes and FUA writes cost media time. */
+} USB_SIM_Config;
+
+/* Counters of the simulated device and bus, see USB_SIM_GetStats. */
+typedef struct {
+	uint64_t m_Commands;			/* SCSI commands received. */
+	uint64_t m_FailedCommands;		/* Commands completed with CHECK CONDITION. */
+	uint64_t m_ReadCommands;
+	uint64_t m_WriteCommands;
+	uint64_t m_BytesRead;			/* Bytes read from the image. */
+	uint64_t m_BytesWritten;		/* Bytes written to the image. */
+	uint64_t m_URBs;				/* URBs submitted by the host controller. */
+	uint64_t m_Packets;				/* Packets transferred on the bus. */
+	uint64_t m_BusTimeNs;			/* Simulated time spent transferring packets. */
+	uint64_t m_DeviceTimeNs;		/* Simulated time spent in command processing and media access. */
+	uint64_t m_InjectedFaults;		/* Faults injected with m_FaultInterval. */
+	uint64_t m_UnmapCommands;		/* UNMAP commands executed. */
+	uint64_t m_UnmappedBlocks;		/* Blocks of the executed UNMAP commands. */
+	uint64_t m_CacheFlushes;		/* SYNCHRONIZE CACHE commands which wrote cached data with m_WriteCache. */
+	uint64_t m_FUAWrites;			/* Write commands with the FUA bit. */
+} USB_SIM_Stats;
+
+void USB_SIM_GetDefaultConfig(USB_SIM_Config *config);
+USB_ERROR USB_SIM_Init(const USB_SIM_Config *config);
+USB_ERROR USB_SIM_DeInit();
+
+void USB_SIM_GetStats(USB_SIM_Stats *stats);
+void USB_SIM_ResetStats();
+void USB_SIM_Replug();
+void USB_SIM_ChangeMedium();
+
+/* Simulated time base */
+uint64_t USB_SIM_GetTimeNs();
+void USB_SIM_AdvanceTime(uint64_t ns);
+void USB_SIM_SetTimer(uint32_t periodUs, void (*callback)());
+
+/** Simulated device, used by the simulated host controller **/
+typedef enum {
+	USB_SIM_XFER_DONE,		/* Transfer completed. */
+	USB_SIM_XFER_NAK,		/* Device has nothing to send or can not accept data yet. */
+	USB_SIM_XFER_STALL		/* Endpoint is halted or the request is not supported. */
+} USB_SIM_XFER_RESULT;
+
+void USB_SIM_DeviceReset();
+uint16_t USB_SIM_DeviceMaxPacketSize();
+USB_SIM_XFER_RESULT USB_SIM_DeviceTransfer(uint8_t epAddr, BOOL setup, uint8_t *buffer, uint32_t length, uint32_t *xferCount);
+const USB_SIM_Config *USB_SIM_GetConfig();
+USB_SIM_Stats *USB_SIM_GetStatsRef();
+
+#endif /* HOST_USB_SIM_H_ */
@@ -0,0 +1,691 @@
+/*
+ * usb_sim_main.c
+ *
+ *  Example of the host build. Attaches the simulated mass storage device backed by a disk image,
+ *  formats the image if it contains no file system, writes a file, reads it back and prints the
+ *  throughput measured with the simulated time base.
+ *
+ *  usage: usb_sim_demo <image> [size in MB] [-hs] [-virtual] [-trace] [-tracebin <file>] [-fastattach] [-exfat] [-replug]
+ *                      [-fault <n>] [-faultport] [-mediachange] [-blocklimits] [-trim] [-cache] [-fua] [-sector <bytes>]
+ *                      [-urgent] [-chunk <KB>] [-recordlog] [-timeseries]
+ *
+ *  -exfat    formats an image without file system with exFAT instead of FAT32.
+ *  -replug    replugs the device after the test and mounts the volume again, warm if the fingerprint matches.
+ *  -fastattach  enables the fast attach mode (usb_attach.h), replugs the device once and prints the time to ready of both attaches.
+ *  -trace     prints the layer trace (usb_trace.h) of closing the written file, requires -DUSB_TRACE=ON.
+ *  -tracebin  writes the newest trace entries after closing the written file to a file of the host, convert it with usb_trace2json.
+ *  -fault     halts the bulk endpoints of the device on every n-th read or write command and prints the recovery counters (usb_recovery.h).
+ *  -faultport  injected faults are only cleared by a port reset.
+ *  -mediachange  changes the medium after the test, accesses the old file and opens it again on the remounted volume.
+ *  -blocklimits  the device reports the Block Limits VPD page with 16 KB granularity and 128 KB optimal transfer length.
+ *  -trim      like -blocklimits, the device supports UNMAP. Deletes the file after the test and trims the free space (usb_trim.h).
+ *  -cache     the device reports an enabled write cache, prints the flushes of the write test (usb_cache.h).
+ *  -fua       writes FAT and directory sectors with force unit access (USB_CACHE_FLUSH_FUA_METADATA).
+ *  -sector    logical block size of the device (512 to 4096), e.g. 4096 for a 4K native SSD.
+ *  -urgent    a timer submits an urgent read of sector 0 every 10 ms during the write test, deadline 2 ms (usb_iosched.h).
+ *  -chunk     largest command of FatFs reads and writes in KB, so that urgent requests are served in between.
+ *  -recordlog  appends records to a record log (usb_record_log.h), tears the last record on the media as a power loss
+ *             would, reopens the log and checks the recovered records, then appends more and reopens it again.
+ *  -timeseries  appends samples to a sample store (usb_timeseries.h) across several index groups, reopens it and
+ *             looks up timestamps at block and group boundaries. Prints the read commands of appending and of the lookups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usb_handler.h"
+#include "usb_sim.h"
+#include "usb_trace.h"
+#include "usb_record_log.h"
+#include "usb_timeseries.h"
+
+#define USB_SIM_DEMO_FILE			"0:/SIMTEST.BIN"
+#define USB_SIM_DEMO_FILE_SIZE		(4 * 1024 * 1024)
+#define USB_SIM_DEMO_CHUNK_SIZE		(32 * 1024)
+#define USB_SIM_DEMO_PAGE_SIZE		(16 * 1024)		/* Flash page and optimal transfer length with -blocklimits */
+#define USB_SIM_DEMO_OPTIMAL_TRANSFER	(128 * 1024)
+#define USB_SIM_DEMO_TRIM_SECTORS	16				/* FAT or bitmap sectors per USB_TrimFreeSpace call with -trim */
+#define USB_SIM_DEMO_URGENT_PERIOD_US	10000		/* Timer period and deadline of the urgent reads with -urgent */
+#define USB_SIM_DEMO_URGENT_DEADLINE_US	2000
+#define USB_SIM_DEMO_LOG_FILE		"0:/SIMLOG.BIN"
+#define USB_SIM_DEMO_LOG_CAPACITY	(256 * USB_LOG_BLOCK_SIZE)
+#define USB_SIM_DEMO_LOG_RECORDS	5000			/* Records before the power loss, they span several checkpoints */
+#define USB_SIM_DEMO_LOG_APPENDS	100				/* Records appended after the recovery */
+#define USB_SIM_DEMO_LOG_PAYLOAD	100
+#define USB_SIM_DEMO_TS_FILE		"0:/SIMTS.BIN"
+#define USB_SIM_DEMO_TS_GROUPS		3				/* Index groups of the store, the last one is incomplete */
+#define USB_SIM_DEMO_TS_PAYLOAD		20				/* Multiple of 4, samples are not padded */
+#define USB_SIM_DEMO_TS_PERIOD		10				/* Timestamp distance of the samples */
+#define USB_SIM_DEMO_TS_PER_BLOCK	((USB_TS_BLOCK_SIZE - USB_TS_DATA_HEADER_SIZE) / (USB_TS_SAMPLE_HEADER_SIZE + USB_SIM_DEMO_TS_PAYLOAD))
+#define USB_SIM_DEMO_TS_SAMPLES		((USB_SIM_DEMO_TS_GROUPS - 1) * USB_TS_BLOCKS_PER_INDEX * USB_SIM_DEMO_TS_PER_BLOCK + 1000)
+
+static USB_IO_REQUEST urgentRequest;
+static uint32_t urgentBuffer[4096 / 4];
+static uint32_t urgentSkipped = 0;
+
+/** Internally defined **/
+static int USB_SIM_CheckError(const char *step, USB_ERROR err);
+static void USB_SIM_PrintThroughput(const char *step, uint64_t bytes, uint64_t ns);
+static int USB_SIM_SaveTrace(const char *fileName);
+static void USB_SIM_PrintAttach();
+static int USB_SIM_PrintFreeSpace();
+static void USB_SIM_PrintRecovery();
+static void USB_SIM_PrintUnit();
+static void USB_SIM_PrintTransfer();
+static void USB_SIM_PrintTrim(const char *step);
+static void USB_SIM_PrintCache();
+static void USB_SIM_UrgentTimer();
+static void USB_SIM_PrintUrgent();
+static int USB_SIM_TestRecordLog(USB_MS_Handle *usbHandle);
+static int USB_SIM_AppendRecords(USB_LOG_Handle *log, uint32_t first, uint32_t count);
+static int USB_SIM_CountRecords(USB_LOG_Handle *log, uint32_t *count);
+static int USB_SIM_TestTimeSeries(USB_MS_Handle *usbHandle);
+static int USB_SIM_FindSample(USB_TS_Handle *ts, uint32_t sample);
+
+
+int main(int argc, char **argv)
+{
+	USB_SIM_Config config;
+	USB_SIM_Stats stats;
+	USB_MS_Handle usbHandle;
+	static uint8_t buffer[USB_SIM_DEMO_CHUNK_SIZE];
+	BOOL trace = FALSE;
+	const char *traceFile = NULL;
+	BOOL fastAttach = FALSE;
+	USB_FS_TYPE fsType = USB_FS_FAT32;
+	BOOL replug = FALSE;
+	BOOL mediaChange = FALSE;
+	BOOL trim = FALSE;
+	BOOL cache = FALSE;
+	USB_CACHE_MODE cacheMode = USB_CACHE_FLUSH;
+	BOOL urgent = FALSE;
+	uint32_t chunkBytes = 0;
+	BOOL recordLog = FALSE;
+	BOOL timeSeries = FALSE;
+
+	if(argc < 2)
+	{
+		printf("usage: %s <image> [size in MB] [-hs] [-virtual] [-trace] [-tracebin <file>] [-fastattach] [-exfat] [-replug] [-fault <n>] [-faultport] [-mediachange] [-blocklimits] [-trim] [-cache] [-fua] [-sector <bytes>] [-urgent] [-chunk <KB>] [-recordlog] [-timeseries]\n", argv[0]);
+		return 1;
+	}
+
+	USB_SIM_GetDefaultConfig(&config);
+	config.m_ImagePath = argv[1];
+	config.m_ImageSize = 64ULL * 1024 * 1024;
+	for(int i = 2; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-hs") == 0)
+			config.m_HighSpeed = TRUE;
+		else if(strcmp(argv[i], "-virtual") == 0)
+			config.m_VirtualTimeOnly = TRUE;
+		else if(strcmp(argv[i], "-trace") == 0)
+			trace = TRUE;
+		else if(strcmp(argv[i], "-tracebin") == 0 && i + 1 < argc)
+			traceFile = argv[++i];
+		else if(strcmp(argv[i], "-fastattach") == 0)
+			fastAttach = TRUE;
+		else if(strcmp(argv[i], "-exfat") == 0)
+			fsType = USB_FS_EXFAT;
+		else if(strcmp(argv[i], "-replug") == 0)
+			replug = TRUE;
+		else if(strcmp(argv[i], "-fault") == 0 && i + 1 < argc)
+			config.m_FaultInterval = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-mediachange") == 0)
+			mediaChange = TRUE;
+		else if(strcmp(argv[i], "-faultport") == 0)
+			config.m_FaultNeedsPortReset = TRUE;
+		else if(strcmp(argv[i], "-blocklimits") == 0 || strcmp(argv[i], "-trim") == 0)
+		{
+			trim = trim || strcmp(argv[i], "-trim") == 0;
+			config.m_WritePageBytes = USB_SIM_DEMO_PAGE_SIZE;
+			config.m_OptimalTransferBytes = USB_SIM_DEMO_OPTIMAL_TRANSFER;
+		}
+		else if(strcmp(argv[i], "-sector") == 0 && i + 1 < argc)
+			config.m_BlockSize = strtoul(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-cache") == 0)
+			cache = config.m_WriteCache = TRUE;
+		else if(strcmp(argv[i], "-fua") == 0)
+		{
+			cache = TRUE;
+			cacheMode = USB_CACHE_FLUSH_FUA_METADATA;
+		}
+		else if(strcmp(argv[i], "-urgent") == 0)
+			urgent = TRUE;
+		else if(strcmp(argv[i], "-chunk") == 0 && i + 1 < argc)
+			chunkBytes = strtoul(argv[++i], NULL, 10) * 1024;
+		else if(strcmp(argv[i], "-recordlog") == 0)
+			recordLog = TRUE;
+		else if(strcmp(argv[i], "-timeseries") == 0)
+			timeSeries = TRUE;
+		else
+			config.m_ImageSize = strtoull(argv[i], NULL, 10) * 1024 * 1024;
+	}
+
+	if(USB_SIM_CheckError("USB_SIM_Init", USB_SIM_Init(&config)))
+		return 1;
+	USB_SetFastAttach(fastAttach);
+	USB_SetCacheMode(cacheMode);
+	USB_SetIOScheduler(chunkBytes, 0);
+	if(USB_SIM_CheckError("USB_InitConnection", USB_InitConnection(&usbHandle)))
+		return 1;
+	if(USB_SIM_CheckError("USB_ExecuteStateMachine", USB_ExecuteStateMachine(&usbHandle, 10000)))
+		return 1;
+	USB_SIM_PrintAttach();
+	if(fastAttach)
+	{
+		// The second attach restores the descriptors and LUN info from the cache
+		USB_SIM_Replug();
+		if(USB_SIM_CheckError("USB_ExecuteStateMachine", USB_ExecuteStateMachine(&usbHandle, 10000)))
+			return 1;
+		USB_SIM_PrintAttach();
+	}
+	USB_SIM_PrintTransfer();
+
+	uint64_t start = USB_SIM_GetTimeNs();
+	BOOL formatted = FALSE;
+	USB_ERROR ret = USB_MountDrive();
+	if(ret.m_ErrCode == USB_NO_FILESYSTEM)
+	{
+		printf("No file system found, formatting image\n");
+		ret = USB_FormatDrive(fsType, 0);
+		formatted = TRUE;
+	}
+	if(USB_SIM_CheckError("USB_MountDrive", ret))
+		return 1;
+	printf("Mounted in %llu us\n", (unsigned long long)((USB_SIM_GetTimeNs() - start) / 1000));
+	if(USB_SIM_PrintFreeSpace())
+		return 1;
+
+	// Write test file
+	USB_SIM_ResetStats();
+	USB_ResetIOSchedulerStats();
+	if(urgent)
+		USB_SIM_SetTimer(USB_SIM_DEMO_URGENT_PERIOD_US, USB_SIM_UrgentTimer);
+	start = USB_SIM_GetTimeNs();
+	if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_WRITE | USB_OVERWRITE)))
+		return 1;
+	for(uint32_t pos = 0; pos < USB_SIM_DEMO_FILE_SIZE; pos += USB_SIM_DEMO_CHUNK_SIZE)
+	{
+		for(uint32_t i = 0; i < USB_SIM_DEMO_CHUNK_SIZE; i++)
+			buffer[i] = (uint8_t)((pos + i) * 7);
+		uint32_t len = USB_SIM_DEMO_CHUNK_SIZE;
+		if(USB_SIM_CheckError("USB_WriteData", USB_WriteData(&usbHandle, buffer, &len, FALSE)))
+			return 1;
+		if(urgent)
+			USB_ServeUrgentIO();
+	}
+	if(trace)
+		USB_TRACE_Clear();
+	if(USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(&usbHandle)))
+		return 1;
+	if(trace)
+		USB_TRACE_Dump();
+	if(traceFile && USB_SIM_SaveTrace(traceFile))
+		return 1;
+	USB_SIM_PrintThroughput("Write", USB_SIM_DEMO_FILE_SIZE, USB_SIM_GetTimeNs() - start);
+	USB_SIM_GetStats(&stats);
+	uint64_t bytesPerWrite = stats.m_WriteCommands ? stats.m_BytesWritten / stats.m_WriteCommands : 0;
+	printf("Write commands: %llu, %llu bytes per command\n", (unsigned long long)stats.m_WriteCommands,
+			(unsigned long long)bytesPerWrite);
+	// The default cluster size follows the page of the device, only FAT and directory updates are single sectors
+	if(formatted && config.m_OptimalTransferBytes && !chunkBytes && bytesPerWrite < USB_SIM_DEMO_PAGE_SIZE / 2)
+	{
+		printf("Write commands are smaller than the flash page\n");
+		return 1;
+	}
+	if(cache)
+		USB_SIM_PrintCache();
+	if(urgent)
+	{
+		USB_SIM_SetTimer(0, NULL);
+		USB_ServeUrgentIO();
+		USB_SIM_PrintUrgent();
+	}
+
+	// Read back and verify
+	start = USB_SIM_GetTimeNs();
+	if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_READ | USB_OPEN_IF_EXISTS)))
+		return 1;
+	for(uint32_t pos = 0; pos < USB_SIM_DEMO_FILE_SIZE; pos += USB_SIM_DEMO_CHUNK_SIZE)
+	{
+		uint32_t len = USB_SIM_DEMO_CHUNK_SIZE;
+		if(USB_SIM_CheckError("USB_ReadData", USB_ReadData(&usbHandle, buffer, &len)))
+			return 1;
+		for(uint32_t i = 0; i < len; i++)
+		{
+			if(buffer[i] != (uint8_t)((pos + i) * 7))
+			{
+				printf("Verification failed at offset %lu\n", (unsigned long)(pos + i));
+				return 1;
+			}
+		}
+	}
+	USB_SIM_PrintThroughput("Read", USB_SIM_DEMO_FILE_SIZE, USB_SIM_GetTimeNs() - start);
+
+	USB_SIM_GetStats(&stats);
+	printf("Commands: %llu (read %llu, write %llu, failed %llu), URBs: %llu, packets: %llu\n",
+			(unsigned long long)stats.m_Commands, (unsigned long long)stats.m_ReadCommands,
+			(unsigned long long)stats.m_WriteCommands, (unsigned long long)stats.m_FailedCommands,
+			(unsigned long long)stats.m_URBs, (unsigned long long)stats.m_Packets);
+	printf("Bus time: %llu us, device time: %llu us\n",
+			(unsigned long long)(stats.m_BusTimeNs / 1000), (unsigned long long)(stats.m_DeviceTimeNs / 1000));
+	if(config.m_FaultInterval)
+	{
+		printf("Injected faults: %llu\n", (unsigned long long)stats.m_InjectedFaults);
+		USB_SIM_PrintRecovery();
+	}
+
+	if(recordLog || timeSeries)
+	{
+		// The log and the store use the handle exclusively, the test file is opened again afterwards
+		if(USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(&usbHandle)))
+			return 1;
+		if((recordLog && USB_SIM_TestRecordLog(&usbHandle)) || (timeSeries && USB_SIM_TestTimeSeries(&usbHandle)))
+			return 1;
+		if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_READ | USB_OPEN_IF_EXISTS)))
+			return 1;
+	}
+
+	if(mediaChange)
+	{
+		// The first command after the change fails with UNIT ATTENTION, it is not retried
+		uint32_t len = USB_SIM_DEMO_CHUNK_SIZE;
+		if(USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(&usbHandle)))
+			return 1;
+		USB_SIM_ChangeMedium();
+		ret = USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_READ | USB_OPEN_IF_EXISTS);
+		if(ret.m_ErrCode == USB_NO_ERROR)
+		{
+			ret = USB_ReadData(&usbHandle, buffer, &len);
+			USB_CloseFile(&usbHandle);
+		}
+		printf("Access after the medium change: %s\n", USB_ReturnErrorCodeStr(ret));
+		USB_SIM_PrintUnit();
+		// disk_status reports STA_NOINIT, FatFs mounts the volume again
+		if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_READ | USB_OPEN_IF_EXISTS)))
+			return 1;
+		USB_SIM_PrintUnit();
+	}
+
+	if(replug)
+	{
+		// The volume is unchanged, its fingerprint was taken when the written file was closed
+		USB_VOLUME_STATS volumeStats;
+		if(USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(&usbHandle)))
+			return 1;
+		USB_SIM_Replug();
+		if(USB_SIM_CheckError("USB_ExecuteStateMachine", USB_ExecuteStateMachine(&usbHandle, 10000)))
+			return 1;
+		if(USB_SIM_CheckError("USB_MountDrive", USB_MountDrive()))
+			return 1;
+		USB_GetVolumeStats(&volumeStats);
+		printf("Remounted in %lu us (%s)\n", (unsigned long)volumeStats.m_LastMountUs, volumeStats.m_LastWarm ? "warm" : "cold");
+		if(USB_SIM_PrintFreeSpace())
+			return 1;
+		if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(&usbHandle, USB_SIM_DEMO_FILE, USB_READ | USB_OPEN_IF_EXISTS)))
+			return 1;
+	}
+
+	if(trim)
+	{
+		// The clusters of the deleted file are unmapped at the sync of f_unlink, the scan covers the whole free space
+		BOOL done = FALSE;
+		USB_CloseFile(&usbHandle);
+		if(USB_SIM_CheckError("USB_DeleteFile", USB_DeleteFile(USB_SIM_DEMO_FILE)))
+			return 1;
+		USB_SIM_PrintTrim("Delete");
+		start = USB_SIM_GetTimeNs();
+		while(!done)
+		{
+			if(USB_SIM_CheckError("USB_TrimFreeSpace", USB_TrimFreeSpace(USB_SIM_DEMO_TRIM_SECTORS, &done)))
+				return 1;
+		}
+		printf("Free space trimmed in %llu us\n", (unsigned long long)((USB_SIM_GetTimeNs() - start) / 1000));
+		USB_SIM_PrintTrim("Total");
+	}
+
+	if(USB_SIM_CheckError("USB_DeInitConnection", USB_DeInitConnection(&usbHandle)))
+		return 1;
+	USB_SIM_DeInit();
+	return 0;
+}
+
+static int USB_SIM_CheckError(const char *step, USB_ERROR err)
+{
+	if(err.m_ErrCode == USB_NO_ERROR)
+		return 0;
+	printf("%s: %s\n", step, USB_ReturnErrorCodeStr(err));
+	return 1;
+}
+
+static void USB_SIM_PrintThroughput(const char *step, uint64_t bytes, uint64_t ns)
+{
+	printf("%s: %llu bytes in %llu us, %.3f MB/s\n", step, (unsigned long long)bytes,
+			(unsigned long long)(ns / 1000), ns ? (double)bytes * 1000.0 / (double)ns : 0.0);
+}
+
+/**
+ * @brief Writes the binary export of the trace buffer to a file of the host.
+ */
+static int USB_SIM_SaveTrace(const char *fileName)
+{
+	static uint8_t traceExport[USB_TRACE_EXPORT_SIZE];
+	uint32_t size = USB_TRACE_Export(traceExport, sizeof(traceExport));
+	FILE *file = fopen(fileName, "wb");
+	if(!file || fwrite(traceExport, 1, size, file) != size)
+	{
+		printf("Can not write %s\n", fileName);
+		if(file)
+			fclose(file);
+		return 1;
+	}
+	fclose(file);
+	printf("Trace written to %s (%lu entries)\n", fileName, (unsigned long)((size - USB_TRACE_HEADER_SIZE) / USB_TRACE_ENTRY_SIZE));
+	return 0;
+}
+
+static void USB_SIM_PrintAttach()
+{
+	USB_ATTACH_STATS stats;
+	USB_GetAttachStats(&stats);
+	printf("Time to ready: %lu us (debounce %lu, reset %lu, enumeration %lu, class %lu us)%s%s\n",
+			(unsigned long)stats.m_TimeToReadyUs, (unsigned long)stats.m_DebounceUs, (unsigned long)stats.m_ResetUs,
+			(unsigned long)stats.m_EnumerationUs, (unsigned long)stats.m_ClassInitUs,
+			stats.m_FastAttach ? ", fast attach" : "", stats.m_CacheHit ? ", cache hit" : "");
+}
+
+static int USB_SIM_PrintFreeSpace()
+{
+	uint64_t freeBytes;
+	uint64_t start = USB_SIM_GetTimeNs();
+	if(USB_SIM_CheckError("USB_GetFreeSpace", USB_GetFreeSpace(&freeBytes)))
+		return 1;
+	printf("Free space: %llu bytes in %llu us\n", (unsigned long long)freeBytes,
+			(unsigned long long)((USB_SIM_GetTimeNs() - start) / 1000));
+	return 0;
+}
+
+static void USB_SIM_PrintRecovery()
+{
+	USB_RECOVERY_STATS stats;
+	USB_GetRecoveryStats(&stats);
+	printf("Recovery: %lu recovered, %lu failed, %lu sense retries, %lu reset recoveries, %lu port resets, last %lu us, max %lu us\n",
+			(unsigned long)stats.m_Recovered, (unsigned long)stats.m_Failed, (unsigned long)stats.m_SenseRetries,
+			(unsigned long)stats.m_BotResets, (unsigned long)stats.m_PortResets, (unsigned long)stats.m_LastRecoveryUs,
+			(unsigned long)stats.m_MaxRecoveryUs);
+}
+
+static void USB_SIM_PrintUnit()
+{
+	USB_UNIT_INFO info;
+	USB_GetUnitInfo(0, &info);
+	printf("Unit: state %d, %lu media changes, %lu status queries, %lu polls, last sense %x/%x/%x\n",
+			(int)info.m_State, (unsigned long)info.m_MediaChanges, (unsigned long)info.m_StatusQueries,
+			(unsigned long)info.m_Polls, info.m_SenseKey, info.m_ASC, info.m_ASCQ);
+}
+
+static void USB_SIM_PrintTransfer()
+{
+	USB_TRANSFER_TUNING tuning;
+	USB_GetTransferTuning(&tuning);
+	printf("Transfer: commands up to %lu sectors, aligned to %lu sectors\n", (unsigned long)tuning.m_MaxSectors,
+			(unsigned long)tuning.m_AlignSectors);
+}
+
+static void USB_SIM_PrintTrim(const char *step)
+{
+	USB_TRIM_STATS trimStats;
+	USB_SIM_Stats stats;
+	USB_GetTrimStats(&trimStats);
+	USB_SIM_GetStats(&stats);
+	printf("%s: %lu ranges (%lu skipped), %lu UNMAP commands (%lu failed), %llu blocks, device unmapped %llu blocks\n",
+			step, (unsigned long)trimStats.m_Ranges, (unsigned long)trimStats.m_Skipped,
+			(unsigned long)trimStats.m_Commands, (unsigned long)trimStats.m_Failed,
+			(unsigned long long)trimStats.m_Blocks, (unsigned long long)stats.m_UnmappedBlocks);
+}
+
+static void USB_SIM_PrintCache()
+{
+	USB_CACHE_INFO info;
+	USB_SIM_Stats stats;
+	USB_GetCacheInfo(0, &info);
+	USB_SIM_GetStats(&stats);
+	printf("Write cache: %s%s, %lu syncs (%lu clean), %lu flushes (%lu failed, max %lu us), %lu FUA writes, device flushed %llu times\n",
+			!info.m_PageReported ? "unknown" : (info.m_WriteCache ? "enabled" : "disabled"), info.m_FUASupported ? " with FUA" : "",
+			(unsigned long)info.m_Syncs, (unsigned long)info.m_CleanSyncs, (unsigned long)info.m_Flushes,
+			(unsigned long)info.m_FailedFlushes, (unsigned long)info.m_MaxFlushUs, (unsigned long)info.m_FUAWrites,
+			(unsigned long long)stats.m_CacheFlushes);
+}
+
+/**
+ * @brief Timer interrupt of -urgent, submits the next urgent read if the previous one completed.
+ */
+static void USB_SIM_UrgentTimer()
+{
+	if(urgentRequest.m_State == USB_IO_QUEUED || urgentRequest.m_State == USB_IO_ACTIVE)
+	{
+		urgentSkipped++;
+		return;
+	}
+	urgentRequest.m_Lun = 0;
+	urgentRequest.m_Write = FALSE;
+	urgentRequest.m_Sector = 0;
+	urgentRequest.m_Count = 1;
+	urgentRequest.m_Buffer = (uint8_t*)urgentBuffer;
+	urgentRequest.m_DeadlineUs = USB_SIM_DEMO_URGENT_DEADLINE_US;
+	USB_SubmitUrgentIO(&urgentRequest);
+}
+
+static void USB_SIM_PrintUrgent()
+{
+	USB_IOSCHED_STATS stats;
+	USB_GetIOSchedulerStats(&stats);
+	printf("Urgent reads: %lu (%lu failed, %lu skipped), %lu missed the deadline (max latency %lu us, max late %lu us), "
+			"%lu served between chunks\n",
+			(unsigned long)stats.m_Requests[USB_IO_URGENT], (unsigned long)stats.m_Failed[USB_IO_URGENT],
+			(unsigned long)urgentSkipped, (unsigned long)stats.m_DeadlineMisses[USB_IO_URGENT],
+			(unsigned long)stats.m_MaxLatencyUs[USB_IO_URGENT], (unsigned long)stats.m_MaxLateUs[USB_IO_URGENT],
+			(unsigned long)stats.m_Preemptions);
+	printf("Bulk requests: %lu, %lu commands, max latency %lu us\n", (unsigned long)stats.m_Requests[USB_IO_BULK],
+			(unsigned long)stats.m_BulkChunks, (unsigned long)stats.m_MaxLatencyUs[USB_IO_BULK]);
+}
+
+/**
+ * @brief Test of -recordlog. The records are flushed, then a byte of the last record is overwritten on the media,
+ * 		  like a write which was interrupted by a power loss. The file is closed without USB_LOG_Close, so the
+ * 		  block buffer is lost. USB_LOG_Open must recover all records but the torn one.
+ */
+static int USB_SIM_TestRecordLog(USB_MS_Handle *usbHandle)
+{
+	static USB_LOG_Handle log;
+	uint32_t recovered, reopened;
+
+	if(USB_SIM_CheckError("USB_LOG_Create", USB_LOG_Create(&log, usbHandle, USB_SIM_DEMO_LOG_FILE, USB_SIM_DEMO_LOG_CAPACITY))
+			|| USB_SIM_AppendRecords(&log, 0, USB_SIM_DEMO_LOG_RECORDS)
+			|| USB_SIM_CheckError("USB_LOG_Flush", USB_LOG_Flush(&log)))
+		return 1;
+	uint64_t tornOffset = (uint64_t)(log.m_BlockIndex + 1) * USB_LOG_BLOCK_SIZE + log.m_BlockUsed - 4;
+	if(USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(usbHandle)))
+		return 1;
+
+	uint8_t torn = 0xA5;
+	uint32_t len = sizeof(torn);
+	if(USB_SIM_CheckError("USB_OpenFile", USB_OpenFile(usbHandle, USB_SIM_DEMO_LOG_FILE, USB_WRITE | USB_OPEN_IF_EXISTS))
+			|| USB_SIM_CheckError("USB_Seek", USB_Seek(usbHandle, tornOffset))
+			|| USB_SIM_CheckError("USB_WriteData", USB_WriteData(usbHandle, &torn, &len, FALSE))
+			|| USB_SIM_CheckError("USB_CloseFile", USB_CloseFile(usbHandle)))
+		return 1;
+
+	uint64_t start = USB_SIM_GetTimeNs();
+	if(USB_SIM_CheckError("USB_LOG_Open", USB_LOG_Open(&log, usbHandle, USB_SIM_DEMO_LOG_FILE)))
+		return 1;
+	uint64_t recoveryNs = USB_SIM_GetTimeNs() - start;
+	if(USB_SIM_CountRecords(&log, &recovered)
+			|| USB_SIM_AppendRecords(&log, recovered, USB_SIM_DEMO_LOG_APPENDS)
+			|| USB_SIM_CheckError("USB_LOG_Close", USB_LOG_Close(&log))
+			|| USB_SIM_CheckError("USB_LOG_Open", USB_LOG_Open(&log, usbHandle, USB_SIM_DEMO_LOG_FILE))
+			|| USB_SIM_CountRecords(&log, &reopened)
+			|| USB_SIM_CheckError("USB_LOG_Close", USB_LOG_Close(&log)))
+		return 1;
+
+	printf("Record log: %lu records, last one torn, %lu recovered in %llu us, %lu after appending %lu and reopening\n",
+			(unsigned long)USB_SIM_DEMO_LOG_RECORDS, (unsigned long)recovered, (unsigned long long)(recoveryNs / 1000),
+			(unsigned long)reopened, (unsigned long)USB_SIM_DEMO_LOG_APPENDS);
+	if(recovered != USB_SIM_DEMO_LOG_RECORDS - 1 || reopened != recovered + USB_SIM_DEMO_LOG_APPENDS)
+	{
+		printf("Record log: unexpected number of records\n");
+		return 1;
+	}
+	return USB_SIM_CheckError("USB_DeleteFile", USB_DeleteFile(USB_SIM_DEMO_LOG_FILE));
+}
+
+/**
+ * @brief Appends records whose payload is derived from their number, see USB_SIM_CountRecords.
+ */
+static int USB_SIM_AppendRecords(USB_LOG_Handle *log, uint32_t first, uint32_t count)
+{
+	uint8_t payload[USB_SIM_DEMO_LOG_PAYLOAD];
+
+	for(uint32_t record = first; record < first + count; record++)
+	{
+		for(uint32_t i = 0; i < sizeof(payload); i++)
+			payload[i] = (uint8_t)(record + i);
+		if(USB_SIM_CheckError("USB_LOG_Append", USB_LOG_Append(log, 1, payload, sizeof(payload))))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Reads all records of the log and checks their payload.
+ */
+static int USB_SIM_CountRecords(USB_LOG_Handle *log, uint32_t *count)
+{
+	uint8_t payload[USB_SIM_DEMO_LOG_PAYLOAD];
+	USB_LOG_Cursor cursor;
+	uint16_t type;
+	uint32_t len = sizeof(payload);
+	USB_ERROR ret;
+
+	*count = 0;
+	USB_LOG_InitCursor(&cursor);
+	while((ret = USB_LOG_ReadNext(log, &cursor, &type, payload, &len)).m_ErrCode == USB_NO_ERROR)
+	{
+		for(uint32_t i = 0; i < len; i++)
+		{
+			if(type != 1 || len != sizeof(payload) || payload[i] != (uint8_t)(*count + i))
+			{
+				printf("Record log: record %lu is corrupted\n", (unsigned long)*count);
+				return 1;
+			}
+		}
+		(*count)++;
+		len = sizeof(payload);
+	}
+	return (ret.m_ErrCode == USB_LOG_END) ? 0 : USB_SIM_CheckError("USB_LOG_ReadNext", ret);
+}
+
+/**
+ * @brief Test of -timeseries. The samples fill USB_SIM_DEMO_TS_GROUPS index groups, the store is closed and opened again.
+ * 		  The lookups hit the first and last sample of blocks at the start and end of each group, and timestamps between
+ * 		  two samples. The read commands of appending show whether the seeks of the writer read the FAT.
+ */
+static int USB_SIM_TestTimeSeries(USB_MS_Handle *usbHandle)
+{
+	static USB_TS_Handle ts;
+	uint8_t payload[USB_SIM_DEMO_TS_PAYLOAD];
+	USB_SIM_Stats before, after;
+	uint32_t lookups = 0;
+
+	USB_SIM_GetStats(&before);
+	uint64_t start = USB_SIM_GetTimeNs();
+	if(USB_SIM_CheckError("USB_TS_Create", USB_TS_Create(&ts, usbHandle, USB_SIM_DEMO_TS_FILE)))
+		return 1;
+	for(uint32_t sample = 0; sample < USB_SIM_DEMO_TS_SAMPLES; sample++)
+	{
+		for(uint32_t i = 0; i < sizeof(payload); i++)
+			payload[i] = (uint8_t)(sample + i);
+		if(USB_SIM_CheckError("USB_TS_Append", USB_TS_Append(&ts, (uint64_t)sample * USB_SIM_DEMO_TS_PERIOD, payload, sizeof(payload))))
+			return 1;
+	}
+	if(USB_SIM_CheckError("USB_TS_Close", USB_TS_Close(&ts)))
+		return 1;
+	uint64_t appendNs = USB_SIM_GetTimeNs() - start;
+	USB_SIM_GetStats(&after);
+	printf("Time series: %lu samples in %lu blocks appended in %llu ms, %llu read and %llu write commands\n",
+			(unsigned long)USB_SIM_DEMO_TS_SAMPLES, (unsigned long)ts.m_DataBlocks, (unsigned long long)(appendNs / 1000000),
+			(unsigned long long)(after.m_ReadCommands - before.m_ReadCommands),
+			(unsigned long long)(after.m_WriteCommands - before.m_WriteCommands));
+
+	if(USB_SIM_CheckError("USB_TS_Open", USB_TS_Open(&ts, usbHandle, USB_SIM_DEMO_TS_FILE)))
+		return 1;
+	USB_SIM_GetStats(&before);
+	start = USB_SIM_GetTimeNs();
+	for(uint32_t group = 0; group < USB_SIM_DEMO_TS_GROUPS; group++)
+	{
+		uint32_t blocks[] = { group * USB_TS_BLOCKS_PER_INDEX, group * USB_TS_BLOCKS_PER_INDEX + 1,
+				(group + 1) * USB_TS_BLOCKS_PER_INDEX - 1 };
+		for(uint32_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+		{
+			uint32_t first = blocks[i] * USB_SIM_DEMO_TS_PER_BLOCK;
+			uint32_t samples[] = { first, first + 1, first + USB_SIM_DEMO_TS_PER_BLOCK - 1 };
+			for(uint32_t j = 0; j < sizeof(samples) / sizeof(samples[0]); j++)
+			{
+				if(samples[j] >= USB_SIM_DEMO_TS_SAMPLES)
+					continue;
+				if(USB_SIM_FindSample(&ts, samples[j]))
+					return 1;
+				lookups++;
+			}
+		}
+	}
+	if(USB_SIM_FindSample(&ts, USB_SIM_DEMO_TS_SAMPLES - 1))
+		return 1;
+	lookups++;
+	uint64_t lookupNs = USB_SIM_GetTimeNs() - start;
+	USB_SIM_GetStats(&after);
+
+	// Nothing is stored after the last sample
+	USB_TS_Cursor cursor;
+	USB_ERROR ret = USB_TS_Find(&ts, (uint64_t)USB_SIM_DEMO_TS_SAMPLES * USB_SIM_DEMO_TS_PERIOD, &cursor);
+	if(ret.m_ErrCode != USB_LOG_END)
+	{
+		printf("Time series: lookup after the last sample returned %s\n", USB_ReturnErrorCodeStr(ret));
+		return 1;
+	}
+	if(USB_SIM_CheckError("USB_TS_Close", USB_TS_Close(&ts)))
+		return 1;
+
+	printf("Time series: %lu lookups after reopening in %llu us, %llu read commands\n", (unsigned long)lookups,
+			(unsigned long long)(lookupNs / 1000), (unsigned long long)(after.m_ReadCommands - before.m_ReadCommands));
+	return USB_SIM_CheckError("USB_DeleteFile", USB_DeleteFile(USB_SIM_DEMO_TS_FILE));
+}
+
+/**
+ * @brief Looks up the timestamp of a sample and a timestamp just before it, both must return the sample.
+ */
+static int USB_SIM_FindSample(USB_TS_Handle *ts, uint32_t sample)
+{
+	uint64_t timestamp = (uint64_t)sample * USB_SIM_DEMO_TS_PERIOD;
+	uint8_t payload[USB_SIM_DEMO_TS_PAYLOAD];
+	USB_TS_Cursor cursor;
+
+	for(uint32_t i = 0; i < 2; i++)
+	{
+		uint64_t found;
+		uint32_t len = sizeof(payload);
+		uint64_t query = (i == 0 || sample == 0) ? timestamp : timestamp - USB_SIM_DEMO_TS_PERIOD / 2;
+		if(USB_SIM_CheckError("USB_TS_Find", USB_TS_Find(ts, query, &cursor))
+				|| USB_SIM_CheckError("USB_TS_ReadNext", USB_TS_ReadNext(ts, &cursor, &found, payload, &len)))
+			return 1;
+		for(uint32_t j = 0; j < sizeof(payload); j++)
+		{
+			if(found != timestamp || len != sizeof(payload) || payload[j] != (uint8_t)(sample + j))
+			{
+				printf("Time series: lookup of %llu returned a wrong sample\n", (unsigned long long)query);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * usb_trace2json.c
+ *
+ *  Converts a layer trace exported by USB_SaveTrace or printed by USB_TRACE_DumpBinary (usb_trace.h) into
+ *  the Chrome trace event format, which is displayed by chrome://tracing and ui.perfetto.dev. Each layer
+ *  gets its own track: FatFs, diskio, MSC commands, BOT phases, interrupts and one track per pipe for
+ *  the URBs, so gaps in the pipeline between the layers become visible on the timeline.
+ *
+ *  usage: usb_trace2json <trace.bin | console.log> [output.json]
+ *
+ *  The input is either the binary file or a captured console output containing the "USBT " lines of
+ *  USB_TRACE_DumpBinary. The JSON is written to stdout if no output file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "usb_defines.h"
+#include "usb_trace.h"
+
+#define TRACE2JSON_MAX_PIPES		16
+
+/* Track (thread id) of each layer */
+#define TRACE2JSON_TID_FS			1
+#define TRACE2JSON_TID_DISK			2
+#define TRACE2JSON_TID_MSC			3
+#define TRACE2JSON_TID_BOT			4
+#define TRACE2JSON_TID_IRQ			5
+#define TRACE2JSON_TID_PIPE			16
+
+typedef struct {
+	FILE *m_Out;
+	uint32_t m_CoreClock;
+	BOOL m_FirstEvent;
+	uint64_t m_Cycles;				/* Time of the current entry, extended to 64 bits */
+	uint32_t m_LastCycles;
+	BOOL m_BotStateValid;
+	uint16_t m_BotState;
+	uint64_t m_BotStateStart;
+	BOOL m_PipeOpen[TRACE2JSON_MAX_PIPES];
+	BOOL m_PipeNamed[TRACE2JSON_MAX_PIPES];
+} TRACE2JSON_Context;
+
+/** Internally defined **/
+static uint8_t* TRACE2JSON_Load(const char *path, uint32_t *size);
+static uint32_t TRACE2JSON_ParseHex(uint8_t *data, uint32_t size);
+static uint32_t TRACE2JSON_Get32(const uint8_t *src);
+static uint16_t TRACE2JSON_Get16(const uint8_t *src);
+static void TRACE2JSON_Convert(TRACE2JSON_Context *ctx, const USB_TRACE_Entry *entry);
+static void TRACE2JSON_Event(TRACE2JSON_Context *ctx, char phase, uint32_t tid, const char *name, uint64_t cycles, const char *args);
+static void TRACE2JSON_Complete(TRACE2JSON_Context *ctx, uint32_t tid, const char *name, uint64_t start, uint64_t end);
+static void TRACE2JSON_ThreadName(TRACE2JSON_Context *ctx, uint32_t tid, const char *name);
+static const char* TRACE2JSON_BotStateName(uint16_t state);
+
+
+int main(int argc, char **argv)
+{
+	TRACE2JSON_Context ctx;
+	uint32_t size;
+
+	if(argc < 2)
+	{
+		printf("usage: %s <trace.bin | console.log> [output.json]\n", argv[0]);
+		return 1;
+	}
+
+	uint8_t *data = TRACE2JSON_Load(argv[1], &size);
+	if(!data)
+	{
+		printf("can not read %s\n", argv[1]);
+		return 1;
+	}
+	if(size < 4 || TRACE2JSON_Get32(data) != USB_TRACE_MAGIC)
+		size = TRACE2JSON_ParseHex(data, size);
+	if(size < USB_TRACE_HEADER_SIZE || TRACE2JSON_Get32(data) != USB_TRACE_MAGIC
+			|| TRACE2JSON_Get16(data + 4) != USB_TRACE_FORMAT_VERSION)
+	{
+		printf("%s contains no trace of version %u\n", argv[1], USB_TRACE_FORMAT_VERSION);
+		free(data);
+		return 1;
+	}
+
+	uint16_t entrySize = TRACE2JSON_Get16(data + 6);
+	uint32_t count = TRACE2JSON_Get32(data + 12);
+	if(entrySize < USB_TRACE_ENTRY_SIZE || USB_TRACE_HEADER_SIZE + (uint64_t)count * entrySize > size)
+	{
+		printf("%s is truncated\n", argv[1]);
+		free(data);
+		return 1;
+	}
+
+	memset(&ctx, 0x00, sizeof(TRACE2JSON_Context));
+	ctx.m_CoreClock = TRACE2JSON_Get32(data + 8) ? TRACE2JSON_Get32(data + 8) : 1;
+	ctx.m_FirstEvent = TRUE;
+	ctx.m_Out = (argc > 2) ? fopen(argv[2], "w") : stdout;
+	if(!ctx.m_Out)
+	{
+		printf("can not create %s\n", argv[2]);
+		free(data);
+		return 1;
+	}
+
+	fprintf(ctx.m_Out, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"coreClock\":%lu,\"dropped\":%lu},\"traceEvents\":[\n",
+			(unsigned long)ctx.m_CoreClock, (unsigned long)TRACE2JSON_Get32(data + 16));
+	TRACE2JSON_ThreadName(&ctx, TRACE2JSON_TID_FS, "FatFs");
+	TRACE2JSON_ThreadName(&ctx, TRACE2JSON_TID_DISK, "diskio");
+	TRACE2JSON_ThreadName(&ctx, TRACE2JSON_TID_MSC, "MSC");
+	TRACE2JSON_ThreadName(&ctx, TRACE2JSON_TID_BOT, "BOT");
+	TRACE2JSON_ThreadName(&ctx, TRACE2JSON_TID_IRQ, "IRQ");
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t *src = data + USB_TRACE_HEADER_SIZE + i * entrySize;
+		USB_TRACE_Entry entry;
+		entry.m_Sequence = TRACE2JSON_Get32(src);
+		entry.m_Cycles = TRACE2JSON_Get32(src + 4);
+		entry.m_Event = src[8];
+		entry.m_Arg8 = src[9];
+		entry.m_Arg16 = TRACE2JSON_Get16(src + 10);
+		entry.m_Arg = TRACE2JSON_Get32(src + 12);
+
+		if(i == 0)
+			ctx.m_LastCycles = entry.m_Cycles;
+		ctx.m_Cycles += (uint32_t)(entry.m_Cycles - ctx.m_LastCycles);
+		ctx.m_LastCycles = entry.m_Cycles;
+		TRACE2JSON_Convert(&ctx, &entry);
+	}
+
+	/* Close the spans which are still open at the end of the trace */
+	if(ctx.m_BotStateValid)
+		TRACE2JSON_Complete(&ctx, TRACE2JSON_TID_BOT, TRACE2JSON_BotStateName(ctx.m_BotState), ctx.m_BotStateStart, ctx.m_Cycles);
+	for(uint32_t pipe = 0; pipe < TRACE2JSON_MAX_PIPES; pipe++)
+	{
+		if(ctx.m_PipeOpen[pipe])
+			TRACE2JSON_Event(&ctx, 'E', TRACE2JSON_TID_PIPE + pipe, NULL, ctx.m_Cycles, NULL);
+	}
+
+	fprintf(ctx.m_Out, "\n]}\n");
+	if(ctx.m_Out != stdout)
+		fclose(ctx.m_Out);
+	free(data);
+	return 0;
+}
+
+/**
+ * @brief Reads a file into memory.
+ * @param path file to read.
+ * @param size returns the size of the file.
+ * @return content of the file, NULL if the file can not be read.
+ */
+static uint8_t* TRACE2JSON_Load(const char *path, uint32_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if(!file)
+		return NULL;
+	// Pipes and other streams which can not seek are rejected, ftell returns -1 for them
+	long length = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+	if(length < 0 || (unsigned long)length > UINT32_MAX || fseek(file, 0, SEEK_SET) != 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+	uint8_t *data = malloc(length > 0 ? length : 1);
+	if(data && fread(data, 1, length, file) != (size_t)length)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*size = (uint32_t)length;
+	return data;
+}
+
+/**
+ * @brief Decodes the "USBT " lines of USB_TRACE_DumpBinary in place, all other lines are skipped.
+ * @param data text of the console output, returns the binary trace.
+ * @param size size of the text.
+ * @return size of the binary trace.
+ */
+static uint32_t TRACE2JSON_ParseHex(uint8_t *data, uint32_t size)
+{
+	uint32_t out = 0;
+	uint32_t pos = 0;
+
+	while(pos < size)
+	{
+		uint32_t lineEnd = pos;
+		while(lineEnd < size && data[lineEnd] != '\n')
+			lineEnd++;
+		/* The prefix may be preceded by other output of the same line, e.g. a timestamp of the terminal */
+		for(uint32_t i = pos; i + 5 <= lineEnd; i++)
+		{
+			if(memcmp(&data[i], "USBT ", 5) != 0)
+				continue;
+			for(i += 5; i + 1 < lineEnd && isxdigit(data[i]) && isxdigit(data[i + 1]); i += 2)
+			{
+				char hex[3] = { (char)data[i], (char)data[i + 1], 0 };
+				data[out++] = (uint8_t)strtoul(hex, NULL, 16);
+			}
+			break;
+		}
+		pos = lineEnd + 1;
+	}
+	return out;
+}
+
+static uint32_t TRACE2JSON_Get32(const uint8_t *src)
+{
+	return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static uint16_t TRACE2JSON_Get16(const uint8_t *src)
+{
+	return (uint16_t)(src[0] | (src[1] << 8));
+}
+
+/**
+ * @brief Converts a trace entry into Chrome trace events. BEGIN and END events of FatFs, diskio, MSC and
+ * 		  interrupts become duration events, URBs span from the submit to the completion on the track of
+ * 		  their pipe and each BOT state spans until the next state change.
+ */
+static void TRACE2JSON_Convert(TRACE2JSON_Context *ctx, const USB_TRACE_Entry *entry)
+{
+	char args[128];
+	uint32_t pipe = entry->m_Arg8 % TRACE2JSON_MAX_PIPES;
+
+	switch(entry->m_Event)
+	{
+	case USB_TRACE_FS_WRITE_BEGIN:
+		snprintf(args, sizeof(args), "{\"bytes\":%lu}", (unsigned long)entry->m_Arg);
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_FS, "f_write", ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_FS_SYNC_BEGIN:
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_FS, "f_sync", ctx->m_Cycles, NULL);
+		break;
+	case USB_TRACE_FS_WRITE_END:
+	case USB_TRACE_FS_SYNC_END:
+		snprintf(args, sizeof(args), "{\"result\":%u,\"bytes\":%lu}", entry->m_Arg8, (unsigned long)entry->m_Arg);
+		TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_FS, NULL, ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_DISK_READ_BEGIN:
+	case USB_TRACE_DISK_WRITE_BEGIN:
+		snprintf(args, sizeof(args), "{\"drive\":%u,\"sector\":%lu,\"count\":%u}", entry->m_Arg8,
+				(unsigned long)entry->m_Arg, entry->m_Arg16);
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_DISK, (entry->m_Event == USB_TRACE_DISK_READ_BEGIN) ? "disk_read" : "disk_write",
+				ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_DISK_READ_END:
+	case USB_TRACE_DISK_WRITE_END:
+		snprintf(args, sizeof(args), "{\"result\":%u}", entry->m_Arg16);
+		TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_DISK, NULL, ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_MSC_READ_BEGIN:
+	case USB_TRACE_MSC_WRITE_BEGIN:
+		snprintf(args, sizeof(args), "{\"lun\":%u,\"lba\":%lu,\"blocks\":%u}", entry->m_Arg8,
+				(unsigned long)entry->m_Arg, entry->m_Arg16);
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_MSC, (entry->m_Event == USB_TRACE_MSC_READ_BEGIN) ? "READ10" : "WRITE10",
+				ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_MSC_READ_END:
+	case USB_TRACE_MSC_WRITE_END:
+		snprintf(args, sizeof(args), "{\"status\":%u}", entry->m_Arg16);
+		TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_MSC, NULL, ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_BOT_STATE:
+		if(ctx->m_BotStateValid)
+			TRACE2JSON_Complete(ctx, TRACE2JSON_TID_BOT, TRACE2JSON_BotStateName(ctx->m_BotState), ctx->m_BotStateStart, ctx->m_Cycles);
+		ctx->m_BotState = entry->m_Arg16;
+		ctx->m_BotStateStart = ctx->m_Cycles;
+		ctx->m_BotStateValid = TRUE;
+		break;
+	case USB_TRACE_URB_SUBMIT:
+		if(ctx->m_PipeOpen[pipe])
+			TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_PIPE + pipe, NULL, ctx->m_Cycles, NULL);
+		if(!ctx->m_PipeNamed[pipe])
+		{
+			char name[16];
+			snprintf(name, sizeof(name), "pipe %lu", (unsigned long)pipe);
+			TRACE2JSON_ThreadName(ctx, TRACE2JSON_TID_PIPE + pipe, name);
+			ctx->m_PipeNamed[pipe] = TRUE;
+		}
+		snprintf(args, sizeof(args), "{\"length\":%u,\"direction\":\"%s\",\"ep_type\":%lu}", entry->m_Arg16,
+				(entry->m_Arg >> 8) ? "IN" : "OUT", (unsigned long)(entry->m_Arg & 0xFF));
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_PIPE + pipe, "URB", ctx->m_Cycles, args);
+		ctx->m_PipeOpen[pipe] = TRUE;
+		break;
+	case USB_TRACE_URB_DONE:
+		if(!ctx->m_PipeOpen[pipe])
+			break;
+		snprintf(args, sizeof(args), "{\"urb_state\":%u,\"bytes\":%lu}", entry->m_Arg16, (unsigned long)entry->m_Arg);
+		TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_PIPE + pipe, NULL, ctx->m_Cycles, args);
+		ctx->m_PipeOpen[pipe] = FALSE;
+		break;
+	case USB_TRACE_IRQ_BEGIN:
+		snprintf(args, sizeof(args), "{\"gintsts\":\"0x%08lx\"}", (unsigned long)entry->m_Arg);
+		TRACE2JSON_Event(ctx, 'B', TRACE2JSON_TID_IRQ, "OTG_HS_IRQ", ctx->m_Cycles, args);
+		break;
+	case USB_TRACE_IRQ_END:
+		TRACE2JSON_Event(ctx, 'E', TRACE2JSON_TID_IRQ, NULL, ctx->m_Cycles, NULL);
+		break;
+	default:
+		snprintf(args, sizeof(args), "{\"event\":%u,\"arg8\":%u,\"arg16\":%u,\"arg\":%lu}", entry->m_Event,
+				entry->m_Arg8, entry->m_Arg16, (unsigned long)entry->m_Arg);
+		TRACE2JSON_Event(ctx, 'i', TRACE2JSON_TID_IRQ, USB_TRACE_EventName(entry->m_Event), ctx->m_Cycles, args);
+		break;
+	}
+}
+
+/**
+ * @brief Writes a single trace event.
+ * @param phase 'B' begin, 'E' end, 'i' instant event.
+ * @param name name of the event, NULL for end events.
+ * @param cycles time of the event.
+ * @param args JSON object with the arguments or NULL.
+ */
+static void TRACE2JSON_Event(TRACE2JSON_Context *ctx, char phase, uint32_t tid, const char *name, uint64_t cycles, const char *args)
+{
+	fprintf(ctx->m_Out, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f", ctx->m_FirstEvent ? "" : ",\n", phase,
+			(unsigned long)tid, (double)cycles * 1000000.0 / ctx->m_CoreClock);
+	if(name)
+		fprintf(ctx->m_Out, ",\"name\":\"%s\"", name);
+	if(phase == 'i')
+		fprintf(ctx->m_Out, ",\"s\":\"t\"");
+	if(args)
+		fprintf(ctx->m_Out, ",\"args\":%s", args);
+	fprintf(ctx->m_Out, "}");
+	ctx->m_FirstEvent = FALSE;
+}
+
+/**
+ * @brief Writes a complete event with a duration.
+ */
+static void TRACE2JSON_Complete(TRACE2JSON_Context *ctx, uint32_t tid, const char *name, uint64_t start, uint64_t end)
+{
+	fprintf(ctx->m_Out, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"%s\"}",
+			ctx->m_FirstEvent ? "" : ",\n", (unsigned long)tid, (double)start * 1000000.0 / ctx->m_CoreClock,
+			(double)(end - start) * 1000000.0 / ctx->m_CoreClock, name);
+	ctx->m_FirstEvent = FALSE;
+}
+
+static void TRACE2JSON_ThreadName(TRACE2JSON_Context *ctx, uint32_t tid, const char *name)
+{
+	fprintf(ctx->m_Out, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+			ctx->m_FirstEvent ? "" : ",\n", (unsigned long)tid, name);
+	fprintf(ctx->m_Out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%lu}}",
+			(unsigned long)tid, (unsigned long)tid);
+	ctx->m_FirstEvent = FALSE;
+}
+
+/**
+ * @brief Returns the name of a BOT_StateTypeDef value (usbh_msc_bot.h).
+ */
+static const char* TRACE2JSON_BotStateName(uint16_t state)
+{
+	static const char *names[] = { "IDLE", "SEND_CBW", "SEND_CBW_WAIT", "DATA_IN", "DATA_IN_WAIT", "DATA_OUT",
+		"DATA_OUT_WAIT", "RECEIVE_CSW", "RECEIVE_CSW_WAIT", "ERROR_IN", "ERROR_OUT", "UNRECOVERED_ERROR" };
+	if(state >= sizeof(names) / sizeof(names[0]))
+		return "UNKNOWN";
+	return names[state];
+}
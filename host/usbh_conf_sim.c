@@ -0,0 +1,410 @@
+/*
+ * usbh_conf_sim.c
+ *
+ *  Replacement of usbh_conf.c for the host build. Implements the low level driver interface of the
+ *  USB host library on top of the simulated device in usb_msc_sim.c. URBs complete synchronously
+ *  when they are submitted, the bus time of each URB is added to the simulated time base.
+ */
+
+#include "usb_sim.h"
+#include <time.h>
+#include "stm32f4xx_hal.h"
+#include "usbh_core.h"
+#include "usb_trace.h"
+#include "usb_bus_stats.h"
+#include "usb_irq_stats.h"
+#include "usb_attach.h"
+
+/* Number of pipes of the simulated host controller (OTG HS: 12 host channels). */
+#define USB_SIM_MAX_PIPES				16
+
+/* Protocol overhead of a packet in bytes (sync, PID, CRC, handshake and inter packet gap). */
+#define USB_SIM_FS_PACKET_OVERHEAD		13
+#define USB_SIM_HS_PACKET_OVERHEAD		24
+
+/* Bit time in ps */
+#define USB_SIM_FS_BIT_TIME_PS			83333
+#define USB_SIM_HS_BIT_TIME_PS			2083
+
+/* Frame period in ns */
+#define USB_SIM_FS_FRAME_NS				1000000
+#define USB_SIM_HS_FRAME_NS				125000
+
+typedef struct {
+	uint8_t m_EpNum;
+	uint8_t m_EpType;
+	uint16_t m_MPS;
+	uint8_t m_Toggle;
+	USBH_URBStateTypeDef m_URBState;
+	uint32_t m_XferCount;
+} USB_SIM_Pipe;
+
+HCD_HandleTypeDef hhcd;
+uint32_t SystemCoreClock = 168000000;
+
+static USBH_HandleTypeDef *simHost = NULL;
+static USB_SIM_Pipe simPipes[USB_SIM_MAX_PIPES];
+static struct timespec simStartTime;
+static BOOL simStartTimeValid = FALSE;
+static uint64_t simVirtualNs = 0;
+static uint64_t simTimerPeriodNs = 0;
+static uint64_t simTimerNextNs = 0;
+static void (*simTimerCallback)() = NULL;
+static BOOL simTimerActive = FALSE;
+#if USB_BUS_STATS_FRAMES
+static uint64_t simFrame = 0;
+#endif /* USB_BUS_STATS_FRAMES */
+
+/** Internally defined **/
+static void USB_SIM_UpdateHostTimer();
+static uint64_t USB_SIM_GetBusTime(uint32_t length, uint16_t mps, uint32_t *packets);
+static void USB_SIM_TransferPackets(uint8_t pipe, uint32_t length, uint16_t mps, uint32_t packets, uint64_t busTime);
+static void USB_SIM_InterruptLoad(uint8_t pipe, BOOL in, uint32_t length, uint16_t mps, uint32_t packets);
+
+/**
+ * @brief Returns the simulated time since the start of the program. It consists of the simulated
+ * 		  bus, device and delay times and, if m_VirtualTimeOnly is not set, the CPU time of the host.
+ * @return simulated time in ns.
+ */
+uint64_t USB_SIM_GetTimeNs()
+{
+	struct timespec now;
+	if(!simStartTimeValid)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &simStartTime);
+		simStartTimeValid = TRUE;
+	}
+	if(USB_SIM_GetConfig()->m_VirtualTimeOnly)
+		return simVirtualNs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t elapsed = (int64_t)(now.tv_sec - simStartTime.tv_sec) * 1000000000LL + (now.tv_nsec - simStartTime.tv_nsec);
+	return simVirtualNs + (uint64_t)elapsed;
+}
+
+/**
+ * @brief Advances the simulated time base instead of waiting.
+ * @param ns time in ns.
+ */
+void USB_SIM_AdvanceTime(uint64_t ns)
+{
+	simVirtualNs += ns;
+	USB_SIM_UpdateHostTimer();
+}
+
+/**
+ * @brief Starts a periodic timer of the simulated time base, e.g. for a sampling interrupt of the application.
+ * 		  The callback is called like an interrupt handler from the host controller, between two URBs.
+ * @param periodUs period of the timer, 0 stops it.
+ * @param callback called when the timer expires.
+ */
+void USB_SIM_SetTimer(uint32_t periodUs, void (*callback)())
+{
+	simTimerPeriodNs = (uint64_t)periodUs * 1000;
+	simTimerNextNs = USB_SIM_GetTimeNs() + simTimerPeriodNs;
+	simTimerCallback = callback;
+}
+
+/**
+ * @brief The host library timer counts frames (ms). It is driven by the SOF interrupt on the target,
+ * 		  here it follows the simulated time base. The frames of the bus statistics are closed the same way.
+ */
+static void USB_SIM_UpdateHostTimer()
+{
+#if USB_BUS_STATS_FRAMES
+	uint64_t frame = USB_SIM_GetTimeNs() / (USB_SIM_GetConfig()->m_HighSpeed ? USB_SIM_HS_FRAME_NS : USB_SIM_FS_FRAME_NS);
+	for(; simFrame < frame; simFrame++)
+		USB_BUS_Frame();
+#endif /* USB_BUS_STATS_FRAMES */
+	if(simTimerPeriodNs && simTimerCallback && !simTimerActive)
+	{
+		simTimerActive = TRUE;
+		for(; simTimerNextNs <= USB_SIM_GetTimeNs(); simTimerNextNs += simTimerPeriodNs)
+			simTimerCallback();
+		simTimerActive = FALSE;
+	}
+	if(!simHost)
+		return;
+	uint32_t now = (uint32_t)(USB_SIM_GetTimeNs() / 1000000);
+	while((int32_t)(now - simHost->Timer) > 0)
+		USBH_LL_IncTimer(simHost);
+}
+
+/**
+ * @brief Calculates the time to transfer an URB on the bus.
+ * @param length length of the URB.
+ * @param mps max packet size of the pipe.
+ * @param packets returns the number of packets of the URB.
+ * @return transfer time in ns.
+ */
+static uint64_t USB_SIM_GetBusTime(uint32_t length, uint16_t mps, uint32_t *packets)
+{
+	BOOL highSpeed = USB_SIM_GetConfig()->m_HighSpeed;
+	*packets = (length + mps - 1) / mps;
+	if(*packets == 0)
+		*packets = 1;
+	uint64_t bytes = length + *packets * (highSpeed ? USB_SIM_HS_PACKET_OVERHEAD : USB_SIM_FS_PACKET_OVERHEAD);
+	return bytes * 8 * (highSpeed ? USB_SIM_HS_BIT_TIME_PS : USB_SIM_FS_BIT_TIME_PS) / 1000;
+}
+
+/**
+ * @brief Counts the packets of a completed URB in the bus statistics and advances the simulated time
+ * 		  by the bus time. With the per frame statistics enabled, the time advances packet by packet,
+ * 		  so each packet is counted in the frame it was transferred in.
+ * @param pipe pipe (channel) of the URB.
+ * @param length transferred bytes.
+ * @param mps max packet size of the pipe.
+ * @param packets number of packets.
+ * @param busTime transfer time of the URB in ns.
+ */
+static void USB_SIM_TransferPackets(uint8_t pipe, uint32_t length, uint16_t mps, uint32_t packets, uint64_t busTime)
+{
+#if USB_BUS_STATS_FRAMES
+	uint64_t elapsed = 0;
+	for(uint32_t i = 0; i < packets; i++)
+	{
+		uint32_t bytes = (length > mps) ? mps : length;
+		length -= bytes;
+		USB_BUS_AddTransfer(pipe, bytes, 1);
+		uint64_t end = busTime * (i + 1) / packets;
+		USB_SIM_AdvanceTime(end - elapsed);
+		elapsed = end;
+	}
+#else
+	USB_BUS_AddTransfer(pipe, length, packets);
+	USB_SIM_AdvanceTime(busTime);
+#endif /* USB_BUS_STATS_FRAMES */
+}
+
+/**
+ * @brief Models the interrupts the host controller raises for an URB without DMA: one channel interrupt per
+ * 		  packet and, for IN packets, the copy out of the receive FIFO. The CPU time is taken from
+ * 		  m_IRQNsPerPacket and m_IRQNsPerKB, advances the simulated time and is added to the interrupt statistics.
+ * @param pipe pipe (channel) of the URB.
+ * @param in TRUE for an IN transfer.
+ * @param length transferred bytes.
+ * @param mps max packet size of the pipe.
+ * @param packets number of packets, NAKs and STALLs count as one packet without data.
+ */
+static void USB_SIM_InterruptLoad(uint8_t pipe, BOOL in, uint32_t length, uint16_t mps, uint32_t packets)
+{
+	const USB_SIM_Config *config = USB_SIM_GetConfig();
+	uint64_t irqNs = 0;
+
+	if(!USB_IRQ_STATS_ENABLE && config->m_IRQNsPerPacket == 0 && config->m_IRQNsPerKB == 0)
+		return;
+	for(uint32_t i = 0; i < packets; i++)
+	{
+		uint32_t bytes = (length > mps) ? mps : length;
+		uint32_t fifoNs = in ? bytes * config->m_IRQNsPerKB / 1024 : 0;
+		length -= bytes;
+#if USB_IRQ_STATS_ENABLE
+		uint32_t cyclesPerUs = SystemCoreClock / 1000000;
+		USB_IRQ_AddCycles(&usbIrqStats.m_Channels[pipe & (USB_BUS_STATS_CHANNELS - 1)], config->m_IRQNsPerPacket * cyclesPerUs / 1000);
+		USB_IRQ_AddCycles(&usbIrqStats.m_Total, config->m_IRQNsPerPacket * cyclesPerUs / 1000);
+		if(in && bytes)
+		{
+			USB_IRQ_AddCycles(&usbIrqStats.m_RxFifo, fifoNs * cyclesPerUs / 1000);
+			USB_IRQ_AddCycles(&usbIrqStats.m_Total, fifoNs * cyclesPerUs / 1000);
+		}
+#endif /* USB_IRQ_STATS_ENABLE */
+		irqNs += config->m_IRQNsPerPacket + fifoNs;
+	}
+	USB_SIM_AdvanceTime(irqNs);
+}
+
+/** HAL functions used by the library **/
+
+uint32_t HAL_GetTick(void)
+{
+	return (uint32_t)(USB_SIM_GetTimeNs() / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	USB_SIM_AdvanceTime((uint64_t)Delay * 1000000);
+}
+
+/**
+ * @brief Interrupts are not used by the simulation, connection and URB events are signaled
+ * 		  synchronously by the low level driver functions.
+ */
+void HAL_HCD_IRQHandler(HCD_HandleTypeDef *hhcd)
+{
+}
+
+/** Low level driver interface (USB host library --> simulated host controller) **/
+
+USBH_StatusTypeDef USBH_LL_Init(USBH_HandleTypeDef *phost)
+{
+	memset(&hhcd, 0x00, sizeof(HCD_HandleTypeDef));
+	memset(simPipes, 0x00, sizeof(simPipes));
+	hhcd.Init.Host_channels = 11;
+	hhcd.Init.dma_enable = 0;
+	hhcd.Init.speed = USB_SIM_GetConfig()->m_HighSpeed ? HCD_SPEED_HIGH : HCD_SPEED_FULL;
+
+	/* Link The driver to the stack */
+	hhcd.pData = phost;
+	phost->pData = &hhcd;
+	simHost = phost;
+
+	USBH_LL_SetTimer(phost, (uint32_t)(USB_SIM_GetTimeNs() / 1000000));
+	return USBH_OK;
+}
+
+USBH_StatusTypeDef USBH_LL_DeInit(USBH_HandleTypeDef *phost)
+{
+	simHost = NULL;
+	return USBH_OK;
+}
+
+/**
+ * @brief Starts the host controller. The simulated device is always plugged in, the connect event
+ * 		  is signaled immediately.
+ */
+USBH_StatusTypeDef USBH_LL_Start(USBH_HandleTypeDef *phost)
+{
+	if(USB_SIM_GetConfig()->m_ImagePath)
+		USBH_LL_Connect(phost);
+	return USBH_OK;
+}
+
+/**
+ * @brief Unplugs and plugs the simulated device. The disconnection is processed immediately, the
+ * 		  device is attached again by the following calls of USBH_Process.
+ */
+void USB_SIM_Replug()
+{
+	if(!simHost)
+		return;
+	USBH_LL_Disconnect(simHost);
+	USBH_Process(simHost);
+}
+
+USBH_StatusTypeDef USBH_LL_Stop(USBH_HandleTypeDef *phost)
+{
+	return USBH_OK;
+}
+
+USBH_SpeedTypeDef USBH_LL_GetSpeed(USBH_HandleTypeDef *phost)
+{
+	return USB_SIM_GetConfig()->m_HighSpeed ? USBH_SPEED_HIGH : USBH_SPEED_FULL;
+}
+
+/**
+ * @brief Resets the port. The device returns to its default state, the port enabled event
+ * 		  is signaled after the reset signaling time of 10 ms.
+ */
+USBH_StatusTypeDef USBH_LL_ResetPort(USBH_HandleTypeDef *phost)
+{
+	USB_SIM_DeviceReset();
+	USB_SIM_AdvanceTime(10000000);
+	USBH_LL_PortEnabled(phost);
+	return USBH_OK;
+}
+
+uint32_t USBH_LL_GetLastXferSize(USBH_HandleTypeDef *phost, uint8_t pipe)
+{
+	return simPipes[pipe].m_XferCount;
+}
+
+USBH_StatusTypeDef USBH_LL_OpenPipe(USBH_HandleTypeDef *phost, uint8_t pipe, uint8_t epnum,
+		uint8_t dev_address, uint8_t speed, uint8_t ep_type, uint16_t mps)
+{
+	if(pipe >= USB_SIM_MAX_PIPES)
+		return USBH_FAIL;
+	simPipes[pipe].m_EpNum = epnum;
+	simPipes[pipe].m_EpType = ep_type;
+	simPipes[pipe].m_MPS = mps;
+	simPipes[pipe].m_Toggle = 0;
+	simPipes[pipe].m_URBState = USBH_URB_IDLE;
+	simPipes[pipe].m_XferCount = 0;
+	return USBH_OK;
+}
+
+USBH_StatusTypeDef USBH_LL_ClosePipe(USBH_HandleTypeDef *phost, uint8_t pipe)
+{
+	return USBH_OK;
+}
+
+/**
+ * @brief Submits an URB to the simulated device. The URB is completed before the function returns,
+ * 		  the result is reported by USBH_LL_GetURBState and USBH_LL_GetLastXferSize.
+ */
+USBH_StatusTypeDef USBH_LL_SubmitURB(USBH_HandleTypeDef *phost, uint8_t pipe, uint8_t direction,
+		uint8_t ep_type, uint8_t token, uint8_t *pbuff, uint16_t length, uint8_t do_ping)
+{
+	if(pipe >= USB_SIM_MAX_PIPES)
+		return USBH_FAIL;
+
+	USB_SIM_Pipe *simPipe = &simPipes[pipe];
+	USB_SIM_Stats *stats = USB_SIM_GetStatsRef();
+	uint8_t epAddr = (simPipe->m_EpNum & 0x7F) | (direction ? 0x80 : 0x00);
+	uint32_t xferCount = 0;
+	uint32_t packets = 0;
+
+	USB_TRACE(USB_TRACE_URB_SUBMIT, pipe, length, ((uint32_t)direction << 8) | ep_type);
+	USB_SIM_XFER_RESULT result = USB_SIM_DeviceTransfer(epAddr, token == 0, pbuff, length, &xferCount);
+	uint64_t busTime = USB_SIM_GetBusTime((result == USB_SIM_XFER_DONE) ? xferCount : 0, simPipe->m_MPS, &packets);
+
+	stats->m_URBs++;
+	stats->m_Packets += packets;
+	stats->m_BusTimeNs += busTime;
+
+	/* Without DMA each transfer, NAK or STALL halts the channel */
+	USB_BUS_COUNT(pipe, m_Halts);
+	simPipe->m_XferCount = xferCount;
+	switch(result)
+	{
+	case USB_SIM_XFER_DONE:
+		simPipe->m_URBState = USBH_URB_DONE;
+		simPipe->m_Toggle ^= (packets & 0x01);
+		USB_SIM_TransferPackets(pipe, xferCount, simPipe->m_MPS, packets, busTime);
+		USB_SIM_InterruptLoad(pipe, direction != 0, xferCount, simPipe->m_MPS, packets);
+		break;
+	case USB_SIM_XFER_NAK:
+		simPipe->m_URBState = USBH_URB_NOTREADY;
+		USB_BUS_COUNT(pipe, m_NAKs);
+		USB_SIM_AdvanceTime(busTime);
+		USB_SIM_InterruptLoad(pipe, FALSE, 0, simPipe->m_MPS, 1);
+		break;
+	default:
+		simPipe->m_URBState = USBH_URB_STALL;
+		USB_BUS_COUNT(pipe, m_Stalls);
+		USB_SIM_AdvanceTime(busTime);
+		USB_SIM_InterruptLoad(pipe, FALSE, 0, simPipe->m_MPS, 1);
+		break;
+	}
+	USB_TRACE(USB_TRACE_URB_DONE, pipe, simPipe->m_URBState, xferCount);
+	return USBH_OK;
+}
+
+USBH_URBStateTypeDef USBH_LL_GetURBState(USBH_HandleTypeDef *phost, uint8_t pipe)
+{
+	USB_SIM_UpdateHostTimer();
+	return simPipes[pipe].m_URBState;
+}
+
+USBH_StatusTypeDef USBH_LL_DriverVBUS(USBH_HandleTypeDef *phost, uint8_t state)
+{
+	/* The fast attach waits for the connect debounce interval instead */
+	if(!state || !USB_ATTACH_IsFast())
+		HAL_Delay(200);
+	return USBH_OK;
+}
+
+USBH_StatusTypeDef USBH_LL_SetToggle(USBH_HandleTypeDef *phost, uint8_t pipe, uint8_t toggle)
+{
+	simPipes[pipe].m_Toggle = toggle;
+	return USBH_OK;
+}
+
+uint8_t USBH_LL_GetToggle(USBH_HandleTypeDef *phost, uint8_t pipe)
+{
+	return simPipes[pipe].m_Toggle;
+}
+
+void USBH_Delay(uint32_t Delay)
+{
+	HAL_Delay(Delay);
+}
@@ -60,6 +60,7 @@ DWORD get_fattime (void);
 #define CTRL_LOCK			6	/* Lock/Unlock media removal */
 #define CTRL_EJECT			7	/* Eject media */
 #define CTRL_FORMAT			8	/* Create physical format on the media */
+#define GET_OPTIMAL_TRANSFER	9	/* Get optimal transfer length and alignment in unit of sector (DWORD[2]) */
 
 /* MMC/SDC specific ioctl command */
 #define MMC_GET_TYPE		10	/* Get card type */
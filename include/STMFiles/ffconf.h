@@ -66,7 +66,7 @@
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_EXPAND		0
+#define	_USE_EXPAND		1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -117,7 +117,7 @@
 */
 
 
-#define	_USE_LFN	0
+#define	_USE_LFN	1
 #define	_MAX_LFN	255
 /* The _USE_LFN switches the support of long file name (LFN).
 /
@@ -189,7 +189,7 @@
 
 
 #define	_MIN_SS		512
-#define	_MAX_SS		512
+#define	_MAX_SS		4096
 /* These options configure the range of sector size to be supported. (512, 1024,
 /  2048 or 4096) Always set both 512 for most systems, all type of memory cards and
 /  harddisk. But a larger value may be required for on-board flash memory and some
@@ -198,7 +198,7 @@
 /  disk_ioctl() function. */
 
 
-#define	_USE_TRIM	0
+#define	_USE_TRIM	1
 /* This option switches support of ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -216,6 +216,14 @@
 */
 
 
+#define _FS_LAZY_FSINFO	1
+/* This option defers FSINFO updates on FAT32 volumes. (0:Disable or 1:Enable)
+/  When enabled, f_sync(), f_close() and the directory functions do not rewrite the
+/  FSINFO sector. The pending free cluster count is written by f_syncfs(), so the
+/  updates of several files are coalesced into a single write. Until then, FSINFO
+/  on the media may report a wrong free space, the FAT itself stays consistent. */
+
+
 
 /*---------------------------------------------------------------------------/
 / System Configurations
@@ -228,7 +236,7 @@
 /  buffer in the file system object (FATFS) is used for the file data transfer. */
 
 
-#define _FS_EXFAT	0
+#define _FS_EXFAT	1
 /* This option switches support of exFAT file system. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled. (_USE_LFN >= 1)
 /  Note that enabling exFAT discards C89 compatibility. */
@@ -10,11 +10,25 @@
 
 #include <stdint.h>
 
+/* Monotonic 64-bit time base, the DWT cycle counter extended in software. The conversions
+ * are derived from SystemCoreClock. */
+void USB_InitTimeBase();
+uint64_t USB_GetCycles();
+uint64_t USB_CyclesToNs(uint64_t cycles);
+uint64_t USB_CyclesToUs(uint64_t cycles);
+uint64_t USB_CyclesToMs(uint64_t cycles);
+uint64_t USB_GetTimeNs();
+uint64_t USB_GetTimeUs();
+uint64_t USB_GetTimeMs();
+
+/* 32-bit interface, values are the lower 32 bits of USB_GetCycles */
 uint32_t USB_StartTimer();
 void USB_ResetTimer();
 uint32_t USB_GetTimer();
 uint32_t USB_TransformClockFrequencyToNs(uint32_t value);
+uint32_t USB_TransformClockFrequencyToUs(uint32_t value);
 uint32_t USB_TransformClockFrequencyToMS(uint32_t value);
+void USB_DelayNs(uint32_t ns);
 
 #endif /* INC_TIME_MEASUREMENT_H_ */
 
@@ -64,6 +64,8 @@ typedef enum
   MSC_WRITE,
   MSC_UNRECOVERED_ERROR,
   MSC_PERIODIC_CHECK,
+  MSC_READ_CAPACITY16,
+  MSC_READ_VPD,
 }
 MSC_StateTypeDef;
 
@@ -100,10 +102,16 @@ typedef struct
   SCSI_SenseTypeDef           sense;
   SCSI_StdInquiryDataTypeDef  inquiry;
   uint8_t                     state_changed;
+  SCSI_BlockLimitsTypeDef     limits;    /* VPD pages of SPC-3 devices, 0 if not reported */
+  uint8_t                     vpd_page;  /* Page requested in MSC_READ_VPD */
+  uint8_t                     write_fua; /* Writes of USBH_MSC_WriteFUA set the FUA bit */
 
 }
 MSC_LUNTypeDef;
 
+/* Non-blocking SCSI command of USBH_MSC_ExecuteSync, called until it does not return USBH_BUSY */
+typedef USBH_StatusTypeDef (*USBH_MSC_CommandTypeDef)(USBH_HandleTypeDef *phost, uint8_t lun, void *arg);
+
 /* Structure for MSC process */
 typedef struct _MSC_Process
 {
@@ -175,6 +183,10 @@ extern USBH_ClassTypeDef  USBH_msc;
 uint8_t USBH_MSC_IsReady(USBH_HandleTypeDef *phost);
 uint8_t USBH_MSC_GetMaxLUN(USBH_HandleTypeDef *phost);
 uint8_t USBH_MSC_UnitIsReady(USBH_HandleTypeDef *phost, uint8_t lun);
+uint32_t USBH_MSC_GetMaxTransfer(USBH_HandleTypeDef *phost, uint8_t lun);
+uint32_t USBH_MSC_GetBlockSize(USBH_HandleTypeDef *phost, uint8_t lun);
+uint8_t USBH_MSC_GetOptimalTransfer(USBH_HandleTypeDef *phost, uint8_t lun,
+                                    uint32_t *length, uint32_t *granularity);
 
 USBH_StatusTypeDef USBH_MSC_GetLUNInfo(USBH_HandleTypeDef *phost, uint8_t lun,
                                        MSC_LUNTypeDef *info);
@@ -184,6 +196,14 @@ USBH_StatusTypeDef USBH_MSC_Read(USBH_HandleTypeDef *phost, uint8_t lun,
 
 USBH_StatusTypeDef USBH_MSC_Write(USBH_HandleTypeDef *phost, uint8_t lun,
                                   uint32_t address, uint8_t *pbuf, uint32_t length);
+
+USBH_StatusTypeDef USBH_MSC_WriteFUA(USBH_HandleTypeDef *phost, uint8_t lun,
+                                     uint32_t address, uint8_t *pbuf, uint32_t length);
+
+uint8_t USBH_MSC_IsIdle(USBH_HandleTypeDef *phost, uint8_t lun);
+
+USBH_StatusTypeDef USBH_MSC_ExecuteSync(USBH_HandleTypeDef *phost, uint8_t lun,
+                                        USBH_MSC_CommandTypeDef command, void *arg, uint32_t timeout);
 /**
   * @}
   */
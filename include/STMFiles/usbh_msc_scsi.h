@@ -50,7 +50,7 @@ extern "C" {
 /* Capacity data */
 typedef struct
 {
-  uint32_t block_nbr;
+  uint64_t block_nbr;
   uint16_t block_size;
 } SCSI_CapacityTypeDef;
 
@@ -69,11 +69,71 @@ typedef struct
   uint8_t PeripheralQualifier;
   uint8_t DeviceType;
   uint8_t RemovableMedia;
+  uint8_t version;        /* SCSI_VERSION_xxx of the implemented standard */
   uint8_t vendor_id[9];
   uint8_t product_id[17];
   uint8_t revision_id[5];
 } SCSI_StdInquiryDataTypeDef;
 
+/* Block Limits, Block Device Characteristics and Logical Block Provisioning VPD pages, fields are 0 if not reported */
+typedef struct
+{
+  uint8_t  pages;                    /* SCSI_VPD_xxx bits of the pages listed by the Supported VPD Pages page */
+  uint16_t optimal_granularity;      /* Optimal transfer length granularity in blocks */
+  uint32_t max_transfer_blocks;      /* Maximum transfer length in blocks */
+  uint32_t optimal_transfer_blocks;  /* Optimal transfer length in blocks */
+  uint32_t max_unmap_blocks;         /* Maximum unmap LBA count */
+  uint32_t max_unmap_descriptors;    /* Maximum unmap block descriptor count */
+  uint32_t unmap_granularity;        /* Optimal unmap granularity in blocks */
+  uint32_t unmap_alignment;          /* Unmap granularity alignment, valid if unmap_granularity is reported */
+  uint16_t rotation_rate;            /* Medium rotation rate, 1 for non rotating media */
+  uint8_t  provisioning;             /* SCSI_LBP_xxx bits of the Logical Block Provisioning page */
+} SCSI_BlockLimitsTypeDef;
+
+/* Commands of the CDB table */
+typedef enum
+{
+  SCSI_CDB_TEST_UNIT_READY = 0U,
+  SCSI_CDB_REQUEST_SENSE,
+  SCSI_CDB_INQUIRY,
+  SCSI_CDB_INQUIRY_VPD,
+  SCSI_CDB_MODE_SENSE6,
+  SCSI_CDB_MODE_SENSE6_PAGE,
+  SCSI_CDB_READ_CAPACITY10,
+  SCSI_CDB_READ_CAPACITY16,
+  SCSI_CDB_READ10,
+  SCSI_CDB_WRITE10,
+  SCSI_CDB_READ16,
+  SCSI_CDB_WRITE16,
+  SCSI_CDB_WRITE10_FUA,
+  SCSI_CDB_WRITE16_FUA,
+  SCSI_CDB_SYNCHRONIZE_CACHE10,
+  SCSI_CDB_UNMAP,
+  SCSI_CDB_COUNT
+} SCSI_CdbTypeDef;
+
+/* Layout of a CDB, multi-byte fields are big endian */
+typedef struct
+{
+  uint8_t opcode;
+  uint8_t length;         /* CDB length in bytes */
+  uint8_t direction;      /* USB_EP_DIR_IN or USB_EP_DIR_OUT */
+  uint8_t fixed_offset;   /* Constant field, e.g. the service action, 0 if none */
+  uint8_t fixed_value;
+  uint8_t lba_offset;     /* Logical block address, size 0 if none */
+  uint8_t lba_size;
+  uint8_t len_offset;     /* Transfer, allocation or parameter list length, size 0 if none */
+  uint8_t len_size;
+  uint8_t flags;          /* SCSI_CDB_FLAG_xxx */
+} SCSI_CdbDescTypeDef;
+
+/* Range of an UNMAP command */
+typedef struct
+{
+  uint64_t address;
+  uint32_t length;
+} SCSI_UnmapRangeTypeDef;
+
 /** @defgroup USBH_MSC_SCSI_Exported_Defines
   * @{
   */
@@ -83,11 +143,61 @@ typedef struct
 #define OPCODE_WRITE10                    0x2AU
 #define OPCODE_REQUEST_SENSE              0x03U
 #define OPCODE_INQUIRY                    0x12U
+#define OPCODE_MODE_SENSE6                0x1AU
+#define OPCODE_SYNCHRONIZE_CACHE10        0x35U
+#define OPCODE_UNMAP                      0x42U
+#define OPCODE_READ16                     0x88U
+#define OPCODE_WRITE16                    0x8AU
+#define OPCODE_READ_CAPACITY16            0x9EU
+
+#define SERVICE_ACTION_READ_CAPACITY16    0x10U
+#define INQUIRY_EVPD                      0x01U
+#define MODE_SENSE_ALL_PAGES              0x3FU
+#define MODE_SENSE_DBD                    0x08U
+#define WRITE_FUA                         0x08U
 
 #define DATA_LEN_MODE_TEST_UNIT_READY        0U
 #define DATA_LEN_READ_CAPACITY10             8U
 #define DATA_LEN_INQUIRY                    36U
 #define DATA_LEN_REQUEST_SENSE              14U
+#define DATA_LEN_READ_CAPACITY16            32U
+#define DATA_LEN_MODE_SENSE6                 4U
+#define DATA_LEN_UNMAP_HEADER                8U
+#define DATA_LEN_UNMAP_DESCRIPTOR           16U
+#define DATA_LEN_VPD                        64U
+#define DATA_LEN_MODE_SENSE_CACHING         32U
+
+/* VPD pages, requested from devices which implement SPC-3 or later */
+#define SCSI_VERSION_SPC3                   0x05U
+#define SCSI_VPD_PAGE_SUPPORTED             0x00U
+#define SCSI_VPD_PAGE_BLOCK_LIMITS          0xB0U
+#define SCSI_VPD_PAGE_BLOCK_CHARACTERISTICS 0xB1U
+#define SCSI_VPD_PAGE_PROVISIONING          0xB2U
+
+#define SCSI_VPD_BLOCK_LIMITS               0x01U  /* Bits of SCSI_BlockLimitsTypeDef.pages */
+#define SCSI_VPD_BLOCK_CHARACTERISTICS      0x02U
+#define SCSI_VPD_PROVISIONING               0x04U
+
+#define SCSI_LBP_UNMAP                      0x80U  /* LBPU: UNMAP is supported */
+#define SCSI_LBP_WRITE_SAME16               0x40U  /* LBPWS: WRITE SAME(16) with UNMAP bit is supported */
+#define SCSI_LBP_ZEROED                     0x04U  /* LBPRZ: unmapped blocks read as zeros */
+
+/* Caching mode page, requested with the block descriptors disabled */
+#define SCSI_MODE_PAGE_CACHING              0x08U
+#define SCSI_CACHING_PAGE                   0x01U  /* Bits of the caching result: the page was returned */
+#define SCSI_CACHING_WCE                    0x02U  /* Write cache enabled */
+#define SCSI_CACHING_DPOFUA                 0x04U  /* Writes with FUA bit are supported */
+
+/* Largest values of the fields of READ10/WRITE10, larger requests use READ16/WRITE16 */
+#define SCSI_CDB10_MAX_LBA                  0xFFFFFFFFU
+#define SCSI_CDB10_MAX_BLOCKS               0xFFFFU
+
+/* Ranges of an UNMAP parameter list in the data buffer of the BOT handle */
+#define SCSI_UNMAP_MAX_RANGES               3U
+
+#define SCSI_CDB_FLAG_LUN                   0x01U  /* LUN in bits 7..5 of byte 1 for SCSI-2 devices */
+#define SCSI_CDB_FLAG_BLOCKS                0x02U  /* Length field counts blocks of the unit */
+#define SCSI_CDB_FLAG_NO_DATA               0x04U  /* No data phase */
 
 #define CBW_CB_LENGTH                       16U
 #define CBW_LENGTH                          10U
@@ -159,6 +269,13 @@ typedef struct
 /** @defgroup USBH_MSC_SCSI_Exported_FunctionsPrototype
   * @{
   */
+USBH_StatusTypeDef USBH_MSC_SCSI_Submit(USBH_HandleTypeDef *phost,
+                                        uint8_t lun,
+                                        SCSI_CdbTypeDef cdb,
+                                        uint64_t address,
+                                        uint32_t length,
+                                        uint8_t *pbuf);
+
 USBH_StatusTypeDef USBH_MSC_SCSI_TestUnitReady(USBH_HandleTypeDef *phost,
                                                uint8_t lun);
 
@@ -166,26 +283,53 @@ USBH_StatusTypeDef USBH_MSC_SCSI_ReadCapacity(USBH_HandleTypeDef *phost,
                                               uint8_t lun,
                                               SCSI_CapacityTypeDef *capacity);
 
+USBH_StatusTypeDef USBH_MSC_SCSI_ReadCapacity16(USBH_HandleTypeDef *phost,
+                                                uint8_t lun,
+                                                SCSI_CapacityTypeDef *capacity);
+
+USBH_StatusTypeDef USBH_MSC_SCSI_ModeSense6(USBH_HandleTypeDef *phost,
+                                            uint8_t lun,
+                                            uint8_t *write_protect);
+
+USBH_StatusTypeDef USBH_MSC_SCSI_ModeSenseCaching(USBH_HandleTypeDef *phost,
+                                                 uint8_t lun,
+                                                 uint8_t *caching);
+
 USBH_StatusTypeDef USBH_MSC_SCSI_Inquiry(USBH_HandleTypeDef *phost,
                                          uint8_t lun,
                                          SCSI_StdInquiryDataTypeDef *inquiry);
 
+USBH_StatusTypeDef USBH_MSC_SCSI_InquiryVPD(USBH_HandleTypeDef *phost,
+                                            uint8_t lun,
+                                            uint8_t page,
+                                            SCSI_BlockLimitsTypeDef *limits);
+
 USBH_StatusTypeDef USBH_MSC_SCSI_RequestSense(USBH_HandleTypeDef *phost,
                                               uint8_t lun,
                                               SCSI_SenseTypeDef *sense_data);
 
 USBH_StatusTypeDef USBH_MSC_SCSI_Write(USBH_HandleTypeDef *phost,
                                        uint8_t lun,
-                                       uint32_t address,
+                                       uint64_t address,
                                        uint8_t *pbuf,
                                        uint32_t length);
 
 USBH_StatusTypeDef USBH_MSC_SCSI_Read(USBH_HandleTypeDef *phost,
                                       uint8_t lun,
-                                      uint32_t address,
+                                      uint64_t address,
                                       uint8_t *pbuf,
                                       uint32_t length);
 
+USBH_StatusTypeDef USBH_MSC_SCSI_SynchronizeCache(USBH_HandleTypeDef *phost,
+                                                  uint8_t lun,
+                                                  uint32_t address,
+                                                  uint16_t length);
+
+USBH_StatusTypeDef USBH_MSC_SCSI_Unmap(USBH_HandleTypeDef *phost,
+                                       uint8_t lun,
+                                       const SCSI_UnmapRangeTypeDef *ranges,
+                                       uint8_t count);
+
 
 /**
   * @}
@@ -0,0 +1,42 @@
+/*
+ * ramdisk_diskio.h
+ *
+ *  RAM disk driver for FatFs. Can be linked with FATFS_LinkDriver instead of or in addition to USBH_Driver
+ *  to measure the costs of the file system without the USB stack. The disk is a memory buffer or, on
+ *  the host build, a memory mapped image file. An optional latency model adds a fixed cost per command
+ *  and a cost per byte to each read and write.
+ */
+
+#ifndef INC_RAMDISK_DISKIO_H_
+#define INC_RAMDISK_DISKIO_H_
+
+#include "usb_defines.h"
+#include "ff_gen_drv.h"
+
+typedef struct {
+	uint8_t *m_Buffer;			/* Memory of the disk. NULL allocates the memory or maps m_ImagePath. */
+	const char *m_ImagePath;	/* Host build only: image file which is mapped into memory, created if it does not exist. */
+	uint32_t m_SectorCount;		/* Size of the disk in sectors. 0 uses the size of an existing image. */
+	uint16_t m_SectorSize;		/* Must be in the range _MIN_SS to _MAX_SS. */
+	uint32_t m_CommandLatencyNs;	/* Fixed cost of each read and write command. */
+	uint32_t m_ByteLatencyPs;	/* Cost of each transferred byte, e.g. 50000 ps for 20 MB/s. */
+} RAMDISK_Config;
+
+/* Counters of the RAM disk, see RAMDISK_GetStats. */
+typedef struct {
+	uint32_t m_ReadCommands;
+	uint32_t m_WriteCommands;
+	uint32_t m_SyncCommands;
+	uint64_t m_SectorsRead;
+	uint64_t m_SectorsWritten;
+	uint64_t m_LatencyNs;		/* Sum of the modelled latencies. */
+} RAMDISK_Stats;
+
+extern const Diskio_drvTypeDef RAMDISK_Driver;
+
+USB_ERROR RAMDISK_Init(const RAMDISK_Config *config);
+USB_ERROR RAMDISK_DeInit();
+void RAMDISK_GetStats(RAMDISK_Stats *stats);
+void RAMDISK_ResetStats();
+
+#endif /* INC_RAMDISK_DISKIO_H_ */
@@ -0,0 +1,55 @@
+/*
+ * usb_attach.h
+ *
+ *  Attach timing and the fast attach mode. USBH_Process calls into this module at each phase of an attach,
+ *  the durations of the last attach are returned by USB_GetAttachStats (usb_handler.h).
+ *
+ *  With the fast attach mode (USB_SetFastAttach) the fixed delays of the host library are replaced by
+ *  non-blocking waits of the minimum times of the USB 2.0 specification: connect debounce (TATTDB) and
+ *  reset recovery (TRSTRCY). The serial number is requested right after SET_ADDRESS. If the device is in
+ *  the cache, its configuration descriptor, the number of LUNs and INQUIRY and READ CAPACITY data of each
+ *  LUN, with the VPD pages of SPC-3 devices, are restored instead of being requested. TEST UNIT READY is
+ *  always sent. Devices without a serial number are never taken from the cache.
+ */
+
+#ifndef INC_USB_ATTACH_H_
+#define INC_USB_ATTACH_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+#include "usbh_msc.h"
+
+#define USB_ATTACH_DEBOUNCE_MS			100		/* TATTDB: connection stable before the port reset. */
+#define USB_ATTACH_RESET_RECOVERY_MS	10		/* TRSTRCY: port enabled until the first request. */
+
+typedef enum {
+	USB_ATTACH_PHASE_IDLE = 0,
+	USB_ATTACH_PHASE_DEBOUNCE,
+	USB_ATTACH_PHASE_RESET,
+	USB_ATTACH_PHASE_RECOVERY,
+	USB_ATTACH_PHASE_ENUMERATION,
+	USB_ATTACH_PHASE_CLASS,
+	USB_ATTACH_PHASE_READY
+} USB_ATTACH_PHASE;
+
+void USB_ATTACH_SetFast(BOOL enable);
+BOOL USB_ATTACH_IsFast();
+
+/* Called by the host library */
+BOOL USB_ATTACH_Debounced();
+BOOL USB_ATTACH_ResetRecovered();
+uint32_t USB_ATTACH_ElapsedMs();
+void USB_ATTACH_Mark(USB_ATTACH_PHASE phase);
+void USB_ATTACH_SetSerial(const char *serial);
+BOOL USB_ATTACH_RestoreConfig(USBH_HandleTypeDef *phost);
+BOOL USB_ATTACH_CachedMaxLUN(uint8_t *maxLun);
+BOOL USB_ATTACH_CachedLUN(uint8_t lun, SCSI_StdInquiryDataTypeDef *inquiry, SCSI_CapacityTypeDef *capacity,
+		SCSI_BlockLimitsTypeDef *limits);
+void USB_ATTACH_Invalidate(uint8_t lun);
+void USB_ATTACH_Ready(USBH_HandleTypeDef *phost);
+void USB_ATTACH_Disconnected();
+
+void USB_ATTACH_GetSerial(char *serial);
+void USB_ATTACH_GetStats(USB_ATTACH_STATS *stats);
+
+#endif /* INC_USB_ATTACH_H_ */
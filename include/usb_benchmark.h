@@ -0,0 +1,57 @@
+/*
+ * usb_benchmark.h
+ *
+ *  Throughput and latency benchmark of the usb_handler.h API. Runs a fixed matrix of tests on the
+ *  mounted drive "0:" and prints MB/s, operations per second and the p50, p99 and max latency of
+ *  each test with printf (semihosting on the target, stdout on the host build).
+ */
+
+#ifndef INC_USB_BENCHMARK_H_
+#define INC_USB_BENCHMARK_H_
+
+#include "usb_defines.h"
+
+/* Number of latency samples stored per test. Percentiles are calculated over the first
+ * USB_BENCH_MAX_SAMPLES operations, the max latency over all operations. */
+#ifndef USB_BENCH_MAX_SAMPLES
+#define USB_BENCH_MAX_SAMPLES		2048
+#endif
+
+/* Largest chunk size of the sequential tests, also the size of the data buffer. */
+#define USB_BENCH_MAX_CHUNK_SIZE	(64 * 1024)
+#define USB_BENCH_RANDOM_SIZE		4096
+
+typedef struct {
+	uint32_t m_FileSize;		/* Size of the file of the sequential and random tests. */
+	uint32_t m_RandomOps;		/* Number of reads and writes of the random tests. */
+	uint32_t m_SmallFiles;		/* Number of files created and deleted. */
+	uint32_t m_SmallFileSize;	/* Size of each of the small files. */
+	uint32_t m_SyncAppends;		/* Number of appends, each followed by USB_Sync. */
+	uint32_t m_SyncAppendSize;	/* Size of each append. */
+	BOOL m_DurableSync;			/* Parameter durable of USB_Sync in the append test. */
+	uint32_t m_MountCount;		/* Number of mounts of the mount test. */
+} USB_BENCH_Config;
+
+/* Result of a single test */
+typedef struct {
+	const char *m_Name;
+	uint32_t m_ChunkSize;
+	uint32_t m_Ops;
+	uint64_t m_Bytes;
+	uint64_t m_TotalNs;			/* Duration of the test including open and close. */
+	uint32_t m_P50Ns;
+	uint32_t m_P99Ns;
+	uint32_t m_MaxNs;
+} USB_BENCH_Result;
+
+void USB_BENCH_GetDefaultConfig(USB_BENCH_Config *config);
+USB_ERROR USB_BENCH_Run(USB_MS_Handle *usbHandle, const USB_BENCH_Config *config);
+void USB_BENCH_PrintResult(const USB_BENCH_Result *result);
+void USB_BENCH_PrintLatencyHistograms(uint8_t lun);
+void USB_BENCH_PrintBusStats();
+USB_ERROR USB_BENCH_RunCpuLoad(USB_MS_Handle *usbHandle, uint32_t bytesPerSecond, uint32_t durationMs);
+void USB_BENCH_PrintIRQStats(const USB_IRQ_STATS *stats);
+USB_ERROR USB_BENCH_RunCalibration(uint32_t bufferSize);
+USB_ERROR USB_BENCH_RunSeek(USB_MS_Handle *usbHandle, uint64_t fileSize, uint32_t ops);
+
+#endif /* INC_USB_BENCHMARK_H_ */
@@ -0,0 +1,46 @@
+/*
+ * usb_bus_stats.h
+ *
+ *  Bus level counters of the host channels. HCD_HC_IN_IRQHandler, HCD_HC_OUT_IRQHandler and
+ *  HCD_RXQLVL_IRQHandler count packets, bytes, NAKs, NYETs, STALLs, halts, errors and retries per
+ *  channel. With USB_BUS_STATS_FRAMES=1 (cmake -DUSB_BUS_FRAMES=ON) the SOF interrupt additionally
+ *  closes a per frame byte accumulator. The application reads the counters with USB_GetBusStats
+ *  and USB_GetBusFrameStats (usb_handler.h).
+ */
+
+#ifndef INC_USB_BUS_STATS_H_
+#define INC_USB_BUS_STATS_H_
+
+#include "usb_defines.h"
+
+extern volatile USB_BUS_CHANNEL_STATS usbBusChannelStats[USB_BUS_STATS_CHANNELS];
+#if USB_BUS_STATS_FRAMES
+extern volatile uint32_t usbBusFrameBytes;
+#endif /* USB_BUS_STATS_FRAMES */
+
+/* Increments a counter of USB_BUS_CHANNEL_STATS, e.g. USB_BUS_COUNT(ch_num, m_NAKs). Only called from
+ * the interrupt handlers of the host controller (or the simulated one), so no locking is needed. */
+#define USB_BUS_COUNT(channel, counter)	(usbBusChannelStats[(channel) & (USB_BUS_STATS_CHANNELS - 1)].counter++)
+
+/**
+ * @brief Adds transferred data to the counters of a channel and to the byte accumulator of the current frame.
+ * @param channel host channel.
+ * @param bytes payload bytes.
+ * @param packets number of data packets.
+ */
+static inline void USB_BUS_AddTransfer(uint32_t channel, uint32_t bytes, uint32_t packets)
+{
+	volatile USB_BUS_CHANNEL_STATS *stats = &usbBusChannelStats[channel & (USB_BUS_STATS_CHANNELS - 1)];
+	stats->m_Packets += packets;
+	stats->m_Bytes += bytes;
+#if USB_BUS_STATS_FRAMES
+	usbBusFrameBytes += bytes;
+#endif /* USB_BUS_STATS_FRAMES */
+}
+
+void USB_BUS_Frame();
+BOOL USB_BUS_GetChannelStats(uint8_t channel, USB_BUS_CHANNEL_STATS *stats);
+void USB_BUS_GetFrameStats(USB_BUS_FRAME_STATS *stats);
+void USB_BUS_Reset();
+
+#endif /* INC_USB_BUS_STATS_H_ */
@@ -0,0 +1,40 @@
+/*
+ * usb_cache.h
+ *
+ *  Write cache flushes at CTRL_SYNC. FatFs issues CTRL_SYNC at the end of f_sync, f_close, f_unlink, f_syncfs and
+ *  the other functions which modify the volume. USBH_ioctl sends SYNCHRONIZE CACHE(10) for the whole unit if data
+ *  was written since the last flush, so a completed f_sync survives a power loss of the device. Consecutive syncs
+ *  without writes in between, e.g. f_sync followed by f_syncfs, cost no command. USB_SyncFiles defers the flushes
+ *  of several files to one command at the end.
+ *
+ *  The caching mode page is requested once per attach, before the first flush. A unit which reports the write
+ *  cache disabled is not flushed. A unit which does not return the page is flushed, many flash drives have a RAM
+ *  cache without reporting it. SYNCHRONIZE CACHE failing with ILLEGAL REQUEST is not sent again until the next
+ *  attach, other errors fail CTRL_SYNC.
+ *
+ *  With USB_CACHE_FLUSH_FUA_METADATA the sectors which FatFs writes from the window of the file system object,
+ *  i.e. FAT, allocation bitmap and directory sectors, are written with force unit access if the unit reports
+ *  DPOFUA. The file system structure is on the medium after each of these writes, and a sync which wrote only
+ *  metadata needs no flush. File data written before the metadata still reaches the medium with the flush.
+ */
+
+#ifndef INC_USB_CACHE_H_
+#define INC_USB_CACHE_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+
+#define USB_CACHE_COMMAND_TIMEOUT_MS	10000	/* Timeout of SYNCHRONIZE CACHE, the device writes its whole cache. */
+
+/* Called by the disk I/O driver */
+BOOL USB_CACHE_Write(USBH_HandleTypeDef *phost, uint8_t lun, const uint8_t *buff);
+USBH_StatusTypeDef USB_CACHE_Sync(USBH_HandleTypeDef *phost, uint8_t lun);
+
+void USB_CACHE_SetMode(USB_CACHE_MODE mode);
+void USB_CACHE_SetMetadataBuffer(const uint8_t *window);
+void USB_CACHE_BeginBatch();
+USBH_StatusTypeDef USB_CACHE_EndBatch(USBH_HandleTypeDef *phost);
+void USB_CACHE_Detach();
+void USB_CACHE_GetInfo(uint8_t lun, USB_CACHE_INFO *info);
+
+#endif /* INC_USB_CACHE_H_ */
@@ -10,7 +10,7 @@
 
 #include <stdint.h>
 
-char errorBuffer[512];
+extern char errorBuffer[512];
 
 typedef enum {
 	USB_NO_ERROR,
@@ -38,7 +38,11 @@ typedef enum {
 	USB_TIMEOUT,
 	USB_RESOURCE_LOCKED,
 	USB_NOT_ENOUGH_CORE,
-	USB_TO_MANY_OPEN_FILES
+	USB_TO_MANY_OPEN_FILES,
+	USB_MKFS_ABORTED,
+	USB_LOG_FULL,
+	USB_LOG_INVALID,
+	USB_LOG_END
 } USB_ERROR_CODE;
 
 typedef struct {
@@ -59,9 +63,318 @@ typedef enum {
 
 typedef int BOOL;
 
+#ifndef FALSE
 #define FALSE 0
+#endif
+#ifndef TRUE
 #define TRUE 1
+#endif
 
+/* Number of DWORD entries in the cluster link map of each handle. Each fragment of a file
+ * needs two entries, two more entries are required for the table header and terminator. */
+#ifndef USB_LINKMAP_SIZE
+#define USB_LINKMAP_SIZE	128
+#endif
+
+typedef enum {
+	USB_LINKMAP_DISABLED = 0,	/* File not opened with USB_FAST_SEEK. */
+	USB_LINKMAP_VALID,			/* Link map describes the complete cluster chain. */
+	USB_LINKMAP_STALE,			/* File grew, link map is rebuilt on the next seek. */
+	USB_LINKMAP_OVERFLOW		/* File too fragmented for USB_LINKMAP_SIZE, FAT chain is used. */
+} USB_LINKMAP_STATE;
+
+/* Seek statistics of a handle, see USB_GetSeekStats. */
+typedef struct {
+	uint32_t m_SeekCount;		/* Number of calls to USB_Seek. */
+	uint32_t m_FastSeekCount;	/* Seeks resolved by the link map without reading the FAT. */
+	uint32_t m_LinkMapBuilds;	/* Number of times the link map was (re)built. */
+	uint32_t m_LinkMapOverflows;	/* Number of times the link map did not fit into the arena. */
+	uint32_t m_LastSeekNs;		/* Duration of the last seek. */
+	uint32_t m_MaxSeekNs;		/* Longest seek since the last reset. */
+	uint64_t m_TotalSeekNs;		/* Sum of all seek durations since the last reset. */
+} USB_SEEK_STATS;
+
+/* Metadata sync policy of a handle, see USB_SetSyncPolicy. A value of 0 disables the criterion. */
+typedef struct {
+	uint32_t m_IntervalMS;		/* Rewrite the directory entry at the latest m_IntervalMS after the last update. */
+	uint32_t m_ByteThreshold;	/* Rewrite the directory entry after m_ByteThreshold bytes were written. */
+} USB_SYNC_POLICY;
+
+/* Log bucketed latency histograms of the MSC read and write commands, see USB_GetLatencyHistogram.
+ * Latencies are stored in us. Each power of 2 is split into 2^USB_LATENCY_SUB_BUCKET_BITS buckets,
+ * so a bucket covers at most 1/4 of its value with the default of 2. Latencies above
+ * 2^(USB_LATENCY_MAX_EXPONENT + 1) us are counted in the last bucket. */
+#ifndef USB_LATENCY_SUB_BUCKET_BITS
+#define USB_LATENCY_SUB_BUCKET_BITS	2
+#endif
+#ifndef USB_LATENCY_MAX_EXPONENT
+#define USB_LATENCY_MAX_EXPONENT	22		/* 2^23 us = 8.4 s */
+#endif
+#define USB_LATENCY_BUCKETS			((USB_LATENCY_MAX_EXPONENT - USB_LATENCY_SUB_BUCKET_BITS + 2) << USB_LATENCY_SUB_BUCKET_BITS)
+
+/* Histograms are kept per LUN, direction and transfer size class. The size classes grow by a factor of 8:
+ * 1 sector, 2-8, 9-64 and more than 64 sectors. Fewer classes (minimum 1) merge the larger transfer sizes. */
+#ifndef USB_LATENCY_SIZE_CLASSES
+#define USB_LATENCY_SIZE_CLASSES	4
+#endif
+#define USB_LATENCY_MAX_LUN			2
+#define USB_LATENCY_ALL_SIZES		0xFF	/* Size class parameter: sum of all size classes. */
+
+typedef enum {
+	USB_LATENCY_READ = 0,
+	USB_LATENCY_WRITE = 1
+} USB_LATENCY_DIR;
+
+typedef struct {
+	uint32_t m_Count;			/* Number of successful commands. */
+	uint32_t m_Failed;			/* Number of failed or timed out commands, not contained in the buckets. */
+	uint32_t m_MinUs;
+	uint32_t m_MaxUs;
+	uint64_t m_SumUs;
+	uint64_t m_Sectors;			/* Number of transferred sectors. */
+	uint32_t m_Buckets[USB_LATENCY_BUCKETS];
+} USB_LATENCY_HISTOGRAM;
+
+/* Bus level counters of the host channels, see USB_GetBusStats. The HCD interrupt handlers count the
+ * handshakes and errors which otherwise only end up in the URB state. */
+#define USB_BUS_STATS_CHANNELS		16		/* OTG HS: 12 host channels, must be a power of 2. */
+
+/* Per frame accumulator driven by the SOF interrupt (1 ms at full speed, 125 us at high speed).
+ * Needs the SOF interrupt to call into the statistics 8000 times per second, so it is optional. */
+#ifndef USB_BUS_STATS_FRAMES
+#define USB_BUS_STATS_FRAMES		0
+#endif
+
+typedef struct {
+	uint32_t m_Packets;			/* Transferred data packets. */
+	uint64_t m_Bytes;			/* Transferred payload bytes. IN: counted per packet, OUT: when the transfer completes. */
+	uint32_t m_NAKs;			/* Device was not ready to send or receive data. */
+	uint32_t m_NYETs;			/* OUT data accepted, but the device has no space for the next packet (high speed). */
+	uint32_t m_Stalls;
+	uint32_t m_Halts;			/* Channel halted interrupts, each transfer, NAK or error halts the channel. */
+	uint32_t m_XactErrors;		/* Transaction errors: CRC, timeout, bit stuffing or false EOP. */
+	uint32_t m_ToggleErrors;	/* Data toggle mismatches. */
+	uint32_t m_OtherErrors;		/* Babble, AHB and frame overrun errors. */
+	uint32_t m_Retries;			/* Transactions repeated by the driver after a transaction or toggle error. */
+	uint32_t m_URBErrors;		/* Transfers failed after the retries were exhausted. */
+} USB_BUS_CHANNEL_STATS;
+
+typedef struct {
+	uint32_t m_Frames;			/* Number of (micro)frames since the last reset. */
+	uint32_t m_BusyFrames;		/* Frames with at least one transferred byte. */
+	uint32_t m_MaxFrameBytes;	/* Maximum number of bytes transferred in one frame. */
+	uint32_t m_LastFrameBytes;	/* Bytes of the last completed frame. */
+	uint64_t m_Bytes;			/* Bytes of all completed frames. */
+} USB_BUS_FRAME_STATS;
+
+/* Interrupt time accounting of OTG_HS_IRQHandler, see USB_GetIRQStats. Reads the DWT cycle counter
+ * before and after each interrupt source, so it is optional. */
+#ifndef USB_IRQ_STATS_ENABLE
+#define USB_IRQ_STATS_ENABLE		0
+#endif
+
+typedef struct {
+	uint32_t m_Count;			/* Number of handled interrupts of the source. */
+	uint32_t m_MaxCycles;		/* Longest handling time of a single interrupt. */
+	uint64_t m_Cycles;			/* Cumulative handling time. */
+} USB_IRQ_SOURCE_STATS;
+
+typedef struct {
+	USB_IRQ_SOURCE_STATS m_Total;		/* Whole OTG_HS_IRQHandler without exception entry and exit. */
+	USB_IRQ_SOURCE_STATS m_Disconnect;
+	USB_IRQ_SOURCE_STATS m_Port;		/* Connect, enable and overcurrent changes of the host port. */
+	USB_IRQ_SOURCE_STATS m_SOF;
+	USB_IRQ_SOURCE_STATS m_RxFifo;		/* RXFLVL: IN packets copied out of the receive FIFO. */
+	USB_IRQ_SOURCE_STATS m_Channels[USB_BUS_STATS_CHANNELS];	/* HCINT of each host channel. */
+	uint64_t m_ElapsedCycles;	/* Cycles since the last reset, the CPU load is m_Total.m_Cycles / m_ElapsedCycles. */
+} USB_IRQ_STATS;
+
+#define USB_SERIAL_LENGTH			32		/* Serial number string of a device including the terminator. */
+
+/* Transfer tuning of a device, see USB_CalibrateTransfers. The diskio layer splits the requests of FatFs into
+ * read and write commands of at most m_MaxSectors which do not cross a multiple of m_AlignSectors. */
+#define USB_TUNING_DEVICE_MAX_SECTORS	0xFFFFFFFF	/* No limit of the tuning, the maximum transfer length of the device applies. */
+#define USB_TUNING_SIZES			8		/* Transfer sizes of the probe: 4 KB, 8 KB, ... 512 KB. */
+
+/* Number of devices whose tuning is kept in RAM. The oldest entry is replaced. */
+#ifndef USB_TUNING_CACHE_ENTRIES
+#define USB_TUNING_CACHE_ENTRIES	4
+#endif
+
+typedef struct {
+	uint16_t m_VendorID;
+	uint16_t m_ProductID;
+	char m_Serial[USB_SERIAL_LENGTH];	/* Serial number string, empty if the device has none. */
+	uint32_t m_MaxSectors;		/* Largest command, limited to the maximum transfer length of the device. */
+	uint32_t m_AlignSectors;	/* Commands are split at multiples of this LBA, 1 disables the alignment. */
+	uint32_t m_WriteKBs;		/* Throughput measured with m_MaxSectors, 0 if not calibrated. */
+	uint32_t m_ReadKBs;
+	BOOL m_Calibrated;			/* FALSE: defaults, the Block Limits VPD page of the device or the maximum transfer length. */
+} USB_TRANSFER_TUNING;
+
+/* Throughput of one transfer size measured by the probe. */
+typedef struct {
+	uint32_t m_Sectors;
+	uint32_t m_WriteKBs;			/* Commands starting at a multiple of m_Sectors. */
+	uint32_t m_ReadKBs;
+	uint32_t m_UnalignedWriteKBs;	/* Commands shifted by one sector. */
+	uint32_t m_UnalignedReadKBs;
+} USB_TUNING_SAMPLE;
+
+typedef struct {
+	uint32_t m_SampleCount;
+	USB_TUNING_SAMPLE m_Samples[USB_TUNING_SIZES];
+} USB_TUNING_REPORT;
+
+/* Number of devices whose configuration and LUN info is kept for the fast attach mode, see USB_SetFastAttach. */
+#ifndef USB_ATTACH_CACHE_ENTRIES
+#define USB_ATTACH_CACHE_ENTRIES	4
+#endif
+
+/* Durations of the last attach, measured from the connect interrupt. See USB_GetAttachStats. */
+typedef struct {
+	uint32_t m_Attaches;		/* Devices which reached the class active state. */
+	uint32_t m_CacheHits;		/* Attaches which restored the configuration and the LUN info from the cache. */
+	BOOL m_FastAttach;			/* Last attach used the fast attach mode. */
+	BOOL m_CacheHit;			/* Last attach was served from the cache. */
+	uint32_t m_DebounceUs;		/* Connect interrupt until the port reset. */
+	uint32_t m_ResetUs;			/* Port reset and reset recovery. */
+	uint32_t m_EnumerationUs;	/* Standard requests until the configuration was known. */
+	uint32_t m_ClassInitUs;		/* SET_CONFIGURATION, GetMaxLUN and the SCSI commands of each LUN. */
+	uint32_t m_TimeToReadyUs;	/* Connect interrupt until the MSC class is active. */
+	uint32_t m_MaxTimeToReadyUs;
+} USB_ATTACH_STATS;
+
+/* Number of volumes whose fingerprint is kept for the warm remount, see USB_MountDrive. */
+#ifndef USB_VOLUME_CACHE_ENTRIES
+#define USB_VOLUME_CACHE_ENTRIES	4
+#endif
+
+/* Results of the fingerprint check of USB_MountDrive, see USB_GetVolumeStats. */
+typedef struct {
+	uint32_t m_Mounts;
+	uint32_t m_WarmMounts;		/* Free cluster count and allocation hint were restored. */
+	uint32_t m_Mismatches;		/* Known volume which was modified elsewhere, mounted cold. */
+	uint32_t m_Captures;		/* Fingerprints taken at durable sync points. */
+	BOOL m_LastWarm;			/* Last mount was warm. */
+	uint32_t m_LastMountUs;		/* Duration of the last USB_MountDrive including the check. */
+} USB_VOLUME_STATS;
+
+/* Recovery of failed MSC read and write commands, see USB_GetRecoveryStats. Recovery times are measured
+ * from the first error of a command until it completed. */
+typedef struct {
+	uint32_t m_SenseRetries;	/* Commands sent again after a transient CHECK CONDITION. */
+	uint32_t m_BotResets;		/* Reset recoveries: Bulk-Only Mass Storage Reset and clearing both bulk halts. */
+	uint32_t m_PortResets;		/* Port resets followed by SET_ADDRESS and SET_CONFIGURATION. */
+	uint32_t m_Recovered;		/* Commands which completed after a recovery. */
+	uint32_t m_Failed;			/* Commands which failed after a recovery. HOST_USER_UNRECOVERED_ERROR if the port reset failed too. */
+	uint32_t m_LastRecoveryUs;
+	uint32_t m_MaxRecoveryUs;
+	uint64_t m_TotalRecoveryUs;
+} USB_RECOVERY_STATS;
+
+/* Ready state of a logical unit, see USB_GetUnitInfo. */
+typedef enum {
+	USB_UNIT_NOT_PRESENT = 0,	/* No device attached or class not initialized yet. */
+	USB_UNIT_READY,
+	USB_UNIT_NOT_READY,			/* NOT READY, e.g. becoming ready. */
+	USB_UNIT_NO_MEDIUM,			/* NOT READY, medium not present. */
+	USB_UNIT_MEDIUM_CHANGED,	/* UNIT ATTENTION or a medium was inserted, the volume has to be mounted again. */
+	USB_UNIT_FAILED				/* Recovery failed, the device has to be re-enumerated. */
+} USB_UNIT_STATE;
+
+/* Ready state and events of a logical unit. */
+typedef struct {
+	USB_UNIT_STATE m_State;
+	uint8_t m_SenseKey;			/* Sense data of the last failed command. */
+	uint8_t m_ASC;
+	uint8_t m_ASCQ;
+	uint32_t m_MediaChanges;
+	uint32_t m_StatusQueries;	/* disk_status calls, answered without a bus transaction. */
+	uint32_t m_Polls;			/* TEST UNIT READY commands sent while the unit was not ready. */
+} USB_UNIT_INFO;
+
+/* TRIM of freed clusters, see USB_GetTrimStats. */
+typedef struct {
+	uint32_t m_Ranges;			/* Sector ranges of CTRL_TRIM and of USB_TrimFreeSpace. */
+	uint32_t m_Skipped;			/* Ranges of units without UNMAP or smaller than an unmap granule. */
+	uint32_t m_Commands;		/* UNMAP commands completed. */
+	uint32_t m_Failed;			/* UNMAP commands which failed, their blocks stay mapped. */
+	uint32_t m_EarlyFlushes;	/* UNMAP commands sent because a write overlapped a collected range. */
+	uint32_t m_ScanPasses;		/* Passes of USB_TrimFreeSpace over the whole volume. */
+	uint64_t m_Blocks;			/* Blocks of the completed UNMAP commands. */
+} USB_TRIM_STATS;
+
+/* Handling of the write cache of the device at CTRL_SYNC, see USB_SetCacheMode. */
+typedef enum {
+	USB_CACHE_NO_FLUSH = 0,			/* CTRL_SYNC sends no command, durability depends on the device. */
+	USB_CACHE_FLUSH,				/* CTRL_SYNC sends SYNCHRONIZE CACHE if data was written since the last flush. */
+	USB_CACHE_FLUSH_FUA_METADATA	/* Like USB_CACHE_FLUSH, FAT and directory sectors are written with force unit access. */
+} USB_CACHE_MODE;
+
+/* Write cache of a logical unit and the flushes of CTRL_SYNC, see USB_GetCacheInfo. */
+typedef struct {
+	BOOL m_Probed;				/* Caching mode page was requested. */
+	BOOL m_PageReported;		/* Device returned the caching mode page. */
+	BOOL m_WriteCache;			/* WCE of the page. A device without the page is flushed, too. */
+	BOOL m_FUASupported;		/* DPOFUA of the mode parameter header. */
+	BOOL m_FlushSupported;		/* FALSE after SYNCHRONIZE CACHE failed with ILLEGAL REQUEST. */
+	uint32_t m_Syncs;			/* CTRL_SYNC calls. */
+	uint32_t m_Flushes;			/* SYNCHRONIZE CACHE commands completed. */
+	uint32_t m_CleanSyncs;		/* CTRL_SYNC without cached writes since the last flush, no command. */
+	uint32_t m_DeferredSyncs;	/* CTRL_SYNC of USB_SyncFiles, combined into one flush. */
+	uint32_t m_FailedFlushes;
+	uint32_t m_FUAWrites;		/* FAT and directory writes with force unit access. */
+	uint32_t m_LastFlushUs;
+	uint32_t m_MaxFlushUs;
+} USB_CACHE_INFO;
+
+/* Priority classes of the I/O scheduler, see usb_iosched.h. */
+typedef enum {
+	USB_IO_BULK = 0,		/* disk_read and disk_write of FatFs, split into chunks. */
+	USB_IO_URGENT,			/* Requests of USB_SubmitUrgentIO, served between two chunks. */
+	USB_IO_CLASSES
+} USB_IO_CLASS;
+
+typedef enum {
+	USB_IO_IDLE = 0,		/* Not submitted yet. */
+	USB_IO_QUEUED,
+	USB_IO_ACTIVE,
+	USB_IO_DONE				/* m_Success, m_DeadlineMissed and m_LatencyUs are valid. */
+} USB_IO_STATE;
+
+/* Urgent raw sector request, see USB_SubmitUrgentIO. Owned by the application, it has to stay valid until m_State is USB_IO_DONE. */
+typedef struct {
+	uint8_t m_Lun;
+	BOOL m_Write;
+	uint32_t m_Sector;
+	uint32_t m_Count;			/* Sectors to read or write. */
+	uint8_t *m_Buffer;			/* 4 byte aligned for DMA. */
+	uint32_t m_DeadlineUs;		/* Deadline relative to the submission, 0 for none. */
+	void (*m_Callback)(void *context);	/* Called by the scheduler after completion, may be NULL. */
+	void *m_Context;
+	/* Set by the scheduler */
+	volatile USB_IO_STATE m_State;
+	BOOL m_Success;
+	BOOL m_DeadlineMissed;
+	uint64_t m_SubmitUs;
+	uint32_t m_LatencyUs;		/* Submission until completion. */
+} USB_IO_REQUEST;
+
+/* Counters of the I/O scheduler per priority class, see USB_GetIOSchedulerStats. */
+typedef struct {
+	uint32_t m_Requests[USB_IO_CLASSES];
+	uint32_t m_Failed[USB_IO_CLASSES];
+	uint32_t m_DeadlineMisses[USB_IO_CLASSES];
+	uint32_t m_MaxLatencyUs[USB_IO_CLASSES];	/* Submission or disk_read/disk_write call until completion. */
+	uint32_t m_MaxLateUs[USB_IO_CLASSES];		/* Largest time a request completed after its deadline. */
+	uint32_t m_BulkChunks;		/* Commands of bulk requests. */
+	uint32_t m_Preemptions;		/* Urgent requests served between two chunks of a bulk request. */
+	uint32_t m_Rejected;		/* Urgent requests not queued because the queue was full. */
+	USB_IO_CLASS m_LastMissClass;	/* Last missed deadline: class, first sector and lateness. */
+	uint32_t m_LastMissSector;
+	uint32_t m_LastMissLateUs;
+} USB_IOSCHED_STATS;
 
 struct
 {
@@ -69,6 +382,12 @@ struct
 	void* m_FileHandle; /* File object */
 	char m_USBDISKPath[4];
 	volatile USB_STATE m_USBState;
+	USB_LINKMAP_STATE m_LinkMapState;
+	unsigned long m_LinkMap[USB_LINKMAP_SIZE]; /* Cluster link map (FatFs DWORD) for fast seeking */
+	USB_SEEK_STATS m_SeekStats;
+	USB_SYNC_POLICY m_SyncPolicy;
+	uint32_t m_UnsyncedBytes; /* Bytes written since the last directory entry update */
+	uint32_t m_LastSyncTick; /* HAL tick of the last directory entry update */
 }typedef USB_MS_Handle;
 
 
@@ -80,6 +399,14 @@ struct
 #define USB_OVERWRITE		0x20	/* Always create new file, overwrite old one. */
 #define USB_CREATE_OR_OPEN 	0x40    /* Open existing file. Create new one if not exists. */
 #define USB_APPEND			0x80 	/* Open existing, set write pointer to the end of the file. */
+#define USB_FAST_SEEK		0x100	/* Build a cluster link map when opened for reading, seeks do not walk the FAT. */
+
+/* File system types which can be created by USB_FormatDrive. */
+typedef enum {
+	USB_FS_FAT = 0x01,	/* FAT12/FAT16, chosen by the volume size. */
+	USB_FS_FAT32 = 0x02,	/* FAT32, files are limited to 4 GB - 1. FAT12/FAT16 on too small volumes. */
+	USB_FS_EXFAT = 0x04	/* exFAT, allocation bitmap and files larger than 4 GB. */
+} USB_FS_TYPE;
 
 
 #endif /* INC_USB_DEFINES_H_ */
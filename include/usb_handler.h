@@ -18,9 +18,60 @@ USB_ERROR USB_DeInitConnection(USB_MS_Handle* usbHandle);
 USB_ERROR USB_MountDrive();
 USB_ERROR USB_OpenFile(USB_MS_Handle* usbHandle, const char* fileName, int flags);
 USB_ERROR USB_CloseFile(USB_MS_Handle* usbHandle);
+USB_ERROR USB_DeleteFile(const char* fileName);
 USB_ERROR USB_WriteData(USB_MS_Handle* usbHandle, uint8_t *buffer, uint32_t *bufferLen, BOOL append);
 USB_ERROR USB_ReadData(USB_MS_Handle* usbHandle, uint8_t *buffer, uint32_t *len);
 USB_ERROR USB_SetLastBufferPos(USB_MS_Handle* usbHandle);
+USB_ERROR USB_SetSyncPolicy(USB_MS_Handle* usbHandle, uint32_t intervalMS, uint32_t byteThreshold);
+USB_ERROR USB_Sync(USB_MS_Handle* usbHandle, BOOL durable);
+USB_ERROR USB_SyncFiles(USB_MS_Handle** usbHandles, uint32_t count);
+USB_ERROR USB_SetCacheMode(USB_CACHE_MODE mode);
+USB_ERROR USB_GetCacheInfo(uint8_t lun, USB_CACHE_INFO *info);
+
+/* Large file and volume functions */
+USB_ERROR USB_FormatDrive(USB_FS_TYPE fsType, uint32_t clusterSize);
+USB_ERROR USB_GetFreeSpace(uint64_t *freeBytes);
+USB_ERROR USB_GetVolumeStats(USB_VOLUME_STATS *stats);
+USB_ERROR USB_TrimFreeSpace(uint32_t maxSectors, BOOL *done);
+USB_ERROR USB_GetTrimStats(USB_TRIM_STATS *stats);
+USB_ERROR USB_PreallocateFile(USB_MS_Handle* usbHandle, uint64_t size);
+USB_ERROR USB_Seek(USB_MS_Handle* usbHandle, uint64_t offset);
+USB_ERROR USB_SetFastSeek(USB_MS_Handle* usbHandle, BOOL enable);
+USB_ERROR USB_GetFileSize(USB_MS_Handle* usbHandle, uint64_t *size);
+USB_ERROR USB_GetSeekStats(USB_MS_Handle* usbHandle, USB_SEEK_STATS *stats);
+USB_ERROR USB_ResetSeekStats(USB_MS_Handle* usbHandle);
+
+/* Command latency functions */
+USB_ERROR USB_GetLatencyHistogram(uint8_t lun, USB_LATENCY_DIR dir, uint8_t sizeClass, USB_LATENCY_HISTOGRAM *hist);
+USB_ERROR USB_ResetLatencyHistograms();
+USB_ERROR USB_GetLatencyPercentile(const USB_LATENCY_HISTOGRAM *hist, float percentile, uint32_t *latencyUs);
+
+/* Bus level functions */
+USB_ERROR USB_GetBusStats(uint8_t channel, USB_BUS_CHANNEL_STATS *stats);
+USB_ERROR USB_GetBusFrameStats(USB_BUS_FRAME_STATS *stats);
+USB_ERROR USB_ResetBusStats();
+USB_ERROR USB_GetIRQStats(USB_IRQ_STATS *stats);
+USB_ERROR USB_ResetIRQStats();
+USB_ERROR USB_SaveTrace(const char* fileName);
+
+/* Transfer tuning functions */
+USB_ERROR USB_CalibrateTransfers(const char* fileName, uint8_t *buffer, uint32_t bufferSize, USB_TUNING_REPORT *report);
+USB_ERROR USB_GetTransferTuning(USB_TRANSFER_TUNING *tuning);
+USB_ERROR USB_SetTransferTuning(const USB_TRANSFER_TUNING *tuning);
+
+/* I/O scheduler functions */
+USB_ERROR USB_SetIOScheduler(uint32_t chunkBytes, uint32_t bulkDeadlineUs);
+USB_ERROR USB_SubmitUrgentIO(USB_IO_REQUEST *request);
+USB_ERROR USB_ServeUrgentIO();
+USB_ERROR USB_GetIOSchedulerStats(USB_IOSCHED_STATS *stats);
+USB_ERROR USB_ResetIOSchedulerStats();
+
+/* Attach and recovery functions */
+USB_ERROR USB_SetFastAttach(BOOL enable);
+USB_ERROR USB_GetAttachStats(USB_ATTACH_STATS *stats);
+USB_ERROR USB_GetRecoveryStats(USB_RECOVERY_STATS *stats);
+USB_ERROR USB_ResetRecoveryStats();
+USB_ERROR USB_GetUnitInfo(uint8_t lun, USB_UNIT_INFO *info);
 
 
 USB_ERROR USB_OpenWriteFile(USB_MS_Handle* usbHandle, const char* filename,
@@ -0,0 +1,42 @@
+/*
+ * usb_iosched.h
+ *
+ *  I/O scheduler of the disk I/O driver with two priority classes. All commands are synchronous and a running
+ *  command can not be preempted, so the scheduler bounds the time an urgent request waits for a bulk request:
+ *   - Bulk: disk_read and disk_write of FatFs. USBH_read and USBH_write split them into commands of at most
+ *     the configured chunk size and call USB_IOSCHED_Yield before each command.
+ *   - Urgent: raw sector reads and writes queued with USB_IOSCHED_Submit, e.g. by a timer interrupt or a control
+ *     task. They are served before the next command of a running bulk request, at the next disk_read or
+ *     disk_write, or by USB_IOSCHED_Poll from the main loop. Queued requests are served earliest deadline first.
+ *  A 64 KB log flush then delays an urgent 512 byte read by one chunk instead of the whole flush.
+ *
+ *  Urgent requests have their own deadline, bulk requests the deadline set with USB_IOSCHED_SetConfig. A request
+ *  which completes after its deadline is counted with its lateness in USB_IOSCHED_STATS, an urgent request gets
+ *  m_DeadlineMissed.
+ *
+ *  Urgent requests bypass FatFs. They must not access sectors which FatFs holds modified in a buffer, e.g. they
+ *  read sectors of a preallocated parameter file which FatFs does not write.
+ */
+
+#ifndef INC_USB_IOSCHED_H_
+#define INC_USB_IOSCHED_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+
+#define USB_IOSCHED_QUEUE_SIZE		8		/* Urgent requests queued at the same time. */
+
+/* Called by the disk I/O driver */
+void USB_IOSCHED_BulkBegin(uint32_t sector);
+void USB_IOSCHED_BulkEnd(BOOL success);
+uint32_t USB_IOSCHED_ChunkSectors(uint32_t blockSize, uint32_t sectors);
+void USB_IOSCHED_Yield(USBH_HandleTypeDef *phost);
+
+BOOL USB_IOSCHED_Submit(USB_IO_REQUEST *request);
+void USB_IOSCHED_Poll(USBH_HandleTypeDef *phost);
+void USB_IOSCHED_SetConfig(uint32_t chunkBytes, uint32_t bulkDeadlineUs);
+void USB_IOSCHED_Detach();
+void USB_IOSCHED_GetStats(USB_IOSCHED_STATS *stats);
+void USB_IOSCHED_ResetStats();
+
+#endif /* INC_USB_IOSCHED_H_ */
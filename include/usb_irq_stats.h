@@ -0,0 +1,52 @@
+/*
+ * usb_irq_stats.h
+ *
+ *  Interrupt time accounting of the host controller. With USB_IRQ_STATS_ENABLE=1 (cmake -DUSB_IRQ_STATS=ON)
+ *  OTG_HS_IRQHandler and the sources handled by HAL_HCD_IRQHandler (disconnect, port, SOF, RXFLVL and
+ *  HCINT per channel) accumulate their cycles and keep the maximum per interrupt. The application reads
+ *  the statistics with USB_GetIRQStats (usb_handler.h). Otherwise the macros expand to nothing.
+ */
+
+#ifndef INC_USB_IRQ_STATS_H_
+#define INC_USB_IRQ_STATS_H_
+
+#include "usb_defines.h"
+
+#if USB_IRQ_STATS_ENABLE
+
+#ifdef USB_HOST_SIM
+#include "usb_time_measurement.h"
+#define USB_IRQ_CYCLES()					USB_GetTimer()
+#else
+#include "stm32f4xx.h"
+#define USB_IRQ_CYCLES()					(DWT->CYCCNT)
+#endif /* USB_HOST_SIM */
+
+extern volatile USB_IRQ_STATS usbIrqStats;
+
+/* Declares the start time of a source, USB_IRQ_ACCOUNT adds the time since then to a member of USB_IRQ_STATS. */
+#define USB_IRQ_STAMP(start)				uint32_t start = USB_IRQ_CYCLES()
+#define USB_IRQ_ACCOUNT(source, start)		USB_IRQ_AddCycles(&usbIrqStats.source, USB_IRQ_CYCLES() - (start))
+
+/**
+ * @brief Adds a handled interrupt to a source.
+ * @param source member of usbIrqStats.
+ * @param cycles handling time.
+ */
+static inline void USB_IRQ_AddCycles(volatile USB_IRQ_SOURCE_STATS *source, uint32_t cycles)
+{
+	source->m_Count++;
+	source->m_Cycles += cycles;
+	if(cycles > source->m_MaxCycles)
+		source->m_MaxCycles = cycles;
+}
+
+#else
+#define USB_IRQ_STAMP(start)				((void)0)
+#define USB_IRQ_ACCOUNT(source, start)		((void)0)
+#endif /* USB_IRQ_STATS_ENABLE */
+
+void USB_IRQ_GetStats(USB_IRQ_STATS *stats);
+void USB_IRQ_Reset();
+
+#endif /* INC_USB_IRQ_STATS_H_ */
@@ -0,0 +1,20 @@
+/*
+ * usb_latency.h
+ *
+ *  Latency histograms of the MSC read and write commands. USBH_MSC_Read and USBH_MSC_Write record
+ *  each command, the application reads the histograms with USB_GetLatencyHistogram (usb_handler.h).
+ *  The memory is constant: USB_LATENCY_MAX_LUN * 2 * USB_LATENCY_SIZE_CLASSES histograms.
+ */
+
+#ifndef INC_USB_LATENCY_H_
+#define INC_USB_LATENCY_H_
+
+#include "usb_defines.h"
+
+void USB_LATENCY_Record(uint8_t lun, USB_LATENCY_DIR dir, uint32_t sectors, uint32_t us, BOOL success);
+BOOL USB_LATENCY_Get(uint8_t lun, USB_LATENCY_DIR dir, uint8_t sizeClass, USB_LATENCY_HISTOGRAM *hist);
+void USB_LATENCY_Reset();
+uint32_t USB_LATENCY_Percentile(const USB_LATENCY_HISTOGRAM *hist, float percentile);
+uint8_t USB_LATENCY_SizeClass(uint32_t sectors);
+
+#endif /* INC_USB_LATENCY_H_ */
@@ -0,0 +1,62 @@
+/*
+ * usb_record_log.h
+ *
+ *  Append-only record log on top of a preallocated file. Records are written without any
+ *  metadata updates and are recovered after a power loss by scanning from the last checkpoint.
+ */
+
+#ifndef INC_USB_RECORD_LOG_H_
+#define INC_USB_RECORD_LOG_H_
+
+#include "usb_defines.h"
+
+/* Size of a log block. Must be a multiple of the sector size, a block is always written as a whole. */
+#ifndef USB_LOG_BLOCK_SIZE
+#define USB_LOG_BLOCK_SIZE				4096
+#endif
+
+/* Every USB_LOG_CHECKPOINT_INTERVAL blocks, a block starts with a checkpoint record. */
+#ifndef USB_LOG_CHECKPOINT_INTERVAL
+#define USB_LOG_CHECKPOINT_INTERVAL		64
+#endif
+
+#define USB_LOG_BLOCK_HEADER_SIZE		16
+#define USB_LOG_RECORD_HEADER_SIZE		12
+#define USB_LOG_CHECKPOINT_SIZE			(USB_LOG_RECORD_HEADER_SIZE + 16)
+
+/* Maximum payload of a single record, records do not span blocks. */
+#define USB_LOG_MAX_RECORD_SIZE			(USB_LOG_BLOCK_SIZE - USB_LOG_BLOCK_HEADER_SIZE - USB_LOG_CHECKPOINT_SIZE - USB_LOG_RECORD_HEADER_SIZE)
+
+/* Record type of checkpoint records. Types 0x0000 and 0xFFFF are reserved. */
+#define USB_LOG_RECORD_CHECKPOINT		0xFFFF
+
+typedef struct {
+	USB_MS_Handle *m_Handle;
+	uint32_t m_Session;		/* Identifies the blocks of this log, stale blocks of older logs are ignored. */
+	uint32_t m_BlockCount;	/* Capacity of the log in blocks, without the header block. */
+	uint32_t m_BlockIndex;	/* Block which is currently filled. */
+	uint32_t m_BlockUsed;	/* Used bytes of the current block. */
+	uint32_t m_NextSeq;		/* Sequence number of the next record. */
+	uint64_t m_PayloadBytes;	/* Payload appended since the log was created. */
+	uint8_t m_Block[USB_LOG_BLOCK_SIZE];
+} USB_LOG_Handle;
+
+/* Read position inside the log, see USB_LOG_ReadNext. */
+typedef struct {
+	uint32_t m_BlockIndex;
+	uint32_t m_Offset;
+} USB_LOG_Cursor;
+
+USB_ERROR USB_LOG_Create(USB_LOG_Handle *log, USB_MS_Handle *usbHandle, const char *fileName, uint64_t capacity);
+USB_ERROR USB_LOG_Open(USB_LOG_Handle *log, USB_MS_Handle *usbHandle, const char *fileName);
+USB_ERROR USB_LOG_Append(USB_LOG_Handle *log, uint16_t type, const uint8_t *data, uint32_t len);
+USB_ERROR USB_LOG_Flush(USB_LOG_Handle *log);
+USB_ERROR USB_LOG_Close(USB_LOG_Handle *log);
+
+void USB_LOG_InitCursor(USB_LOG_Cursor *cursor);
+USB_ERROR USB_LOG_ReadNext(USB_LOG_Handle *log, USB_LOG_Cursor *cursor, uint16_t *type, uint8_t *buffer, uint32_t *len);
+
+/** Helper functions **/
+uint32_t USB_CalculateCRC32(uint32_t crc, const uint8_t *data, uint32_t len);
+
+#endif /* INC_USB_RECORD_LOG_H_ */
@@ -0,0 +1,43 @@
+/*
+ * usb_recovery.h
+ *
+ *  Recovery of failed MSC read and write commands without a re-enumeration. USBH_MSC_Read and USBH_MSC_Write
+ *  send the failed command again after each step of the ladder:
+ *   1. CHECK CONDITION with a transient sense key (UNIT ATTENTION, NOT READY, ABORTED COMMAND): the command is
+ *      sent again up to USB_RECOVERY_SENSE_RETRIES times.
+ *   2. Transport error (phase error, invalid CSW, second STALL of the CSW, transaction error or timeout): the
+ *      BOT state machine does the reset recovery of the BOT specification, Bulk-Only Mass Storage Reset followed
+ *      by CLEAR_FEATURE(ENDPOINT_HALT) of the bulk IN and OUT endpoints, before it reports the error.
+ *   3. Transport error after the reset recovery or failed reset recovery: the port is reset and the device gets
+ *      its address and configuration again. Descriptors, pipes and LUN info of the MSC class are kept.
+ *  If the command fails after the port reset, the read or write fails and HOST_USER_UNRECOVERED_ERROR is reported,
+ *  the application has to re-enumerate the device. The counters are returned by USB_GetRecoveryStats (usb_handler.h).
+ */
+
+#ifndef INC_USB_RECOVERY_H_
+#define INC_USB_RECOVERY_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+#include "usbh_msc.h"
+
+#define USB_RECOVERY_SENSE_RETRIES		2		/* Retries of a command after a transient CHECK CONDITION. */
+#define USB_RECOVERY_BOT_RETRIES		1		/* Retries of a command after a reset recovery. */
+#define USB_RECOVERY_PORT_RESETS		1		/* Port resets for a command. */
+#define USB_RECOVERY_PORT_TIMEOUT_MS	500		/* Port reset until the port is enabled. */
+
+/* Called by the MSC class */
+void USB_RECOVERY_Begin(uint32_t address, uint8_t *pbuf, uint32_t length);
+void USB_RECOVERY_End(USBH_HandleTypeDef *phost, USBH_StatusTypeDef status);
+BOOL USB_RECOVERY_SenseRetry(const SCSI_SenseTypeDef *sense);
+BOOL USB_RECOVERY_Timeout(USBH_HandleTypeDef *phost, uint8_t lun);
+USBH_StatusTypeDef USB_RECOVERY_Process(USBH_HandleTypeDef *phost);
+void USB_RECOVERY_Resend(USBH_HandleTypeDef *phost, uint8_t lun);
+
+/* Called by the BOT state machine */
+USBH_StatusTypeDef USB_RECOVERY_ResetRecovery(USBH_HandleTypeDef *phost);
+
+void USB_RECOVERY_GetStats(USB_RECOVERY_STATS *stats);
+void USB_RECOVERY_ResetStats();
+
+#endif /* INC_USB_RECOVERY_H_ */
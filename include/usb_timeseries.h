@@ -0,0 +1,61 @@
+/*
+ * usb_timeseries.h
+ *
+ *  Time indexed sample store on top of the USB_MS_Handle file API. Samples are packed into fixed size
+ *  blocks, a sparse index (first timestamp of each block) allows to locate any point in time with a
+ *  few block reads instead of reading the file from the start.
+ */
+
+#ifndef INC_USB_TIMESERIES_H_
+#define INC_USB_TIMESERIES_H_
+
+#include "usb_defines.h"
+
+/* Size of data and index blocks. Should be a multiple of the cluster size for best throughput. */
+#ifndef USB_TS_BLOCK_SIZE
+#define USB_TS_BLOCK_SIZE				4096
+#endif
+
+/* The index block of the current group is rewritten every USB_TS_INDEX_FLUSH_INTERVAL data blocks. */
+#ifndef USB_TS_INDEX_FLUSH_INTERVAL
+#define USB_TS_INDEX_FLUSH_INTERVAL		16
+#endif
+
+#define USB_TS_DATA_HEADER_SIZE			32
+#define USB_TS_INDEX_HEADER_SIZE		16
+#define USB_TS_SAMPLE_HEADER_SIZE		12
+
+/* Number of data blocks described by one index block. */
+#define USB_TS_BLOCKS_PER_INDEX			((USB_TS_BLOCK_SIZE - USB_TS_INDEX_HEADER_SIZE) / 8)
+
+/* Maximum payload of a single sample, samples do not span blocks. */
+#define USB_TS_MAX_SAMPLE_SIZE			(USB_TS_BLOCK_SIZE - USB_TS_DATA_HEADER_SIZE - USB_TS_SAMPLE_HEADER_SIZE)
+
+typedef struct {
+	USB_MS_Handle *m_Handle;
+	uint32_t m_StoreId;		/* Identifies the blocks of this store, stale blocks of older files are ignored. */
+	uint32_t m_DataBlocks;	/* Number of data blocks including the current one. */
+	uint32_t m_BlockUsed;	/* Used bytes of the current data block. */
+	uint32_t m_IndexCount;	/* Used entries of the current index block. */
+	uint64_t m_LastTimestamp;
+	uint8_t m_Block[USB_TS_BLOCK_SIZE];	/* Current data block */
+	uint8_t m_Index[USB_TS_BLOCK_SIZE];	/* Index block of the current group */
+} USB_TS_Handle;
+
+/* Read position inside the store, see USB_TS_Find and USB_TS_ReadNext. */
+typedef struct {
+	uint32_t m_DataBlock;
+	uint32_t m_Offset;
+	uint32_t m_BlockUsed;
+} USB_TS_Cursor;
+
+USB_ERROR USB_TS_Create(USB_TS_Handle *ts, USB_MS_Handle *usbHandle, const char *fileName);
+USB_ERROR USB_TS_Open(USB_TS_Handle *ts, USB_MS_Handle *usbHandle, const char *fileName);
+USB_ERROR USB_TS_Append(USB_TS_Handle *ts, uint64_t timestamp, const uint8_t *data, uint32_t len);
+USB_ERROR USB_TS_Flush(USB_TS_Handle *ts);
+USB_ERROR USB_TS_Close(USB_TS_Handle *ts);
+
+USB_ERROR USB_TS_Find(USB_TS_Handle *ts, uint64_t timestamp, USB_TS_Cursor *cursor);
+USB_ERROR USB_TS_ReadNext(USB_TS_Handle *ts, USB_TS_Cursor *cursor, uint64_t *timestamp, uint8_t *buffer, uint32_t *len);
+
+#endif /* INC_USB_TIMESERIES_H_ */
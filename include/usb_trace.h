@@ -0,0 +1,90 @@
+/*
+ * usb_trace.h
+ *
+ *  Layer trace of the storage path. Trace points at the boundaries f_write/f_sync, disk_read/disk_write,
+ *  USBH_MSC_Read/USBH_MSC_Write, the BOT state machine and USBH_LL_SubmitURB/URB completion write an
+ *  entry with the DWT cycle counter into a RAM ring buffer. Writers only reserve a slot with an atomic
+ *  increment, so trace points may be used in interrupt handlers.
+ *
+ *  The trace is compiled in with USB_TRACE_ENABLE=1 (cmake -DUSB_TRACE=ON). Otherwise USB_TRACE expands
+ *  to nothing and no buffer is allocated.
+ *
+ *  USB_TRACE_Export serializes the buffer into the binary format below, USB_SaveTrace (usb_handler.h) writes
+ *  it to a file on the stick and USB_TRACE_DumpBinary prints it as hex lines over semihosting. The host tool
+ *  usb_trace2json converts both into the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+ */
+
+#ifndef INC_USB_TRACE_H_
+#define INC_USB_TRACE_H_
+
+#include <stdint.h>
+
+#ifndef USB_TRACE_ENABLE
+#define USB_TRACE_ENABLE	0
+#endif
+
+/* Number of entries of the ring buffer, must be a power of 2. Each entry needs 16 bytes. */
+#ifndef USB_TRACE_SIZE
+#define USB_TRACE_SIZE		256
+#endif
+
+typedef enum {
+	USB_TRACE_FS_WRITE_BEGIN = 1,	/* arg: bytes to write */
+	USB_TRACE_FS_WRITE_END,			/* arg8: FRESULT, arg: bytes written */
+	USB_TRACE_FS_SYNC_BEGIN,
+	USB_TRACE_FS_SYNC_END,			/* arg8: FRESULT */
+	USB_TRACE_DISK_READ_BEGIN,		/* arg8: drive, arg16: sectors, arg: sector */
+	USB_TRACE_DISK_READ_END,		/* arg8: drive, arg16: DRESULT */
+	USB_TRACE_DISK_WRITE_BEGIN,		/* arg8: drive, arg16: sectors, arg: sector */
+	USB_TRACE_DISK_WRITE_END,		/* arg8: drive, arg16: DRESULT */
+	USB_TRACE_MSC_READ_BEGIN,		/* arg8: lun, arg16: sectors, arg: sector */
+	USB_TRACE_MSC_READ_END,			/* arg8: lun, arg16: USBH_StatusTypeDef */
+	USB_TRACE_MSC_WRITE_BEGIN,		/* arg8: lun, arg16: sectors, arg: sector */
+	USB_TRACE_MSC_WRITE_END,		/* arg8: lun, arg16: USBH_StatusTypeDef */
+	USB_TRACE_BOT_STATE,			/* arg8: lun, arg16: new BOT_StateTypeDef, arg: previous state */
+	USB_TRACE_URB_SUBMIT,			/* arg8: pipe, arg16: length, arg: direction << 8 | endpoint type */
+	USB_TRACE_URB_DONE,				/* arg8: channel, arg16: URB state, arg: transferred bytes */
+	USB_TRACE_IRQ_BEGIN,			/* arg: pending and unmasked interrupts (GINTSTS & GINTMSK), SOF only interrupts are not traced */
+	USB_TRACE_IRQ_END,
+	USB_TRACE_EVENT_COUNT
+} USB_TRACE_EVENT;
+
+typedef struct {
+	uint32_t m_Sequence;	/* Number of the entry since the last USB_TRACE_Clear, starting at 1. 0 while written. */
+	uint32_t m_Cycles;		/* DWT cycle counter (simulated time base on the host build) */
+	uint8_t m_Event;		/* USB_TRACE_EVENT */
+	uint8_t m_Arg8;
+	uint16_t m_Arg16;
+	uint32_t m_Arg;
+} USB_TRACE_Entry;
+
+/* Binary format of USB_TRACE_Export, all fields are little endian. The header is followed by the entries,
+ * oldest first, each in the field order of USB_TRACE_Entry without padding.
+ *   0  uint32  magic USB_TRACE_MAGIC ("USBT")
+ *   4  uint16  USB_TRACE_FORMAT_VERSION
+ *   6  uint16  entry size (USB_TRACE_ENTRY_SIZE)
+ *   8  uint32  core clock in Hz, the unit of m_Cycles
+ *  12  uint32  number of entries
+ *  16  uint32  entries recorded before the first exported entry, which were overwritten or did not fit
+ *  20  uint32  reserved (0) */
+#define USB_TRACE_MAGIC				0x54425355
+#define USB_TRACE_FORMAT_VERSION	1
+#define USB_TRACE_HEADER_SIZE		24
+#define USB_TRACE_ENTRY_SIZE		16
+#define USB_TRACE_EXPORT_SIZE		(USB_TRACE_HEADER_SIZE + USB_TRACE_SIZE * USB_TRACE_ENTRY_SIZE)
+
+#if USB_TRACE_ENABLE
+#define USB_TRACE(event, arg8, arg16, arg)	USB_TRACE_Record((event), (uint8_t)(arg8), (uint16_t)(arg16), (uint32_t)(arg))
+void USB_TRACE_Record(uint8_t event, uint8_t arg8, uint16_t arg16, uint32_t arg);
+#else
+#define USB_TRACE(event, arg8, arg16, arg)	((void)0)
+#endif /* USB_TRACE_ENABLE */
+
+void USB_TRACE_Clear();
+uint32_t USB_TRACE_Read(USB_TRACE_Entry *entries, uint32_t maxEntries, uint32_t *dropped);
+void USB_TRACE_Dump();
+uint32_t USB_TRACE_Export(uint8_t *buffer, uint32_t size);
+void USB_TRACE_DumpBinary();
+const char* USB_TRACE_EventName(uint8_t event);
+
+#endif /* INC_USB_TRACE_H_ */
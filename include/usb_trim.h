@@ -0,0 +1,36 @@
+/*
+ * usb_trim.h
+ *
+ *  TRIM of freed clusters. With _USE_TRIM FatFs reports every contiguous block of clusters which remove_chain
+ *  frees, and f_mkfs the whole volume, with CTRL_TRIM. USBH_ioctl collects the ranges and sends them as one
+ *  UNMAP command with up to SCSI_UNMAP_MAX_RANGES descriptors: when the list is full, before a write which
+ *  overlaps a collected range (the cluster was allocated again) and at CTRL_SYNC. Contiguous ranges are merged,
+ *  ranges are shrunk to whole unmap granules and split at the limits of the Block Limits VPD page. Only units
+ *  whose Logical Block Provisioning VPD page reports UNMAP are trimmed, on other units CTRL_TRIM succeeds
+ *  without a command. A failed UNMAP is counted and ignored, the freed clusters just stay mapped.
+ *
+ *  USB_TRIM_FreeSpace unmaps all free clusters of the mounted volume, e.g. of files which were deleted by another
+ *  host or before TRIM was enabled. Each call scans a limited number of FAT or allocation bitmap sectors and
+ *  continues where the last call stopped, so the application can spread the scan over idle periods.
+ */
+
+#ifndef INC_USB_TRIM_H_
+#define INC_USB_TRIM_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+#include "ff.h"
+
+#define USB_TRIM_COMMAND_TIMEOUT_MS	5000	/* Timeout of an UNMAP command, the device may erase the blocks. */
+
+/* Called by the disk I/O driver */
+void USB_TRIM_Add(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t first, uint32_t last);
+void USB_TRIM_Write(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t sector, uint32_t count);
+void USB_TRIM_Flush(USBH_HandleTypeDef *phost);
+
+BOOL USB_TRIM_Supported(USBH_HandleTypeDef *phost, uint8_t lun);
+USB_ERROR USB_TRIM_FreeSpace(USBH_HandleTypeDef *phost, uint8_t lun, FATFS *fs, uint32_t maxSectors, BOOL *done);
+void USB_TRIM_Detach();
+void USB_TRIM_GetStats(USB_TRIM_STATS *stats);
+
+#endif /* INC_USB_TRIM_H_ */
@@ -0,0 +1,65 @@
+/*
+ * usb_tuning.h
+ *
+ *  Transfer size and alignment tuning per device. USB_TUNING_Probe times raw READ10/WRITE10 commands of
+ *  several sizes, aligned and shifted by one sector, and chooses the smallest size which reaches
+ *  USB_TUNING_THRESHOLD_PERCENT of the best throughput. The result is cached per VID/PID/serial and
+ *  applied again when the device is attached. USBH_read and USBH_write split their requests with
+ *  USB_TUNING_ChunkSectors. The application calibrates with USB_CalibrateTransfers (usb_handler.h).
+ */
+
+#ifndef INC_USB_TUNING_H_
+#define INC_USB_TUNING_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+
+/* Bytes transferred by each of the four measurements of a transfer size. Larger values average out the
+ * device latencies, but the probe takes longer: 5 sizes need 5 MB of bus traffic with the default. */
+#ifndef USB_TUNING_PROBE_BYTES
+#define USB_TUNING_PROBE_BYTES			(256 * 1024)
+#endif
+
+/* A smaller transfer size is preferred if it reaches this share of the best throughput. */
+#ifndef USB_TUNING_THRESHOLD_PERCENT
+#define USB_TUNING_THRESHOLD_PERCENT	95
+#endif
+
+/* Commands are aligned if the shifted commands are slower than this share of the aligned ones. */
+#ifndef USB_TUNING_ALIGN_PERCENT
+#define USB_TUNING_ALIGN_PERCENT		90
+#endif
+
+#define USB_TUNING_MIN_BYTES			4096	/* Smallest probed transfer size, at least one block. */
+
+/* Size of the scratch area of USB_TUNING_Probe in bytes for a buffer of bufferSize bytes. */
+#define USB_TUNING_AREA_SIZE(bufferSize)	(USB_TUNING_PROBE_BYTES + 2 * (uint64_t)(bufferSize))
+
+extern USB_TRANSFER_TUNING usbTransferTuning;
+
+/**
+ * @brief Returns the number of sectors of the next command of a request.
+ * @param sector first sector of the remaining request.
+ * @param count remaining sectors of the request.
+ * @return sectors of the next command, at least 1.
+ */
+static inline uint32_t USB_TUNING_ChunkSectors(uint32_t sector, uint32_t count)
+{
+	uint32_t chunk = (count < usbTransferTuning.m_MaxSectors) ? count : usbTransferTuning.m_MaxSectors;
+	if(usbTransferTuning.m_AlignSectors > 1)
+	{
+		uint32_t boundary = usbTransferTuning.m_AlignSectors - sector % usbTransferTuning.m_AlignSectors;
+		if(chunk > boundary)
+			chunk = boundary;
+	}
+	return chunk;
+}
+
+void USB_TUNING_Attach(USBH_HandleTypeDef *phost);
+void USB_TUNING_Detach();
+USBH_StatusTypeDef USB_TUNING_Probe(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t sector, uint32_t sectorCount,
+		uint8_t *buffer, uint32_t bufferSize, USB_TUNING_REPORT *report);
+void USB_TUNING_Get(USB_TRANSFER_TUNING *tuning);
+void USB_TUNING_Set(const USB_TRANSFER_TUNING *tuning);
+
+#endif /* INC_USB_TUNING_H_ */
@@ -0,0 +1,43 @@
+/*
+ * usb_unit.h
+ *
+ *  Event driven ready state of the logical units. FatFs calls disk_status at the start of every file system
+ *  function, the state is answered from memory. It is updated from the results of the commands which are sent
+ *  anyway: the TEST UNIT READY and READ CAPACITY of the class initialization, completed reads and writes, the
+ *  sense data of failed commands, a failed recovery (usb_recovery.h) and the detach of the device.
+ *
+ *  UNIT ATTENTION with "medium may have changed" or a medium inserted into an empty unit set
+ *  USB_UNIT_MEDIUM_CHANGED. disk_status reports STA_NOINIT until FatFs mounted the volume again, i.e. until the
+ *  next disk_initialize, file objects of the old medium become invalid. Only units which are not ready, have no
+ *  medium or failed are polled, every USB_UNIT_POLL_MS. The poll runs through the TEST UNIT READY, REQUEST SENSE and
+ *  READ CAPACITY states of the class initialization, one step per call of USBH_Process. A read or write completes
+ *  a running poll first. A failed unit which answers the poll becomes ready again.
+ */
+
+#ifndef INC_USB_UNIT_H_
+#define INC_USB_UNIT_H_
+
+#include "usb_defines.h"
+#include "usbh_core.h"
+#include "usbh_msc.h"
+#include "diskio.h"
+
+#define USB_UNIT_POLL_MS			1000	/* Interval of TEST UNIT READY while a unit is not ready. */
+#define USB_UNIT_COMMAND_TIMEOUT_MS	1000	/* Timeout of a command sent by this module. */
+#define USB_UNIT_POLL_TIMEOUT_MS	5000	/* Timeout of a running poll which blocks a read or write. */
+
+/* Called by the MSC class */
+void USB_UNIT_Attached(uint8_t lun);
+void USB_UNIT_Ready(uint8_t lun);
+void USB_UNIT_Sense(uint8_t lun, const SCSI_SenseTypeDef *sense);
+void USB_UNIT_Failed(uint8_t lun);
+void USB_UNIT_Detached();
+BOOL USB_UNIT_PollDue(USBH_HandleTypeDef *phost, uint8_t *lun);
+
+/* Called by the disk I/O driver */
+DSTATUS USB_UNIT_Status(uint8_t lun);
+DSTATUS USB_UNIT_Initialize(USBH_HandleTypeDef *phost, uint8_t lun);
+
+void USB_UNIT_GetInfo(uint8_t lun, USB_UNIT_INFO *info);
+
+#endif /* INC_USB_UNIT_H_ */
@@ -0,0 +1,38 @@
+/*
+ * usb_volume.h
+ *
+ *  Warm remount of known volumes. FatFs starts every mount with an unknown free cluster count and
+ *  allocation hint (only FAT32 has them in FSINFO), so the first f_getfree scans the whole FAT or allocation
+ *  bitmap and the first allocation searches from cluster 2.
+ *
+ *  At durable sync points the fingerprint of the mounted volume is taken: volume serial number, a CRC of
+ *  the boot sector, the FAT geometry, the free cluster count, the allocation hint and a CRC of sampled
+ *  FAT or allocation bitmap sectors (first, last and the one holding the hint). When a volume with the same
+ *  serial number, boot sector and geometry is mounted again, the sampled sectors are read and compared. If
+ *  they match, the free cluster count and the allocation hint are restored. A volume which was written by
+ *  another host mismatches in most cases, e.g. the dirty flags in the first FAT sector and the exFAT boot
+ *  sector change. Both values are hints for FatFs, a missed modification only makes the free space
+ *  inaccurate, allocations always check the FAT or the bitmap.
+ */
+
+#ifndef INC_USB_VOLUME_H_
+#define INC_USB_VOLUME_H_
+
+#include "usb_defines.h"
+#include "ff.h"
+
+#define USB_VOLUME_SAMPLES			3		/* FAT or bitmap sectors of the fingerprint. */
+
+/* Sector size of a mounted volume. With _MAX_SS larger than _MIN_SS FatFs takes it from GET_SECTOR_SIZE. */
+#if _MAX_SS == _MIN_SS
+#define USB_VOLUME_SECTOR_SIZE(fs)	((uint32_t)_MAX_SS)
+#else
+#define USB_VOLUME_SECTOR_SIZE(fs)	((uint32_t)(fs)->ssize)
+#endif
+
+FRESULT USB_VOLUME_Mount(FATFS *fs, const TCHAR *path);
+void USB_VOLUME_Capture(FATFS *fs);
+void USB_VOLUME_GetStats(USB_VOLUME_STATS *stats);
+uint32_t USB_VOLUME_AllocSector(FATFS *fs, uint32_t cluster);
+
+#endif /* INC_USB_VOLUME_H_ */
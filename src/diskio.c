@@ -13,6 +13,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "diskio.h"
 #include "ff_gen_drv.h"
+#include "usb_trace.h"
 
 #if defined ( __GNUC__ )
 #ifndef __weak
@@ -79,7 +80,9 @@ DRESULT disk_read (
 {
   DRESULT res;
 
+  USB_TRACE(USB_TRACE_DISK_READ_BEGIN, pdrv, count, sector);
   res = disk.drv[pdrv]->disk_read(disk.lun[pdrv], buff, sector, count);
+  USB_TRACE(USB_TRACE_DISK_READ_END, pdrv, res, 0);
   return res;
 }
 
@@ -101,7 +104,9 @@ DRESULT disk_write (
 {
   DRESULT res;
 
+  USB_TRACE(USB_TRACE_DISK_WRITE_BEGIN, pdrv, count, sector);
   res = disk.drv[pdrv]->disk_write(disk.lun[pdrv], buff, sector, count);
+  USB_TRACE(USB_TRACE_DISK_WRITE_END, pdrv, res, 0);
   return res;
 }
 #endif /* _USE_WRITE == 1 */
@@ -20,6 +20,7 @@
 
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
+#include "usb_trace.h"	/* Layer trace points of f_write and f_sync */
 
 
 /*--------------------------------------------------------------------------
@@ -936,6 +937,33 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 
 
 #if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Write back FSInfo sector if it is dirty                               */
+/*-----------------------------------------------------------------------*/
+
+static
+void sync_fsinfo (
+	FATFS* fs		/* File system object (window must be clean) */
+)
+{
+	if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
+		/* Create FSInfo structure */
+		mem_set(fs->win, 0, SS(fs));
+		st_word(fs->win + BS_55AA, 0xAA55);
+		st_dword(fs->win + FSI_LeadSig, 0x41615252);
+		st_dword(fs->win + FSI_StrucSig, 0x61417272);
+		st_dword(fs->win + FSI_Free_Count, fs->free_clst);
+		st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);
+		/* Write it into the FSInfo sector */
+		fs->winsect = fs->volbase + 1;
+		disk_write(fs->drv, fs->win, fs->winsect, 1);
+		fs->fsi_flag = 0;
+	}
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Synchronize file system and strage device                             */
 /*-----------------------------------------------------------------------*/
@@ -950,20 +978,9 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 
 	res = sync_window(fs);
 	if (res == FR_OK) {
-		/* Update FSInfo sector if needed */
-		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
-			/* Create FSInfo structure */
-			mem_set(fs->win, 0, SS(fs));
-			st_word(fs->win + BS_55AA, 0xAA55);
-			st_dword(fs->win + FSI_LeadSig, 0x41615252);
-			st_dword(fs->win + FSI_StrucSig, 0x61417272);
-			st_dword(fs->win + FSI_Free_Count, fs->free_clst);
-			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);
-			/* Write it into the FSInfo sector */
-			fs->winsect = fs->volbase + 1;
-			disk_write(fs->drv, fs->win, fs->winsect, 1);
-			fs->fsi_flag = 0;
-		}
+#if !_FS_LAZY_FSINFO
+		sync_fsinfo(fs);	/* Update FSInfo sector if needed */
+#endif
 		/* Make sure that no pending write process in the physical drive */
 		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
 	}
@@ -1035,7 +1052,7 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluste
 			break;
 #if _FS_EXFAT
 		case FS_EXFAT :
-			if (obj->objsize) {
+			if ((obj->objsize != 0 && obj->sclust != 0) || obj->stat == 0) {	/* Object except root dir must have valid data length */
 				DWORD cofs = clst - obj->sclust;	/* Offset from start cluster */
 				DWORD clen = (DWORD)((obj->objsize - 1) / SS(fs)) / fs->csize;	/* Number of clusters - 1 */
 
@@ -2038,6 +2055,7 @@ FRESULT load_obj_dir (
 	dp->obj.stat = (BYTE)obj->c_size;
 	dp->obj.objsize = obj->c_size & 0xFFFFFF00;
 	dp->blk_ofs = obj->c_ofs;
+	dp->obj.n_frag = 0;	/* The containing directory is not being stretched, read the FAT */
 
 	res = dir_sdi(dp, dp->blk_ofs);	/* Goto object's entry block */
 	if (res == FR_OK) {
@@ -2312,19 +2330,22 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 		if (res != FR_OK) return res;
 		dp->blk_ofs = dp->dptr - SZDIRE * (nent - 1);	/* Set the allocated entry block offset */
 
-		if (dp->obj.sclust != 0 && (dp->obj.stat & 4)) {	/* Has the sub-directory been stretched? */
-			dp->obj.objsize += (DWORD)fs->csize * SS(fs);	/* Increase the directory size by cluster size */
+		if (dp->obj.stat & 4) {			/* Has the directory been stretched by new allocation? */
+			dp->obj.stat &= ~4;
 			res = fill_first_frag(&dp->obj);				/* Fill first fragment on the FAT if needed */
 			if (res != FR_OK) return res;
-			res = fill_last_frag(&dp->obj, dp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
-			if (res != FR_OK) return res;
-			res = load_obj_dir(&dj, &dp->obj);				/* Load the object status */
-			if (res != FR_OK) return res;
-			st_qword(fs->dirbuf + XDIR_FileSize, dp->obj.objsize);		/* Update the allocation status */
-			st_qword(fs->dirbuf + XDIR_ValidFileSize, dp->obj.objsize);
-			fs->dirbuf[XDIR_GenFlags] = dp->obj.stat | 1;
-			res = store_xdir(&dj);							/* Store the object status */
+			res = fill_last_frag(&dp->obj, dp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed (also the root directory) */
 			if (res != FR_OK) return res;
+			if (dp->obj.sclust != 0) {	/* Is it a sub-directory? */
+				dp->obj.objsize += (DWORD)fs->csize * SS(fs);	/* Increase the directory size by cluster size */
+				res = load_obj_dir(&dj, &dp->obj);				/* Load the object status */
+				if (res != FR_OK) return res;
+				st_qword(fs->dirbuf + XDIR_FileSize, dp->obj.objsize);		/* Update the allocation status */
+				st_qword(fs->dirbuf + XDIR_ValidFileSize, dp->obj.objsize);
+				fs->dirbuf[XDIR_GenFlags] = dp->obj.stat | 1;
+				res = store_xdir(&dj);							/* Store the object status */
+				if (res != FR_OK) return res;
+			}
 		}
 
 		create_xdir(fs->dirbuf, fs->lfnbuf);	/* Create on-memory directory block to be written later */
@@ -3608,6 +3629,13 @@ FRESULT f_read (
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
 
+#if USB_TRACE_ENABLE
+/* With the trace enabled f_write and f_sync wrap the implementation, so the
+   END event covers all of its return paths */
+static FRESULT f_write_body (FIL* fp, const void* buff, UINT btw, UINT* bw);
+#define f_write f_write_body
+#endif
+
 FRESULT f_write (
 	FIL* fp,			/* Pointer to the file object */
 	const void* buff,	/* Pointer to the data to be written */
@@ -3722,6 +3750,24 @@ FRESULT f_write (
 	LEAVE_FF(fs, FR_OK);
 }
 
+#if USB_TRACE_ENABLE
+#undef f_write
+FRESULT f_write (
+	FIL* fp,			/* Pointer to the file object */
+	const void* buff,	/* Pointer to the data to be written */
+	UINT btw,			/* Number of bytes to write */
+	UINT* bw			/* Pointer to number of bytes written */
+)
+{
+	FRESULT res;
+
+	USB_TRACE(USB_TRACE_FS_WRITE_BEGIN, 0, 0, btw);
+	res = f_write_body(fp, buff, btw, bw);
+	USB_TRACE(USB_TRACE_FS_WRITE_END, res, 0, *bw);
+	return res;
+}
+#endif
+
 
 
 
@@ -3729,6 +3775,11 @@ FRESULT f_write (
 /* Synchronize the File                                                  */
 /*-----------------------------------------------------------------------*/
 
+#if USB_TRACE_ENABLE
+static FRESULT f_sync_body (FIL* fp);
+#define f_sync f_sync_body
+#endif
+
 FRESULT f_sync (
 	FIL* fp		/* Pointer to the file object */
 )
@@ -3801,6 +3852,77 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+#if USB_TRACE_ENABLE
+#undef f_sync
+FRESULT f_sync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+
+	USB_TRACE(USB_TRACE_FS_SYNC_BEGIN, 0, 0, 0);
+	res = f_sync_body(fp);
+	USB_TRACE(USB_TRACE_FS_SYNC_END, res, 0, 0);
+	return res;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write back cached data of the file without updating its directory entry */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_flush (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) {
+#if !_FS_TINY
+		if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+			if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
+#endif
+		res = sync_window(fs);		/* Write back FAT changes */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize the Volume including deferred FSInfo updates              */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_syncfs (
+	const TCHAR* path	/* Logical drive number */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = find_volume(&path, &fs, FA_WRITE);	/* Get logical drive */
+	if (res == FR_OK) {
+		res = sync_window(fs);
+		if (res == FR_OK) {
+			sync_fsinfo(fs);
+			if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* !_FS_READONLY */
 
 
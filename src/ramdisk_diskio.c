@@ -0,0 +1,249 @@
+/*
+ * ramdisk_diskio.c
+ *
+ *  RAM disk driver for FatFs, see ramdisk_diskio.h.
+ */
+
+#include "ramdisk_diskio.h"
+#include "usb_time_measurement.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USB_HOST_SIM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* USB_HOST_SIM */
+
+typedef struct {
+	uint8_t *m_Buffer;
+	BOOL m_Allocated;	/* Buffer was allocated by RAMDISK_Init. */
+	BOOL m_Mapped;		/* Buffer is a mapped image file. */
+	uint64_t m_Size;
+	RAMDISK_Config m_Config;
+	RAMDISK_Stats m_Stats;
+} RAMDISK_Handle;
+
+static RAMDISK_Handle ramDisk;
+
+/** Internally defined **/
+DSTATUS RAMDISK_initialize(BYTE lun);
+DSTATUS RAMDISK_status(BYTE lun);
+DRESULT RAMDISK_read(BYTE lun, BYTE *buff, DWORD sector, UINT count);
+#if _USE_WRITE == 1
+DRESULT RAMDISK_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+DRESULT RAMDISK_ioctl(BYTE lun, BYTE cmd, void *buff);
+#endif /* _USE_IOCTL == 1 */
+static void RAMDISK_ApplyLatency(UINT count);
+
+const Diskio_drvTypeDef RAMDISK_Driver =
+{
+	RAMDISK_initialize,
+	RAMDISK_status,
+	RAMDISK_read,
+#if _USE_WRITE == 1
+	RAMDISK_write,
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+	RAMDISK_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+/**
+ * @brief This function initializes the RAM disk. Must be called before the driver is linked with FATFS_LinkDriver.
+ * @param config size, memory and latency model of the disk.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR RAMDISK_Init(const RAMDISK_Config *config)
+{
+	if(!config || config->m_SectorSize < _MIN_SS || config->m_SectorSize > _MAX_SS)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(ramDisk.m_Buffer)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+
+	memset(&ramDisk, 0x00, sizeof(RAMDISK_Handle));
+	ramDisk.m_Config = *config;
+	ramDisk.m_Size = (uint64_t)config->m_SectorCount * config->m_SectorSize;
+
+	if(config->m_Buffer)
+	{
+		if(ramDisk.m_Size == 0)
+			return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+		ramDisk.m_Buffer = config->m_Buffer;
+	}
+	else if(config->m_ImagePath)
+	{
+#ifdef USB_HOST_SIM
+		struct stat imageStat;
+		int fd = open(config->m_ImagePath, O_RDWR | O_CREAT, 0644);
+		if(fd < 0)
+			return (USB_ERROR) {USB_FILE_UNAVAILABLE, __LINE__};
+		if(fstat(fd, &imageStat) != 0)
+		{
+			close(fd);
+			return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+		}
+		if(ramDisk.m_Size == 0)
+			ramDisk.m_Size = (uint64_t)imageStat.st_size / config->m_SectorSize * config->m_SectorSize;
+		else if((uint64_t)imageStat.st_size < ramDisk.m_Size && ftruncate(fd, (off_t)ramDisk.m_Size) != 0)
+		{
+			close(fd);
+			return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+		}
+		if(ramDisk.m_Size == 0)
+		{
+			close(fd);
+			return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+		}
+		void *map = mmap(NULL, ramDisk.m_Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED)
+			return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+		ramDisk.m_Buffer = map;
+		ramDisk.m_Mapped = TRUE;
+#else
+		return (USB_ERROR) {USB_NOT_SUPPORTED, __LINE__};
+#endif /* USB_HOST_SIM */
+	}
+	else
+	{
+		if(ramDisk.m_Size == 0)
+			return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+		ramDisk.m_Buffer = calloc(1, ramDisk.m_Size);
+		if(!ramDisk.m_Buffer)
+			return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+		ramDisk.m_Allocated = TRUE;
+	}
+
+	ramDisk.m_Config.m_SectorCount = (uint32_t)(ramDisk.m_Size / config->m_SectorSize);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function releases the memory of the RAM disk. A mapped image is written back to the file.
+ * 		  The driver must be unlinked before.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR RAMDISK_DeInit()
+{
+	if(!ramDisk.m_Buffer)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	USB_ERROR ret = (USB_ERROR) {USB_NO_ERROR, __LINE__};
+#ifdef USB_HOST_SIM
+	if(ramDisk.m_Mapped)
+	{
+		if(msync(ramDisk.m_Buffer, ramDisk.m_Size, MS_SYNC) != 0)
+			ret = (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+		munmap(ramDisk.m_Buffer, ramDisk.m_Size);
+	}
+#endif /* USB_HOST_SIM */
+	if(ramDisk.m_Allocated)
+		free(ramDisk.m_Buffer);
+	ramDisk.m_Buffer = NULL;
+	return ret;
+}
+
+/**
+ * @brief Returns the counters of the RAM disk since the last reset.
+ * @param stats returns the counters.
+ */
+void RAMDISK_GetStats(RAMDISK_Stats *stats)
+{
+	if(stats)
+		*stats = ramDisk.m_Stats;
+}
+
+void RAMDISK_ResetStats()
+{
+	memset(&ramDisk.m_Stats, 0x00, sizeof(RAMDISK_Stats));
+}
+
+DSTATUS RAMDISK_initialize(BYTE lun)
+{
+	return ramDisk.m_Buffer ? RES_OK : STA_NOINIT;
+}
+
+DSTATUS RAMDISK_status(BYTE lun)
+{
+	return ramDisk.m_Buffer ? RES_OK : STA_NOINIT;
+}
+
+DRESULT RAMDISK_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+	if(!ramDisk.m_Buffer)
+		return RES_NOTRDY;
+	if((uint64_t)sector + count > ramDisk.m_Config.m_SectorCount)
+		return RES_PARERR;
+
+	memcpy(buff, &ramDisk.m_Buffer[(uint64_t)sector * ramDisk.m_Config.m_SectorSize], (size_t)count * ramDisk.m_Config.m_SectorSize);
+	ramDisk.m_Stats.m_ReadCommands++;
+	ramDisk.m_Stats.m_SectorsRead += count;
+	RAMDISK_ApplyLatency(count);
+	return RES_OK;
+}
+
+#if _USE_WRITE == 1
+DRESULT RAMDISK_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+	if(!ramDisk.m_Buffer)
+		return RES_NOTRDY;
+	if((uint64_t)sector + count > ramDisk.m_Config.m_SectorCount)
+		return RES_PARERR;
+
+	memcpy(&ramDisk.m_Buffer[(uint64_t)sector * ramDisk.m_Config.m_SectorSize], buff, (size_t)count * ramDisk.m_Config.m_SectorSize);
+	ramDisk.m_Stats.m_WriteCommands++;
+	ramDisk.m_Stats.m_SectorsWritten += count;
+	RAMDISK_ApplyLatency(count);
+	return RES_OK;
+}
+#endif /* _USE_WRITE == 1 */
+
+#if _USE_IOCTL == 1
+DRESULT RAMDISK_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+	if(!ramDisk.m_Buffer)
+		return RES_NOTRDY;
+
+	switch(cmd)
+	{
+	case CTRL_SYNC:
+		// Memory is always in sync, a mapped image is written back by RAMDISK_DeInit
+		ramDisk.m_Stats.m_SyncCommands++;
+		return RES_OK;
+	case GET_SECTOR_COUNT:
+		*(DWORD*)buff = ramDisk.m_Config.m_SectorCount;
+		return RES_OK;
+	case GET_SECTOR_SIZE:
+		*(WORD*)buff = ramDisk.m_Config.m_SectorSize;
+		return RES_OK;
+	case GET_BLOCK_SIZE:
+		*(DWORD*)buff = 1;
+		return RES_OK;
+	default:
+		return RES_PARERR;
+	}
+}
+#endif /* _USE_IOCTL == 1 */
+
+/**
+ * @brief Waits for the modelled duration of a read or write command of count sectors.
+ * @param count number of transferred sectors.
+ */
+static void RAMDISK_ApplyLatency(UINT count)
+{
+	uint64_t ns = ramDisk.m_Config.m_CommandLatencyNs
+			+ (uint64_t)count * ramDisk.m_Config.m_SectorSize * ramDisk.m_Config.m_ByteLatencyPs / 1000;
+	if(ns == 0)
+		return;
+	ramDisk.m_Stats.m_LatencyNs += ns;
+	while(ns > 0xFFFFFFFF)
+	{
+		USB_DelayNs(0xFFFFFFFF);
+		ns -= 0xFFFFFFFF;
+	}
+	USB_DelayNs((uint32_t)ns);
+}
@@ -55,6 +55,8 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
+#include "usb_bus_stats.h"
+#include "usb_irq_stats.h"
 
 /** @addtogroup STM32F4xx_HAL_Driver
   * @{
@@ -533,6 +535,7 @@ void HAL_HCD_IRQHandler(HCD_HandleTypeDef *hhcd)
     /* Handle Host Disconnect Interrupts */
     if (__HAL_HCD_GET_FLAG(hhcd, USB_OTG_GINTSTS_DISCINT))
     {
+      USB_IRQ_STAMP(irqStart);
       __HAL_HCD_CLEAR_FLAG(hhcd, USB_OTG_GINTSTS_DISCINT);
 
       if ((USBx_HPRT0 & USB_OTG_HPRT_PCSTS) == 0U)
@@ -546,34 +549,44 @@ void HAL_HCD_IRQHandler(HCD_HandleTypeDef *hhcd)
 
         (void)USB_InitFSLSPClkSel(hhcd->Instance, HCFG_48_MHZ);
       }
+      USB_IRQ_ACCOUNT(m_Disconnect, irqStart);
     }
 
     /* Handle Host Port Interrupts */
     if (__HAL_HCD_GET_FLAG(hhcd, USB_OTG_GINTSTS_HPRTINT))
     {
+      USB_IRQ_STAMP(irqStart);
       HCD_Port_IRQHandler(hhcd);
+      USB_IRQ_ACCOUNT(m_Port, irqStart);
     }
 
     /* Handle Host SOF Interrupt */
     if (__HAL_HCD_GET_FLAG(hhcd, USB_OTG_GINTSTS_SOF))
     {
+      USB_IRQ_STAMP(irqStart);
 #if (USE_HAL_HCD_REGISTER_CALLBACKS == 1U)
       hhcd->SOFCallback(hhcd);
 #else
     //  HAL_HCD_SOF_Callback(hhcd);
 #endif /* USE_HAL_HCD_REGISTER_CALLBACKS */
+#if USB_BUS_STATS_FRAMES
+      USB_BUS_Frame();
+#endif /* USB_BUS_STATS_FRAMES */
 
       __HAL_HCD_CLEAR_FLAG(hhcd, USB_OTG_GINTSTS_SOF);
+      USB_IRQ_ACCOUNT(m_SOF, irqStart);
     }
 
     /* Handle Rx Queue Level Interrupts */
     if ((__HAL_HCD_GET_FLAG(hhcd, USB_OTG_GINTSTS_RXFLVL)) != 0U)
     {
+      USB_IRQ_STAMP(irqStart);
       USB_MASK_INTERRUPT(hhcd->Instance, USB_OTG_GINTSTS_RXFLVL);
 
       HCD_RXQLVL_IRQHandler(hhcd);
 
       USB_UNMASK_INTERRUPT(hhcd->Instance, USB_OTG_GINTSTS_RXFLVL);
+      USB_IRQ_ACCOUNT(m_RxFifo, irqStart);
     }
 
     /* Handle Host channel Interrupt */
@@ -584,6 +597,7 @@ void HAL_HCD_IRQHandler(HCD_HandleTypeDef *hhcd)
       {
         if ((interrupt & (1UL << (i & 0xFU))) != 0U)
         {
+          USB_IRQ_STAMP(irqStart);
           if ((USBx_HC(i)->HCCHAR & USB_OTG_HCCHAR_EPDIR) == USB_OTG_HCCHAR_EPDIR)
           {
             HCD_HC_IN_IRQHandler(hhcd, (uint8_t)i);
@@ -592,6 +606,7 @@ void HAL_HCD_IRQHandler(HCD_HandleTypeDef *hhcd)
           {
             HCD_HC_OUT_IRQHandler(hhcd, (uint8_t)i);
           }
+          USB_IRQ_ACCOUNT(m_Channels[i & 0xFU], irqStart);
         }
       }
       __HAL_HCD_CLEAR_FLAG(hhcd, USB_OTG_GINTSTS_HCINT);
@@ -1184,11 +1199,13 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   {
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_AHBERR);
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
+    USB_BUS_COUNT(ch_num, m_OtherErrors);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_BBERR) == USB_OTG_HCINT_BBERR)
   {
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_BBERR);
     hhcd->hc[ch_num].state = HC_BBLERR;
+    USB_BUS_COUNT(ch_num, m_OtherErrors);
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
   }
@@ -1200,6 +1217,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   {
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     hhcd->hc[ch_num].state = HC_STALL;
+    USB_BUS_COUNT(ch_num, m_Stalls);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_NAK);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_STALL);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
@@ -1208,6 +1226,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   {
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     hhcd->hc[ch_num].state = HC_DATATGLERR;
+    USB_BUS_COUNT(ch_num, m_ToggleErrors);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_NAK);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_DTERR);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
@@ -1216,6 +1235,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   {
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     hhcd->hc[ch_num].state = HC_XACTERR;
+    USB_BUS_COUNT(ch_num, m_XactErrors);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_TXERR);
   }
@@ -1229,6 +1249,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_FRMOR);
+    USB_BUS_COUNT(ch_num, m_OtherErrors);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_XFRC) == USB_OTG_HCINT_XFRC)
   {
@@ -1236,6 +1257,8 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     {
       hhcd->hc[ch_num].xfer_count = hhcd->hc[ch_num].XferSize - \
                                     (USBx_HC(ch_num)->HCTSIZ & USB_OTG_HCTSIZ_XFRSIZ);
+      USB_BUS_AddTransfer(ch_num, hhcd->hc[ch_num].xfer_count,
+                          (hhcd->hc[ch_num].xfer_count + hhcd->hc[ch_num].max_packet - 1U) / hhcd->hc[ch_num].max_packet);
     }
 
     hhcd->hc[ch_num].state = HC_XFRC;
@@ -1291,6 +1314,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_CHH) == USB_OTG_HCINT_CHH)
   {
     __HAL_HCD_MASK_HALT_HC_INT(ch_num);
+    USB_BUS_COUNT(ch_num, m_Halts);
 
     if (hhcd->hc[ch_num].state == HC_XFRC)
     {
@@ -1308,10 +1332,12 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
       {
         hhcd->hc[ch_num].ErrCnt = 0U;
         hhcd->hc[ch_num].urb_state = URB_ERROR;
+        USB_BUS_COUNT(ch_num, m_URBErrors);
       }
       else
       {
         hhcd->hc[ch_num].urb_state = URB_NOTREADY;
+        USB_BUS_COUNT(ch_num, m_Retries);
 
         /* re-activate the channel */
         tmpreg = USBx_HC(ch_num)->HCCHAR;
@@ -1334,6 +1360,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     {
       hhcd->hc[ch_num].ErrCnt++;
       hhcd->hc[ch_num].urb_state = URB_ERROR;
+      USB_BUS_COUNT(ch_num, m_URBErrors);
     }
     else
     {
@@ -1344,6 +1371,7 @@ static void HCD_HC_IN_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_NAK) == USB_OTG_HCINT_NAK)
   {
+    USB_BUS_COUNT(ch_num, m_NAKs);
     if (hhcd->hc[ch_num].ep_type == EP_TYPE_INTR)
     {
       hhcd->hc[ch_num].ErrCnt = 0U;
@@ -1393,6 +1421,7 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   {
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_AHBERR);
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
+    USB_BUS_COUNT(ch_num, m_OtherErrors);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_ACK) == USB_OTG_HCINT_ACK)
   {
@@ -1412,14 +1441,19 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_FRMOR);
+    USB_BUS_COUNT(ch_num, m_OtherErrors);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_XFRC) == USB_OTG_HCINT_XFRC)
   {
     hhcd->hc[ch_num].ErrCnt = 0U;
+    USB_BUS_AddTransfer(ch_num, hhcd->hc[ch_num].xfer_len,
+                        (hhcd->hc[ch_num].xfer_len > 0U) ?
+                        (hhcd->hc[ch_num].xfer_len + hhcd->hc[ch_num].max_packet - 1U) / hhcd->hc[ch_num].max_packet : 1U);
 
     /* transaction completed with NYET state, update do ping state */
     if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_NYET) == USB_OTG_HCINT_NYET)
     {
+      USB_BUS_COUNT(ch_num, m_NYETs);
       hhcd->hc[ch_num].do_ping = 1U;
       __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_NYET);
     }
@@ -1431,6 +1465,7 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_NYET) == USB_OTG_HCINT_NYET)
   {
     hhcd->hc[ch_num].state = HC_NYET;
+    USB_BUS_COUNT(ch_num, m_NYETs);
     hhcd->hc[ch_num].do_ping = 1U;
     hhcd->hc[ch_num].ErrCnt = 0U;
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
@@ -1443,11 +1478,13 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     __HAL_HCD_UNMASK_HALT_HC_INT(ch_num);
     (void)USB_HC_Halt(hhcd->Instance, (uint8_t)ch_num);
     hhcd->hc[ch_num].state = HC_STALL;
+    USB_BUS_COUNT(ch_num, m_Stalls);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_NAK) == USB_OTG_HCINT_NAK)
   {
     hhcd->hc[ch_num].ErrCnt = 0U;
     hhcd->hc[ch_num].state = HC_NAK;
+    USB_BUS_COUNT(ch_num, m_NAKs);
 
     if (hhcd->hc[ch_num].do_ping == 0U)
     {
@@ -1463,6 +1500,7 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_TXERR) == USB_OTG_HCINT_TXERR)
   {
+    USB_BUS_COUNT(ch_num, m_XactErrors);
     if (hhcd->Init.dma_enable == 0U)
     {
       hhcd->hc[ch_num].state = HC_XACTERR;
@@ -1476,12 +1514,13 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
       {
         hhcd->hc[ch_num].ErrCnt = 0U;
         hhcd->hc[ch_num].urb_state = URB_ERROR;
+        USB_BUS_COUNT(ch_num, m_URBErrors);
         HAL_HCD_HC_NotifyURBChange_Callback(hhcd, (uint8_t)ch_num, hhcd->hc[ch_num].urb_state);
       }
       else
       {
         hhcd->hc[ch_num].urb_state = URB_NOTREADY;
-
+        USB_BUS_COUNT(ch_num, m_Retries);
       }
     }
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_TXERR);
@@ -1493,10 +1532,12 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_NAK);
     __HAL_HCD_CLEAR_HC_INT(ch_num, USB_OTG_HCINT_DTERR);
     hhcd->hc[ch_num].state = HC_DATATGLERR;
+    USB_BUS_COUNT(ch_num, m_ToggleErrors);
   }
   else if ((USBx_HC(ch_num)->HCINT & USB_OTG_HCINT_CHH) == USB_OTG_HCINT_CHH)
   {
     __HAL_HCD_MASK_HALT_HC_INT(ch_num);
+    USB_BUS_COUNT(ch_num, m_Halts);
 
     if (hhcd->hc[ch_num].state == HC_XFRC)
     {
@@ -1542,10 +1583,12 @@ static void HCD_HC_OUT_IRQHandler(HCD_HandleTypeDef *hhcd, uint8_t chnum)
       {
         hhcd->hc[ch_num].ErrCnt = 0U;
         hhcd->hc[ch_num].urb_state = URB_ERROR;
+        USB_BUS_COUNT(ch_num, m_URBErrors);
       }
       else
       {
         hhcd->hc[ch_num].urb_state = URB_NOTREADY;
+        USB_BUS_COUNT(ch_num, m_Retries);
 
         /* re-activate the channel  */
         tmpreg = USBx_HC(ch_num)->HCCHAR;
@@ -1603,6 +1646,7 @@ static void HCD_RXQLVL_IRQHandler(HCD_HandleTypeDef *hhcd)
           /* manage multiple Xfer */
           hhcd->hc[ch_num].xfer_buff += pktcnt;
           hhcd->hc[ch_num].xfer_count += pktcnt;
+          USB_BUS_AddTransfer(ch_num, pktcnt, 1U);
 
           /* get transfer size packet count */
           xferSizePktCnt = (USBx_HC(ch_num)->HCTSIZ & USB_OTG_HCTSIZ_PKTCNT) >> 19;
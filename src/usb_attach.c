@@ -0,0 +1,314 @@
+/*
+ * usb_attach.c
+ *
+ *  Attach timing and the fast attach mode, see usb_attach.h.
+ */
+
+#include "usb_attach.h"
+#include "usb_time_measurement.h"
+#include <string.h>
+
+/* Configuration and LUN info of a device */
+typedef struct {
+	uint16_t m_VendorID;
+	uint16_t m_ProductID;
+	char m_Serial[USB_SERIAL_LENGTH];
+	USBH_CfgDescTypeDef m_CfgDesc;
+	uint8_t m_MaxLUN;				/* Response of GetMaxLUN */
+	SCSI_StdInquiryDataTypeDef m_Inquiry[MAX_SUPPORTED_LUN];
+	SCSI_CapacityTypeDef m_Capacity[MAX_SUPPORTED_LUN];
+	SCSI_BlockLimitsTypeDef m_Limits[MAX_SUPPORTED_LUN];	/* VPD pages read after READ CAPACITY */
+	BOOL m_Valid;
+} USB_ATTACH_ENTRY;
+
+static BOOL fastAttach = FALSE;
+static USB_ATTACH_ENTRY attachCache[USB_ATTACH_CACHE_ENTRIES];
+static uint32_t attachCacheNext = 0;		/* Entry replaced next */
+static USB_ATTACH_ENTRY *cachedDevice = NULL;	/* Entry restored by the current attach */
+static BOOL lunCacheValid[MAX_SUPPORTED_LUN];	/* INQUIRY and READ CAPACITY data of cachedDevice may be used */
+static char attachSerial[USB_SERIAL_LENGTH];
+
+static USB_ATTACH_PHASE attachPhase = USB_ATTACH_PHASE_IDLE;
+static uint64_t phaseStartUs[USB_ATTACH_PHASE_READY + 1];
+static uint32_t phasesReached = 0;			/* Bit mask of the phases of the current attach */
+static USB_ATTACH_STATS attachStats;
+
+/** Internally defined **/
+static USB_ATTACH_ENTRY *USB_ATTACH_Find(uint16_t vendorID, uint16_t productID, const char *serial);
+static void USB_ATTACH_Store(USBH_HandleTypeDef *phost);
+
+/** Helper functions **/
+static BOOL USB_ATTACH_Waited(uint32_t ms);
+static uint32_t USB_ATTACH_PhaseUs(USB_ATTACH_PHASE from, USB_ATTACH_PHASE to);
+static void USB_ATTACH_SetLUNCacheValid(BOOL valid);
+
+
+/**
+ * @brief Enables or disables the fast attach mode. Takes effect with the next attach.
+ */
+void USB_ATTACH_SetFast(BOOL enable)
+{
+	fastAttach = enable;
+}
+
+BOOL USB_ATTACH_IsFast()
+{
+	return fastAttach;
+}
+
+/**
+ * @brief Called in HOST_IDLE while a device is connected. Records the connect time on the first call.
+ * @return TRUE if the port may be reset: immediately without the fast attach mode (the host library
+ * 		   delays itself), otherwise after the connection was stable for USB_ATTACH_DEBOUNCE_MS.
+ */
+BOOL USB_ATTACH_Debounced()
+{
+	if(attachPhase == USB_ATTACH_PHASE_IDLE)
+	{
+		phasesReached = 0;
+		attachSerial[0] = '\0';
+		cachedDevice = NULL;
+		USB_ATTACH_SetLUNCacheValid(FALSE);
+		USB_ATTACH_Mark(USB_ATTACH_PHASE_DEBOUNCE);
+	}
+	if(!fastAttach || attachPhase != USB_ATTACH_PHASE_DEBOUNCE)
+		return TRUE;
+	return USB_ATTACH_Waited(USB_ATTACH_DEBOUNCE_MS);
+}
+
+/**
+ * @brief Called in HOST_DEV_WAIT_FOR_ATTACHMENT after the port was enabled. Records the end of the reset.
+ * @return TRUE if the reset recovery time is over: immediately without the fast attach mode (the host
+ * 		   library delays itself), otherwise USB_ATTACH_RESET_RECOVERY_MS after the port was enabled.
+ */
+BOOL USB_ATTACH_ResetRecovered()
+{
+	if(attachPhase != USB_ATTACH_PHASE_RECOVERY)
+		USB_ATTACH_Mark(USB_ATTACH_PHASE_RECOVERY);
+	if(!fastAttach)
+		return TRUE;
+	return USB_ATTACH_Waited(USB_ATTACH_RESET_RECOVERY_MS);
+}
+
+/**
+ * @brief Returns the time since the start of the current phase.
+ */
+uint32_t USB_ATTACH_ElapsedMs()
+{
+	return (uint32_t)((USB_GetTimeUs() - phaseStartUs[attachPhase]) / 1000);
+}
+
+/**
+ * @brief Starts a phase of the attach.
+ */
+void USB_ATTACH_Mark(USB_ATTACH_PHASE phase)
+{
+	attachPhase = phase;
+	phaseStartUs[phase] = USB_GetTimeUs();
+	phasesReached |= 1U << phase;
+}
+
+/**
+ * @brief Stores the serial number string read during the enumeration.
+ * @param serial ASCII string, empty if the device has no serial number.
+ */
+void USB_ATTACH_SetSerial(const char *serial)
+{
+	strncpy(attachSerial, serial, USB_SERIAL_LENGTH - 1);
+	attachSerial[USB_SERIAL_LENGTH - 1] = '\0';
+}
+
+/**
+ * @brief Restores the parsed configuration descriptor of a known device in the fast attach mode.
+ * @param phost host handle, the device descriptor and the serial number were read.
+ * @return TRUE if the configuration descriptor requests can be skipped.
+ */
+BOOL USB_ATTACH_RestoreConfig(USBH_HandleTypeDef *phost)
+{
+	cachedDevice = NULL;
+	USB_ATTACH_SetLUNCacheValid(FALSE);
+	if(!fastAttach || attachSerial[0] == '\0')
+		return FALSE;
+
+	cachedDevice = USB_ATTACH_Find(phost->device.DevDesc.idVendor, phost->device.DevDesc.idProduct, attachSerial);
+	if(!cachedDevice)
+		return FALSE;
+	memcpy(&phost->device.CfgDesc, &cachedDevice->m_CfgDesc, sizeof(USBH_CfgDescTypeDef));
+	USB_ATTACH_SetLUNCacheValid(TRUE);
+	return TRUE;
+}
+
+/**
+ * @brief Returns the cached response of GetMaxLUN.
+ * @return TRUE if the request can be skipped.
+ */
+BOOL USB_ATTACH_CachedMaxLUN(uint8_t *maxLun)
+{
+	if(!cachedDevice)
+		return FALSE;
+	*maxLun = cachedDevice->m_MaxLUN;
+	return TRUE;
+}
+
+/**
+ * @brief Returns the cached INQUIRY or READ CAPACITY data of a LUN.
+ * @param inquiry returns the INQUIRY data, may be NULL.
+ * @param capacity returns the READ CAPACITY data, may be NULL.
+ * @param limits returns the VPD pages, may be NULL. They are skipped together with READ CAPACITY.
+ * @return TRUE if the command can be skipped.
+ */
+BOOL USB_ATTACH_CachedLUN(uint8_t lun, SCSI_StdInquiryDataTypeDef *inquiry, SCSI_CapacityTypeDef *capacity,
+		SCSI_BlockLimitsTypeDef *limits)
+{
+	if(!cachedDevice || lun >= MAX_SUPPORTED_LUN || !lunCacheValid[lun])
+		return FALSE;
+	if(inquiry)
+		*inquiry = cachedDevice->m_Inquiry[lun];
+	if(capacity)
+		*capacity = cachedDevice->m_Capacity[lun];
+	if(limits)
+		*limits = cachedDevice->m_Limits[lun];
+	return TRUE;
+}
+
+/**
+ * @brief Stops using the cached LUN info of a LUN whose medium changed or was removed. READ CAPACITY is sent and
+ * 		  the cache entry is updated.
+ * @param lun logical unit number.
+ */
+void USB_ATTACH_Invalidate(uint8_t lun)
+{
+	if(lun < MAX_SUPPORTED_LUN)
+		lunCacheValid[lun] = FALSE;
+}
+
+/**
+ * @brief Called when the MSC class becomes active. Calculates the durations of the attach and stores the
+ * 		  configuration and the LUN info of devices with a serial number in the cache.
+ * @param phost host handle in the state HOST_CLASS.
+ */
+void USB_ATTACH_Ready(USBH_HandleTypeDef *phost)
+{
+	USB_ATTACH_Mark(USB_ATTACH_PHASE_READY);
+
+	attachStats.m_Attaches++;
+	attachStats.m_FastAttach = fastAttach;
+	attachStats.m_CacheHit = (cachedDevice != NULL);
+	if(cachedDevice)
+		attachStats.m_CacheHits++;
+	attachStats.m_DebounceUs = USB_ATTACH_PhaseUs(USB_ATTACH_PHASE_DEBOUNCE, USB_ATTACH_PHASE_RESET);
+	attachStats.m_ResetUs = USB_ATTACH_PhaseUs(USB_ATTACH_PHASE_RESET, USB_ATTACH_PHASE_ENUMERATION);
+	attachStats.m_EnumerationUs = USB_ATTACH_PhaseUs(USB_ATTACH_PHASE_ENUMERATION, USB_ATTACH_PHASE_CLASS);
+	attachStats.m_ClassInitUs = USB_ATTACH_PhaseUs(USB_ATTACH_PHASE_CLASS, USB_ATTACH_PHASE_READY);
+	attachStats.m_TimeToReadyUs = USB_ATTACH_PhaseUs(USB_ATTACH_PHASE_DEBOUNCE, USB_ATTACH_PHASE_READY);
+	if(attachStats.m_TimeToReadyUs > attachStats.m_MaxTimeToReadyUs)
+		attachStats.m_MaxTimeToReadyUs = attachStats.m_TimeToReadyUs;
+
+	BOOL lunCacheUpdated = FALSE;
+	for(uint8_t lun = 0; lun < MAX_SUPPORTED_LUN; lun++)
+		lunCacheUpdated |= !lunCacheValid[lun];
+	if(attachSerial[0] != '\0' && (!cachedDevice || lunCacheUpdated))
+		USB_ATTACH_Store(phost);
+}
+
+/**
+ * @brief Ends the attach, called when the device is disconnected. The cache is kept.
+ */
+void USB_ATTACH_Disconnected()
+{
+	attachPhase = USB_ATTACH_PHASE_IDLE;
+	cachedDevice = NULL;
+	USB_ATTACH_SetLUNCacheValid(FALSE);
+}
+
+/**
+ * @brief Copies the serial number string of the attached device.
+ * @param serial buffer of USB_SERIAL_LENGTH characters, empty if the device has no serial number.
+ */
+void USB_ATTACH_GetSerial(char *serial)
+{
+	memcpy(serial, attachSerial, USB_SERIAL_LENGTH);
+}
+
+void USB_ATTACH_GetStats(USB_ATTACH_STATS *stats)
+{
+	*stats = attachStats;
+}
+
+static USB_ATTACH_ENTRY *USB_ATTACH_Find(uint16_t vendorID, uint16_t productID, const char *serial)
+{
+	for(uint32_t i = 0; i < USB_ATTACH_CACHE_ENTRIES; i++)
+	{
+		USB_ATTACH_ENTRY *entry = &attachCache[i];
+		if(entry->m_Valid && entry->m_VendorID == vendorID && entry->m_ProductID == productID
+				&& strncmp(entry->m_Serial, serial, USB_SERIAL_LENGTH) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Replaces the entry of the device or the oldest entry of the cache. Devices with a LUN which failed
+ * 		  the initialization are not stored.
+ */
+static void USB_ATTACH_Store(USBH_HandleTypeDef *phost)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *)phost->pActiveClass->pData;
+
+	for(uint8_t lun = 0; lun < MSC_Handle->max_lun; lun++)
+	{
+		if(MSC_Handle->unit[lun].error != MSC_OK)
+			return;
+	}
+
+	USB_ATTACH_ENTRY *entry = USB_ATTACH_Find(phost->device.DevDesc.idVendor, phost->device.DevDesc.idProduct, attachSerial);
+	if(!entry)
+	{
+		entry = &attachCache[attachCacheNext];
+		attachCacheNext = (attachCacheNext + 1) % USB_ATTACH_CACHE_ENTRIES;
+	}
+	memset(entry, 0x00, sizeof(USB_ATTACH_ENTRY));
+	entry->m_VendorID = phost->device.DevDesc.idVendor;
+	entry->m_ProductID = phost->device.DevDesc.idProduct;
+	memcpy(entry->m_Serial, attachSerial, USB_SERIAL_LENGTH);
+	memcpy(&entry->m_CfgDesc, &phost->device.CfgDesc, sizeof(USBH_CfgDescTypeDef));
+	entry->m_MaxLUN = MSC_Handle->max_lun - 1;
+	for(uint8_t lun = 0; lun < MSC_Handle->max_lun; lun++)
+	{
+		entry->m_Inquiry[lun] = MSC_Handle->unit[lun].inquiry;
+		entry->m_Capacity[lun] = MSC_Handle->unit[lun].capacity;
+		entry->m_Limits[lun] = MSC_Handle->unit[lun].limits;
+	}
+	entry->m_Valid = TRUE;
+}
+
+/**
+ * @brief Checks if ms milliseconds passed since the start of the current phase. The simulated time
+ * 		  only advances with bus activity, the host build skips the remaining time instead of polling.
+ */
+static BOOL USB_ATTACH_Waited(uint32_t ms)
+{
+	uint32_t elapsed = USB_ATTACH_ElapsedMs();
+	if(elapsed >= ms)
+		return TRUE;
+#ifdef USB_HOST_SIM
+	USB_DelayNs((ms - elapsed) * 1000000);
+#endif /* USB_HOST_SIM */
+	return FALSE;
+}
+
+/**
+ * @brief Time between the start of two phases, 0 if a phase was not reached.
+ */
+static uint32_t USB_ATTACH_PhaseUs(USB_ATTACH_PHASE from, USB_ATTACH_PHASE to)
+{
+	if(!(phasesReached & (1U << from)) || !(phasesReached & (1U << to)) || phaseStartUs[to] < phaseStartUs[from])
+		return 0;
+	return (uint32_t)(phaseStartUs[to] - phaseStartUs[from]);
+}
+
+static void USB_ATTACH_SetLUNCacheValid(BOOL valid)
+{
+	for(uint8_t lun = 0; lun < MAX_SUPPORTED_LUN; lun++)
+		lunCacheValid[lun] = valid;
+}
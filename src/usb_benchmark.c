@@ -0,0 +1,694 @@
+/*
+ * usb_benchmark.c
+ *
+ *  Throughput and latency benchmark of the usb_handler.h API, see usb_benchmark.h.
+ */
+
+#include "usb_benchmark.h"
+#include "usb_handler.h"
+#include "usb_time_measurement.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USB_BENCH_FILE			"0:/BENCH.BIN"
+#define USB_BENCH_APPEND_FILE	"0:/BAPPEND.BIN"
+#define USB_BENCH_TUNING_FILE	"0:/TUNING.BIN"
+#define USB_BENCH_RANDOM_SEED	0x1234567
+
+typedef struct {
+	USB_MS_Handle *m_Handle;
+	const USB_BENCH_Config *m_Config;
+	uint8_t *m_Buffer;
+	uint32_t *m_Samples;
+	uint32_t m_Seed;
+	USB_BENCH_Result m_Result;
+	uint64_t m_StartTime;		/* Cycle count at the start of the test */
+	uint64_t m_OpStartTime;
+} USB_BENCH_Context;
+
+/** Internally defined **/
+static USB_ERROR USB_BENCH_Mount(USB_BENCH_Context *ctx);
+static USB_ERROR USB_BENCH_SeqWrite(USB_BENCH_Context *ctx, uint32_t chunkSize);
+static USB_ERROR USB_BENCH_SeqRead(USB_BENCH_Context *ctx, uint32_t chunkSize);
+static USB_ERROR USB_BENCH_Random(USB_BENCH_Context *ctx, BOOL write);
+static USB_ERROR USB_BENCH_SmallFiles(USB_BENCH_Context *ctx);
+static USB_ERROR USB_BENCH_SyncAppend(USB_BENCH_Context *ctx);
+static USB_ERROR USB_BENCH_Seek(USB_BENCH_Context *ctx, uint64_t fileSize, uint32_t ops, BOOL fastSeek);
+static USB_ERROR USB_BENCH_PacedTransfer(USB_MS_Handle *usbHandle, uint8_t *buffer, BOOL write,
+		uint32_t bytesPerSecond, uint64_t totalBytes);
+
+/** Helper functions **/
+static void USB_BENCH_Begin(USB_BENCH_Context *ctx, const char *name, uint32_t chunkSize);
+static void USB_BENCH_StartOp(USB_BENCH_Context *ctx);
+static void USB_BENCH_EndOp(USB_BENCH_Context *ctx, uint32_t bytes);
+static void USB_BENCH_End(USB_BENCH_Context *ctx);
+static USB_ERROR USB_BENCH_Abort(USB_BENCH_Context *ctx, USB_ERROR err);
+static uint32_t USB_BENCH_Random32(USB_BENCH_Context *ctx);
+static int USB_BENCH_CompareSamples(const void *a, const void *b);
+
+/**
+ * @brief Fills a configuration with the default test matrix.
+ * @param config configuration to fill.
+ */
+void USB_BENCH_GetDefaultConfig(USB_BENCH_Config *config)
+{
+	if(!config)
+		return;
+	config->m_FileSize = 1024 * 1024;
+	config->m_RandomOps = 256;
+	config->m_SmallFiles = 64;
+	config->m_SmallFileSize = 512;
+	config->m_SyncAppends = 256;
+	config->m_SyncAppendSize = 64;
+	config->m_DurableSync = TRUE;
+	config->m_MountCount = 8;
+}
+
+/**
+ * @brief Runs the benchmark matrix on the mounted drive "0:" and prints the results:
+ * 		  mount time, sequential write and read with chunk sizes from 512 B to 64 KB, 4 KB random
+ * 		  read and write, creation and deletion of small files and appends followed by USB_Sync.
+ * 		  The files of the benchmark are deleted afterwards. No file may be open on usbHandle.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param config test parameters, see USB_BENCH_GetDefaultConfig.
+ * @return Error Handle containing USB_NO_ERROR if all tests were successful.
+ */
+USB_ERROR USB_BENCH_Run(USB_MS_Handle *usbHandle, const USB_BENCH_Config *config)
+{
+	static const uint32_t chunkSizes[] = { 512, 2048, 8192, 32768, USB_BENCH_MAX_CHUNK_SIZE };
+	USB_BENCH_Context ctx;
+
+	if(!usbHandle || !config || config->m_FileSize < USB_BENCH_MAX_CHUNK_SIZE
+			|| config->m_SmallFileSize > USB_BENCH_MAX_CHUNK_SIZE || config->m_SyncAppendSize > USB_BENCH_MAX_CHUNK_SIZE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(usbHandle->m_Open)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+
+	memset(&ctx, 0x00, sizeof(USB_BENCH_Context));
+	ctx.m_Handle = usbHandle;
+	ctx.m_Config = config;
+	ctx.m_Seed = USB_BENCH_RANDOM_SEED;
+	ctx.m_Buffer = malloc(USB_BENCH_MAX_CHUNK_SIZE);
+	ctx.m_Samples = malloc(USB_BENCH_MAX_SAMPLES * sizeof(uint32_t));
+	if(!ctx.m_Buffer || !ctx.m_Samples)
+		return USB_BENCH_Abort(&ctx, (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__});
+	for(uint32_t i = 0; i < USB_BENCH_MAX_CHUNK_SIZE; i++)
+		ctx.m_Buffer[i] = (uint8_t)i;
+
+	USB_ResetLatencyHistograms();
+	USB_ResetBusStats();
+	printf("%-12s %7s %7s %10s %10s %10s %10s %10s\n", "test", "chunk", "ops", "MB/s", "ops/s", "p50[us]", "p99[us]", "max[us]");
+
+	USB_ERROR ret = USB_BENCH_Mount(&ctx);
+	for(uint32_t i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]) && ret.m_ErrCode == USB_NO_ERROR; i++)
+	{
+		ret = USB_BENCH_SeqWrite(&ctx, chunkSizes[i]);
+		if(ret.m_ErrCode == USB_NO_ERROR)
+			ret = USB_BENCH_SeqRead(&ctx, chunkSizes[i]);
+	}
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_Random(&ctx, FALSE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_Random(&ctx, TRUE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_SmallFiles(&ctx);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_SyncAppend(&ctx);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return USB_BENCH_Abort(&ctx, ret);
+	USB_BENCH_PrintLatencyHistograms(0);
+	USB_BENCH_PrintBusStats();
+
+	ret = USB_DeleteFile(USB_BENCH_FILE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_DeleteFile(USB_BENCH_APPEND_FILE);
+	return USB_BENCH_Abort(&ctx, ret);
+}
+
+/**
+ * @brief Prints the result of a single test as one line of the result table.
+ * @param result result to print.
+ */
+void USB_BENCH_PrintResult(const USB_BENCH_Result *result)
+{
+	double seconds = (double)result->m_TotalNs / 1e9;
+	printf("%-12s %7lu %7lu %10.3f %10.1f %10.1f %10.1f %10.1f\n", result->m_Name,
+			(unsigned long)result->m_ChunkSize, (unsigned long)result->m_Ops,
+			(seconds > 0) ? (double)result->m_Bytes / seconds / 1e6 : 0.0,
+			(seconds > 0) ? (double)result->m_Ops / seconds : 0.0,
+			(double)result->m_P50Ns / 1000.0, (double)result->m_P99Ns / 1000.0, (double)result->m_MaxNs / 1000.0);
+}
+
+/**
+ * @brief Measures the duration of USB_MountDrive, the volume is mounted again each time.
+ */
+static USB_ERROR USB_BENCH_Mount(USB_BENCH_Context *ctx)
+{
+	USB_BENCH_Begin(ctx, "mount", 0);
+	for(uint32_t i = 0; i < ctx->m_Config->m_MountCount; i++)
+	{
+		USB_BENCH_StartOp(ctx);
+		USB_ERROR ret = USB_MountDrive();
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, 0);
+	}
+	USB_BENCH_End(ctx);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Writes a file of m_FileSize bytes in chunks of chunkSize bytes. The total time includes
+ * 		  opening and closing the file.
+ */
+static USB_ERROR USB_BENCH_SeqWrite(USB_BENCH_Context *ctx, uint32_t chunkSize)
+{
+	USB_BENCH_Begin(ctx, "seq_write", chunkSize);
+	USB_ERROR ret = USB_OpenFile(ctx->m_Handle, USB_BENCH_FILE, USB_WRITE | USB_OVERWRITE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	for(uint32_t pos = 0; pos + chunkSize <= ctx->m_Config->m_FileSize; pos += chunkSize)
+	{
+		uint32_t len = chunkSize;
+		USB_BENCH_StartOp(ctx);
+		ret = USB_WriteData(ctx->m_Handle, ctx->m_Buffer, &len, FALSE);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+
+	ret = USB_CloseFile(ctx->m_Handle);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	USB_BENCH_End(ctx);
+	return ret;
+}
+
+/**
+ * @brief Reads the file written by USB_BENCH_SeqWrite in chunks of chunkSize bytes.
+ */
+static USB_ERROR USB_BENCH_SeqRead(USB_BENCH_Context *ctx, uint32_t chunkSize)
+{
+	USB_BENCH_Begin(ctx, "seq_read", chunkSize);
+	USB_ERROR ret = USB_OpenFile(ctx->m_Handle, USB_BENCH_FILE, USB_READ | USB_OPEN_IF_EXISTS);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	for(uint32_t pos = 0; pos + chunkSize <= ctx->m_Config->m_FileSize; pos += chunkSize)
+	{
+		uint32_t len = chunkSize;
+		USB_BENCH_StartOp(ctx);
+		ret = USB_ReadData(ctx->m_Handle, ctx->m_Buffer, &len);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+
+	ret = USB_CloseFile(ctx->m_Handle);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	USB_BENCH_End(ctx);
+	return ret;
+}
+
+/**
+ * @brief Reads or writes USB_BENCH_RANDOM_SIZE bytes at m_RandomOps aligned random positions of the
+ * 		  benchmark file. Each operation consists of USB_Seek and USB_ReadData or USB_WriteData.
+ */
+static USB_ERROR USB_BENCH_Random(USB_BENCH_Context *ctx, BOOL write)
+{
+	uint32_t blocks = ctx->m_Config->m_FileSize / USB_BENCH_RANDOM_SIZE;
+
+	USB_BENCH_Begin(ctx, write ? "rand_write" : "rand_read", USB_BENCH_RANDOM_SIZE);
+	USB_ERROR ret = USB_OpenFile(ctx->m_Handle, USB_BENCH_FILE, write ? (USB_WRITE | USB_OPEN_IF_EXISTS) : (USB_READ | USB_OPEN_IF_EXISTS));
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	for(uint32_t i = 0; i < ctx->m_Config->m_RandomOps; i++)
+	{
+		uint32_t len = USB_BENCH_RANDOM_SIZE;
+		uint64_t offset = (uint64_t)(USB_BENCH_Random32(ctx) % blocks) * USB_BENCH_RANDOM_SIZE;
+		USB_BENCH_StartOp(ctx);
+		ret = USB_Seek(ctx->m_Handle, offset);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		if(write)
+			ret = USB_WriteData(ctx->m_Handle, ctx->m_Buffer, &len, FALSE);
+		else
+			ret = USB_ReadData(ctx->m_Handle, ctx->m_Buffer, &len);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+
+	ret = USB_CloseFile(ctx->m_Handle);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	USB_BENCH_End(ctx);
+	return ret;
+}
+
+/**
+ * @brief Seeks to ops aligned random positions of the file of USB_BENCH_RunSeek and reads USB_BENCH_RANDOM_SIZE
+ * 		  bytes at each. Every seek starts from the previous position, backward seeks walk the chain from the start.
+ */
+static USB_ERROR USB_BENCH_Seek(USB_BENCH_Context *ctx, uint64_t fileSize, uint32_t ops, BOOL fastSeek)
+{
+	uint64_t blocks = fileSize / USB_BENCH_RANDOM_SIZE;
+
+	USB_BENCH_Begin(ctx, fastSeek ? "fast_seek" : "seek", USB_BENCH_RANDOM_SIZE);
+	USB_ERROR ret = USB_OpenFile(ctx->m_Handle, USB_BENCH_FILE, USB_READ | USB_OPEN_IF_EXISTS | (fastSeek ? USB_FAST_SEEK : 0));
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	for(uint32_t i = 0; i < ops; i++)
+	{
+		uint32_t len = USB_BENCH_RANDOM_SIZE;
+		uint64_t offset = (((uint64_t)USB_BENCH_Random32(ctx) << 24) ^ USB_BENCH_Random32(ctx)) % blocks * USB_BENCH_RANDOM_SIZE;
+		USB_BENCH_StartOp(ctx);
+		ret = USB_Seek(ctx->m_Handle, offset);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		ret = USB_ReadData(ctx->m_Handle, ctx->m_Buffer, &len);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+
+	ret = USB_CloseFile(ctx->m_Handle);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	USB_BENCH_End(ctx);
+	return ret;
+}
+
+/**
+ * @brief Creates m_SmallFiles files of m_SmallFileSize bytes (open, write, close) and deletes them again.
+ */
+static USB_ERROR USB_BENCH_SmallFiles(USB_BENCH_Context *ctx)
+{
+	char fileName[24];
+	USB_ERROR ret;
+
+	USB_BENCH_Begin(ctx, "create", ctx->m_Config->m_SmallFileSize);
+	for(uint32_t i = 0; i < ctx->m_Config->m_SmallFiles; i++)
+	{
+		uint32_t len = ctx->m_Config->m_SmallFileSize;
+		sprintf(fileName, "0:/B%05lu.TMP", (unsigned long)i);
+		USB_BENCH_StartOp(ctx);
+		ret = USB_OpenFile(ctx->m_Handle, fileName, USB_WRITE | USB_OVERWRITE);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		ret = USB_WriteData(ctx->m_Handle, ctx->m_Buffer, &len, FALSE);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		ret = USB_CloseFile(ctx->m_Handle);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+	USB_BENCH_End(ctx);
+
+	USB_BENCH_Begin(ctx, "delete", 0);
+	for(uint32_t i = 0; i < ctx->m_Config->m_SmallFiles; i++)
+	{
+		sprintf(fileName, "0:/B%05lu.TMP", (unsigned long)i);
+		USB_BENCH_StartOp(ctx);
+		ret = USB_DeleteFile(fileName);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, 0);
+	}
+	USB_BENCH_End(ctx);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Appends m_SyncAppends times m_SyncAppendSize bytes to a file, each append is followed by USB_Sync.
+ */
+static USB_ERROR USB_BENCH_SyncAppend(USB_BENCH_Context *ctx)
+{
+	USB_BENCH_Begin(ctx, "sync_append", ctx->m_Config->m_SyncAppendSize);
+	USB_ERROR ret = USB_OpenFile(ctx->m_Handle, USB_BENCH_APPEND_FILE, USB_WRITE | USB_OVERWRITE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	for(uint32_t i = 0; i < ctx->m_Config->m_SyncAppends; i++)
+	{
+		uint32_t len = ctx->m_Config->m_SyncAppendSize;
+		USB_BENCH_StartOp(ctx);
+		ret = USB_WriteData(ctx->m_Handle, ctx->m_Buffer, &len, FALSE);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		ret = USB_Sync(ctx->m_Handle, ctx->m_Config->m_DurableSync);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_BENCH_EndOp(ctx, len);
+	}
+
+	ret = USB_CloseFile(ctx->m_Handle);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	USB_BENCH_End(ctx);
+	return ret;
+}
+
+static void USB_BENCH_Begin(USB_BENCH_Context *ctx, const char *name, uint32_t chunkSize)
+{
+	memset(&ctx->m_Result, 0x00, sizeof(USB_BENCH_Result));
+	ctx->m_Result.m_Name = name;
+	ctx->m_Result.m_ChunkSize = chunkSize;
+	ctx->m_StartTime = USB_GetCycles();
+}
+
+static void USB_BENCH_StartOp(USB_BENCH_Context *ctx)
+{
+	ctx->m_OpStartTime = USB_GetCycles();
+}
+
+static void USB_BENCH_EndOp(USB_BENCH_Context *ctx, uint32_t bytes)
+{
+	uint32_t ns = (uint32_t)USB_CyclesToNs(USB_GetCycles() - ctx->m_OpStartTime);
+	if(ctx->m_Result.m_Ops < USB_BENCH_MAX_SAMPLES)
+		ctx->m_Samples[ctx->m_Result.m_Ops] = ns;
+	if(ns > ctx->m_Result.m_MaxNs)
+		ctx->m_Result.m_MaxNs = ns;
+	ctx->m_Result.m_Ops++;
+	ctx->m_Result.m_Bytes += bytes;
+}
+
+/**
+ * @brief Calculates the percentiles of the recorded latencies and prints the result.
+ */
+static void USB_BENCH_End(USB_BENCH_Context *ctx)
+{
+	USB_BENCH_Result *result = &ctx->m_Result;
+	uint32_t samples = (result->m_Ops < USB_BENCH_MAX_SAMPLES) ? result->m_Ops : USB_BENCH_MAX_SAMPLES;
+
+	result->m_TotalNs = USB_CyclesToNs(USB_GetCycles() - ctx->m_StartTime);
+	if(samples > 0)
+	{
+		qsort(ctx->m_Samples, samples, sizeof(uint32_t), USB_BENCH_CompareSamples);
+		result->m_P50Ns = ctx->m_Samples[(samples - 1) * 50 / 100];
+		result->m_P99Ns = ctx->m_Samples[(samples - 1) * 99 / 100];
+	}
+	USB_BENCH_PrintResult(result);
+}
+
+/**
+ * @brief Prints the MSC command latencies of a LUN per direction and transfer size, see USB_GetLatencyHistogram.
+ * 		  Size classes without commands are omitted. Nothing is printed if the drive is not a USB device.
+ * @param lun logical unit number.
+ */
+void USB_BENCH_PrintLatencyHistograms(uint8_t lun)
+{
+	static const char *sizeNames[] = { "1", "2-8", "9-64", ">64" };
+	static const char *lastSizeNames[] = { "all", ">1", ">8", ">64" };
+	static const char *dirNames[] = { "read", "write" };
+	USB_LATENCY_HISTOGRAM hist;
+	BOOL header = FALSE;
+
+	for(uint32_t dir = USB_LATENCY_READ; dir <= USB_LATENCY_WRITE; dir++)
+	{
+		for(uint32_t sizeClass = 0; sizeClass < USB_LATENCY_SIZE_CLASSES; sizeClass++)
+		{
+			uint32_t p50, p99, p999;
+			if(USB_GetLatencyHistogram(lun, (USB_LATENCY_DIR)dir, (uint8_t)sizeClass, &hist).m_ErrCode != USB_NO_ERROR
+					|| (hist.m_Count == 0 && hist.m_Failed == 0))
+				continue;
+			if(!header)
+			{
+				printf("%-12s %7s %7s %7s %10s %10s %10s %10s %10s\n", "msc_cmd", "sectors", "count", "failed",
+						"mean[us]", "p50[us]", "p99[us]", "p99.9[us]", "max[us]");
+				header = TRUE;
+			}
+			USB_GetLatencyPercentile(&hist, 50.0f, &p50);
+			USB_GetLatencyPercentile(&hist, 99.0f, &p99);
+			USB_GetLatencyPercentile(&hist, 99.9f, &p999);
+			printf("%-12s %7s %7lu %7lu %10lu %10lu %10lu %10lu %10lu\n", dirNames[dir],
+					(sizeClass == USB_LATENCY_SIZE_CLASSES - 1) ? lastSizeNames[sizeClass] : sizeNames[sizeClass],
+					(unsigned long)hist.m_Count, (unsigned long)hist.m_Failed,
+					(unsigned long)(hist.m_Count ? hist.m_SumUs / hist.m_Count : 0),
+					(unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)hist.m_MaxUs);
+		}
+	}
+}
+
+/**
+ * @brief Prints the bus level counters of all channels which were used since the last USB_ResetBusStats,
+ * 		  followed by the bytes per frame statistics if the library was built with USB_BUS_STATS_FRAMES.
+ */
+void USB_BENCH_PrintBusStats()
+{
+	USB_BUS_CHANNEL_STATS stats;
+	USB_BUS_FRAME_STATS frames;
+	BOOL header = FALSE;
+
+	for(uint8_t channel = 0; channel < USB_BUS_STATS_CHANNELS; channel++)
+	{
+		if(USB_GetBusStats(channel, &stats).m_ErrCode != USB_NO_ERROR || stats.m_Halts + stats.m_Packets == 0)
+			continue;
+		if(!header)
+		{
+			printf("%-7s %9s %12s %8s %8s %7s %8s %7s %7s %7s\n", "channel", "packets", "bytes", "NAKs", "NYETs",
+					"stalls", "halts", "errors", "retries", "failed");
+			header = TRUE;
+		}
+		printf("%-7u %9lu %12llu %8lu %8lu %7lu %8lu %7lu %7lu %7lu\n", channel, (unsigned long)stats.m_Packets,
+				(unsigned long long)stats.m_Bytes, (unsigned long)stats.m_NAKs, (unsigned long)stats.m_NYETs,
+				(unsigned long)stats.m_Stalls, (unsigned long)stats.m_Halts,
+				(unsigned long)(stats.m_XactErrors + stats.m_ToggleErrors + stats.m_OtherErrors),
+				(unsigned long)stats.m_Retries, (unsigned long)stats.m_URBErrors);
+	}
+
+	if(USB_GetBusFrameStats(&frames).m_ErrCode == USB_NO_ERROR && frames.m_Frames)
+		printf("frames %lu, busy %lu (%lu%%), max %lu bytes/frame, mean %lu bytes/busy frame\n",
+				(unsigned long)frames.m_Frames, (unsigned long)frames.m_BusyFrames,
+				(unsigned long)((uint64_t)frames.m_BusyFrames * 100 / frames.m_Frames),
+				(unsigned long)frames.m_MaxFrameBytes,
+				(unsigned long)(frames.m_BusyFrames ? frames.m_Bytes / frames.m_BusyFrames : 0));
+}
+
+/**
+ * @brief Measures the CPU load caused by the USB interrupts at a given throughput. Writes a file at bytesPerSecond
+ * 		  for durationMs and reads it back at the same rate, in chunks of USB_BENCH_RANDOM_SIZE bytes. The
+ * 		  time between the chunks is spent in USB_DelayNs. Prints the achieved throughput and the interrupt
+ * 		  statistics of each phase, see USB_GetIRQStats. The library must be built with USB_IRQ_STATS_ENABLE.
+ * @param usbHandle handle to read and write data to the USB mass storage device. No file may be open.
+ * @param bytesPerSecond target throughput.
+ * @param durationMs duration of each phase.
+ * @return Error Handle containing USB_NO_ERROR if both phases were successful.
+ */
+USB_ERROR USB_BENCH_RunCpuLoad(USB_MS_Handle *usbHandle, uint32_t bytesPerSecond, uint32_t durationMs)
+{
+	static const char *phaseNames[] = { "write", "read" };
+	USB_IRQ_STATS stats;
+	uint64_t totalBytes = (uint64_t)bytesPerSecond * durationMs / 1000;
+
+	totalBytes -= totalBytes % USB_BENCH_RANDOM_SIZE;
+	if(!usbHandle || totalBytes == 0 || !USB_IRQ_STATS_ENABLE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	uint8_t *buffer = malloc(USB_BENCH_RANDOM_SIZE);
+	if(!buffer)
+		return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+	for(uint32_t i = 0; i < USB_BENCH_RANDOM_SIZE; i++)
+		buffer[i] = (uint8_t)i;
+
+	USB_ERROR ret = (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	for(uint32_t phase = 0; phase < 2 && ret.m_ErrCode == USB_NO_ERROR; phase++)
+	{
+		ret = USB_OpenFile(usbHandle, USB_BENCH_FILE, phase ? (USB_READ | USB_OPEN_IF_EXISTS) : (USB_WRITE | USB_OVERWRITE));
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			break;
+		USB_ResetIRQStats();
+		ret = USB_BENCH_PacedTransfer(usbHandle, buffer, phase == 0, bytesPerSecond, totalBytes);
+		USB_GetIRQStats(&stats);
+		USB_ERROR closeRet = USB_CloseFile(usbHandle);
+		if(ret.m_ErrCode == USB_NO_ERROR)
+			ret = closeRet;
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			break;
+
+		uint64_t elapsedUs = USB_CyclesToUs(stats.m_ElapsedCycles);
+		printf("cpu_load %s: target %lu KB/s, achieved %lu KB/s\n", phaseNames[phase], (unsigned long)(bytesPerSecond / 1024),
+				(unsigned long)(elapsedUs ? totalBytes * 1000000 / 1024 / elapsedUs : 0));
+		USB_BENCH_PrintIRQStats(&stats);
+	}
+
+	free(buffer);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_DeleteFile(USB_BENCH_FILE);
+	return ret;
+}
+
+/**
+ * @brief Calibrates the transfer size and alignment of the attached device with USB_CalibrateTransfers
+ * 		  and prints the throughput of each probed transfer size and the chosen tuning.
+ * @param bufferSize largest probed transfer size.
+ * @return Error Handle containing USB_NO_ERROR if the calibration was successful.
+ */
+USB_ERROR USB_BENCH_RunCalibration(uint32_t bufferSize)
+{
+	USB_TUNING_REPORT report;
+	USB_TRANSFER_TUNING tuning;
+
+	uint8_t *buffer = malloc(bufferSize);
+	if(!buffer)
+		return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+	USB_ERROR ret = USB_CalibrateTransfers(USB_BENCH_TUNING_FILE, buffer, bufferSize, &report);
+	free(buffer);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	printf("%-8s %10s %10s %12s %12s\n", "transfer", "write KB/s", "read KB/s", "shifted wr", "shifted rd");
+	for(uint32_t i = 0; i < report.m_SampleCount; i++)
+	{
+		const USB_TUNING_SAMPLE *sample = &report.m_Samples[i];
+		printf("%-8lu %10lu %10lu %12lu %12lu\n", (unsigned long)sample->m_Sectors, (unsigned long)sample->m_WriteKBs,
+				(unsigned long)sample->m_ReadKBs, (unsigned long)sample->m_UnalignedWriteKBs,
+				(unsigned long)sample->m_UnalignedReadKBs);
+	}
+	USB_GetTransferTuning(&tuning);
+	printf("tuning %04X:%04X \"%s\": max %lu sectors, align %lu sectors\n", tuning.m_VendorID, tuning.m_ProductID,
+			tuning.m_Serial, (unsigned long)tuning.m_MaxSectors, (unsigned long)tuning.m_AlignSectors);
+	return USB_DeleteFile(USB_BENCH_TUNING_FILE);
+}
+
+/**
+ * @brief Measures seeks in a large file: a file of fileSize bytes is preallocated with USB_PreallocateFile,
+ * 		  then ops times USB_Seek to an aligned random position followed by a read of USB_BENCH_RANDOM_SIZE
+ * 		  bytes. The test runs without and with USB_FAST_SEEK. Without the link map, a seek on FAT32 walks
+ * 		  the FAT chain, a contiguous exFAT file is addressed without the FAT.
+ * @param usbHandle handle to read and write data to the USB mass storage device. No file may be open.
+ * @param fileSize size of the file, at least USB_BENCH_RANDOM_SIZE. Sizes of 4 GB and more require exFAT.
+ * @param ops number of seeks of each test.
+ * @return Error Handle containing USB_NO_ERROR if both tests were successful.
+ */
+USB_ERROR USB_BENCH_RunSeek(USB_MS_Handle *usbHandle, uint64_t fileSize, uint32_t ops)
+{
+	USB_BENCH_Context ctx;
+
+	if(!usbHandle || fileSize < USB_BENCH_RANDOM_SIZE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(usbHandle->m_Open)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+
+	memset(&ctx, 0x00, sizeof(USB_BENCH_Context));
+	ctx.m_Handle = usbHandle;
+	ctx.m_Seed = USB_BENCH_RANDOM_SEED;
+	ctx.m_Buffer = malloc(USB_BENCH_RANDOM_SIZE);
+	ctx.m_Samples = malloc(USB_BENCH_MAX_SAMPLES * sizeof(uint32_t));
+	if(!ctx.m_Buffer || !ctx.m_Samples)
+		return USB_BENCH_Abort(&ctx, (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__});
+
+	USB_ERROR ret = USB_OpenFile(usbHandle, USB_BENCH_FILE, USB_WRITE | USB_OVERWRITE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_PreallocateFile(usbHandle, fileSize);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return USB_BENCH_Abort(&ctx, ret);
+	ret = USB_CloseFile(usbHandle);
+
+	printf("%-12s %7s %7s %10s %10s %10s %10s %10s\n", "test", "chunk", "ops", "MB/s", "ops/s", "p50[us]", "p99[us]", "max[us]");
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_Seek(&ctx, fileSize, ops, FALSE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_BENCH_Seek(&ctx, fileSize, ops, TRUE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return USB_BENCH_Abort(&ctx, ret);
+	return USB_BENCH_Abort(&ctx, USB_DeleteFile(USB_BENCH_FILE));
+}
+
+/**
+ * @brief Prints the interrupt statistics of the sources which were active: number of interrupts, mean and
+ * 		  max cycles per interrupt and the share of the elapsed time.
+ * @param stats statistics returned by USB_GetIRQStats.
+ */
+void USB_BENCH_PrintIRQStats(const USB_IRQ_STATS *stats)
+{
+	static const char *sourceNames[] = { "total", "disconnect", "port", "sof", "rx_fifo" };
+	const USB_IRQ_SOURCE_STATS *sources[] = { &stats->m_Total, &stats->m_Disconnect, &stats->m_Port, &stats->m_SOF, &stats->m_RxFifo };
+	char name[16];
+
+	printf("%-12s %9s %12s %10s %10s %8s\n", "irq_source", "count", "cycles", "mean", "max", "load[%]");
+	for(uint32_t i = 0; i < sizeof(sources) / sizeof(sources[0]) + USB_BUS_STATS_CHANNELS; i++)
+	{
+		const USB_IRQ_SOURCE_STATS *source;
+		if(i < sizeof(sources) / sizeof(sources[0]))
+		{
+			source = sources[i];
+			snprintf(name, sizeof(name), "%s", sourceNames[i]);
+		}
+		else
+		{
+			uint32_t channel = i - sizeof(sources) / sizeof(sources[0]);
+			source = &stats->m_Channels[channel];
+			snprintf(name, sizeof(name), "channel_%lu", (unsigned long)channel);
+		}
+		if(source->m_Count == 0 && i != 0)
+			continue;
+		printf("%-12s %9lu %12llu %10lu %10lu %8.2f\n", name, (unsigned long)source->m_Count,
+				(unsigned long long)source->m_Cycles,
+				(unsigned long)(source->m_Count ? source->m_Cycles / source->m_Count : 0),
+				(unsigned long)source->m_MaxCycles,
+				stats->m_ElapsedCycles ? (double)source->m_Cycles * 100.0 / (double)stats->m_ElapsedCycles : 0.0);
+	}
+}
+
+/**
+ * @brief Reads or writes totalBytes of the open file in chunks of USB_BENCH_RANDOM_SIZE bytes. Before each chunk
+ * 		  the function waits until the chunk is due at bytesPerSecond. Chunks which are late are not made up for
+ * 		  by waiting less later, so the achieved throughput is below the target if the drive is too slow.
+ */
+static USB_ERROR USB_BENCH_PacedTransfer(USB_MS_Handle *usbHandle, uint8_t *buffer, BOOL write,
+		uint32_t bytesPerSecond, uint64_t totalBytes)
+{
+	uint64_t start = USB_GetCycles();
+	uint64_t dueNs = 0;
+
+	for(uint64_t pos = 0; pos < totalBytes; pos += USB_BENCH_RANDOM_SIZE)
+	{
+		uint64_t nowNs = USB_CyclesToNs(USB_GetCycles() - start);
+		if(nowNs < dueNs)
+			USB_DelayNs((uint32_t)(dueNs - nowNs));
+		else
+			dueNs = nowNs;
+		dueNs += (uint64_t)USB_BENCH_RANDOM_SIZE * 1000000000ULL / bytesPerSecond;
+
+		uint32_t len = USB_BENCH_RANDOM_SIZE;
+		USB_ERROR ret = write ? USB_WriteData(usbHandle, buffer, &len, FALSE) : USB_ReadData(usbHandle, buffer, &len);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+	}
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Releases the resources of the benchmark and closes the file of a failed test.
+ * @return err
+ */
+static USB_ERROR USB_BENCH_Abort(USB_BENCH_Context *ctx, USB_ERROR err)
+{
+	if(ctx->m_Handle->m_Open)
+		USB_CloseFile(ctx->m_Handle);
+	free(ctx->m_Buffer);
+	free(ctx->m_Samples);
+	return err;
+}
+
+/**
+ * @brief Linear congruential generator, the random tests access the same positions in each run.
+ */
+static uint32_t USB_BENCH_Random32(USB_BENCH_Context *ctx)
+{
+	ctx->m_Seed = ctx->m_Seed * 1664525 + 1013904223;
+	return ctx->m_Seed >> 8;
+}
+
+static int USB_BENCH_CompareSamples(const void *a, const void *b)
+{
+	uint32_t sampleA = *(const uint32_t*)a;
+	uint32_t sampleB = *(const uint32_t*)b;
+	return (sampleA > sampleB) - (sampleA < sampleB);
+}
@@ -0,0 +1,115 @@
+/*
+ * usb_bus_stats.c
+ *
+ *  Bus level counters of the host channels, see usb_bus_stats.h.
+ */
+
+#include "usb_bus_stats.h"
+#include <string.h>
+
+#ifndef USB_HOST_SIM
+#include "stm32f4xx.h"
+#endif /* USB_HOST_SIM */
+
+#if (USB_BUS_STATS_CHANNELS & (USB_BUS_STATS_CHANNELS - 1)) != 0
+#error "USB_BUS_STATS_CHANNELS must be a power of 2"
+#endif
+
+volatile USB_BUS_CHANNEL_STATS usbBusChannelStats[USB_BUS_STATS_CHANNELS];
+
+#if USB_BUS_STATS_FRAMES
+volatile uint32_t usbBusFrameBytes = 0;		/* Bytes of the current frame */
+static volatile USB_BUS_FRAME_STATS frameStats;
+#endif /* USB_BUS_STATS_FRAMES */
+
+/** Helper functions **/
+static uint32_t USB_BUS_Lock();
+static void USB_BUS_Unlock(uint32_t primask);
+
+
+/**
+ * @brief Closes the byte accumulator of the current frame. Called by the SOF interrupt.
+ */
+void USB_BUS_Frame()
+{
+#if USB_BUS_STATS_FRAMES
+	uint32_t bytes = usbBusFrameBytes;
+	usbBusFrameBytes = 0;
+
+	frameStats.m_Frames++;
+	frameStats.m_LastFrameBytes = bytes;
+	frameStats.m_Bytes += bytes;
+	if(bytes)
+		frameStats.m_BusyFrames++;
+	if(bytes > frameStats.m_MaxFrameBytes)
+		frameStats.m_MaxFrameBytes = bytes;
+#endif /* USB_BUS_STATS_FRAMES */
+}
+
+/**
+ * @brief Copies the counters of a channel. The interrupts are masked while copying, so the counters are consistent.
+ * @param channel host channel.
+ * @param stats returns the copy.
+ * @return FALSE if the channel is out of range.
+ */
+BOOL USB_BUS_GetChannelStats(uint8_t channel, USB_BUS_CHANNEL_STATS *stats)
+{
+	if(channel >= USB_BUS_STATS_CHANNELS)
+		return FALSE;
+
+	uint32_t primask = USB_BUS_Lock();
+	*stats = *(USB_BUS_CHANNEL_STATS*)&usbBusChannelStats[channel];
+	USB_BUS_Unlock(primask);
+	return TRUE;
+}
+
+/**
+ * @brief Copies the per frame statistics. All values are 0 if USB_BUS_STATS_FRAMES is disabled.
+ * @param stats returns the copy.
+ */
+void USB_BUS_GetFrameStats(USB_BUS_FRAME_STATS *stats)
+{
+#if USB_BUS_STATS_FRAMES
+	uint32_t primask = USB_BUS_Lock();
+	*stats = *(USB_BUS_FRAME_STATS*)&frameStats;
+	USB_BUS_Unlock(primask);
+#else
+	memset(stats, 0x00, sizeof(USB_BUS_FRAME_STATS));
+#endif /* USB_BUS_STATS_FRAMES */
+}
+
+/**
+ * @brief Clears the counters of all channels and the per frame statistics.
+ */
+void USB_BUS_Reset()
+{
+	uint32_t primask = USB_BUS_Lock();
+	memset((void*)usbBusChannelStats, 0x00, sizeof(usbBusChannelStats));
+#if USB_BUS_STATS_FRAMES
+	usbBusFrameBytes = 0;
+	memset((void*)&frameStats, 0x00, sizeof(frameStats));
+#endif /* USB_BUS_STATS_FRAMES */
+	USB_BUS_Unlock(primask);
+}
+
+/**
+ * @brief Masks the interrupts, the counters are updated by the host controller interrupt.
+ * @return previous PRIMASK.
+ */
+static uint32_t USB_BUS_Lock()
+{
+#ifdef USB_HOST_SIM
+	return 0;
+#else
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+#endif /* USB_HOST_SIM */
+}
+
+static void USB_BUS_Unlock(uint32_t primask)
+{
+#ifndef USB_HOST_SIM
+	__set_PRIMASK(primask);
+#endif /* USB_HOST_SIM */
+}
@@ -0,0 +1,246 @@
+/*
+ * usb_cache.c
+ *
+ *  Write cache flushes at CTRL_SYNC, see usb_cache.h.
+ */
+
+#include "usb_cache.h"
+#include "usb_unit.h"
+#include "usb_time_measurement.h"
+#include "usbh_msc.h"
+
+/* Command of USB_CACHE_Execute */
+typedef struct {
+	uint8_t m_Opcode;
+	uint8_t *m_Caching;
+} USB_CACHE_COMMAND;
+
+static USB_CACHE_INFO cacheInfo[MAX_SUPPORTED_LUN];
+static BOOL cacheDirty[MAX_SUPPORTED_LUN];		/* Writes without FUA since the last flush */
+static BOOL syncDeferred[MAX_SUPPORTED_LUN];	/* CTRL_SYNC within a batch */
+static USB_CACHE_MODE cacheMode = USB_CACHE_FLUSH;
+static const uint8_t *metadataBuffer = NULL;	/* Window of the file system object */
+static uint32_t batchDepth = 0;
+
+/** Internally defined **/
+static void USB_CACHE_Probe(USBH_HandleTypeDef *phost, uint8_t lun);
+static USBH_StatusTypeDef USB_CACHE_Flush(USBH_HandleTypeDef *phost, uint8_t lun);
+static USBH_StatusTypeDef USB_CACHE_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode, uint8_t *caching);
+static USBH_StatusTypeDef USB_CACHE_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *command);
+
+
+/**
+ * @brief Called before a write. Decides if the write uses force unit access, other writes have to be flushed.
+ * @param buff data of the write, metadata if it is the window of the file system object.
+ * @return TRUE if the write has to be sent with USBH_MSC_WriteFUA.
+ */
+BOOL USB_CACHE_Write(USBH_HandleTypeDef *phost, uint8_t lun, const uint8_t *buff)
+{
+	if(lun >= MAX_SUPPORTED_LUN)
+		return FALSE;
+	if(cacheMode == USB_CACHE_FLUSH_FUA_METADATA && metadataBuffer && buff == metadataBuffer)
+	{
+		USB_CACHE_Probe(phost, lun);
+		if(cacheInfo[lun].m_FUASupported)
+		{
+			cacheInfo[lun].m_FUAWrites++;
+			return TRUE;
+		}
+	}
+	cacheDirty[lun] = TRUE;
+	return FALSE;
+}
+
+/**
+ * @brief Called for CTRL_SYNC. Flushes the write cache of the unit if it holds written data.
+ * @return USBH_OK if the written data is on the medium or the unit can not be flushed.
+ */
+USBH_StatusTypeDef USB_CACHE_Sync(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	if(lun >= MAX_SUPPORTED_LUN)
+		return USBH_FAIL;
+
+	USB_CACHE_INFO *info = &cacheInfo[lun];
+	info->m_Syncs++;
+	if(cacheMode == USB_CACHE_NO_FLUSH)
+		return USBH_OK;
+	if(batchDepth > 0)
+	{
+		info->m_DeferredSyncs++;
+		syncDeferred[lun] = TRUE;
+		return USBH_OK;
+	}
+	if(!cacheDirty[lun])
+	{
+		info->m_CleanSyncs++;
+		return USBH_OK;
+	}
+
+	USB_CACHE_Probe(phost, lun);
+	if((info->m_PageReported && !info->m_WriteCache) || !info->m_FlushSupported)
+	{
+		// Write through, the data is on the medium when the write completed
+		cacheDirty[lun] = FALSE;
+		info->m_CleanSyncs++;
+		return USBH_OK;
+	}
+	return USB_CACHE_Flush(phost, lun);
+}
+
+void USB_CACHE_SetMode(USB_CACHE_MODE mode)
+{
+	cacheMode = mode;
+}
+
+/**
+ * @brief Sets the window of the file system object, writes from it are FAT, bitmap and directory sectors.
+ */
+void USB_CACHE_SetMetadataBuffer(const uint8_t *window)
+{
+	metadataBuffer = window;
+}
+
+/**
+ * @brief Defers the flushes of CTRL_SYNC until USB_CACHE_EndBatch. Batches may be nested.
+ */
+void USB_CACHE_BeginBatch()
+{
+	batchDepth++;
+}
+
+/**
+ * @brief Ends a batch, units which received CTRL_SYNC within the outermost batch are flushed once.
+ */
+USBH_StatusTypeDef USB_CACHE_EndBatch(USBH_HandleTypeDef *phost)
+{
+	USBH_StatusTypeDef status = USBH_OK;
+
+	if(batchDepth == 0 || --batchDepth > 0)
+		return USBH_OK;
+	for(uint8_t lun = 0; lun < MAX_SUPPORTED_LUN; lun++)
+	{
+		if(!syncDeferred[lun])
+			continue;
+		syncDeferred[lun] = FALSE;
+		cacheInfo[lun].m_Syncs--;	// Counted as deferred
+		if(USB_CACHE_Sync(phost, lun) != USBH_OK)
+			status = USBH_FAIL;
+	}
+	return status;
+}
+
+/**
+ * @brief Called when the device was detached, the next device is probed again.
+ */
+void USB_CACHE_Detach()
+{
+	for(uint8_t lun = 0; lun < MAX_SUPPORTED_LUN; lun++)
+	{
+		cacheInfo[lun].m_Probed = FALSE;
+		cacheDirty[lun] = FALSE;
+		syncDeferred[lun] = FALSE;
+	}
+}
+
+void USB_CACHE_GetInfo(uint8_t lun, USB_CACHE_INFO *info)
+{
+	*info = cacheInfo[lun];
+}
+
+/**
+ * @brief Requests the caching mode page once per attach. Without a result the unit is flushed and written
+ * 		  without FUA.
+ */
+static void USB_CACHE_Probe(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	USB_CACHE_INFO *info = &cacheInfo[lun];
+	uint8_t caching = 0;
+
+	if(info->m_Probed)
+		return;
+	info->m_PageReported = FALSE;
+	info->m_WriteCache = TRUE;
+	info->m_FUASupported = FALSE;
+	info->m_FlushSupported = TRUE;
+	if(!USBH_MSC_IsIdle(phost, lun))
+		return;
+
+	info->m_Probed = TRUE;
+	if(USB_CACHE_Execute(phost, lun, OPCODE_MODE_SENSE6, &caching) != USBH_OK)
+	{
+		// Clears the sense data of the unsupported page
+		USB_CACHE_Execute(phost, lun, OPCODE_REQUEST_SENSE, NULL);
+		return;
+	}
+	info->m_PageReported = (caching & SCSI_CACHING_PAGE) != 0;
+	info->m_WriteCache = !info->m_PageReported || (caching & SCSI_CACHING_WCE) != 0;
+	info->m_FUASupported = (caching & SCSI_CACHING_DPOFUA) != 0;
+}
+
+/**
+ * @brief Sends SYNCHRONIZE CACHE(10) for the whole unit.
+ */
+static USBH_StatusTypeDef USB_CACHE_Flush(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+	USB_CACHE_INFO *info = &cacheInfo[lun];
+
+	if(!USBH_MSC_IsIdle(phost, lun))
+	{
+		info->m_FailedFlushes++;
+		return USBH_FAIL;
+	}
+
+	uint64_t start = USB_GetTimeUs();
+	USBH_StatusTypeDef status = USB_CACHE_Execute(phost, lun, OPCODE_SYNCHRONIZE_CACHE10, NULL);
+	if(status == USBH_OK)
+	{
+		cacheDirty[lun] = FALSE;
+		info->m_Flushes++;
+		info->m_LastFlushUs = (uint32_t)(USB_GetTimeUs() - start);
+		if(info->m_LastFlushUs > info->m_MaxFlushUs)
+			info->m_MaxFlushUs = info->m_LastFlushUs;
+		return USBH_OK;
+	}
+
+	if(phost->device.is_connected != 0U && USB_CACHE_Execute(phost, lun, OPCODE_REQUEST_SENSE, NULL) == USBH_OK)
+	{
+		if(MSC_Handle->unit[lun].sense.key == SCSI_SENSE_KEY_ILLEGAL_REQUEST)
+		{
+			// Command not supported, nothing more can be done for durability
+			info->m_FlushSupported = FALSE;
+			cacheDirty[lun] = FALSE;
+			return USBH_OK;
+		}
+		USB_UNIT_Sense(lun, &MSC_Handle->unit[lun].sense);
+	}
+	info->m_FailedFlushes++;
+	return USBH_FAIL;
+}
+
+/**
+ * @brief Sends a command of this module and waits for the CSW.
+ * @param opcode OPCODE_MODE_SENSE6 (caching page), OPCODE_SYNCHRONIZE_CACHE10 or OPCODE_REQUEST_SENSE.
+ * @param caching returns the SCSI_CACHING_xxx bits of OPCODE_MODE_SENSE6.
+ */
+static USBH_StatusTypeDef USB_CACHE_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode, uint8_t *caching)
+{
+	USB_CACHE_COMMAND command = {opcode, caching};
+	return USBH_MSC_ExecuteSync(phost, lun, USB_CACHE_Command, &command, USB_CACHE_COMMAND_TIMEOUT_MS);
+}
+
+static USBH_StatusTypeDef USB_CACHE_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *command)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+	USB_CACHE_COMMAND *cmd = (USB_CACHE_COMMAND*)command;
+
+	switch(cmd->m_Opcode)
+	{
+	case OPCODE_MODE_SENSE6:
+		return USBH_MSC_SCSI_ModeSenseCaching(phost, lun, cmd->m_Caching);
+	case OPCODE_SYNCHRONIZE_CACHE10:
+		return USBH_MSC_SCSI_SynchronizeCache(phost, lun, 0U, 0U);
+	default:
+		return USBH_MSC_SCSI_RequestSense(phost, lun, &MSC_Handle->unit[lun].sense);
+	}
+}
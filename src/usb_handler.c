@@ -10,15 +10,36 @@
 #include "ff.h"
 #include "usbh_def.h" 
 #include "usb_time_measurement.h"
+#include "usb_latency.h"
+#include "usb_bus_stats.h"
+#include "usb_irq_stats.h"
+#include "usb_trace.h"
+#include "usb_tuning.h"
+#include "usb_attach.h"
+#include "usb_volume.h"
+#include "usb_recovery.h"
+#include "usb_unit.h"
+#include "usb_trim.h"
+#include "usb_cache.h"
+#include "usb_iosched.h"
 
+/** Size of the work buffer passed to f_mkfs, at least _MAX_SS. A larger buffer reduces the number of write commands during formatting. **/
+#ifndef USB_MKFS_WORK_BUFFER_SIZE
+#define USB_MKFS_WORK_BUFFER_SIZE	(8 * _MIN_SS)
+#endif
 
 // TODO this variables could be specified locally?
+char errorBuffer[512];
 FATFS USBDISKFatFs;
 USBH_HandleTypeDef hUSBHost; /* USB Host handle */
 extern HCD_HandleTypeDef hhcd;
 
 /** Internally defined **/
 void USB_StateCallback(USBH_HandleTypeDef *phost, uint8_t id);
+static USB_ERROR USB_BuildLinkMap(USB_MS_Handle* usbHandle);
+static void USB_DetachLinkMap(USB_MS_Handle* usbHandle);
+static USB_ERROR USB_ApplySyncPolicy(USB_MS_Handle* usbHandle);
+static uint32_t USB_GetDefaultClusterSize(BYTE opt);
 
 /** 
  * @brief Callback function, which is invoked after a USB Host interrupt. 
@@ -26,7 +47,20 @@ void USB_StateCallback(USBH_HandleTypeDef *phost, uint8_t id);
  */
 extern void OTG_HS_IRQHandler(void)
 {
+	USB_IRQ_STAMP(irqStart);
+#if USB_TRACE_ENABLE
+	/* SOF only interrupts occur every (micro)frame, they would flood the trace */
+	uint32_t pending = hhcd.Instance->GINTSTS & hhcd.Instance->GINTMSK;
+	if(pending & ~USB_OTG_GINTSTS_SOF)
+		USB_TRACE(USB_TRACE_IRQ_BEGIN, 0, 0, pending);
+#endif /* USB_TRACE_ENABLE */
 	HAL_HCD_IRQHandler(&hhcd);
+	(void)USB_GetCycles(); /* The SOF interrupts keep the 64-bit time base extended while the host is running */
+	USB_IRQ_ACCOUNT(m_Total, irqStart);
+#if USB_TRACE_ENABLE
+	if(pending & ~USB_OTG_GINTSTS_SOF)
+		USB_TRACE(USB_TRACE_IRQ_END, 0, 0, 0);
+#endif /* USB_TRACE_ENABLE */
 }
 
 
@@ -46,8 +80,14 @@ USB_ERROR USB_InitConnection(USB_MS_Handle *usbHandle)
 	}
 	usbHandle->m_USBState = USB_IDLE;
 	usbHandle->m_Open = FALSE;
+	usbHandle->m_LinkMapState = USB_LINKMAP_DISABLED;
+	memset(&usbHandle->m_SeekStats, 0x00, sizeof(USB_SEEK_STATS));
+	memset(&usbHandle->m_SyncPolicy, 0x00, sizeof(USB_SYNC_POLICY));
 	usbHandle->m_FileHandle = malloc(sizeof(FIL));
 
+	// Writes from the window of the file system object are metadata, see usb_cache.h
+	USB_CACHE_SetMetadataBuffer(USBDISKFatFs.win);
+
 	// Link USB I/O driver
 	if (FATFS_LinkDriver(&USBH_Driver, usbHandle->m_USBDISKPath) != 0)
 	{
@@ -86,7 +126,12 @@ USB_ERROR USB_DeInitConnection(USB_MS_Handle* usbHandle)
 	if(!usbHandle)
 		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
 
+	// No file may be open, e.g. after USB_DeleteFile
 	USB_ERROR ret = USB_CloseFile(usbHandle);
+	if(ret.m_ErrCode != USB_NO_ERROR && ret.m_ErrCode != USB_INTERFACE_CLOSED)
+		return ret;
+	// Write the deferred FSINFO update before the volume is released
+	ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_syncfs("0:")), __LINE__ };
 	if(ret.m_ErrCode != USB_NO_ERROR)
 		return ret;
 	if(FATFS_UnLinkDriver("0:") != 0)
@@ -108,25 +153,28 @@ USB_ERROR USB_ExecuteStateMachine(USB_MS_Handle* usbHandle, int timeoutMS)
 	if(!usbHandle)
 		return (USB_ERROR ) {USB_PARAM_ERROR, __LINE__ } ;
 
-	int val = USB_StartTimer();
+	uint64_t start = USB_GetTimeMs();
 	while (usbHandle->m_USBState != USB_START) {
 
 		/* USB Host Background task */
 		hUSBHost.m_USBHandle = (void*)usbHandle;
 		USBH_Process(&hUSBHost);
-		if(USB_TransformClockFrequencyToMS(USB_GetTimer() - val) >= timeoutMS)
+		if(USB_GetTimeMs() - start >= (uint64_t)timeoutMS)
 			return (USB_ERROR ) {USB_TIMEOUT, __LINE__ } ;
 	}
+	// Apply the cached transfer tuning of the device
+	USB_TUNING_Attach(&hUSBHost);
 	return (USB_ERROR ) {USB_NO_ERROR, __LINE__ } ;
 }
 
 /**
- * @brief This function mounts a detected USB drive.
+ * @brief This function mounts a detected USB drive. If the volume was mounted before and was not modified
+ * 				elsewhere, the free cluster count and the allocation hint are restored (see usb_volume.h).
  * @return Error Handle containing USB_NO_ERROR if function was successful. 
  */
 USB_ERROR USB_MountDrive()
 {
-	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_mount(&USBDISKFatFs, "0:", 1)), __LINE__ };
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(USB_VOLUME_Mount(&USBDISKFatFs, "0:")), __LINE__ };
 }
 
 /**
@@ -136,6 +184,8 @@ USB_ERROR USB_MountDrive()
  * @param flags multiple parameters can be specified by combining them with a logical or operator. 
  * 				e.g. USB_WRITE | USB_APPEND means that the file is opened in write mode and the 
  * 				data is appended to the exiting content.
+ * 				If USB_FAST_SEEK is combined with USB_READ, a cluster link map is built after opening the file.
+ * 				Seeks are then resolved without reading the FAT, also in fragmented multi-GB files.
  * @return Error Handle containing USB_NO_ERROR if function was successful. 
  */
 USB_ERROR USB_OpenFile(USB_MS_Handle* usbHandle, const char* fileName, int flags)
@@ -160,9 +210,24 @@ USB_ERROR USB_OpenFile(USB_MS_Handle* usbHandle, const char* fileName, int flags
 	if(!usbHandle)
 		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
 
+	usbHandle->m_LinkMapState = USB_LINKMAP_DISABLED;
 	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_open((FIL*)usbHandle->m_FileHandle, fileName, fopenFlag)), __LINE__ };
-	if(ret.m_ErrCode == USB_NO_ERROR)
-		usbHandle->m_Open = TRUE;
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	usbHandle->m_Open = TRUE;
+	usbHandle->m_UnsyncedBytes = 0;
+	usbHandle->m_LastSyncTick = HAL_GetTick();
+	if((flags & USB_FAST_SEEK) && (fopenFlag & FA_READ))
+	{
+		ret = USB_BuildLinkMap(usbHandle);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+		{
+			// The caller treats the file as not opened, release the file object and its lock
+			f_close((FIL*)usbHandle->m_FileHandle);
+			usbHandle->m_Open = FALSE;
+		}
+	}
 	return ret;
 }
 
@@ -181,10 +246,27 @@ USB_ERROR USB_CloseFile(USB_MS_Handle* usbHandle)
 
 	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_close((FIL*)usbHandle->m_FileHandle)), __LINE__ };
 	if(ret.m_ErrCode == USB_NO_ERROR)
+	{
 		usbHandle->m_Open = FALSE;
+		usbHandle->m_LinkMapState = USB_LINKMAP_DISABLED;
+		USB_VOLUME_Capture(&USBDISKFatFs);
+	}
 	return ret;
 }
 
+/**
+ * @brief This function deletes a file or an empty directory on the USB device. The file must not be opened.
+ * @param fileName name of the file to delete.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_DeleteFile(const char* fileName)
+{
+	if(!fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_unlink(fileName)), __LINE__ };
+}
+
 
 /**
  * @brief This function writes data on a file, previously opened by the USB_OpenFile function.
@@ -192,6 +274,7 @@ USB_ERROR USB_CloseFile(USB_MS_Handle* usbHandle)
  * @param buffer Buffer containing the data to write.
  * @param bufferLen Input: Length of the buffer to write, Output: Acutually written data.
  * @param append If append is enabled, the pointer is set to the end of the file and the data is appended to the existing content.
+ * 				The directory entry is updated as configured by USB_SetSyncPolicy.
  * @return Error Handle containing USB_NO_ERROR if function was successful. 
  */
 USB_ERROR USB_WriteData(USB_MS_Handle* usbHandle, uint8_t *buffer, uint32_t *bufferLen, BOOL append)
@@ -210,7 +293,150 @@ USB_ERROR USB_WriteData(USB_MS_Handle* usbHandle, uint8_t *buffer, uint32_t *buf
 	}
 
 	uint32_t maxLen = *bufferLen;
-	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_write((FIL*)usbHandle->m_FileHandle, buffer, maxLen, (void *)bufferLen)), __LINE__ };
+	FIL *file = (FIL*)usbHandle->m_FileHandle;
+	// In fast seek mode FatFs cannot stretch the cluster chain, fall back to the FAT until the next seek
+	if(file->fptr + maxLen > f_size(file))
+		USB_DetachLinkMap(usbHandle);
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_write((FIL*)usbHandle->m_FileHandle, buffer, maxLen, (void *)bufferLen)), __LINE__ };
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	usbHandle->m_UnsyncedBytes += *bufferLen;
+	return USB_ApplySyncPolicy(usbHandle);
+}
+
+/**
+ * @brief This function configures when the directory entry (file size, cluster and timestamp) of an opened file
+ * 				is written to the device. Between two updates the size is only kept in RAM. After a power loss the
+ * 				file has the size of the last update, all data written afterwards is lost, even if it reached the media.
+ * 				The window of data loss is therefore at most intervalMS milliseconds or byteThreshold bytes.
+ * 				Without a policy (both 0) the directory entry is only written by USB_Sync and USB_CloseFile.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param intervalMS maximum time between two directory entry updates, 0 to disable.
+ * @param byteThreshold maximum amount of written bytes between two directory entry updates, 0 to disable.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_SetSyncPolicy(USB_MS_Handle* usbHandle, uint32_t intervalMS, uint32_t byteThreshold)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	usbHandle->m_SyncPolicy.m_IntervalMS = intervalMS;
+	usbHandle->m_SyncPolicy.m_ByteThreshold = byteThreshold;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function synchronizes an opened file with the device.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param durable If TRUE, the cached data, the directory entry and the deferred FSINFO sector are written,
+ * 				after the function returns all written data survives a power loss.
+ * 				If FALSE, only the cached data is written. The directory entry is updated if the sync policy
+ * 				of the handle requires it.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_Sync(USB_MS_Handle* usbHandle, BOOL durable)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	if(!durable)
+	{
+		USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_flush((FIL*)usbHandle->m_FileHandle)), __LINE__ };
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		return USB_ApplySyncPolicy(usbHandle);
+	}
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_sync((FIL*)usbHandle->m_FileHandle)), __LINE__ };
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	usbHandle->m_UnsyncedBytes = 0;
+	usbHandle->m_LastSyncTick = HAL_GetTick();
+	ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_syncfs("0:")), __LINE__ };
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		USB_VOLUME_Capture(&USBDISKFatFs);
+	return ret;
+}
+
+/**
+ * @brief This function synchronizes several opened files with the device, as USB_Sync with durable TRUE. The write
+ * 				cache of the device is flushed once after all files instead of once per file.
+ * @param usbHandles opened handles to synchronize.
+ * @param count number of handles.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_DISK_ERROR if the final flush of the write cache failed.
+ */
+USB_ERROR USB_SyncFiles(USB_MS_Handle** usbHandles, uint32_t count)
+{
+	USB_ERROR ret = (USB_ERROR) {USB_NO_ERROR, __LINE__};
+
+	if(!usbHandles)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	USB_CACHE_BeginBatch();
+	for(uint32_t i = 0; i < count && ret.m_ErrCode == USB_NO_ERROR; i++)
+		ret = USB_Sync(usbHandles[i], TRUE);
+	if(USB_CACHE_EndBatch(&hUSBHost) != USBH_OK && ret.m_ErrCode == USB_NO_ERROR)
+		ret = (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+	return ret;
+}
+
+/**
+ * @brief This function selects how CTRL_SYNC makes written data durable on devices with a write cache,
+ * 				see usb_cache.h. The default is USB_CACHE_FLUSH.
+ * @param mode USB_CACHE_NO_FLUSH to rely on the device, USB_CACHE_FLUSH to send SYNCHRONIZE CACHE or
+ * 				USB_CACHE_FLUSH_FUA_METADATA to write FAT and directory sectors with force unit access in addition.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_SetCacheMode(USB_CACHE_MODE mode)
+{
+	if(mode > USB_CACHE_FLUSH_FUA_METADATA)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_CACHE_SetMode(mode);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the write cache state of a logical unit and the counters of the flushes.
+ * @param lun logical unit number.
+ * @param info Output: reported caching mode page, syncs, flushes and FUA writes.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_GetCacheInfo(uint8_t lun, USB_CACHE_INFO *info)
+{
+	if(!info || lun >= MAX_SUPPORTED_LUN)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_CACHE_GetInfo(lun, info);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Internal function which rewrites the directory entry of the opened file, if the sync policy requires it.
+ * 				FSINFO is not written here, its updates are coalesced until the next durable sync.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+static USB_ERROR USB_ApplySyncPolicy(USB_MS_Handle* usbHandle)
+{
+	USB_SYNC_POLICY *policy = &usbHandle->m_SyncPolicy;
+	BOOL bytesDue = policy->m_ByteThreshold && usbHandle->m_UnsyncedBytes >= policy->m_ByteThreshold;
+	BOOL timeDue = policy->m_IntervalMS && (HAL_GetTick() - usbHandle->m_LastSyncTick) >= policy->m_IntervalMS;
+	if(!bytesDue && !timeDue)
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_sync((FIL*)usbHandle->m_FileHandle)), __LINE__ };
+	if(ret.m_ErrCode == USB_NO_ERROR)
+	{
+		usbHandle->m_UnsyncedBytes = 0;
+		usbHandle->m_LastSyncTick = HAL_GetTick();
+	}
+	return ret;
 }
 
 /**
@@ -227,6 +453,678 @@ USB_ERROR USB_SetLastBufferPos(USB_MS_Handle* usbHandle)
 	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_lseek((FIL*)usbHandle->m_FileHandle, f_size((FIL*)usbHandle->m_FileHandle))), __LINE__ };
 }
 
+/**
+ * @brief This function creates a new file system on the connected USB drive and mounts it afterwards.
+ * 				All data on the drive is lost.
+ * @param fsType file system to create. USB_FS_EXFAT allows files larger than 4 GB and
+ * 				keeps contiguous files free of FAT chain updates. USB_FS_FAT32 falls back to FAT12/FAT16 if the
+ * 				volume has too few clusters for FAT32, e.g. 4 KB sectors below 512 MB.
+ * @param clusterSize cluster size in bytes. 0 selects the write alignment of the device (Block Limits VPD page
+ * 				or calibration), so that FatFs does not split writes below it at cluster boundaries.
+ * 				Without an alignment the FatFs default for the volume size is used.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_FormatDrive(USB_FS_TYPE fsType, uint32_t clusterSize)
+{
+	BYTE opt;
+	switch(fsType)
+	{
+	case USB_FS_FAT:
+		opt = FM_FAT;
+		break;
+	case USB_FS_FAT32:
+		opt = FM_FAT32;
+		break;
+	case USB_FS_EXFAT:
+		opt = FM_EXFAT;
+		break;
+	default:
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	}
+
+	if(clusterSize == 0)
+		clusterSize = USB_GetDefaultClusterSize(opt);
+
+	void *workBuffer = malloc(USB_MKFS_WORK_BUFFER_SIZE);
+	if(!workBuffer)
+		return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_mkfs("0:", opt, clusterSize, workBuffer, USB_MKFS_WORK_BUFFER_SIZE)), __LINE__ };
+	// FAT32 needs more than 65525 clusters, smaller volumes are formatted with FAT12/FAT16
+	if(ret.m_ErrCode == USB_MKFS_ABORTED && opt == FM_FAT32)
+		ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_mkfs("0:", FM_FAT, clusterSize, workBuffer, USB_MKFS_WORK_BUFFER_SIZE)), __LINE__ };
+	free(workBuffer);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	return USB_MountDrive();
+}
+
+/**
+ * @brief This function returns the free space of the mounted volume. The first call after a cold mount
+ * 				scans the FAT or the allocation bitmap, after a warm mount the restored count is returned.
+ * @param freeBytes Output: free space in bytes.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetFreeSpace(uint64_t *freeBytes)
+{
+	FATFS *fs;
+	DWORD freeClusters;
+
+	if(!freeBytes)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_getfree("0:", &freeClusters, &fs)), __LINE__ };
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	*freeBytes = (uint64_t)freeClusters * fs->csize * USB_VOLUME_SECTOR_SIZE(fs);
+	USB_VOLUME_Capture(fs);
+	return ret;
+}
+
+/**
+ * @brief This function returns the results of the fingerprint check of USB_MountDrive.
+ * @param stats Output: number of warm mounts and mismatches, duration of the last mount.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetVolumeStats(USB_VOLUME_STATS *stats)
+{
+	if(!stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_VOLUME_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function unmaps the free clusters of the mounted volume on devices which support UNMAP, see usb_trim.h.
+ * 				Clusters freed by this host are trimmed when FatFs frees them, the scan covers clusters which were
+ * 				freed elsewhere or before. Each call reads up to maxSectors FAT or allocation bitmap sectors and
+ * 				continues where the previous call stopped, call it in idle periods until done is TRUE.
+ * @param maxSectors FAT or bitmap sectors read by this call, at least 1.
+ * @param done Output: TRUE if the scan reached the end of the volume, the next call starts a new pass.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_NOT_SUPPORTED if the device does not support UNMAP or the volume is FAT12.
+ * 				USB_BUSY if FatFs holds a modified FAT or bitmap sector, retry after USB_Sync.
+ * */
+USB_ERROR USB_TrimFreeSpace(uint32_t maxSectors, BOOL *done)
+{
+	FATFS *fs;
+	DWORD freeClusters;
+
+	if(!done)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_getfree("0:", &freeClusters, &fs)), __LINE__ };
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	return USB_TRIM_FreeSpace(&hUSBHost, 0 /* drive 0: */, fs, maxSectors, done);
+}
+
+/**
+ * @brief This function returns the counters of the TRIM of freed clusters.
+ * @param stats Output: collected ranges, UNMAP commands and unmapped blocks.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetTrimStats(USB_TRIM_STATS *stats)
+{
+	if(!stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_TRIM_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function allocates a contiguous block of clusters to a file, which was just created by USB_OpenFile.
+ * 				The file size is set to size immediately. On exFAT the file is marked as contiguous,
+ * 				so writing into the preallocated area does not touch the FAT at all.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param size number of bytes to allocate. Sizes of 4 GB and above require an exFAT volume.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_ACCESS_DENIED if the file is not empty or no contiguous area of this size is left.
+ * */
+USB_ERROR USB_PreallocateFile(USB_MS_Handle* usbHandle, uint64_t size)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	USB_DetachLinkMap(usbHandle);
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_expand((FIL*)usbHandle->m_FileHandle, (FSIZE_t)size, 1)), __LINE__ };
+}
+
+/**
+ * @brief This function moves the read/write pointer of an opened file.
+ * 				If the file was opened with USB_FAST_SEEK, a stale link map is rebuilt first.
+ * 				The duration of each seek is recorded in the seek statistics of the handle.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param offset byte offset from the beginning of the file. Offsets beyond 4 GB require an exFAT volume.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_Seek(USB_MS_Handle* usbHandle, uint64_t offset)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	FIL *file = (FIL*)usbHandle->m_FileHandle;
+	// Seeking beyond the end of a writable file stretches it, which requires the FAT
+	if(offset > f_size(file) && (file->flag & FA_WRITE))
+		USB_DetachLinkMap(usbHandle);
+	else if(usbHandle->m_LinkMapState == USB_LINKMAP_STALE)
+	{
+		USB_ERROR ret = USB_BuildLinkMap(usbHandle);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+	}
+
+	BOOL fastSeek = (file->cltbl != 0);
+	uint64_t startTime = USB_GetCycles();
+	USB_ERROR ret = (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_lseek(file, (FSIZE_t)offset)), __LINE__ };
+	uint32_t seekTime = (uint32_t)USB_CyclesToNs(USB_GetCycles() - startTime);
+
+	USB_SEEK_STATS *stats = &usbHandle->m_SeekStats;
+	stats->m_SeekCount++;
+	if(fastSeek)
+		stats->m_FastSeekCount++;
+	stats->m_LastSeekNs = seekTime;
+	stats->m_TotalSeekNs += seekTime;
+	if(seekTime > stats->m_MaxSeekNs)
+		stats->m_MaxSeekNs = seekTime;
+	return ret;
+}
+
+/**
+ * @brief This function enables or disables the cluster link map of an opened file, like USB_FAST_SEEK does at USB_OpenFile.
+ * 				An enabled link map is built on the next call of USB_Seek. A writer which appends to the file should disable it,
+ * 				otherwise every seek after the file grew rebuilds the map by reading the whole FAT chain.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param enable TRUE to resolve seeks by the link map, only takes effect if the file was opened with USB_READ.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_SetFastSeek(USB_MS_Handle* usbHandle, BOOL enable)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	FIL *file = (FIL*)usbHandle->m_FileHandle;
+	if(!enable)
+	{
+		file->cltbl = 0;
+		usbHandle->m_LinkMapState = USB_LINKMAP_DISABLED;
+	}
+	else if(usbHandle->m_LinkMapState == USB_LINKMAP_DISABLED && (file->flag & FA_READ))
+		usbHandle->m_LinkMapState = USB_LINKMAP_STALE;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the seek statistics of a handle.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param stats Output: copy of the statistics collected since the last call of USB_ResetSeekStats.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetSeekStats(USB_MS_Handle* usbHandle, USB_SEEK_STATS *stats)
+{
+	if(!usbHandle || !stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	*stats = usbHandle->m_SeekStats;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the seek statistics of a handle.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_ResetSeekStats(USB_MS_Handle* usbHandle)
+{
+	if(!usbHandle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	memset(&usbHandle->m_SeekStats, 0x00, sizeof(USB_SEEK_STATS));
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns a snapshot of the latency histogram of the MSC read or write commands of a LUN.
+ * @param lun logical unit number.
+ * @param dir USB_LATENCY_READ or USB_LATENCY_WRITE.
+ * @param sizeClass 0 for 1 sector, 1 for 2-8, 2 for 9-64, 3 for more sectors per command,
+ * 				or USB_LATENCY_ALL_SIZES for the sum of all size classes.
+ * @param hist Output: copy of the histogram collected since the last call of USB_ResetLatencyHistograms.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetLatencyHistogram(uint8_t lun, USB_LATENCY_DIR dir, uint8_t sizeClass, USB_LATENCY_HISTOGRAM *hist)
+{
+	if(!USB_LATENCY_Get(lun, dir, sizeClass, hist))
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the latency histograms of all LUNs.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_ResetLatencyHistograms()
+{
+	USB_LATENCY_Reset();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function calculates a percentile of a latency histogram. The result is the upper bound of the bucket
+ * 				containing the percentile, so it is at most 1/2^USB_LATENCY_SUB_BUCKET_BITS above the exact value.
+ * @param hist histogram returned by USB_GetLatencyHistogram.
+ * @param percentile percentile between 0 and 100, e.g. 99.9.
+ * @param latencyUs Output: latency in us, 0 if the histogram is empty.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetLatencyPercentile(const USB_LATENCY_HISTOGRAM *hist, float percentile, uint32_t *latencyUs)
+{
+	if(!hist || !latencyUs || percentile < 0.0f || percentile > 100.0f)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	*latencyUs = USB_LATENCY_Percentile(hist, percentile);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns a snapshot of the bus level counters of a host channel. The channel of a pipe
+ * 				is assigned by the host library, the MSC class uses the channels 2 (OUT) and 3 (IN) after
+ * 				the control pipes 0 and 1.
+ * @param channel host channel.
+ * @param stats Output: counters collected since the last call of USB_ResetBusStats.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetBusStats(uint8_t channel, USB_BUS_CHANNEL_STATS *stats)
+{
+	if(!stats || !USB_BUS_GetChannelStats(channel, stats))
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the bytes per frame statistics.
+ * @param stats Output: statistics of the frames since the last call of USB_ResetBusStats.
+ * @return Error Handle containing USB_NO_ERROR if function was successful,
+ * 				USB_PARAM_ERROR if the library was built without USB_BUS_STATS_FRAMES.
+ * */
+USB_ERROR USB_GetBusFrameStats(USB_BUS_FRAME_STATS *stats)
+{
+	if(!stats || !USB_BUS_STATS_FRAMES)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_BUS_GetFrameStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the bus level counters of all channels and the frame statistics.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_ResetBusStats()
+{
+	USB_BUS_Reset();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns a snapshot of the time spent in OTG_HS_IRQHandler, in total and per interrupt
+ * 				source. Requires a build with USB_IRQ_STATS_ENABLE.
+ * @param stats Output: statistics collected since the last call of USB_ResetIRQStats.
+ * @return Error Handle containing USB_NO_ERROR if function was successful,
+ * 				USB_PARAM_ERROR if the library was built without USB_IRQ_STATS_ENABLE.
+ * */
+USB_ERROR USB_GetIRQStats(USB_IRQ_STATS *stats)
+{
+	if(!stats || !USB_IRQ_STATS_ENABLE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_IRQ_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the interrupt statistics and restarts the measurement of the elapsed time.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_ResetIRQStats()
+{
+	USB_IRQ_Reset();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function writes the layer trace (usb_trace.h) in its binary format to a file on the drive. The ring
+ * 				buffer is copied first, the trace of writing the file itself is not contained. Convert the file
+ * 				with the host tool usb_trace2json.
+ * @param fileName name of the file, an existing file is overwritten.
+ * @return Error Handle containing USB_NO_ERROR if function was successful,
+ * 				USB_PARAM_ERROR if the library was built without USB_TRACE_ENABLE.
+ * */
+USB_ERROR USB_SaveTrace(const char* fileName)
+{
+#if USB_TRACE_ENABLE
+	static uint8_t traceExport[USB_TRACE_EXPORT_SIZE];
+	FIL file;
+	UINT written = 0;
+
+	if(!fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	uint32_t size = USB_TRACE_Export(traceExport, sizeof(traceExport));
+	FRESULT res = f_open(&file, fileName, FA_WRITE | FA_CREATE_ALWAYS);
+	if(res != FR_OK)
+		return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+	res = f_write(&file, traceExport, size, &written);
+	FRESULT closeRes = f_close(&file);
+	if(res == FR_OK)
+		res = closeRes;
+	if(res == FR_OK && written != size)
+		res = FR_DENIED;
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+#else
+	return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+#endif /* USB_TRACE_ENABLE */
+}
+
+/**
+ * @brief This function measures the optimal transfer size and alignment of the attached device and applies them
+ * 				in the diskio layer. Raw write and read commands of 4 KB up to bufferSize are timed in a reserved,
+ * 				contiguous file of USB_TUNING_AREA_SIZE(bufferSize) bytes, which is kept for the next calibration.
+ * 				The result is cached per VID/PID/serial number and reapplied by USB_ExecuteStateMachine when
+ * 				the device is attached again. Call it after USB_MountDrive with no file opened for writing.
+ * @param fileName name of the reserved file, its content is overwritten.
+ * @param buffer data buffer of the commands, 4 byte aligned.
+ * @param bufferSize size of the buffer, the largest probed transfer size (e.g. 64 KB).
+ * @param report Output: measured throughput of each transfer size, may be NULL.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_PARAM_ERROR if the buffer is smaller than 4 KB.
+ * */
+USB_ERROR USB_CalibrateTransfers(const char* fileName, uint8_t *buffer, uint32_t bufferSize, USB_TUNING_REPORT *report)
+{
+	FIL file;
+
+	if(!fileName || !buffer || bufferSize < USB_TUNING_MIN_BYTES)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	// Recreate the file, only a file allocated by f_expand is guaranteed to be contiguous
+	FRESULT res = f_open(&file, fileName, FA_WRITE | FA_CREATE_ALWAYS);
+	if(res != FR_OK)
+		return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+	res = f_expand(&file, (FSIZE_t)USB_TUNING_AREA_SIZE(bufferSize), 1);
+	if(res != FR_OK)
+	{
+		f_close(&file);
+		return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+	}
+
+	FATFS *fs = file.obj.fs;
+	uint32_t sector = fs->database + (uint32_t)fs->csize * (file.obj.sclust - 2);
+	uint32_t sectorCount = (uint32_t)(USB_TUNING_AREA_SIZE(bufferSize) / USB_VOLUME_SECTOR_SIZE(fs));
+	USBH_StatusTypeDef status = USB_TUNING_Probe(&hUSBHost, 0 /* drive 0: */, sector, sectorCount, buffer, bufferSize, report);
+
+	res = f_close(&file);
+	if(status != USBH_OK)
+		return (USB_ERROR) {USB_MAP_ErrCodeUSB(status), __LINE__};
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+}
+
+/**
+ * @brief This function returns the transfer tuning applied to the attached device.
+ * @param tuning Output: VID, PID and serial number of the device, maximum transfer size and alignment.
+ * 				m_Calibrated is FALSE if the defaults are used.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetTransferTuning(USB_TRANSFER_TUNING *tuning)
+{
+	if(!tuning)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_TUNING_Get(tuning);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function adds a transfer tuning to the cache, e.g. a result of USB_CalibrateTransfers which was
+ * 				stored by the application. It is applied immediately if VID, PID and serial number match the
+ * 				attached device, otherwise when the device is attached.
+ * @param tuning tuning returned by USB_GetTransferTuning.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_SetTransferTuning(const USB_TRANSFER_TUNING *tuning)
+{
+	if(!tuning)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_TUNING_Set(tuning);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function configures the I/O scheduler, see usb_iosched.h. FatFs reads and writes are bulk requests,
+ * 				they are split into commands of at most chunkBytes so that urgent requests are served in between.
+ * @param chunkBytes largest command of bulk requests in bytes, 0 (default) to keep the tuned command size.
+ * 				Smaller chunks reduce the latency of urgent requests and the throughput of bulk requests.
+ * @param bulkDeadlineUs deadline of each disk_read and disk_write, 0 (default) for none. Misses are counted.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_SetIOScheduler(uint32_t chunkBytes, uint32_t bulkDeadlineUs)
+{
+	USB_IOSCHED_SetConfig(chunkBytes, bulkDeadlineUs);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function queues an urgent sector read or write, it may be called from an interrupt. The request is
+ * 				served between the commands of a running FatFs read or write or by USB_ServeUrgentIO. m_State is
+ * 				USB_IO_DONE and m_Callback is called when it completed. The request must stay valid until then.
+ * @param request lun, direction, first sector, count, 4 byte aligned buffer and deadline relative to the submission.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_BUSY if the queue is full.
+ */
+USB_ERROR USB_SubmitUrgentIO(USB_IO_REQUEST *request)
+{
+	if(!request || !request->m_Buffer || request->m_Count == 0 || request->m_Lun >= MAX_SUPPORTED_LUN
+			|| ((uint32_t)(uintptr_t)request->m_Buffer & 3))
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(request->m_State == USB_IO_QUEUED || request->m_State == USB_IO_ACTIVE)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+	if(!USB_IOSCHED_Submit(request))
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function serves the queued urgent requests. Call it from the main loop when no file is read or
+ * 				written, e.g. between two USB_WriteData calls.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_ServeUrgentIO()
+{
+	USB_IOSCHED_Poll(&hUSBHost);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the counters of the I/O scheduler per priority class.
+ * @param stats Output: requests, failures, deadline misses, latencies and the last missed deadline.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_GetIOSchedulerStats(USB_IOSCHED_STATS *stats)
+{
+	if(!stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_IOSCHED_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the counters of the I/O scheduler, e.g. before a measurement.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_ResetIOSchedulerStats()
+{
+	USB_IOSCHED_ResetStats();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function enables the fast attach mode, see usb_attach.h. The fixed delays of the host library
+ * 				are replaced by the minimum times of the USB specification and the descriptors and LUN info of
+ * 				known devices are taken from a cache. Call it before USB_InitConnection or before a device is attached.
+ * @param enable TRUE to enable the fast attach mode.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_SetFastAttach(BOOL enable)
+{
+	USB_ATTACH_SetFast(enable);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the time to ready of the last attach, from the connect event to the
+ * 				active MSC class, split into its phases.
+ * @param stats Output: durations of the last attach, number of attaches and cache hits.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetAttachStats(USB_ATTACH_STATS *stats)
+{
+	if(!stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_ATTACH_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the counters of the recovery of failed read and write commands, see usb_recovery.h.
+ * 				Transient errors are resolved by sending the command again, by the reset recovery of the BOT
+ * 				specification or by a port reset instead of a re-enumeration.
+ * @param stats Output: steps of the recovery ladder, recovered and failed commands, recovery times.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetRecoveryStats(USB_RECOVERY_STATS *stats)
+{
+	if(!stats)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_RECOVERY_GetStats(stats);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function clears the counters of the recovery of failed read and write commands.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_ResetRecoveryStats()
+{
+	USB_RECOVERY_ResetStats();
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function returns the ready state of a logical unit, see usb_unit.h. The state is tracked from the
+ * 				results of the commands, disk_status does not send TEST UNIT READY.
+ * @param lun logical unit number.
+ * @param info Output: state, last sense data, media changes, status queries and polls of the unit.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetUnitInfo(uint8_t lun, USB_UNIT_INFO *info)
+{
+	if(!info || lun >= MAX_SUPPORTED_LUN)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	USB_UNIT_GetInfo(lun, info);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Internal function which builds the cluster link map of the opened file in the arena of the handle.
+ * 				If the file has more fragments than fit into USB_LINKMAP_SIZE, fast seek is disabled
+ * 				for this handle and f_lseek follows the FAT chain as usual.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+static USB_ERROR USB_BuildLinkMap(USB_MS_Handle* usbHandle)
+{
+	FIL *file = (FIL*)usbHandle->m_FileHandle;
+
+	usbHandle->m_LinkMap[0] = USB_LINKMAP_SIZE;
+	file->cltbl = (DWORD*)usbHandle->m_LinkMap;
+	FRESULT res = f_lseek(file, CREATE_LINKMAP);
+	if(res == FR_OK)
+	{
+		usbHandle->m_LinkMapState = USB_LINKMAP_VALID;
+		usbHandle->m_SeekStats.m_LinkMapBuilds++;
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+
+	file->cltbl = 0;
+	if(res == FR_NOT_ENOUGH_CORE)
+	{
+		usbHandle->m_LinkMapState = USB_LINKMAP_OVERFLOW;
+		usbHandle->m_SeekStats.m_LinkMapOverflows++;
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+	usbHandle->m_LinkMapState = USB_LINKMAP_DISABLED;
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(res), __LINE__};
+}
+
+/**
+ * @brief Internal function which detaches a valid link map before the cluster chain of the file changes.
+ * 				The link map is rebuilt on the next call of USB_Seek.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * */
+static void USB_DetachLinkMap(USB_MS_Handle* usbHandle)
+{
+	if(usbHandle->m_LinkMapState != USB_LINKMAP_VALID)
+		return;
+
+	((FIL*)usbHandle->m_FileHandle)->cltbl = 0;
+	usbHandle->m_LinkMapState = USB_LINKMAP_STALE;
+}
+
+/**
+ * @brief Internal function which derives the cluster size of USB_FormatDrive from the alignment of GET_OPTIMAL_TRANSFER.
+ * 				FatFs writes at most one cluster per command, smaller clusters would split every write below the
+ * 				flash page of the device. Volumes with too few clusters for FAT32 fall back to FAT12/FAT16.
+ * @param opt FatFs format option, FAT volumes are limited to 128 sectors per cluster.
+ * @return cluster size in bytes, 0 if the device reports no alignment.
+ * */
+static uint32_t USB_GetDefaultClusterSize(BYTE opt)
+{
+	DWORD transfer[2];
+	WORD sectorSize;
+
+	if(disk_ioctl(0, GET_OPTIMAL_TRANSFER, transfer) != RES_OK || disk_ioctl(0, GET_SECTOR_SIZE, &sectorSize) != RES_OK)
+		return 0;
+
+	// Largest power of two which divides the alignment
+	uint32_t sectors = transfer[1] & (~transfer[1] + 1);
+	if(opt != FM_EXFAT && sectors > 128)
+		sectors = 128;
+	return (sectors > 1) ? sectors * sectorSize : 0;
+}
+
+/**
+ * @brief This function returns the size of an opened file.
+ * @param usbHandle handle to read and write data to the USB mass storage device.
+ * @param size Output: file size in bytes.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * */
+USB_ERROR USB_GetFileSize(USB_MS_Handle* usbHandle, uint64_t *size)
+{
+	if(!usbHandle || !size)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
+	*size = (uint64_t)f_size((FIL*)usbHandle->m_FileHandle);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
 /**
  * @brief This function reads data from a file, previously opened by the USB_OpenFile function.
  * @param usbHandle handle to read and write data to the USB mass storage device.
@@ -236,8 +1134,14 @@ USB_ERROR USB_SetLastBufferPos(USB_MS_Handle* usbHandle)
  * */
 USB_ERROR USB_ReadData(USB_MS_Handle* usbHandle, uint8_t *buffer, uint32_t *len)
 {
+	if(!usbHandle || !len)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(!usbHandle->m_Open)
+		return (USB_ERROR) {USB_INTERFACE_CLOSED, __LINE__};
+
 	uint32_t maxLen = *len;
-	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_read((FIL*)usbHandle->m_FileHandle, buffer, maxLen, (void *)maxLen)), __LINE__ };
+	return (USB_ERROR) {USB_MAP_ErrCodeFileHandling(f_read((FIL*)usbHandle->m_FileHandle, buffer, maxLen, (void *)len)), __LINE__ };
 }
 
 /**
@@ -300,6 +1204,10 @@ void USB_StateCallback(USBH_HandleTypeDef *phost, uint8_t id)
 	case HOST_USER_DISCONNECTION:
 		usbHandle->m_USBState = USB_IDLE;
 		USB_CloseFile(usbHandle);
+		USB_TUNING_Detach();
+		USB_TRIM_Detach();
+		USB_CACHE_Detach();
+		USB_IOSCHED_Detach();
 		break;
 	case HOST_USER_CLASS_ACTIVE:
 		usbHandle->m_USBState = USB_START;break;
@@ -387,6 +1295,10 @@ USB_ERROR_CODE USB_MAP_ErrCodeFileHandling(int errCode)
 		return USB_NOT_ENOUGH_CORE;
 	case FR_TOO_MANY_OPEN_FILES:
 		return USB_TO_MANY_OPEN_FILES;
+	case FR_MKFS_ABORTED:
+		return USB_MKFS_ABORTED;
+	case FR_INVALID_PARAMETER:
+		return USB_PARAM_ERROR;
 	default:
 		return USB_UNKNOWN_ERROR;
 	}
@@ -479,6 +1391,18 @@ const char* USB_ReturnErrorCodeStr(USB_ERROR err)
 	case USB_TO_MANY_OPEN_FILES:
 		sprintf(errorBuffer, "Line %d: %s\n", err.m_Line, "TO_MANY_OPEN_FILES");
 		break;
+	case USB_MKFS_ABORTED:
+		sprintf(errorBuffer, "Line %d: %s\n", err.m_Line, "MKFS_ABORTED");
+		break;
+	case USB_LOG_FULL:
+		sprintf(errorBuffer, "Line %d: %s\n", err.m_Line, "LOG_FULL");
+		break;
+	case USB_LOG_INVALID:
+		sprintf(errorBuffer, "Line %d: %s\n", err.m_Line, "LOG_INVALID");
+		break;
+	case USB_LOG_END:
+		sprintf(errorBuffer, "Line %d: %s\n", err.m_Line, "LOG_END");
+		break;
 	default:
 		return "UNKNOWN ERROR";
 	}
@@ -0,0 +1,295 @@
+/*
+ * usb_iosched.c
+ *
+ *  I/O scheduler with bulk and urgent requests, see usb_iosched.h.
+ */
+
+#include "usb_iosched.h"
+#include "usb_time_measurement.h"
+#include "usb_tuning.h"
+#include "usb_trim.h"
+#include "usb_cache.h"
+#include "usbh_msc.h"
+#include <string.h>
+
+#ifndef USB_HOST_SIM
+#include "stm32f4xx.h"
+#endif /* USB_HOST_SIM */
+
+static USB_IO_REQUEST *volatile urgentQueue[USB_IOSCHED_QUEUE_SIZE];	/* Unordered, NULL for free slots */
+static volatile uint32_t urgentQueued = 0;
+static uint32_t chunkBytes = 0;			/* Largest command of bulk requests, 0 does not split them */
+static uint32_t bulkDeadlineUs = 0;
+static BOOL bulkActive = FALSE;
+static uint32_t bulkChunks = 0;			/* Commands of the running bulk request */
+static uint32_t bulkSector = 0;
+static uint64_t bulkStartUs = 0;
+static BOOL serving = FALSE;
+static USB_IOSCHED_STATS schedStats;
+
+/** Internally defined **/
+static USB_IO_REQUEST *USB_IOSCHED_Next();
+static void USB_IOSCHED_Execute(USBH_HandleTypeDef *phost, USB_IO_REQUEST *request);
+static void USB_IOSCHED_Complete(USB_IO_REQUEST *request, BOOL success);
+static void USB_IOSCHED_Account(USB_IO_CLASS ioClass, uint32_t sector, uint32_t latencyUs, uint32_t deadlineUs, BOOL success);
+
+/** Helper functions **/
+static uint32_t USB_IOSCHED_Lock();
+static void USB_IOSCHED_Unlock(uint32_t primask);
+
+
+/**
+ * @brief Called at the start of disk_read and disk_write.
+ * @param sector first sector of the request, reported with a missed deadline.
+ */
+void USB_IOSCHED_BulkBegin(uint32_t sector)
+{
+	bulkActive = TRUE;
+	bulkChunks = 0;
+	bulkSector = sector;
+	bulkStartUs = USB_GetTimeUs();
+}
+
+/**
+ * @brief Called at the end of disk_read and disk_write, checks the deadline of the bulk request.
+ */
+void USB_IOSCHED_BulkEnd(BOOL success)
+{
+	bulkActive = FALSE;
+	USB_IOSCHED_Account(USB_IO_BULK, bulkSector, (uint32_t)(USB_GetTimeUs() - bulkStartUs), bulkDeadlineUs, success);
+}
+
+/**
+ * @brief Limits a command of a bulk request to the chunk size.
+ * @param blockSize block size of the unit.
+ * @param sectors sectors of the command, e.g. of USB_TUNING_ChunkSectors.
+ * @return sectors of the command, at least one.
+ */
+uint32_t USB_IOSCHED_ChunkSectors(uint32_t blockSize, uint32_t sectors)
+{
+	if(chunkBytes == 0 || blockSize == 0)
+		return sectors;
+	uint32_t maxSectors = (chunkBytes > blockSize) ? chunkBytes / blockSize : 1;
+	return (sectors > maxSectors) ? maxSectors : sectors;
+}
+
+/**
+ * @brief Called before each command of a bulk request, serves the queued urgent requests.
+ */
+void USB_IOSCHED_Yield(USBH_HandleTypeDef *phost)
+{
+	if(urgentQueued > 0)
+		USB_IOSCHED_Poll(phost);
+	if(bulkActive)
+		bulkChunks++;
+}
+
+/**
+ * @brief Queues an urgent request. May be called from an interrupt, the request is executed by the scheduler.
+ * @param request request with lun, direction, sectors, buffer, deadline and callback.
+ * @return FALSE if the queue is full.
+ */
+BOOL USB_IOSCHED_Submit(USB_IO_REQUEST *request)
+{
+	BOOL queued = FALSE;
+
+	request->m_Success = FALSE;
+	request->m_DeadlineMissed = FALSE;
+	request->m_LatencyUs = 0;
+	request->m_SubmitUs = USB_GetTimeUs();
+
+	uint32_t primask = USB_IOSCHED_Lock();
+	for(uint32_t i = 0; i < USB_IOSCHED_QUEUE_SIZE && !queued; i++)
+	{
+		if(urgentQueue[i] == NULL)
+		{
+			request->m_State = USB_IO_QUEUED;
+			urgentQueue[i] = request;
+			urgentQueued++;
+			queued = TRUE;
+		}
+	}
+	if(!queued)
+		schedStats.m_Rejected++;
+	USB_IOSCHED_Unlock(primask);
+	return queued;
+}
+
+/**
+ * @brief Serves all queued urgent requests, earliest deadline first. Called between the commands of bulk
+ * 		  requests and by the application when no file system function is running.
+ */
+void USB_IOSCHED_Poll(USBH_HandleTypeDef *phost)
+{
+	USB_IO_REQUEST *request;
+
+	if(serving)
+		return;
+	serving = TRUE;
+	while((request = USB_IOSCHED_Next()) != NULL)
+	{
+		if(bulkActive && bulkChunks > 0)
+			schedStats.m_Preemptions++;
+		USB_IOSCHED_Execute(phost, request);
+	}
+	serving = FALSE;
+}
+
+/**
+ * @brief Sets the chunk size of bulk requests and their deadline.
+ * @param chunk largest command of bulk requests in bytes, 0 does not split them.
+ * @param deadlineUs deadline of each disk_read and disk_write, 0 for none.
+ */
+void USB_IOSCHED_SetConfig(uint32_t chunk, uint32_t deadlineUs)
+{
+	chunkBytes = chunk;
+	bulkDeadlineUs = deadlineUs;
+}
+
+/**
+ * @brief Called when the device was detached, the queued urgent requests fail.
+ */
+void USB_IOSCHED_Detach()
+{
+	USB_IO_REQUEST *request;
+	while((request = USB_IOSCHED_Next()) != NULL)
+		USB_IOSCHED_Complete(request, FALSE);
+}
+
+void USB_IOSCHED_GetStats(USB_IOSCHED_STATS *stats)
+{
+	*stats = schedStats;
+}
+
+void USB_IOSCHED_ResetStats()
+{
+	memset(&schedStats, 0x00, sizeof(schedStats));
+}
+
+/**
+ * @brief Removes the queued request with the earliest deadline, requests without deadline after all others.
+ * @return NULL if the queue is empty.
+ */
+static USB_IO_REQUEST *USB_IOSCHED_Next()
+{
+	USB_IO_REQUEST *next = NULL;
+	uint64_t nextDeadline = 0;
+	uint32_t slot = 0;
+
+	uint32_t primask = USB_IOSCHED_Lock();
+	for(uint32_t i = 0; i < USB_IOSCHED_QUEUE_SIZE; i++)
+	{
+		USB_IO_REQUEST *request = urgentQueue[i];
+		if(!request)
+			continue;
+		uint64_t deadline = request->m_DeadlineUs ? request->m_SubmitUs + request->m_DeadlineUs : UINT64_MAX;
+		if(!next || deadline < nextDeadline || (deadline == nextDeadline && request->m_SubmitUs < next->m_SubmitUs))
+		{
+			next = request;
+			nextDeadline = deadline;
+			slot = i;
+		}
+	}
+	if(next)
+	{
+		urgentQueue[slot] = NULL;
+		urgentQueued--;
+		next->m_State = USB_IO_ACTIVE;
+	}
+	USB_IOSCHED_Unlock(primask);
+	return next;
+}
+
+/**
+ * @brief Reads or writes the sectors of an urgent request with the commands of the transfer tuning.
+ */
+static void USB_IOSCHED_Execute(USBH_HandleTypeDef *phost, USB_IO_REQUEST *request)
+{
+	USBH_StatusTypeDef status = USBH_OK;
+	uint32_t blockSize = USBH_MSC_GetBlockSize(phost, request->m_Lun);
+	uint32_t sector = request->m_Sector;
+	uint32_t count = request->m_Count;
+	uint8_t *buffer = request->m_Buffer;
+
+	if(blockSize == 0)
+		status = USBH_FAIL;
+	else if(request->m_Write)
+	{
+		// Same bookkeeping as USBH_write, the data is flushed at the next CTRL_SYNC
+		USB_TRIM_Write(phost, request->m_Lun, sector, count);
+		USB_CACHE_Write(phost, request->m_Lun, buffer);
+	}
+
+	while(count > 0 && status == USBH_OK)
+	{
+		uint32_t chunk = USB_TUNING_ChunkSectors(sector, count);
+		status = request->m_Write ? USBH_MSC_Write(phost, request->m_Lun, sector, buffer, chunk)
+				: USBH_MSC_Read(phost, request->m_Lun, sector, buffer, chunk);
+		sector += chunk;
+		buffer += chunk * blockSize;
+		count -= chunk;
+	}
+	USB_IOSCHED_Complete(request, status == USBH_OK);
+}
+
+/**
+ * @brief Sets the result of an urgent request and calls its callback.
+ */
+static void USB_IOSCHED_Complete(USB_IO_REQUEST *request, BOOL success)
+{
+	request->m_LatencyUs = (uint32_t)(USB_GetTimeUs() - request->m_SubmitUs);
+	request->m_Success = success;
+	request->m_DeadlineMissed = request->m_DeadlineUs && request->m_LatencyUs > request->m_DeadlineUs;
+	USB_IOSCHED_Account(USB_IO_URGENT, request->m_Sector, request->m_LatencyUs, request->m_DeadlineUs, success);
+	request->m_State = USB_IO_DONE;
+	if(request->m_Callback)
+		request->m_Callback(request->m_Context);
+}
+
+/**
+ * @brief Counts a completed request of a class and reports a missed deadline.
+ */
+static void USB_IOSCHED_Account(USB_IO_CLASS ioClass, uint32_t sector, uint32_t latencyUs, uint32_t deadlineUs, BOOL success)
+{
+	schedStats.m_Requests[ioClass]++;
+	if(!success)
+		schedStats.m_Failed[ioClass]++;
+	if(latencyUs > schedStats.m_MaxLatencyUs[ioClass])
+		schedStats.m_MaxLatencyUs[ioClass] = latencyUs;
+	if(ioClass == USB_IO_BULK)
+		schedStats.m_BulkChunks += bulkChunks;
+	if(deadlineUs == 0 || latencyUs <= deadlineUs)
+		return;
+
+	uint32_t lateUs = latencyUs - deadlineUs;
+	schedStats.m_DeadlineMisses[ioClass]++;
+	if(lateUs > schedStats.m_MaxLateUs[ioClass])
+		schedStats.m_MaxLateUs[ioClass] = lateUs;
+	schedStats.m_LastMissClass = ioClass;
+	schedStats.m_LastMissSector = sector;
+	schedStats.m_LastMissLateUs = lateUs;
+}
+
+/**
+ * @brief Masks the interrupts, urgent requests may be queued by an interrupt.
+ * @return previous PRIMASK.
+ */
+static uint32_t USB_IOSCHED_Lock()
+{
+#ifdef USB_HOST_SIM
+	return 0;
+#else
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+#endif /* USB_HOST_SIM */
+}
+
+static void USB_IOSCHED_Unlock(uint32_t primask)
+{
+#ifndef USB_HOST_SIM
+	__set_PRIMASK(primask);
+#else
+	(void)primask;
+#endif /* USB_HOST_SIM */
+}
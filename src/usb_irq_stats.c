@@ -0,0 +1,61 @@
+/*
+ * usb_irq_stats.c
+ *
+ *  Interrupt time accounting of the host controller, see usb_irq_stats.h.
+ */
+
+#include "usb_irq_stats.h"
+#include "usb_time_measurement.h"
+#include <string.h>
+
+#ifndef USB_HOST_SIM
+#include "stm32f4xx.h"
+#endif /* USB_HOST_SIM */
+
+#if USB_IRQ_STATS_ENABLE
+volatile USB_IRQ_STATS usbIrqStats;
+static uint64_t irqStatsStart = 0;		/* USB_GetCycles at the last reset */
+#endif /* USB_IRQ_STATS_ENABLE */
+
+
+/**
+ * @brief Copies the interrupt statistics and calculates the cycles elapsed since the last reset. The interrupts
+ * 		  are masked while copying. All values are 0 if USB_IRQ_STATS_ENABLE is disabled.
+ * @param stats returns the copy.
+ */
+void USB_IRQ_GetStats(USB_IRQ_STATS *stats)
+{
+#if USB_IRQ_STATS_ENABLE
+#ifndef USB_HOST_SIM
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+#endif /* USB_HOST_SIM */
+	*stats = *(USB_IRQ_STATS*)&usbIrqStats;
+#ifndef USB_HOST_SIM
+	__set_PRIMASK(primask);
+#endif /* USB_HOST_SIM */
+	stats->m_ElapsedCycles = USB_GetCycles() - irqStatsStart;
+#else
+	memset(stats, 0x00, sizeof(USB_IRQ_STATS));
+#endif /* USB_IRQ_STATS_ENABLE */
+}
+
+/**
+ * @brief Clears the statistics of all sources and restarts the elapsed time. Enables the DWT cycle counter
+ * 		  read by the interrupt handlers.
+ */
+void USB_IRQ_Reset()
+{
+#if USB_IRQ_STATS_ENABLE
+	USB_InitTimeBase();
+#ifndef USB_HOST_SIM
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+#endif /* USB_HOST_SIM */
+	memset((void*)&usbIrqStats, 0x00, sizeof(usbIrqStats));
+	irqStatsStart = USB_GetCycles();
+#ifndef USB_HOST_SIM
+	__set_PRIMASK(primask);
+#endif /* USB_HOST_SIM */
+#endif /* USB_IRQ_STATS_ENABLE */
+}
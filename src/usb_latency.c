@@ -0,0 +1,176 @@
+/*
+ * usb_latency.c
+ *
+ *  Latency histograms of the MSC read and write commands, see usb_latency.h.
+ */
+
+#include "usb_latency.h"
+#include <string.h>
+
+#if USB_LATENCY_SIZE_CLASSES < 1 || USB_LATENCY_SIZE_CLASSES > 4 || USB_LATENCY_MAX_EXPONENT > 31 || USB_LATENCY_SUB_BUCKET_BITS > USB_LATENCY_MAX_EXPONENT
+#error "Invalid latency histogram configuration"
+#endif
+
+static USB_LATENCY_HISTOGRAM latencyHistograms[USB_LATENCY_MAX_LUN][2][USB_LATENCY_SIZE_CLASSES];
+
+/** Helper functions **/
+static uint32_t USB_LATENCY_BucketIndex(uint32_t us);
+static uint32_t USB_LATENCY_BucketUpperBound(uint32_t index);
+
+
+/**
+ * @brief Adds a command to the histogram of its LUN, direction and size class.
+ * @param lun logical unit of the command.
+ * @param dir USB_LATENCY_READ or USB_LATENCY_WRITE.
+ * @param sectors number of transferred sectors.
+ * @param us duration of the command.
+ * @param success FALSE only increments the failure counter.
+ */
+void USB_LATENCY_Record(uint8_t lun, USB_LATENCY_DIR dir, uint32_t sectors, uint32_t us, BOOL success)
+{
+	if(lun >= USB_LATENCY_MAX_LUN)
+		return;
+
+	USB_LATENCY_HISTOGRAM *hist = &latencyHistograms[lun][dir][USB_LATENCY_SizeClass(sectors)];
+	if(!success)
+	{
+		hist->m_Failed++;
+		return;
+	}
+
+	if(hist->m_Count == 0 || us < hist->m_MinUs)
+		hist->m_MinUs = us;
+	if(us > hist->m_MaxUs)
+		hist->m_MaxUs = us;
+	hist->m_Count++;
+	hist->m_SumUs += us;
+	hist->m_Sectors += sectors;
+	hist->m_Buckets[USB_LATENCY_BucketIndex(us)]++;
+}
+
+/**
+ * @brief Copies a histogram.
+ * @param lun logical unit.
+ * @param dir USB_LATENCY_READ or USB_LATENCY_WRITE.
+ * @param sizeClass size class, see USB_LATENCY_SizeClass, or USB_LATENCY_ALL_SIZES to merge all size classes.
+ * @param hist returns the copy.
+ * @return FALSE if a parameter is out of range.
+ */
+BOOL USB_LATENCY_Get(uint8_t lun, USB_LATENCY_DIR dir, uint8_t sizeClass, USB_LATENCY_HISTOGRAM *hist)
+{
+	if(!hist || lun >= USB_LATENCY_MAX_LUN || (dir != USB_LATENCY_READ && dir != USB_LATENCY_WRITE))
+		return FALSE;
+	if(sizeClass != USB_LATENCY_ALL_SIZES)
+	{
+		if(sizeClass >= USB_LATENCY_SIZE_CLASSES)
+			return FALSE;
+		*hist = latencyHistograms[lun][dir][sizeClass];
+		return TRUE;
+	}
+
+	memset(hist, 0x00, sizeof(USB_LATENCY_HISTOGRAM));
+	for(uint32_t c = 0; c < USB_LATENCY_SIZE_CLASSES; c++)
+	{
+		const USB_LATENCY_HISTOGRAM *src = &latencyHistograms[lun][dir][c];
+		if(src->m_Count > 0 && (hist->m_Count == 0 || src->m_MinUs < hist->m_MinUs))
+			hist->m_MinUs = src->m_MinUs;
+		if(src->m_MaxUs > hist->m_MaxUs)
+			hist->m_MaxUs = src->m_MaxUs;
+		hist->m_Count += src->m_Count;
+		hist->m_Failed += src->m_Failed;
+		hist->m_SumUs += src->m_SumUs;
+		hist->m_Sectors += src->m_Sectors;
+		for(uint32_t i = 0; i < USB_LATENCY_BUCKETS; i++)
+			hist->m_Buckets[i] += src->m_Buckets[i];
+	}
+	return TRUE;
+}
+
+void USB_LATENCY_Reset()
+{
+	memset(latencyHistograms, 0x00, sizeof(latencyHistograms));
+}
+
+/**
+ * @brief Calculates a percentile of a histogram. The result is the upper bound of the bucket which contains
+ * 		  the percentile, limited to the maximum latency.
+ * @param hist histogram.
+ * @param percentile 0 to 100.
+ * @return Latency in us, 0 if the histogram is empty.
+ */
+uint32_t USB_LATENCY_Percentile(const USB_LATENCY_HISTOGRAM *hist, float percentile)
+{
+	if(!hist || hist->m_Count == 0)
+		return 0;
+	if(percentile < 0.0f)
+		percentile = 0.0f;
+	if(percentile > 100.0f)
+		percentile = 100.0f;
+
+	uint32_t rank = (uint32_t)((float)hist->m_Count * percentile / 100.0f + 0.5f);
+	if(rank == 0)
+		rank = 1;
+	if(rank > hist->m_Count)
+		rank = hist->m_Count;
+
+	uint32_t seen = 0;
+	for(uint32_t i = 0; i < USB_LATENCY_BUCKETS; i++)
+	{
+		seen += hist->m_Buckets[i];
+		if(seen >= rank)
+		{
+			uint32_t upper = USB_LATENCY_BucketUpperBound(i);
+			if(upper > hist->m_MaxUs)
+				upper = hist->m_MaxUs;
+			if(upper < hist->m_MinUs)
+				upper = hist->m_MinUs;
+			return upper;
+		}
+	}
+	return hist->m_MaxUs;
+}
+
+/**
+ * @brief Returns the size class of a transfer: 0 for 1 sector, 1 for 2-8, 2 for 9-64 and 3 for more sectors,
+ * 		  limited to USB_LATENCY_SIZE_CLASSES - 1.
+ */
+uint8_t USB_LATENCY_SizeClass(uint32_t sectors)
+{
+	uint32_t sizeClass = 0;
+	if(sectors > 1)
+		sizeClass = (31 - __builtin_clz(sectors - 1)) / 3 + 1;
+	if(sizeClass >= USB_LATENCY_SIZE_CLASSES)
+		sizeClass = USB_LATENCY_SIZE_CLASSES - 1;
+	return (uint8_t)sizeClass;
+}
+
+/**
+ * @brief Maps a latency to its bucket. Values below 2^USB_LATENCY_SUB_BUCKET_BITS have their own bucket,
+ * 		  each higher power of 2 is split into 2^USB_LATENCY_SUB_BUCKET_BITS buckets of equal width.
+ */
+static uint32_t USB_LATENCY_BucketIndex(uint32_t us)
+{
+	if(us < (1U << USB_LATENCY_SUB_BUCKET_BITS))
+		return us;
+
+	uint32_t exponent = 31 - __builtin_clz(us);
+	if(exponent > USB_LATENCY_MAX_EXPONENT)
+		return USB_LATENCY_BUCKETS - 1;
+	uint32_t shift = exponent - USB_LATENCY_SUB_BUCKET_BITS;
+	return ((shift + 1) << USB_LATENCY_SUB_BUCKET_BITS) + (us >> shift) - (1U << USB_LATENCY_SUB_BUCKET_BITS);
+}
+
+/**
+ * @brief Returns the largest latency in us which is mapped to a bucket.
+ */
+static uint32_t USB_LATENCY_BucketUpperBound(uint32_t index)
+{
+	if(index < (1U << USB_LATENCY_SUB_BUCKET_BITS))
+		return index;
+	if(index >= USB_LATENCY_BUCKETS - 1)
+		return 0xFFFFFFFF;
+
+	uint32_t shift = (index >> USB_LATENCY_SUB_BUCKET_BITS) - 1;
+	uint32_t lower = ((1U << USB_LATENCY_SUB_BUCKET_BITS) + (index & ((1U << USB_LATENCY_SUB_BUCKET_BITS) - 1))) << shift;
+	return lower + (1U << shift) - 1;
+}
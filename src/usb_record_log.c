@@ -0,0 +1,560 @@
+/*
+ * usb_record_log.c
+ *
+ *  Append-only record log on top of a preallocated file.
+ *
+ *  File layout (all blocks USB_LOG_BLOCK_SIZE bytes):
+ *  	block 0:	log header (magic, geometry, session id, CRC)
+ *  	block 1..n:	data blocks. Each data block starts with a block header (magic, session id,
+ *  				block index, CRC) followed by records (type, length, sequence number, CRC, payload).
+ *  				Every USB_LOG_CHECKPOINT_INTERVAL-th data block starts with a checkpoint record.
+ *
+ *  The file size is set once by USB_LOG_Create, afterwards only data sectors are written.
+ *  USB_LOG_Open locates the last valid checkpoint by binary search and scans forward until the
+ *  first record with a wrong sequence number or CRC. Everything before it reached the media.
+ */
+
+#include "usb_record_log.h"
+#include "usb_handler.h"
+#include "usb_time_measurement.h"
+#include <string.h>
+
+#define USB_LOG_HEADER_MAGIC	0x474F4C55	/* "ULOG" */
+#define USB_LOG_BLOCK_MAGIC		0x4B4C4255	/* "UBLK" */
+#define USB_LOG_VERSION			1
+#define USB_LOG_HEADER_SIZE		28
+
+#define USB_LOG_RECORD_SIZE(len)	((USB_LOG_RECORD_HEADER_SIZE + (len) + 3) & ~3UL)
+#define USB_LOG_BLOCK_OFFSET(idx)	((uint64_t)((idx) + 1) * USB_LOG_BLOCK_SIZE)
+
+/** Internally defined **/
+static USB_ERROR USB_LOG_WriteAt(USB_LOG_Handle *log, uint64_t offset, uint8_t *data, uint32_t len);
+static USB_ERROR USB_LOG_ReadAt(USB_LOG_Handle *log, uint64_t offset, uint8_t *data, uint32_t len);
+static USB_ERROR USB_LOG_ReadHeader(USB_LOG_Handle *log, uint32_t *blockCount, uint32_t *session);
+static void USB_LOG_StartBlock(USB_LOG_Handle *log, uint32_t blockIndex);
+static void USB_LOG_PutRecord(USB_LOG_Handle *log, uint16_t type, const uint8_t *data, uint32_t len);
+static BOOL USB_LOG_LoadBlock(USB_LOG_Handle *log, uint32_t blockIndex);
+static BOOL USB_LOG_LoadCheckpoint(USB_LOG_Handle *log, uint32_t blockIndex, uint32_t *seq);
+static uint32_t USB_LOG_ScanBlock(USB_LOG_Handle *log, uint32_t *nextSeq, uint64_t *payloadBytes);
+static USB_ERROR USB_LOG_Recover(USB_LOG_Handle *log);
+
+static void USB_LOG_Put16(uint8_t *dst, uint16_t val) { memcpy(dst, &val, sizeof(val)); }
+static void USB_LOG_Put32(uint8_t *dst, uint32_t val) { memcpy(dst, &val, sizeof(val)); }
+static uint16_t USB_LOG_Get16(const uint8_t *src) { uint16_t val; memcpy(&val, src, sizeof(val)); return val; }
+static uint32_t USB_LOG_Get32(const uint8_t *src) { uint32_t val; memcpy(&val, src, sizeof(val)); return val; }
+
+/**
+ * @brief This function creates a new log file, or replaces an existing one. The whole capacity is
+ * 				preallocated as one contiguous area, so appending never changes the FAT or the directory entry.
+ * @param log log handle to initialize.
+ * @param usbHandle handle to read and write data to the USB mass storage device. The handle is used exclusively by the log.
+ * @param fileName name of the log file.
+ * @param capacity size of the log file in bytes, rounded down to a multiple of USB_LOG_BLOCK_SIZE.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_LOG_Create(USB_LOG_Handle *log, USB_MS_Handle *usbHandle, const char *fileName, uint64_t capacity)
+{
+	if(!log || !usbHandle || !fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	uint64_t blocks = capacity / USB_LOG_BLOCK_SIZE;
+	if(blocks < 2 || blocks > 0xFFFFFFFF)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	memset(log, 0x00, sizeof(USB_LOG_Handle));
+	log->m_Handle = usbHandle;
+
+	// Use a new session id, stale blocks of a previous log at the same location are rejected by it
+	uint32_t session = USB_GetTimer();
+	if(USB_OpenFile(usbHandle, fileName, USB_READ | USB_OPEN_IF_EXISTS).m_ErrCode == USB_NO_ERROR)
+	{
+		uint32_t oldBlockCount, oldSession;
+		if(USB_LOG_ReadHeader(log, &oldBlockCount, &oldSession).m_ErrCode == USB_NO_ERROR)
+			session = oldSession + 1;
+		USB_CloseFile(usbHandle);
+	}
+
+	USB_ERROR ret = USB_OpenFile(usbHandle, fileName, USB_READ | USB_WRITE | USB_OVERWRITE | USB_FAST_SEEK);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	ret = USB_PreallocateFile(usbHandle, blocks * USB_LOG_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+	{
+		USB_CloseFile(usbHandle);
+		return ret;
+	}
+
+	log->m_Session = session;
+	log->m_BlockCount = (uint32_t)(blocks - 1);
+
+	// The header block is built in the block buffer, before the first data block is started
+	memset(log->m_Block, 0x00, USB_LOG_BLOCK_SIZE);
+	USB_LOG_Put32(&log->m_Block[0], USB_LOG_HEADER_MAGIC);
+	USB_LOG_Put32(&log->m_Block[4], USB_LOG_VERSION);
+	USB_LOG_Put32(&log->m_Block[8], USB_LOG_BLOCK_SIZE);
+	USB_LOG_Put32(&log->m_Block[12], log->m_BlockCount);
+	USB_LOG_Put32(&log->m_Block[16], USB_LOG_CHECKPOINT_INTERVAL);
+	USB_LOG_Put32(&log->m_Block[20], log->m_Session);
+	USB_LOG_Put32(&log->m_Block[24], USB_CalculateCRC32(0, log->m_Block, USB_LOG_HEADER_SIZE - 4));
+	ret = USB_LOG_WriteAt(log, 0, log->m_Block, USB_LOG_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+	{
+		USB_CloseFile(usbHandle);
+		return ret;
+	}
+
+	// The directory entry is written once here, appending does not change it anymore
+	ret = USB_Sync(usbHandle, TRUE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+	{
+		USB_CloseFile(usbHandle);
+		return ret;
+	}
+
+	USB_LOG_StartBlock(log, 0);
+	return USB_LOG_Flush(log);
+}
+
+/**
+ * @brief This function opens an existing log file and recovers its end. The last checkpoint is located by a
+ * 				binary search, afterwards the records are scanned until the first incomplete one.
+ * 				New records are appended behind the last valid record.
+ * @param log log handle to initialize.
+ * @param usbHandle handle to read and write data to the USB mass storage device. The handle is used exclusively by the log.
+ * @param fileName name of the log file.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_INVALID if the file does not contain a valid log header.
+ */
+USB_ERROR USB_LOG_Open(USB_LOG_Handle *log, USB_MS_Handle *usbHandle, const char *fileName)
+{
+	if(!log || !usbHandle || !fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	memset(log, 0x00, sizeof(USB_LOG_Handle));
+	log->m_Handle = usbHandle;
+
+	USB_ERROR ret = USB_OpenFile(usbHandle, fileName, USB_READ | USB_WRITE | USB_OPEN_IF_EXISTS | USB_FAST_SEEK);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint64_t fileSize;
+	ret = USB_LOG_ReadHeader(log, &log->m_BlockCount, &log->m_Session);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_GetFileSize(usbHandle, &fileSize);
+	if(ret.m_ErrCode == USB_NO_ERROR && fileSize < USB_LOG_BLOCK_OFFSET(log->m_BlockCount))
+		ret = (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_LOG_Recover(log);
+
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		USB_CloseFile(usbHandle);
+	return ret;
+}
+
+/**
+ * @brief This function appends a record to the log. The record is kept in RAM until its block is full
+ * 				or USB_LOG_Flush is called.
+ * @param log handle of an opened log.
+ * @param type application defined record type, 0x0000 and 0xFFFF are reserved.
+ * @param data payload of the record.
+ * @param len length of the payload, at most USB_LOG_MAX_RECORD_SIZE.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_FULL if the preallocated area is exhausted.
+ */
+USB_ERROR USB_LOG_Append(USB_LOG_Handle *log, uint16_t type, const uint8_t *data, uint32_t len)
+{
+	if(!log || !log->m_Handle || (!data && len) || len > USB_LOG_MAX_RECORD_SIZE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(type == 0x0000 || type == USB_LOG_RECORD_CHECKPOINT)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(log->m_BlockUsed + USB_LOG_RECORD_SIZE(len) > USB_LOG_BLOCK_SIZE)
+	{
+		if(log->m_BlockIndex + 1 >= log->m_BlockCount)
+			return (USB_ERROR) {USB_LOG_FULL, __LINE__};
+
+		USB_ERROR ret = USB_LOG_WriteAt(log, USB_LOG_BLOCK_OFFSET(log->m_BlockIndex), log->m_Block, USB_LOG_BLOCK_SIZE);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		USB_LOG_StartBlock(log, log->m_BlockIndex + 1);
+	}
+
+	USB_LOG_PutRecord(log, type, data, len);
+	log->m_PayloadBytes += len;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function writes the partially filled block to the media. No directory entry or FAT sector is written,
+ * 				after the function returns all appended records survive a power loss.
+ * @param log handle of an opened log.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_LOG_Flush(USB_LOG_Handle *log)
+{
+	if(!log || !log->m_Handle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	USB_ERROR ret = USB_LOG_WriteAt(log, USB_LOG_BLOCK_OFFSET(log->m_BlockIndex), log->m_Block, USB_LOG_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	return USB_Sync(log->m_Handle, FALSE);
+}
+
+/**
+ * @brief This function flushes the log and closes the log file.
+ * @param log handle of an opened log.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_LOG_Close(USB_LOG_Handle *log)
+{
+	USB_ERROR ret = USB_LOG_Flush(log);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	ret = USB_CloseFile(log->m_Handle);
+	log->m_Handle = 0;
+	return ret;
+}
+
+/**
+ * @brief This function sets a cursor to the first record of a log.
+ * @param cursor cursor to initialize.
+ */
+void USB_LOG_InitCursor(USB_LOG_Cursor *cursor)
+{
+	if(!cursor)
+		return;
+
+	cursor->m_BlockIndex = 0;
+	cursor->m_Offset = USB_LOG_BLOCK_HEADER_SIZE;
+}
+
+/**
+ * @brief This function reads the record at the cursor position and advances the cursor. Checkpoint records are skipped.
+ * @param log handle of an opened log.
+ * @param cursor read position, initialized by USB_LOG_InitCursor.
+ * @param type Output: type of the record.
+ * @param buffer location to copy the payload.
+ * @param len Input: size of the buffer, Output: length of the payload.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_END if all records were read, USB_NOT_ENOUGH_CORE if the buffer is too small (len contains the required size).
+ */
+USB_ERROR USB_LOG_ReadNext(USB_LOG_Handle *log, USB_LOG_Cursor *cursor, uint16_t *type, uint8_t *buffer, uint32_t *len)
+{
+	if(!log || !log->m_Handle || !cursor || !type || !len)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	for(;;)
+	{
+		if(cursor->m_BlockIndex > log->m_BlockIndex ||
+				(cursor->m_BlockIndex == log->m_BlockIndex && cursor->m_Offset >= log->m_BlockUsed))
+			return (USB_ERROR) {USB_LOG_END, __LINE__};
+
+		BOOL current = (cursor->m_BlockIndex == log->m_BlockIndex);
+		uint64_t offset = USB_LOG_BLOCK_OFFSET(cursor->m_BlockIndex) + cursor->m_Offset;
+		uint8_t header[USB_LOG_RECORD_HEADER_SIZE];
+		uint16_t recordType = 0x0000;
+		uint32_t recordLen = 0;
+
+		if(cursor->m_Offset + USB_LOG_RECORD_HEADER_SIZE <= USB_LOG_BLOCK_SIZE)
+		{
+			if(current)
+				memcpy(header, &log->m_Block[cursor->m_Offset], USB_LOG_RECORD_HEADER_SIZE);
+			else
+			{
+				USB_ERROR ret = USB_LOG_ReadAt(log, offset, header, USB_LOG_RECORD_HEADER_SIZE);
+				if(ret.m_ErrCode != USB_NO_ERROR)
+					return ret;
+			}
+			recordType = USB_LOG_Get16(&header[0]);
+			recordLen = USB_LOG_Get16(&header[2]);
+		}
+
+		// Zero padding at the end of a block
+		if(recordType == 0x0000)
+		{
+			cursor->m_BlockIndex++;
+			cursor->m_Offset = USB_LOG_BLOCK_HEADER_SIZE;
+			continue;
+		}
+
+		if(cursor->m_Offset + USB_LOG_RECORD_SIZE(recordLen) > USB_LOG_BLOCK_SIZE)
+			return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+
+		if(recordType == USB_LOG_RECORD_CHECKPOINT)
+		{
+			cursor->m_Offset += USB_LOG_RECORD_SIZE(recordLen);
+			continue;
+		}
+
+		if(recordLen > *len || (!buffer && recordLen))
+		{
+			*len = recordLen;
+			return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+		}
+
+		if(current)
+			memcpy(buffer, &log->m_Block[cursor->m_Offset + USB_LOG_RECORD_HEADER_SIZE], recordLen);
+		else if(recordLen)
+		{
+			USB_ERROR ret = USB_LOG_ReadAt(log, offset + USB_LOG_RECORD_HEADER_SIZE, buffer, recordLen);
+			if(ret.m_ErrCode != USB_NO_ERROR)
+				return ret;
+		}
+
+		uint32_t crc = USB_CalculateCRC32(USB_CalculateCRC32(0, header, 8), buffer, recordLen);
+		if(crc != USB_LOG_Get32(&header[8]))
+			return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+
+		cursor->m_Offset += USB_LOG_RECORD_SIZE(recordLen);
+		*type = recordType;
+		*len = recordLen;
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+}
+
+/**
+ * @brief This function calculates the CRC-32 (IEEE 802.3) of a buffer.
+ * @param crc CRC of the preceding data, 0 for the first buffer.
+ * @param data buffer to calculate the CRC of.
+ * @param len length of the buffer.
+ * @return CRC of the preceding data and the buffer.
+ */
+uint32_t USB_CalculateCRC32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	static const uint32_t crcTable[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+
+	crc = ~crc;
+	for(uint32_t i = 0; i < len; i++)
+	{
+		crc = crcTable[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+		crc = crcTable[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+	return ~crc;
+}
+
+/**
+ * @brief Internal function which writes a buffer at an absolute position of the log file.
+ */
+static USB_ERROR USB_LOG_WriteAt(USB_LOG_Handle *log, uint64_t offset, uint8_t *data, uint32_t len)
+{
+	USB_ERROR ret = USB_Seek(log->m_Handle, offset);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint32_t written = len;
+	ret = USB_WriteData(log->m_Handle, data, &written, FALSE);
+	if(ret.m_ErrCode == USB_NO_ERROR && written != len)
+		return (USB_ERROR) {USB_LOG_FULL, __LINE__};
+	return ret;
+}
+
+/**
+ * @brief Internal function which reads a buffer from an absolute position of the log file.
+ */
+static USB_ERROR USB_LOG_ReadAt(USB_LOG_Handle *log, uint64_t offset, uint8_t *data, uint32_t len)
+{
+	USB_ERROR ret = USB_Seek(log->m_Handle, offset);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint32_t read = len;
+	ret = USB_ReadData(log->m_Handle, data, &read);
+	if(ret.m_ErrCode == USB_NO_ERROR && read != len)
+		return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+	return ret;
+}
+
+/**
+ * @brief Internal function which reads and validates the log header of the opened file.
+ */
+static USB_ERROR USB_LOG_ReadHeader(USB_LOG_Handle *log, uint32_t *blockCount, uint32_t *session)
+{
+	uint8_t header[USB_LOG_HEADER_SIZE];
+	USB_ERROR ret = USB_LOG_ReadAt(log, 0, header, USB_LOG_HEADER_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	if(USB_LOG_Get32(&header[0]) != USB_LOG_HEADER_MAGIC ||
+			USB_LOG_Get32(&header[4]) != USB_LOG_VERSION ||
+			USB_LOG_Get32(&header[8]) != USB_LOG_BLOCK_SIZE ||
+			USB_LOG_Get32(&header[16]) != USB_LOG_CHECKPOINT_INTERVAL ||
+			USB_LOG_Get32(&header[24]) != USB_CalculateCRC32(0, header, USB_LOG_HEADER_SIZE - 4))
+		return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+
+	*blockCount = USB_LOG_Get32(&header[12]);
+	*session = USB_LOG_Get32(&header[20]);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Internal function which initializes the block buffer for a new block.
+ * 				Checkpoint blocks start with the current sequence number and amount of payload.
+ */
+static void USB_LOG_StartBlock(USB_LOG_Handle *log, uint32_t blockIndex)
+{
+	memset(log->m_Block, 0x00, USB_LOG_BLOCK_SIZE);
+	USB_LOG_Put32(&log->m_Block[0], USB_LOG_BLOCK_MAGIC);
+	USB_LOG_Put32(&log->m_Block[4], log->m_Session);
+	USB_LOG_Put32(&log->m_Block[8], blockIndex);
+	USB_LOG_Put32(&log->m_Block[12], USB_CalculateCRC32(0, log->m_Block, 12));
+	log->m_BlockIndex = blockIndex;
+	log->m_BlockUsed = USB_LOG_BLOCK_HEADER_SIZE;
+
+	if(blockIndex % USB_LOG_CHECKPOINT_INTERVAL == 0)
+	{
+		uint8_t checkpoint[USB_LOG_CHECKPOINT_SIZE - USB_LOG_RECORD_HEADER_SIZE];
+		USB_LOG_Put32(&checkpoint[0], blockIndex);
+		USB_LOG_Put32(&checkpoint[4], log->m_NextSeq);
+		memcpy(&checkpoint[8], &log->m_PayloadBytes, sizeof(uint64_t));
+		USB_LOG_PutRecord(log, USB_LOG_RECORD_CHECKPOINT, checkpoint, sizeof(checkpoint));
+	}
+}
+
+/**
+ * @brief Internal function which serializes a record into the block buffer. The caller checked that it fits.
+ */
+static void USB_LOG_PutRecord(USB_LOG_Handle *log, uint16_t type, const uint8_t *data, uint32_t len)
+{
+	uint8_t *record = &log->m_Block[log->m_BlockUsed];
+	USB_LOG_Put16(&record[0], type);
+	USB_LOG_Put16(&record[2], (uint16_t)len);
+	USB_LOG_Put32(&record[4], log->m_NextSeq++);
+	if(len)
+		memcpy(&record[USB_LOG_RECORD_HEADER_SIZE], data, len);
+	USB_LOG_Put32(&record[8], USB_CalculateCRC32(USB_CalculateCRC32(0, record, 8), data, len));
+	log->m_BlockUsed += USB_LOG_RECORD_SIZE(len);
+}
+
+/**
+ * @brief Internal function which reads a data block into the block buffer and validates its header.
+ * @return TRUE if the block belongs to the current session.
+ */
+static BOOL USB_LOG_LoadBlock(USB_LOG_Handle *log, uint32_t blockIndex)
+{
+	if(USB_LOG_ReadAt(log, USB_LOG_BLOCK_OFFSET(blockIndex), log->m_Block, USB_LOG_BLOCK_SIZE).m_ErrCode != USB_NO_ERROR)
+		return FALSE;
+
+	return USB_LOG_Get32(&log->m_Block[0]) == USB_LOG_BLOCK_MAGIC &&
+			USB_LOG_Get32(&log->m_Block[4]) == log->m_Session &&
+			USB_LOG_Get32(&log->m_Block[8]) == blockIndex &&
+			USB_LOG_Get32(&log->m_Block[12]) == USB_CalculateCRC32(0, log->m_Block, 12);
+}
+
+/**
+ * @brief Internal function which reads a checkpoint block into the block buffer and validates its checkpoint record.
+ * @param seq Output: sequence number of the checkpoint record.
+ * @return TRUE if the block and its checkpoint record are valid.
+ */
+static BOOL USB_LOG_LoadCheckpoint(USB_LOG_Handle *log, uint32_t blockIndex, uint32_t *seq)
+{
+	if(!USB_LOG_LoadBlock(log, blockIndex))
+		return FALSE;
+
+	uint8_t *record = &log->m_Block[USB_LOG_BLOCK_HEADER_SIZE];
+	uint32_t len = USB_LOG_CHECKPOINT_SIZE - USB_LOG_RECORD_HEADER_SIZE;
+	if(USB_LOG_Get16(&record[0]) != USB_LOG_RECORD_CHECKPOINT || USB_LOG_Get16(&record[2]) != len)
+		return FALSE;
+	if(USB_LOG_Get32(&record[8]) != USB_CalculateCRC32(USB_CalculateCRC32(0, record, 8), &record[USB_LOG_RECORD_HEADER_SIZE], len))
+		return FALSE;
+
+	*seq = USB_LOG_Get32(&record[4]);
+	return TRUE;
+}
+
+/**
+ * @brief Internal function which validates the records of the block in the block buffer.
+ * @param nextSeq Input: expected sequence number of the first record, Output: sequence number after the last valid record.
+ * @param payloadBytes Input/Output: amount of payload, taken over from a checkpoint record.
+ * @return offset behind the last valid record.
+ */
+static uint32_t USB_LOG_ScanBlock(USB_LOG_Handle *log, uint32_t *nextSeq, uint64_t *payloadBytes)
+{
+	uint32_t offset = USB_LOG_BLOCK_HEADER_SIZE;
+	while(offset + USB_LOG_RECORD_HEADER_SIZE <= USB_LOG_BLOCK_SIZE)
+	{
+		uint8_t *record = &log->m_Block[offset];
+		uint16_t type = USB_LOG_Get16(&record[0]);
+		uint32_t len = USB_LOG_Get16(&record[2]);
+		if(type == 0x0000 || offset + USB_LOG_RECORD_SIZE(len) > USB_LOG_BLOCK_SIZE)
+			break;
+		if(USB_LOG_Get32(&record[4]) != *nextSeq)
+			break;
+		if(USB_LOG_Get32(&record[8]) != USB_CalculateCRC32(USB_CalculateCRC32(0, record, 8), &record[USB_LOG_RECORD_HEADER_SIZE], len))
+			break;
+
+		if(type == USB_LOG_RECORD_CHECKPOINT)
+			memcpy(payloadBytes, &record[USB_LOG_RECORD_HEADER_SIZE + 8], sizeof(uint64_t));
+		else
+			*payloadBytes += len;
+		(*nextSeq)++;
+		offset += USB_LOG_RECORD_SIZE(len);
+	}
+	return offset;
+}
+
+/**
+ * @brief Internal function which locates the end of the log. The checkpoint blocks are written in ascending order,
+ * 				so the valid ones form a prefix and the last one is found by binary search.
+ * 				Afterwards at most USB_LOG_CHECKPOINT_INTERVAL blocks are scanned.
+ */
+static USB_ERROR USB_LOG_Recover(USB_LOG_Handle *log)
+{
+	uint32_t checkpoints = (log->m_BlockCount + USB_LOG_CHECKPOINT_INTERVAL - 1) / USB_LOG_CHECKPOINT_INTERVAL;
+	uint32_t low = 0, high = checkpoints;	/* Checkpoint low is valid, checkpoint high is not */
+	uint32_t nextSeq;
+
+	if(!USB_LOG_LoadCheckpoint(log, 0, &nextSeq))
+	{
+		// Not even the first block reached the media
+		USB_LOG_StartBlock(log, 0);
+		return USB_LOG_Flush(log);
+	}
+
+	while(high - low > 1)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if(USB_LOG_LoadCheckpoint(log, mid * USB_LOG_CHECKPOINT_INTERVAL, &nextSeq))
+			low = mid;
+		else
+			high = mid;
+	}
+
+	// The checkpoint record carries the sequence number and payload counter
+	uint32_t blockIndex = low * USB_LOG_CHECKPOINT_INTERVAL;
+	if(!USB_LOG_LoadCheckpoint(log, blockIndex, &nextSeq))
+		return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+	uint64_t payloadBytes = 0;
+	uint32_t used = USB_LOG_ScanBlock(log, &nextSeq, &payloadBytes);
+
+	while(blockIndex + 1 < log->m_BlockCount && USB_LOG_LoadBlock(log, blockIndex + 1))
+	{
+		uint32_t blockSeq = nextSeq;
+		uint64_t blockPayload = payloadBytes;
+		uint32_t blockUsed = USB_LOG_ScanBlock(log, &blockSeq, &blockPayload);
+		if(blockUsed == USB_LOG_BLOCK_HEADER_SIZE)
+			break;
+		blockIndex++;
+		nextSeq = blockSeq;
+		payloadBytes = blockPayload;
+		used = blockUsed;
+	}
+
+	// Reload the last valid block, a failed probe of the following block replaced the buffer
+	if(!USB_LOG_LoadBlock(log, blockIndex))
+		return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+	memset(&log->m_Block[used], 0x00, USB_LOG_BLOCK_SIZE - used);
+
+	log->m_BlockIndex = blockIndex;
+	log->m_BlockUsed = used;
+	log->m_NextSeq = nextSeq;
+	log->m_PayloadBytes = payloadBytes;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
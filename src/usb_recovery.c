@@ -0,0 +1,305 @@
+/*
+ * usb_recovery.c
+ *
+ *  Recovery ladder of failed MSC read and write commands, see usb_recovery.h.
+ */
+
+#include "usb_recovery.h"
+#include "usb_attach.h"
+#include "usb_time_measurement.h"
+#include <string.h>
+
+typedef enum {
+	USB_RECOVERY_STEP_IDLE = 0,
+	USB_RECOVERY_STEP_WAIT_PORT,
+	USB_RECOVERY_STEP_SET_ADDRESS,
+	USB_RECOVERY_STEP_SET_CONFIG
+} USB_RECOVERY_STEP;
+
+/* Read or write command of USBH_MSC_Read/USBH_MSC_Write */
+typedef struct {
+	uint32_t m_Address;
+	uint8_t *m_Buffer;
+	uint32_t m_Length;
+	BOOL m_Recovering;			/* An error of the command occurred */
+	uint64_t m_StartUs;			/* First error of the command */
+	uint8_t m_SenseRetries;
+	uint8_t m_BotRetries;
+	uint8_t m_PortResets;
+	BOOL m_ResetFailed;			/* Last reset recovery of the BOT state machine failed */
+	BOOL m_Exhausted;			/* All steps of the ladder failed */
+} USB_RECOVERY_COMMAND;
+
+static USB_RECOVERY_COMMAND recoveryCommand;
+static USB_RECOVERY_STEP recoveryStep = USB_RECOVERY_STEP_IDLE;
+static uint32_t recoveryStepTimer = 0;
+static uint8_t resetRequest = 0;			/* Control request of the reset recovery: BOT reset, IN halt, OUT halt */
+static USB_RECOVERY_STATS recoveryStats;
+
+/** Internally defined **/
+static USBH_StatusTypeDef USB_RECOVERY_PortReset(USBH_HandleTypeDef *phost);
+
+/** Helper functions **/
+static void USB_RECOVERY_Started();
+static void USB_RECOVERY_OpenControlPipes(USBH_HandleTypeDef *phost);
+static void USB_RECOVERY_ResetToggles(USBH_HandleTypeDef *phost);
+
+
+/**
+ * @brief Stores the parameters of a read or write command, called before the command is sent.
+ */
+void USB_RECOVERY_Begin(uint32_t address, uint8_t *pbuf, uint32_t length)
+{
+	memset(&recoveryCommand, 0x00, sizeof(USB_RECOVERY_COMMAND));
+	recoveryCommand.m_Address = address;
+	recoveryCommand.m_Buffer = pbuf;
+	recoveryCommand.m_Length = length;
+	recoveryStep = USB_RECOVERY_STEP_IDLE;
+}
+
+/**
+ * @brief Called when a read or write command completed or failed. Records the recovery time and reports
+ * 		  HOST_USER_UNRECOVERED_ERROR if all steps of the ladder failed.
+ * @param status result of the command.
+ */
+void USB_RECOVERY_End(USBH_HandleTypeDef *phost, USBH_StatusTypeDef status)
+{
+	if(!recoveryCommand.m_Recovering)
+		return;
+
+	uint32_t recoveryUs = (uint32_t)(USB_GetTimeUs() - recoveryCommand.m_StartUs);
+	recoveryStats.m_LastRecoveryUs = recoveryUs;
+	recoveryStats.m_TotalRecoveryUs += recoveryUs;
+	if(recoveryUs > recoveryStats.m_MaxRecoveryUs)
+		recoveryStats.m_MaxRecoveryUs = recoveryUs;
+	if(status == USBH_OK)
+		recoveryStats.m_Recovered++;
+	else
+		recoveryStats.m_Failed++;
+	recoveryCommand.m_Recovering = FALSE;
+
+	if(recoveryCommand.m_Exhausted && phost->pUser != NULL)
+		phost->pUser(phost, HOST_USER_UNRECOVERED_ERROR);
+}
+
+/**
+ * @brief Decides if a command which failed with CHECK CONDITION is sent again.
+ * @param sense sense data returned by REQUEST SENSE.
+ * @return TRUE for a transient condition, up to USB_RECOVERY_SENSE_RETRIES times per command.
+ */
+BOOL USB_RECOVERY_SenseRetry(const SCSI_SenseTypeDef *sense)
+{
+	// A changed medium is not retried, the data belongs to the file system of the old medium (usb_unit.h)
+	BOOL transient = (sense->key == SCSI_SENSE_KEY_UNIT_ATTENTION && sense->asc != SCSI_ASC_NOT_READY_TO_READY_CHANGE)
+			|| sense->key == SCSI_SENSE_KEY_ABORTED_COMMAND
+			|| (sense->key == SCSI_SENSE_KEY_NOT_READY && sense->asc != SCSI_ASC_MEDIUM_NOT_PRESENT);
+	if(!transient || recoveryCommand.m_SenseRetries >= USB_RECOVERY_SENSE_RETRIES)
+		return FALSE;
+
+	USB_RECOVERY_Started();
+	recoveryCommand.m_SenseRetries++;
+	recoveryStats.m_SenseRetries++;
+	return TRUE;
+}
+
+/**
+ * @brief Called when a command timed out. The BOT state machine is switched to the reset recovery, the
+ * 		  URB of the pipe which does not complete is replaced by the control requests.
+ * @return TRUE if the ladder continues, FALSE if the command fails.
+ */
+BOOL USB_RECOVERY_Timeout(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	USB_RECOVERY_Started();
+	if(recoveryCommand.m_PortResets >= USB_RECOVERY_PORT_RESETS || recoveryStep != USB_RECOVERY_STEP_IDLE)
+	{
+		recoveryCommand.m_Exhausted = TRUE;
+		return FALSE;
+	}
+
+	// Move on to the port reset if the reset recovery does not resolve the timeout
+	recoveryCommand.m_BotRetries = USB_RECOVERY_BOT_RETRIES;
+	MSC_Handle->unit[lun].state = (MSC_Handle->state == MSC_WRITE) ? MSC_WRITE : MSC_READ;
+	MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+	MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
+	return TRUE;
+}
+
+/**
+ * @brief Runs the next step of the ladder after the BOT state machine reported a transport error. The reset
+ * 		  recovery was done by the BOT state machine, the command is sent again once. After that the port is reset.
+ * @return USBH_OK if the command may be sent again, USBH_BUSY while the port is reset, USBH_FAIL if the ladder
+ * 		   is exhausted.
+ */
+USBH_StatusTypeDef USB_RECOVERY_Process(USBH_HandleTypeDef *phost)
+{
+	USB_RECOVERY_Started();
+	if(recoveryStep == USB_RECOVERY_STEP_IDLE)
+	{
+		if(!recoveryCommand.m_ResetFailed && recoveryCommand.m_BotRetries < USB_RECOVERY_BOT_RETRIES)
+		{
+			recoveryCommand.m_BotRetries++;
+			return USBH_OK;
+		}
+		if(recoveryCommand.m_PortResets >= USB_RECOVERY_PORT_RESETS || phost->device.is_connected == 0U)
+		{
+			recoveryCommand.m_Exhausted = TRUE;
+			return USBH_FAIL;
+		}
+		recoveryCommand.m_PortResets++;
+		recoveryStats.m_PortResets++;
+	}
+
+	USBH_StatusTypeDef status = USB_RECOVERY_PortReset(phost);
+	if(status == USBH_FAIL)
+		recoveryCommand.m_Exhausted = TRUE;
+	return status;
+}
+
+/**
+ * @brief Sends the stored read or write command again.
+ */
+void USB_RECOVERY_Resend(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	MSC_Handle->hbot.state = BOT_SEND_CBW;
+	MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+	if(MSC_Handle->state == MSC_WRITE)
+	{
+		MSC_Handle->unit[lun].state = MSC_WRITE;
+		USBH_MSC_SCSI_Write(phost, lun, recoveryCommand.m_Address, recoveryCommand.m_Buffer, recoveryCommand.m_Length);
+	}
+	else
+	{
+		MSC_Handle->unit[lun].state = MSC_READ;
+		USBH_MSC_SCSI_Read(phost, lun, recoveryCommand.m_Address, recoveryCommand.m_Buffer, recoveryCommand.m_Length);
+	}
+}
+
+/**
+ * @brief Reset recovery of the BOT specification (5.3.4): Bulk-Only Mass Storage Reset, CLEAR_FEATURE(ENDPOINT_HALT)
+ * 		  of the bulk IN and of the bulk OUT endpoint. Both data toggles start with DATA0 afterwards.
+ * @return USBH_BUSY until the three control requests completed, USBH_OK or USBH_FAIL if a request failed.
+ */
+USBH_StatusTypeDef USB_RECOVERY_ResetRecovery(USBH_HandleTypeDef *phost)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+	USBH_StatusTypeDef status;
+
+	switch(resetRequest)
+	{
+	case 0:
+		status = USBH_MSC_BOT_REQ_Reset(phost);
+		break;
+	case 1:
+		status = USBH_ClrFeature(phost, MSC_Handle->InEp);
+		break;
+	default:
+		status = USBH_ClrFeature(phost, MSC_Handle->OutEp);
+		break;
+	}
+	if(status == USBH_BUSY || (status == USBH_OK && ++resetRequest < 3))
+		return USBH_BUSY;
+
+	resetRequest = 0;
+	recoveryStats.m_BotResets++;
+	recoveryCommand.m_ResetFailed = (status != USBH_OK);
+	if(status != USBH_OK)
+		return USBH_FAIL;
+	USB_RECOVERY_ResetToggles(phost);
+	return USBH_OK;
+}
+
+void USB_RECOVERY_GetStats(USB_RECOVERY_STATS *stats)
+{
+	*stats = recoveryStats;
+}
+
+void USB_RECOVERY_ResetStats()
+{
+	memset(&recoveryStats, 0x00, sizeof(USB_RECOVERY_STATS));
+}
+
+/**
+ * @brief Resets the port and restores the address and the configuration of the device. The pipes of the
+ * 		  MSC class stay open, the device address does not change.
+ */
+static USBH_StatusTypeDef USB_RECOVERY_PortReset(USBH_HandleTypeDef *phost)
+{
+	USBH_StatusTypeDef status = USBH_BUSY;
+
+	switch(recoveryStep)
+	{
+	case USB_RECOVERY_STEP_IDLE:
+		USBH_UsrLog("Recovery: port reset");
+		phost->device.PortEnabled = 0U;
+		USBH_LL_ResetPort(phost);
+		recoveryStepTimer = phost->Timer;
+		recoveryStep = USB_RECOVERY_STEP_WAIT_PORT;
+		break;
+
+	case USB_RECOVERY_STEP_WAIT_PORT:
+		if(phost->device.PortEnabled == 1U)
+		{
+			USBH_Delay(USB_ATTACH_RESET_RECOVERY_MS);
+			phost->device.address = USBH_DEVICE_ADDRESS_DEFAULT;
+			USB_RECOVERY_OpenControlPipes(phost);
+			recoveryStep = USB_RECOVERY_STEP_SET_ADDRESS;
+		}
+		else if((phost->Timer - recoveryStepTimer) > USB_RECOVERY_PORT_TIMEOUT_MS || phost->device.is_connected == 0U)
+			status = USBH_FAIL;
+		break;
+
+	case USB_RECOVERY_STEP_SET_ADDRESS:
+		status = USBH_SetAddress(phost, USBH_DEVICE_ADDRESS);
+		if(status == USBH_OK)
+		{
+			USBH_Delay(2U);
+			phost->device.address = USBH_DEVICE_ADDRESS;
+			USB_RECOVERY_OpenControlPipes(phost);
+			recoveryStep = USB_RECOVERY_STEP_SET_CONFIG;
+			status = USBH_BUSY;
+		}
+		break;
+
+	case USB_RECOVERY_STEP_SET_CONFIG:
+		status = USBH_SetCfg(phost, (uint16_t)phost->device.CfgDesc.bConfigurationValue);
+		if(status == USBH_OK)
+			USB_RECOVERY_ResetToggles(phost);
+		break;
+	}
+
+	if(status == USBH_BUSY)
+		return USBH_BUSY;
+	recoveryStep = USB_RECOVERY_STEP_IDLE;
+	return (status == USBH_OK) ? USBH_OK : USBH_FAIL;
+}
+
+/**
+ * @brief Records the first error of the current command.
+ */
+static void USB_RECOVERY_Started()
+{
+	if(recoveryCommand.m_Recovering)
+		return;
+	recoveryCommand.m_Recovering = TRUE;
+	recoveryCommand.m_StartUs = USB_GetTimeUs();
+}
+
+static void USB_RECOVERY_OpenControlPipes(USBH_HandleTypeDef *phost)
+{
+	USBH_OpenPipe(phost, phost->Control.pipe_in, 0x80U, phost->device.address, phost->device.speed,
+			USBH_EP_CONTROL, (uint16_t)phost->Control.pipe_size);
+	USBH_OpenPipe(phost, phost->Control.pipe_out, 0x00U, phost->device.address, phost->device.speed,
+			USBH_EP_CONTROL, (uint16_t)phost->Control.pipe_size);
+}
+
+static void USB_RECOVERY_ResetToggles(USBH_HandleTypeDef *phost)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	USBH_LL_SetToggle(phost, MSC_Handle->InPipe, 0U);
+	USBH_LL_SetToggle(phost, MSC_Handle->OutPipe, 0U);
+}
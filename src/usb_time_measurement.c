@@ -7,37 +7,186 @@
 
 #include "usb_time_measurement.h"
 
-#define start_timer()    *((volatile uint32_t*)0xE0001000) = 0x40000001  // Enable CYCCNT register
-#define stop_timer()   *((volatile uint32_t*)0xE0001000) = 0x40000000  // Disable CYCCNT register
-#define get_timer()   *((volatile uint32_t*)0xE0001004)               // Get value from CYCCNT register
-#define reset_timer() *((volatile uint32_t*)0xE0001004) = 0x00        // Reset counter
+#ifdef USB_HOST_SIM
+#include "usb_sim.h"
+#else
+#include "stm32f4xx.h"
+#endif /* USB_HOST_SIM */
 
-#define CLOCK_FREQUENCY		168 // MHz
+extern uint32_t SystemCoreClock;
 
-inline uint32_t USB_StartTimer()
+/* Conversion factors as 32.32 fixed point numbers, derived from the SystemCoreClock they were calculated for.
+ * A 64-bit cycle value is split into its high and low word, so the products never overflow and no 64-bit
+ * division is needed. */
+typedef struct {
+	uint32_t m_CoreClock;
+	uint64_t m_NsPerCycle;
+	uint64_t m_UsPerCycle;
+	uint64_t m_MsPerCycle;
+} USB_TIME_Factors;
+
+static USB_TIME_Factors timeFactors;
+
+#ifndef USB_HOST_SIM
+static volatile uint32_t cycleHigh = 0;		/* Number of overflows of the DWT cycle counter */
+static volatile uint32_t cycleLast = 0;		/* Counter value of the last call of USB_GetCycles */
+#endif /* USB_HOST_SIM */
+
+/** Helper functions **/
+static const USB_TIME_Factors* USB_GetTimeFactors();
+static uint64_t USB_ScaleCycles(uint64_t cycles, uint64_t factor);
+
+
+/**
+ * @brief Enables the DWT cycle counter without resetting it and calculates the conversion factors
+ * 		  from SystemCoreClock. Called implicitly, call it again after the system clock was changed.
+ */
+void USB_InitTimeBase()
 {
-    USB_ResetTimer();
-	start_timer();
-	return get_timer();
+#ifndef USB_HOST_SIM
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif /* USB_HOST_SIM */
+	uint32_t clock = SystemCoreClock ? SystemCoreClock : 1;
+	timeFactors.m_NsPerCycle = (1000000000ULL << 32) / clock;
+	timeFactors.m_UsPerCycle = (1000000ULL << 32) / clock;
+	timeFactors.m_MsPerCycle = (1000ULL << 32) / clock;
+	timeFactors.m_CoreClock = SystemCoreClock;
 }
 
+/**
+ * @brief Returns the monotonic 64-bit cycle count. The DWT counter is extended in software, so a
+ * 		  function of the time base has to be called at least once per overflow of the 32-bit counter
+ * 		  (25 s at 168 MHz). OTG_HS_IRQHandler does so on every interrupt, including the SOF interrupts
+ * 		  while the host is running.
+ * 		  The host build derives the cycles from the simulated time base.
+ * @return cycles since the counter was enabled.
+ */
+uint64_t USB_GetCycles()
+{
+#ifdef USB_HOST_SIM
+	uint64_t ns = USB_SIM_GetTimeNs();
+	uint64_t cyclesPerUs = USB_GetTimeFactors()->m_CoreClock / 1000000;
+	return (ns / 1000) * cyclesPerUs + (ns % 1000) * cyclesPerUs / 1000;
+#else
+	if(!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+		USB_InitTimeBase();
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t now = DWT->CYCCNT;
+	if(now < cycleLast)
+		cycleHigh++;
+	cycleLast = now;
+	uint64_t cycles = ((uint64_t)cycleHigh << 32) | now;
+	__set_PRIMASK(primask);
+	return cycles;
+#endif /* USB_HOST_SIM */
+}
+
+uint64_t USB_CyclesToNs(uint64_t cycles)
+{
+	return USB_ScaleCycles(cycles, USB_GetTimeFactors()->m_NsPerCycle);
+}
+
+uint64_t USB_CyclesToUs(uint64_t cycles)
+{
+	return USB_ScaleCycles(cycles, USB_GetTimeFactors()->m_UsPerCycle);
+}
+
+uint64_t USB_CyclesToMs(uint64_t cycles)
+{
+	return USB_ScaleCycles(cycles, USB_GetTimeFactors()->m_MsPerCycle);
+}
+
+uint64_t USB_GetTimeNs()
+{
+	return USB_CyclesToNs(USB_GetCycles());
+}
+
+uint64_t USB_GetTimeUs()
+{
+	return USB_CyclesToUs(USB_GetCycles());
+}
 
+uint64_t USB_GetTimeMs()
+{
+	return USB_CyclesToMs(USB_GetCycles());
+}
+
+/**
+ * @brief Kept for compatibility, the shared counter is no longer reset.
+ * @return lower 32 bits of USB_GetCycles.
+ */
+uint32_t USB_StartTimer()
+{
+	return USB_GetTimer();
+}
+
+/**
+ * @brief Kept for compatibility. Does nothing, the DWT counter is shared by all measurements
+ * 		  and must not be reset.
+ */
 void USB_ResetTimer()
 {
-	reset_timer();
 }
 
+/**
+ * @brief Returns the lower 32 bits of the cycle counter. Differences of two values are valid for
+ * 		  intervals below one overflow (25 s at 168 MHz), use USB_GetCycles for longer intervals.
+ */
 uint32_t USB_GetTimer()
 {
-	return get_timer();
+	return (uint32_t)USB_GetCycles();
 }
 
 uint32_t USB_TransformClockFrequencyToNs(uint32_t value)
 {
-	return (uint32_t)((float)value * (float)13.88/*5.95238095*/);
+	return (uint32_t)USB_CyclesToNs(value);
+}
+
+uint32_t USB_TransformClockFrequencyToUs(uint32_t value)
+{
+	return (uint32_t)USB_CyclesToUs(value);
 }
 
 uint32_t USB_TransformClockFrequencyToMS(uint32_t value)
 {
-	return (uint32_t)((float)value * (float)13.88/*5.95238095*/)/1000/1000;
+	return (uint32_t)USB_CyclesToMs(value);
+}
+
+/**
+ * @brief Busy waits for ns nanoseconds. The host build advances the simulated time instead.
+ * @param ns time to wait in ns.
+ */
+void USB_DelayNs(uint32_t ns)
+{
+#ifdef USB_HOST_SIM
+	USB_SIM_AdvanceTime(ns);
+#else
+	uint64_t start = USB_GetCycles();
+	while(USB_CyclesToNs(USB_GetCycles() - start) < ns)
+		;
+#endif /* USB_HOST_SIM */
+}
+
+/**
+ * @brief Returns the conversion factors, recalculated if SystemCoreClock has changed.
+ */
+static const USB_TIME_Factors* USB_GetTimeFactors()
+{
+	if(timeFactors.m_CoreClock != SystemCoreClock)
+		USB_InitTimeBase();
+	return &timeFactors;
+}
+
+/**
+ * @brief Multiplies a cycle count with a 32.32 fixed point factor.
+ */
+static uint64_t USB_ScaleCycles(uint64_t cycles, uint64_t factor)
+{
+	uint64_t high = (cycles >> 32) * factor;
+	uint64_t low = (cycles & 0xFFFFFFFF) * (factor & 0xFFFFFFFF);
+	uint64_t mid = (cycles & 0xFFFFFFFF) * (factor >> 32);
+	return high + mid + (low >> 32);
 }
@@ -0,0 +1,588 @@
+/*
+ * usb_timeseries.c
+ *
+ *  Time indexed sample store.
+ *
+ *  File layout (all blocks USB_TS_BLOCK_SIZE bytes):
+ *  	block 0:	store header (magic, geometry, store id)
+ *  	group g:	one index block followed by USB_TS_BLOCKS_PER_INDEX data blocks.
+ *  				The index block holds the first timestamp of each data block of the group.
+ *  				Data blocks hold samples (timestamp, length, payload) in ascending time order.
+ *
+ *  USB_TS_Find locates the group by a binary search over the first index entry of each group,
+ *  then the data block by a binary search inside the index block. Only the found data block is
+ *  scanned, so a query needs O(log n) small reads. The seeks of queries are resolved by the cluster link
+ *  map (USB_SetFastSeek) without reading the FAT. Writes disable the map, the file grows with every data
+ *  block and the map would be rebuilt from the whole FAT chain before each of them.
+ */
+
+#include "usb_timeseries.h"
+#include "usb_handler.h"
+#include "usb_time_measurement.h"
+#include <string.h>
+
+#define USB_TS_HEADER_MAGIC		0x53535455	/* "UTSS" */
+#define USB_TS_INDEX_MAGIC		0x58445455	/* "UTDX" */
+#define USB_TS_DATA_MAGIC		0x54445455	/* "UTDT" */
+#define USB_TS_VERSION			1
+#define USB_TS_HEADER_SIZE		20
+
+#define USB_TS_SAMPLE_SIZE(len)		((USB_TS_SAMPLE_HEADER_SIZE + (len) + 3) & ~3UL)
+#define USB_TS_INDEX_OFFSET(group)	((1 + (uint64_t)(group) * (USB_TS_BLOCKS_PER_INDEX + 1)) * USB_TS_BLOCK_SIZE)
+#define USB_TS_DATA_OFFSET(block)	(USB_TS_INDEX_OFFSET((block) / USB_TS_BLOCKS_PER_INDEX) + \
+										(uint64_t)(1 + (block) % USB_TS_BLOCKS_PER_INDEX) * USB_TS_BLOCK_SIZE)
+
+/** Internally defined **/
+static USB_ERROR USB_TS_WriteAt(USB_TS_Handle *ts, uint64_t offset, uint8_t *data, uint32_t len);
+static USB_ERROR USB_TS_ReadAt(USB_TS_Handle *ts, uint64_t offset, uint8_t *data, uint32_t len);
+static USB_ERROR USB_TS_WriteDataBlock(USB_TS_Handle *ts);
+static USB_ERROR USB_TS_WriteIndexBlock(USB_TS_Handle *ts);
+static void USB_TS_StartDataBlock(USB_TS_Handle *ts, uint32_t block);
+static void USB_TS_StartIndexBlock(USB_TS_Handle *ts, uint32_t group);
+static USB_ERROR USB_TS_ReadDataHeader(USB_TS_Handle *ts, uint32_t block, uint8_t *header);
+static USB_ERROR USB_TS_GetIndexEntry(USB_TS_Handle *ts, uint32_t group, uint32_t entry, uint64_t *timestamp);
+static USB_ERROR USB_TS_Peek(USB_TS_Handle *ts, USB_TS_Cursor *cursor, uint64_t *timestamp, uint32_t *len);
+static USB_ERROR USB_TS_Recover(USB_TS_Handle *ts, uint64_t fileSize);
+
+static void USB_TS_Put32(uint8_t *dst, uint32_t val) { memcpy(dst, &val, sizeof(val)); }
+static void USB_TS_Put64(uint8_t *dst, uint64_t val) { memcpy(dst, &val, sizeof(val)); }
+static uint32_t USB_TS_Get32(const uint8_t *src) { uint32_t val; memcpy(&val, src, sizeof(val)); return val; }
+static uint64_t USB_TS_Get64(const uint8_t *src) { uint64_t val; memcpy(&val, src, sizeof(val)); return val; }
+
+/**
+ * @brief This function creates a new sample store, or replaces an existing file.
+ * @param ts store handle to initialize.
+ * @param usbHandle handle to read and write data to the USB mass storage device. The handle is used exclusively by the store.
+ * @param fileName name of the store file.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_TS_Create(USB_TS_Handle *ts, USB_MS_Handle *usbHandle, const char *fileName)
+{
+	if(!ts || !usbHandle || !fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	memset(ts, 0x00, sizeof(USB_TS_Handle));
+	ts->m_Handle = usbHandle;
+	ts->m_StoreId = USB_GetTimer();
+
+	USB_ERROR ret = USB_OpenFile(usbHandle, fileName, USB_READ | USB_WRITE | USB_OVERWRITE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	// The header block is built in the data block buffer, before the first data block is started
+	memset(ts->m_Block, 0x00, USB_TS_BLOCK_SIZE);
+	USB_TS_Put32(&ts->m_Block[0], USB_TS_HEADER_MAGIC);
+	USB_TS_Put32(&ts->m_Block[4], USB_TS_VERSION);
+	USB_TS_Put32(&ts->m_Block[8], USB_TS_BLOCK_SIZE);
+	USB_TS_Put32(&ts->m_Block[12], USB_TS_BLOCKS_PER_INDEX);
+	USB_TS_Put32(&ts->m_Block[16], ts->m_StoreId);
+	ret = USB_TS_WriteAt(ts, 0, ts->m_Block, USB_TS_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+	{
+		USB_CloseFile(usbHandle);
+		return ret;
+	}
+
+	USB_TS_StartIndexBlock(ts, 0);
+	USB_TS_StartDataBlock(ts, 0);
+	return USB_TS_Flush(ts);
+}
+
+/**
+ * @brief This function opens an existing sample store for queries and further appending.
+ * 				An index block which was not flushed before a power loss is rebuilt from the data block headers.
+ * @param ts store handle to initialize.
+ * @param usbHandle handle to read and write data to the USB mass storage device. The handle is used exclusively by the store.
+ * @param fileName name of the store file.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_INVALID if the file is not a sample store.
+ */
+USB_ERROR USB_TS_Open(USB_TS_Handle *ts, USB_MS_Handle *usbHandle, const char *fileName)
+{
+	if(!ts || !usbHandle || !fileName)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	memset(ts, 0x00, sizeof(USB_TS_Handle));
+	ts->m_Handle = usbHandle;
+
+	USB_ERROR ret = USB_OpenFile(usbHandle, fileName, USB_READ | USB_WRITE | USB_OPEN_IF_EXISTS);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint8_t header[USB_TS_HEADER_SIZE];
+	uint64_t fileSize;
+	ret = USB_TS_ReadAt(ts, 0, header, USB_TS_HEADER_SIZE);
+	if(ret.m_ErrCode == USB_NO_ERROR &&
+			(USB_TS_Get32(&header[0]) != USB_TS_HEADER_MAGIC ||
+			USB_TS_Get32(&header[4]) != USB_TS_VERSION ||
+			USB_TS_Get32(&header[8]) != USB_TS_BLOCK_SIZE ||
+			USB_TS_Get32(&header[12]) != USB_TS_BLOCKS_PER_INDEX))
+		ret = (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+	if(ret.m_ErrCode == USB_NO_ERROR)
+	{
+		ts->m_StoreId = USB_TS_Get32(&header[16]);
+		ret = USB_GetFileSize(usbHandle, &fileSize);
+	}
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_TS_Recover(ts, fileSize);
+
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		USB_CloseFile(usbHandle);
+	return ret;
+}
+
+/**
+ * @brief This function appends a sample to the store. The sample is kept in RAM until its block is full
+ * 				or USB_TS_Flush is called.
+ * @param ts handle of an opened store.
+ * @param timestamp timestamp of the sample in an application defined unit. Must not be smaller than the previous one.
+ * @param data payload of the sample.
+ * @param len length of the payload, at most USB_TS_MAX_SAMPLE_SIZE.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_TS_Append(USB_TS_Handle *ts, uint64_t timestamp, const uint8_t *data, uint32_t len)
+{
+	if(!ts || !ts->m_Handle || (!data && len) || len > USB_TS_MAX_SAMPLE_SIZE)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(timestamp < ts->m_LastTimestamp)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	if(ts->m_BlockUsed + USB_TS_SAMPLE_SIZE(len) > USB_TS_BLOCK_SIZE)
+	{
+		USB_ERROR ret = USB_TS_WriteDataBlock(ts);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+
+		uint32_t block = ts->m_DataBlocks;
+		if(block % USB_TS_BLOCKS_PER_INDEX == 0)
+		{
+			// Group complete: write its final index and reserve the index block of the next group
+			ret = USB_TS_WriteIndexBlock(ts);
+			if(ret.m_ErrCode != USB_NO_ERROR)
+				return ret;
+			USB_TS_StartIndexBlock(ts, block / USB_TS_BLOCKS_PER_INDEX);
+			ret = USB_TS_WriteIndexBlock(ts);
+		}
+		else if(block % USB_TS_INDEX_FLUSH_INTERVAL == 0)
+			ret = USB_TS_WriteIndexBlock(ts);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+
+		USB_TS_StartDataBlock(ts, block);
+	}
+
+	uint32_t block = ts->m_DataBlocks - 1;
+	if(ts->m_BlockUsed == USB_TS_DATA_HEADER_SIZE)
+	{
+		// First sample of the block: create its index entry
+		uint32_t entry = block % USB_TS_BLOCKS_PER_INDEX;
+		USB_TS_Put64(&ts->m_Block[16], timestamp);
+		USB_TS_Put64(&ts->m_Index[USB_TS_INDEX_HEADER_SIZE + entry * 8], timestamp);
+		ts->m_IndexCount = entry + 1;
+		USB_TS_Put32(&ts->m_Index[12], ts->m_IndexCount);
+	}
+
+	uint8_t *sample = &ts->m_Block[ts->m_BlockUsed];
+	USB_TS_Put64(&sample[0], timestamp);
+	USB_TS_Put32(&sample[8], len);
+	if(len)
+		memcpy(&sample[USB_TS_SAMPLE_HEADER_SIZE], data, len);
+	ts->m_BlockUsed += USB_TS_SAMPLE_SIZE(len);
+	USB_TS_Put32(&ts->m_Block[12], ts->m_BlockUsed);
+	USB_TS_Put64(&ts->m_Block[24], timestamp);
+	ts->m_LastTimestamp = timestamp;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief This function writes the current data block and index block and synchronizes the file size.
+ * 				After the function returns all appended samples survive a power loss.
+ * @param ts handle of an opened store.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_TS_Flush(USB_TS_Handle *ts)
+{
+	if(!ts || !ts->m_Handle)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	USB_ERROR ret = USB_TS_WriteDataBlock(ts);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	ret = USB_TS_WriteIndexBlock(ts);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	return USB_Sync(ts->m_Handle, TRUE);
+}
+
+/**
+ * @brief This function flushes the store and closes the store file.
+ * @param ts handle of an opened store.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_TS_Close(USB_TS_Handle *ts)
+{
+	USB_ERROR ret = USB_TS_Flush(ts);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	ret = USB_CloseFile(ts->m_Handle);
+	ts->m_Handle = 0;
+	return ret;
+}
+
+/**
+ * @brief This function sets a cursor to the first sample with a timestamp greater or equal to timestamp.
+ * 				Only the index entries on the search path and the found data block are read.
+ * @param ts handle of an opened store.
+ * @param timestamp timestamp to search for.
+ * @param cursor Output: read position for USB_TS_ReadNext.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_END if all samples are older than timestamp.
+ */
+USB_ERROR USB_TS_Find(USB_TS_Handle *ts, uint64_t timestamp, USB_TS_Cursor *cursor)
+{
+	if(!ts || !ts->m_Handle || !cursor)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	uint32_t groups = (ts->m_DataBlocks - 1) / USB_TS_BLOCKS_PER_INDEX + 1;
+	uint32_t low = 0, high = groups;
+	uint64_t first;
+
+	// Number of groups starting before timestamp, the sample is in the last of them
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		USB_ERROR ret = USB_TS_GetIndexEntry(ts, mid, 0, &first);
+		if(ret.m_ErrCode != USB_NO_ERROR && ret.m_ErrCode != USB_LOG_END)
+			return ret;
+		if(ret.m_ErrCode == USB_NO_ERROR && first < timestamp)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	uint32_t group = low ? low - 1 : 0;
+
+	// Same search over the data blocks of the group
+	low = 0;
+	high = (group == groups - 1) ? ts->m_IndexCount : USB_TS_BLOCKS_PER_INDEX;
+	while(low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		USB_ERROR ret = USB_TS_GetIndexEntry(ts, group, mid, &first);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+		if(first < timestamp)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	cursor->m_DataBlock = group * USB_TS_BLOCKS_PER_INDEX + (low ? low - 1 : 0);
+	cursor->m_Offset = USB_TS_DATA_HEADER_SIZE;
+	cursor->m_BlockUsed = 0;
+
+	// Skip the older samples of the block
+	for(;;)
+	{
+		uint64_t sampleTime;
+		uint32_t len;
+		USB_ERROR ret = USB_TS_Peek(ts, cursor, &sampleTime, &len);
+		if(ret.m_ErrCode != USB_NO_ERROR || sampleTime >= timestamp)
+			return ret;
+		cursor->m_Offset += USB_TS_SAMPLE_SIZE(len);
+	}
+}
+
+/**
+ * @brief This function reads the sample at the cursor position and advances the cursor.
+ * @param ts handle of an opened store.
+ * @param cursor read position, set by USB_TS_Find.
+ * @param timestamp Output: timestamp of the sample.
+ * @param buffer location to copy the payload.
+ * @param len Input: size of the buffer, Output: length of the payload.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ * 				USB_LOG_END if all samples were read, USB_NOT_ENOUGH_CORE if the buffer is too small (len contains the required size).
+ */
+USB_ERROR USB_TS_ReadNext(USB_TS_Handle *ts, USB_TS_Cursor *cursor, uint64_t *timestamp, uint8_t *buffer, uint32_t *len)
+{
+	if(!ts || !ts->m_Handle || !cursor || !timestamp || !len)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+
+	uint32_t sampleLen;
+	USB_ERROR ret = USB_TS_Peek(ts, cursor, timestamp, &sampleLen);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	if(sampleLen > *len || (!buffer && sampleLen))
+	{
+		*len = sampleLen;
+		return (USB_ERROR) {USB_NOT_ENOUGH_CORE, __LINE__};
+	}
+
+	uint32_t payload = cursor->m_Offset + USB_TS_SAMPLE_HEADER_SIZE;
+	if(cursor->m_DataBlock == ts->m_DataBlocks - 1)
+		memcpy(buffer, &ts->m_Block[payload], sampleLen);
+	else if(sampleLen)
+	{
+		ret = USB_TS_ReadAt(ts, USB_TS_DATA_OFFSET(cursor->m_DataBlock) + payload, buffer, sampleLen);
+		if(ret.m_ErrCode != USB_NO_ERROR)
+			return ret;
+	}
+
+	cursor->m_Offset += USB_TS_SAMPLE_SIZE(sampleLen);
+	*len = sampleLen;
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Internal function which writes a buffer at an absolute position of the store file.
+ */
+static USB_ERROR USB_TS_WriteAt(USB_TS_Handle *ts, uint64_t offset, uint8_t *data, uint32_t len)
+{
+	USB_ERROR ret = USB_SetFastSeek(ts->m_Handle, FALSE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_Seek(ts->m_Handle, offset);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint32_t written = len;
+	ret = USB_WriteData(ts->m_Handle, data, &written, FALSE);
+	if(ret.m_ErrCode == USB_NO_ERROR && written != len)
+		return (USB_ERROR) {USB_ACCESS_DENIED, __LINE__};
+	return ret;
+}
+
+/**
+ * @brief Internal function which reads a buffer from an absolute position of the store file.
+ */
+static USB_ERROR USB_TS_ReadAt(USB_TS_Handle *ts, uint64_t offset, uint8_t *data, uint32_t len)
+{
+	USB_ERROR ret = USB_SetFastSeek(ts->m_Handle, TRUE);
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		ret = USB_Seek(ts->m_Handle, offset);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint32_t read = len;
+	ret = USB_ReadData(ts->m_Handle, data, &read);
+	if(ret.m_ErrCode == USB_NO_ERROR && read != len)
+		return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+	return ret;
+}
+
+/**
+ * @brief Internal function which writes the current data block to its position.
+ */
+static USB_ERROR USB_TS_WriteDataBlock(USB_TS_Handle *ts)
+{
+	return USB_TS_WriteAt(ts, USB_TS_DATA_OFFSET(ts->m_DataBlocks - 1), ts->m_Block, USB_TS_BLOCK_SIZE);
+}
+
+/**
+ * @brief Internal function which rewrites the index block of the current group in place.
+ */
+static USB_ERROR USB_TS_WriteIndexBlock(USB_TS_Handle *ts)
+{
+	uint32_t group = USB_TS_Get32(&ts->m_Index[8]);
+	return USB_TS_WriteAt(ts, USB_TS_INDEX_OFFSET(group), ts->m_Index, USB_TS_BLOCK_SIZE);
+}
+
+/**
+ * @brief Internal function which initializes the data block buffer for a new, empty data block.
+ */
+static void USB_TS_StartDataBlock(USB_TS_Handle *ts, uint32_t block)
+{
+	memset(ts->m_Block, 0x00, USB_TS_BLOCK_SIZE);
+	USB_TS_Put32(&ts->m_Block[0], USB_TS_DATA_MAGIC);
+	USB_TS_Put32(&ts->m_Block[4], ts->m_StoreId);
+	USB_TS_Put32(&ts->m_Block[8], block);
+	USB_TS_Put32(&ts->m_Block[12], USB_TS_DATA_HEADER_SIZE);
+	ts->m_BlockUsed = USB_TS_DATA_HEADER_SIZE;
+	ts->m_DataBlocks = block + 1;
+}
+
+/**
+ * @brief Internal function which initializes the index block buffer for a new group.
+ */
+static void USB_TS_StartIndexBlock(USB_TS_Handle *ts, uint32_t group)
+{
+	memset(ts->m_Index, 0x00, USB_TS_BLOCK_SIZE);
+	USB_TS_Put32(&ts->m_Index[0], USB_TS_INDEX_MAGIC);
+	USB_TS_Put32(&ts->m_Index[4], ts->m_StoreId);
+	USB_TS_Put32(&ts->m_Index[8], group);
+	ts->m_IndexCount = 0;
+}
+
+/**
+ * @brief Internal function which reads and validates the header of a data block.
+ */
+static USB_ERROR USB_TS_ReadDataHeader(USB_TS_Handle *ts, uint32_t block, uint8_t *header)
+{
+	USB_ERROR ret = USB_TS_ReadAt(ts, USB_TS_DATA_OFFSET(block), header, USB_TS_DATA_HEADER_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	uint32_t used = USB_TS_Get32(&header[12]);
+	if(USB_TS_Get32(&header[0]) != USB_TS_DATA_MAGIC || USB_TS_Get32(&header[4]) != ts->m_StoreId ||
+			USB_TS_Get32(&header[8]) != block || used < USB_TS_DATA_HEADER_SIZE || used > USB_TS_BLOCK_SIZE)
+		return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Internal function which returns the first timestamp of a data block from the index.
+ * 				The index of the current group is taken from RAM.
+ * @return USB_LOG_END if the entry does not exist yet.
+ */
+static USB_ERROR USB_TS_GetIndexEntry(USB_TS_Handle *ts, uint32_t group, uint32_t entry, uint64_t *timestamp)
+{
+	if(group == (ts->m_DataBlocks - 1) / USB_TS_BLOCKS_PER_INDEX)
+	{
+		if(entry >= ts->m_IndexCount)
+			return (USB_ERROR) {USB_LOG_END, __LINE__};
+		*timestamp = USB_TS_Get64(&ts->m_Index[USB_TS_INDEX_HEADER_SIZE + entry * 8]);
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+
+	uint8_t value[8];
+	USB_ERROR ret = USB_TS_ReadAt(ts, USB_TS_INDEX_OFFSET(group) + USB_TS_INDEX_HEADER_SIZE + entry * 8, value, sizeof(value));
+	if(ret.m_ErrCode == USB_NO_ERROR)
+		*timestamp = USB_TS_Get64(value);
+	return ret;
+}
+
+/**
+ * @brief Internal function which moves the cursor to the next sample, if it points behind the end of a
+ * 				data block, and returns the header of the sample.
+ */
+static USB_ERROR USB_TS_Peek(USB_TS_Handle *ts, USB_TS_Cursor *cursor, uint64_t *timestamp, uint32_t *len)
+{
+	for(;;)
+	{
+		if(cursor->m_DataBlock >= ts->m_DataBlocks)
+			return (USB_ERROR) {USB_LOG_END, __LINE__};
+
+		BOOL current = (cursor->m_DataBlock == ts->m_DataBlocks - 1);
+		if(current)
+			cursor->m_BlockUsed = ts->m_BlockUsed;
+		else if(!cursor->m_BlockUsed)
+		{
+			uint8_t header[USB_TS_DATA_HEADER_SIZE];
+			USB_ERROR ret = USB_TS_ReadDataHeader(ts, cursor->m_DataBlock, header);
+			if(ret.m_ErrCode != USB_NO_ERROR)
+				return ret;
+			cursor->m_BlockUsed = USB_TS_Get32(&header[12]);
+		}
+
+		if(cursor->m_Offset + USB_TS_SAMPLE_HEADER_SIZE > cursor->m_BlockUsed)
+		{
+			if(current)
+				return (USB_ERROR) {USB_LOG_END, __LINE__};
+			cursor->m_DataBlock++;
+			cursor->m_Offset = USB_TS_DATA_HEADER_SIZE;
+			cursor->m_BlockUsed = 0;
+			continue;
+		}
+
+		uint8_t sample[USB_TS_SAMPLE_HEADER_SIZE];
+		if(current)
+			memcpy(sample, &ts->m_Block[cursor->m_Offset], USB_TS_SAMPLE_HEADER_SIZE);
+		else
+		{
+			USB_ERROR ret = USB_TS_ReadAt(ts, USB_TS_DATA_OFFSET(cursor->m_DataBlock) + cursor->m_Offset, sample, USB_TS_SAMPLE_HEADER_SIZE);
+			if(ret.m_ErrCode != USB_NO_ERROR)
+				return ret;
+		}
+
+		*timestamp = USB_TS_Get64(&sample[0]);
+		*len = USB_TS_Get32(&sample[8]);
+		if(cursor->m_Offset + USB_TS_SAMPLE_SIZE(*len) > cursor->m_BlockUsed)
+			return (USB_ERROR) {USB_LOG_INVALID, __LINE__};
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+}
+
+/**
+ * @brief Internal function which restores the append position from the file size. The index block of the last
+ * 				group is completed from the data block headers, the last data block is loaded into RAM.
+ */
+static USB_ERROR USB_TS_Recover(USB_TS_Handle *ts, uint64_t fileSize)
+{
+	uint64_t fileBlocks = fileSize / USB_TS_BLOCK_SIZE;
+	if(fileBlocks < 3)
+	{
+		USB_TS_StartIndexBlock(ts, 0);
+		USB_TS_StartDataBlock(ts, 0);
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+
+	uint64_t groupBlocks = fileBlocks - 1;
+	uint32_t group = (uint32_t)((groupBlocks - 1) / (USB_TS_BLOCKS_PER_INDEX + 1));
+	uint32_t dataInGroup = (uint32_t)(groupBlocks - (uint64_t)group * (USB_TS_BLOCKS_PER_INDEX + 1) - 1);
+	if(dataInGroup == 0)
+	{
+		// Only the index block of the last group was reserved
+		USB_TS_StartIndexBlock(ts, group);
+		USB_TS_StartDataBlock(ts, group * USB_TS_BLOCKS_PER_INDEX);
+		ts->m_LastTimestamp = 0;
+		if(group)
+		{
+			uint8_t header[USB_TS_DATA_HEADER_SIZE];
+			if(USB_TS_ReadDataHeader(ts, group * USB_TS_BLOCKS_PER_INDEX - 1, header).m_ErrCode == USB_NO_ERROR)
+				ts->m_LastTimestamp = USB_TS_Get64(&header[24]);
+		}
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+
+	// Load the index of the last group, entries which were not flushed are taken from the data blocks
+	USB_ERROR ret = USB_TS_ReadAt(ts, USB_TS_INDEX_OFFSET(group), ts->m_Index, USB_TS_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+	if(USB_TS_Get32(&ts->m_Index[0]) != USB_TS_INDEX_MAGIC || USB_TS_Get32(&ts->m_Index[4]) != ts->m_StoreId ||
+			USB_TS_Get32(&ts->m_Index[8]) != group)
+		USB_TS_StartIndexBlock(ts, group);
+	ts->m_IndexCount = USB_TS_Get32(&ts->m_Index[12]);
+	if(ts->m_IndexCount > dataInGroup)
+		ts->m_IndexCount = dataInGroup;
+
+	uint32_t firstBlock = group * USB_TS_BLOCKS_PER_INDEX;
+	uint8_t header[USB_TS_DATA_HEADER_SIZE];
+	for(uint32_t entry = ts->m_IndexCount; entry < dataInGroup; entry++)
+	{
+		if(USB_TS_ReadDataHeader(ts, firstBlock + entry, header).m_ErrCode != USB_NO_ERROR ||
+				USB_TS_Get32(&header[12]) == USB_TS_DATA_HEADER_SIZE)
+			break;
+		memcpy(&ts->m_Index[USB_TS_INDEX_HEADER_SIZE + entry * 8], &header[16], 8);
+		ts->m_IndexCount = entry + 1;
+	}
+	USB_TS_Put32(&ts->m_Index[12], ts->m_IndexCount);
+
+	// Continue in the last data block which has an index entry
+	uint32_t lastBlock = firstBlock + (ts->m_IndexCount ? ts->m_IndexCount - 1 : 0);
+	ts->m_DataBlocks = lastBlock + 1;
+	ret = USB_TS_ReadAt(ts, USB_TS_DATA_OFFSET(lastBlock), ts->m_Block, USB_TS_BLOCK_SIZE);
+	if(ret.m_ErrCode != USB_NO_ERROR)
+		return ret;
+
+	memcpy(header, ts->m_Block, USB_TS_DATA_HEADER_SIZE);
+	uint32_t used = USB_TS_Get32(&header[12]);
+	if(!ts->m_IndexCount || USB_TS_Get32(&header[0]) != USB_TS_DATA_MAGIC || USB_TS_Get32(&header[4]) != ts->m_StoreId ||
+			USB_TS_Get32(&header[8]) != lastBlock || used <= USB_TS_DATA_HEADER_SIZE || used > USB_TS_BLOCK_SIZE)
+	{
+		USB_TS_StartDataBlock(ts, lastBlock);
+		ts->m_IndexCount = lastBlock % USB_TS_BLOCKS_PER_INDEX;
+		USB_TS_Put32(&ts->m_Index[12], ts->m_IndexCount);
+		ts->m_LastTimestamp = 0;
+		if(lastBlock && USB_TS_ReadDataHeader(ts, lastBlock - 1, header).m_ErrCode == USB_NO_ERROR)
+			ts->m_LastTimestamp = USB_TS_Get64(&header[24]);
+		return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+	}
+
+	memset(&ts->m_Block[used], 0x00, USB_TS_BLOCK_SIZE - used);
+	ts->m_BlockUsed = used;
+	ts->m_LastTimestamp = USB_TS_Get64(&header[24]);
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
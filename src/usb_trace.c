@@ -0,0 +1,228 @@
+/*
+ * usb_trace.c
+ *
+ *  Layer trace of the storage path, see usb_trace.h.
+ */
+
+#include "usb_trace.h"
+#include "usb_time_measurement.h"
+#include <stdio.h>
+
+/* Number of bytes per line of USB_TRACE_DumpBinary */
+#define USB_TRACE_DUMP_LINE_SIZE	32
+
+extern uint32_t SystemCoreClock;
+
+/** Helper functions **/
+static void USB_TRACE_Put16(uint8_t *dst, uint16_t value);
+static void USB_TRACE_Put32(uint8_t *dst, uint32_t value);
+
+#if USB_TRACE_ENABLE
+
+#if (USB_TRACE_SIZE & (USB_TRACE_SIZE - 1)) != 0
+#error "USB_TRACE_SIZE must be a power of 2"
+#endif
+
+typedef struct {
+	volatile uint32_t m_Head;	/* Number of reserved entries since the last clear */
+	volatile USB_TRACE_Entry m_Entries[USB_TRACE_SIZE];
+} USB_TRACE_Buffer;
+
+static USB_TRACE_Buffer traceBuffer;
+static USB_TRACE_Entry traceSnapshot[USB_TRACE_SIZE];		/* Copy of the buffer used by USB_TRACE_Dump and USB_TRACE_Export */
+
+/**
+ * @brief Writes an entry into the ring buffer, the oldest entry is overwritten. The slot is reserved with an
+ * 		  atomic increment, so the function can be called from the main loop and interrupt handlers. The
+ * 		  sequence number is written last, readers skip entries which are still written.
+ * @param event USB_TRACE_EVENT.
+ * @param arg8 arg16 arg event specific arguments, see USB_TRACE_EVENT.
+ */
+void USB_TRACE_Record(uint8_t event, uint8_t arg8, uint16_t arg16, uint32_t arg)
+{
+	uint32_t seq = __atomic_fetch_add(&traceBuffer.m_Head, 1, __ATOMIC_RELAXED);
+	volatile USB_TRACE_Entry *entry = &traceBuffer.m_Entries[seq & (USB_TRACE_SIZE - 1)];
+
+	entry->m_Sequence = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	entry->m_Cycles = USB_GetTimer();
+	entry->m_Event = event;
+	entry->m_Arg8 = arg8;
+	entry->m_Arg16 = arg16;
+	entry->m_Arg = arg;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	entry->m_Sequence = seq + 1;
+}
+#endif /* USB_TRACE_ENABLE */
+
+/**
+ * @brief Removes all entries from the ring buffer.
+ */
+void USB_TRACE_Clear()
+{
+#if USB_TRACE_ENABLE
+	traceBuffer.m_Head = 0;
+	for(uint32_t i = 0; i < USB_TRACE_SIZE; i++)
+		traceBuffer.m_Entries[i].m_Sequence = 0;
+#endif /* USB_TRACE_ENABLE */
+}
+
+/**
+ * @brief Copies the newest entries of the ring buffer, oldest first. Entries which are overwritten or written
+ * 		  while copying are skipped. The buffer is not cleared.
+ * @param entries returns the entries.
+ * @param maxEntries size of entries.
+ * @param dropped returns the number of entries recorded since the last clear which were not copied, may be NULL.
+ * @return Number of copied entries, 0 if the trace is disabled.
+ */
+uint32_t USB_TRACE_Read(USB_TRACE_Entry *entries, uint32_t maxEntries, uint32_t *dropped)
+{
+	uint32_t count = 0;
+#if USB_TRACE_ENABLE
+	uint32_t head = traceBuffer.m_Head;
+	uint32_t first = (head > USB_TRACE_SIZE) ? head - USB_TRACE_SIZE : 0;
+	if(entries && head - first > maxEntries)
+		first = head - maxEntries;
+
+	for(uint32_t seq = first; entries && seq != head; seq++)
+	{
+		volatile USB_TRACE_Entry *entry = &traceBuffer.m_Entries[seq & (USB_TRACE_SIZE - 1)];
+		if(entry->m_Sequence != seq + 1)
+			continue;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		entries[count].m_Sequence = seq + 1;
+		entries[count].m_Cycles = entry->m_Cycles;
+		entries[count].m_Event = entry->m_Event;
+		entries[count].m_Arg8 = entry->m_Arg8;
+		entries[count].m_Arg16 = entry->m_Arg16;
+		entries[count].m_Arg = entry->m_Arg;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		if(entry->m_Sequence == seq + 1)
+			count++;
+	}
+	if(dropped)
+		*dropped = head - count;
+#else
+	if(dropped)
+		*dropped = 0;
+#endif /* USB_TRACE_ENABLE */
+	return count;
+}
+
+/**
+ * @brief Prints the ring buffer with printf (semihosting on the target, stdout on the host build).
+ * 		  Each line contains the time since the first printed entry and since the previous entry in ns.
+ */
+void USB_TRACE_Dump()
+{
+#if USB_TRACE_ENABLE
+	USB_TRACE_Entry *entries = traceSnapshot;
+	uint32_t dropped;
+	uint32_t count = USB_TRACE_Read(entries, USB_TRACE_SIZE, &dropped);
+
+	printf("%8s %12s %10s %-18s %5s %6s %10s\n", "seq", "time[ns]", "delta[ns]", "event", "arg8", "arg16", "arg");
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t sinceStart = USB_TransformClockFrequencyToNs(entries[i].m_Cycles - entries[0].m_Cycles);
+		uint32_t delta = (i == 0) ? 0 : USB_TransformClockFrequencyToNs(entries[i].m_Cycles - entries[i - 1].m_Cycles);
+		printf("%8lu %12lu %10lu %-18s %5u %6u %10lu\n", (unsigned long)entries[i].m_Sequence, (unsigned long)sinceStart,
+				(unsigned long)delta, USB_TRACE_EventName(entries[i].m_Event), entries[i].m_Arg8, entries[i].m_Arg16,
+				(unsigned long)entries[i].m_Arg);
+	}
+	printf("%lu entries, %lu older entries overwritten\n", (unsigned long)count, (unsigned long)dropped);
+#else
+	printf("trace disabled, build with USB_TRACE_ENABLE=1\n");
+#endif /* USB_TRACE_ENABLE */
+}
+
+/**
+ * @brief Serializes the newest entries of the ring buffer into the binary format described in usb_trace.h.
+ * 		  Not reentrant, the snapshot buffer is shared with USB_TRACE_Dump.
+ * @param buffer returns the header and the entries.
+ * @param size size of buffer, USB_TRACE_EXPORT_SIZE holds the complete ring buffer.
+ * @return Number of bytes written, 0 if size is smaller than the header. Without USB_TRACE_ENABLE only the
+ * 		   header without entries is written.
+ */
+uint32_t USB_TRACE_Export(uint8_t *buffer, uint32_t size)
+{
+	uint32_t count = 0, dropped = 0;
+
+	if(!buffer || size < USB_TRACE_HEADER_SIZE)
+		return 0;
+#if USB_TRACE_ENABLE
+	count = USB_TRACE_Read(traceSnapshot, (size - USB_TRACE_HEADER_SIZE) / USB_TRACE_ENTRY_SIZE, &dropped);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint8_t *dst = buffer + USB_TRACE_HEADER_SIZE + i * USB_TRACE_ENTRY_SIZE;
+		USB_TRACE_Put32(dst, traceSnapshot[i].m_Sequence);
+		USB_TRACE_Put32(dst + 4, traceSnapshot[i].m_Cycles);
+		dst[8] = traceSnapshot[i].m_Event;
+		dst[9] = traceSnapshot[i].m_Arg8;
+		USB_TRACE_Put16(dst + 10, traceSnapshot[i].m_Arg16);
+		USB_TRACE_Put32(dst + 12, traceSnapshot[i].m_Arg);
+	}
+#endif /* USB_TRACE_ENABLE */
+
+	USB_TRACE_Put32(buffer, USB_TRACE_MAGIC);
+	USB_TRACE_Put16(buffer + 4, USB_TRACE_FORMAT_VERSION);
+	USB_TRACE_Put16(buffer + 6, USB_TRACE_ENTRY_SIZE);
+	USB_TRACE_Put32(buffer + 8, SystemCoreClock);
+	USB_TRACE_Put32(buffer + 12, count);
+	USB_TRACE_Put32(buffer + 16, dropped);
+	USB_TRACE_Put32(buffer + 20, 0);
+	return USB_TRACE_HEADER_SIZE + count * USB_TRACE_ENTRY_SIZE;
+}
+
+/**
+ * @brief Prints the binary export of the ring buffer as hex lines with printf, for targets without a file system
+ * 		  to write to. Each line starts with "USBT ", the last line is "USBT END". usb_trace2json reads the
+ * 		  captured console output and ignores all other lines.
+ */
+void USB_TRACE_DumpBinary()
+{
+#if USB_TRACE_ENABLE
+	static uint8_t exportBuffer[USB_TRACE_EXPORT_SIZE];
+#else
+	static uint8_t exportBuffer[USB_TRACE_HEADER_SIZE];
+#endif /* USB_TRACE_ENABLE */
+	uint32_t size = USB_TRACE_Export(exportBuffer, sizeof(exportBuffer));
+
+	for(uint32_t pos = 0; pos < size; pos += USB_TRACE_DUMP_LINE_SIZE)
+	{
+		printf("USBT ");
+		for(uint32_t i = pos; i < size && i < pos + USB_TRACE_DUMP_LINE_SIZE; i++)
+			printf("%02x", exportBuffer[i]);
+		printf("\n");
+	}
+	printf("USBT END\n");
+}
+
+/**
+ * @brief Returns the name of a trace event.
+ * @param event USB_TRACE_EVENT.
+ * @return name of the event or "UNKNOWN".
+ */
+const char* USB_TRACE_EventName(uint8_t event)
+{
+	static const char *names[USB_TRACE_EVENT_COUNT] = {
+		"UNKNOWN", "FS_WRITE_BEGIN", "FS_WRITE_END", "FS_SYNC_BEGIN", "FS_SYNC_END",
+		"DISK_READ_BEGIN", "DISK_READ_END", "DISK_WRITE_BEGIN", "DISK_WRITE_END",
+		"MSC_READ_BEGIN", "MSC_READ_END", "MSC_WRITE_BEGIN", "MSC_WRITE_END",
+		"BOT_STATE", "URB_SUBMIT", "URB_DONE", "IRQ_BEGIN", "IRQ_END"
+	};
+	if(event >= USB_TRACE_EVENT_COUNT)
+		return names[0];
+	return names[event];
+}
+
+static void USB_TRACE_Put16(uint8_t *dst, uint16_t value)
+{
+	dst[0] = (uint8_t)value;
+	dst[1] = (uint8_t)(value >> 8);
+}
+
+static void USB_TRACE_Put32(uint8_t *dst, uint32_t value)
+{
+	USB_TRACE_Put16(dst, (uint16_t)value);
+	USB_TRACE_Put16(dst + 2, (uint16_t)(value >> 16));
+}
@@ -0,0 +1,308 @@
+/*
+ * usb_trim.c
+ *
+ *  TRIM of freed clusters, see usb_trim.h.
+ */
+
+#include "usb_trim.h"
+#include "usb_unit.h"
+#include "usbh_msc.h"
+#include "usb_volume.h"
+#include "diskio.h"
+
+#define USB_TRIM_MAX_LENGTH		0xFFFFFFFF	/* Largest length of an UNMAP block descriptor. */
+
+static SCSI_UnmapRangeTypeDef pendingRanges[SCSI_UNMAP_MAX_RANGES];
+static uint8_t pendingCount = 0;
+static uint8_t pendingLun = 0;
+static uint64_t pendingBlocks = 0;			/* Blocks of pendingRanges */
+static uint32_t scanCluster = 0;			/* Next cluster of USB_TRIM_FreeSpace, 0 starts a new pass */
+static WORD scanVolume = 0;					/* Mount ID of the scanned volume */
+static uint8_t sectorBuffer[_MAX_SS];
+static USB_TRIM_STATS trimStats;
+
+/** Internally defined **/
+static USBH_StatusTypeDef USB_TRIM_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode);
+static USBH_StatusTypeDef USB_TRIM_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *opcode);
+static void USB_TRIM_AddClusters(USBH_HandleTypeDef *phost, uint8_t lun, FATFS *fs, uint32_t first, uint32_t last);
+
+/** Helper functions **/
+static uint64_t USB_TRIM_AlignUp(uint64_t block, uint32_t granularity, uint32_t alignment);
+static uint64_t USB_TRIM_AlignDown(uint64_t block, uint32_t granularity, uint32_t alignment);
+static BOOL USB_TRIM_ClusterFree(FATFS *fs, uint32_t cluster);
+
+
+/**
+ * @brief Collects a range of freed sectors, called for CTRL_TRIM. Collected ranges are sent when the list is full,
+ * 		  before an overlapping write and at CTRL_SYNC.
+ * @param first first sector of the range.
+ * @param last last sector of the range.
+ */
+void USB_TRIM_Add(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t first, uint32_t last)
+{
+	MSC_LUNTypeDef info;
+
+	trimStats.m_Ranges++;
+	if(last < first || lun >= MAX_SUPPORTED_LUN || USBH_MSC_GetLUNInfo(phost, lun, &info) != USBH_OK
+			|| (info.limits.provisioning & SCSI_LBP_UNMAP) == 0)
+	{
+		trimStats.m_Skipped++;
+		return;
+	}
+	if(pendingCount > 0 && lun != pendingLun)
+		USB_TRIM_Flush(phost);
+	pendingLun = lun;
+
+	// Only whole unmap granules are released by the device
+	uint64_t start = first, end = (uint64_t)last + 1;
+	if(info.limits.unmap_granularity > 1)
+	{
+		start = USB_TRIM_AlignUp(start, info.limits.unmap_granularity, info.limits.unmap_alignment);
+		end = USB_TRIM_AlignDown(end, info.limits.unmap_granularity, info.limits.unmap_alignment);
+	}
+	if(end <= start)
+	{
+		trimStats.m_Skipped++;
+		return;
+	}
+
+	uint64_t maxBlocks = info.limits.max_unmap_blocks ? info.limits.max_unmap_blocks : USB_TRIM_MAX_LENGTH;
+	uint8_t maxRanges = SCSI_UNMAP_MAX_RANGES;
+	if(info.limits.max_unmap_descriptors != 0 && info.limits.max_unmap_descriptors < maxRanges)
+		maxRanges = (uint8_t)info.limits.max_unmap_descriptors;
+
+	while(start < end)
+	{
+		SCSI_UnmapRangeTypeDef *prev = (pendingCount > 0) ? &pendingRanges[pendingCount - 1] : NULL;
+		BOOL merge = prev && prev->address + prev->length == start && prev->length < USB_TRIM_MAX_LENGTH;
+		if(pendingBlocks >= maxBlocks || (!merge && pendingCount >= maxRanges))
+		{
+			USB_TRIM_Flush(phost);
+			continue;
+		}
+
+		uint64_t length = end - start;
+		if(length > maxBlocks - pendingBlocks)
+			length = maxBlocks - pendingBlocks;
+		if(merge)
+		{
+			if(length > USB_TRIM_MAX_LENGTH - prev->length)
+				length = USB_TRIM_MAX_LENGTH - prev->length;
+			prev->length += (uint32_t)length;
+		}
+		else
+		{
+			pendingRanges[pendingCount].address = start;
+			pendingRanges[pendingCount].length = (uint32_t)length;
+			pendingCount++;
+		}
+		pendingBlocks += length;
+		start += length;
+	}
+}
+
+/**
+ * @brief Called before a write. Sends the collected ranges if one of them overlaps the written sectors, the
+ * 		  clusters were allocated again and the UNMAP must not follow the new data.
+ */
+void USB_TRIM_Write(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t sector, uint32_t count)
+{
+	if(pendingCount == 0 || lun != pendingLun)
+		return;
+	for(uint8_t i = 0; i < pendingCount; i++)
+	{
+		if(sector < pendingRanges[i].address + pendingRanges[i].length
+				&& pendingRanges[i].address < (uint64_t)sector + count)
+		{
+			trimStats.m_EarlyFlushes++;
+			USB_TRIM_Flush(phost);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Sends the collected ranges as one UNMAP command. The ranges are dropped if the command fails.
+ */
+void USB_TRIM_Flush(USBH_HandleTypeDef *phost)
+{
+	if(pendingCount == 0)
+		return;
+
+	if(USBH_MSC_IsIdle(phost, pendingLun) && USB_TRIM_Execute(phost, pendingLun, OPCODE_UNMAP) == USBH_OK)
+	{
+		trimStats.m_Commands++;
+		trimStats.m_Blocks += pendingBlocks;
+	}
+	else
+		trimStats.m_Failed++;
+	pendingCount = 0;
+	pendingBlocks = 0;
+}
+
+/**
+ * @brief Checks if the unit reported UNMAP support in the Logical Block Provisioning VPD page.
+ */
+BOOL USB_TRIM_Supported(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	MSC_LUNTypeDef info;
+	return lun < MAX_SUPPORTED_LUN && USBH_MSC_GetLUNInfo(phost, lun, &info) == USBH_OK
+			&& (info.limits.provisioning & SCSI_LBP_UNMAP) != 0;
+}
+
+/**
+ * @brief Unmaps the free clusters of a mounted volume. Scans up to maxSectors FAT or allocation bitmap sectors,
+ * 		  the next call continues with the following cluster. The ranges of each call are sent before it returns,
+ * 		  FatFs may allocate the clusters afterwards.
+ * @param fs file system object of the mounted volume.
+ * @param maxSectors FAT or bitmap sectors read by this call, at least 1.
+ * @param done returns TRUE if the scan reached the last cluster, the next call starts a new pass.
+ * @return Error Handle containing USB_NO_ERROR if function was successful.
+ */
+USB_ERROR USB_TRIM_FreeSpace(USBH_HandleTypeDef *phost, uint8_t lun, FATFS *fs, uint32_t maxSectors, BOOL *done)
+{
+	*done = FALSE;
+	if(maxSectors == 0)
+		return (USB_ERROR) {USB_PARAM_ERROR, __LINE__};
+	if(!USB_TRIM_Supported(phost, lun) || fs->fs_type == FS_FAT12)
+		return (USB_ERROR) {USB_NOT_SUPPORTED, __LINE__};
+	// A modified FAT or bitmap sector in the window of FatFs is not on the media yet
+	if(fs->wflag)
+		return (USB_ERROR) {USB_BUSY, __LINE__};
+
+	if(scanVolume != fs->id || scanCluster < 2)
+	{
+		scanVolume = fs->id;
+		scanCluster = 2;
+	}
+
+	uint32_t cluster, runStart = 0, sector = 0, sectors = 0;
+	for(cluster = scanCluster; cluster < fs->n_fatent; cluster++)
+	{
+		uint32_t allocSector = USB_VOLUME_AllocSector(fs, cluster);
+		if(allocSector != sector)
+		{
+			if(sectors == maxSectors)
+				break;
+			if(disk_read(fs->drv, sectorBuffer, allocSector, 1) != RES_OK)
+			{
+				USB_TRIM_Flush(phost);
+				return (USB_ERROR) {USB_DISK_ERROR, __LINE__};
+			}
+			sector = allocSector;
+			sectors++;
+		}
+
+		if(USB_TRIM_ClusterFree(fs, cluster))
+		{
+			if(runStart == 0)
+				runStart = cluster;
+		}
+		else if(runStart != 0)
+		{
+			USB_TRIM_AddClusters(phost, lun, fs, runStart, cluster - 1);
+			runStart = 0;
+		}
+	}
+	if(runStart != 0)
+		USB_TRIM_AddClusters(phost, lun, fs, runStart, cluster - 1);
+	USB_TRIM_Flush(phost);
+
+	scanCluster = cluster;
+	if(cluster >= fs->n_fatent)
+	{
+		scanCluster = 0;
+		trimStats.m_ScanPasses++;
+		*done = TRUE;
+	}
+	return (USB_ERROR) {USB_NO_ERROR, __LINE__};
+}
+
+/**
+ * @brief Called when the device was detached, collected ranges are dropped.
+ */
+void USB_TRIM_Detach()
+{
+	pendingCount = 0;
+	pendingBlocks = 0;
+	scanCluster = 0;
+}
+
+void USB_TRIM_GetStats(USB_TRIM_STATS *stats)
+{
+	*stats = trimStats;
+}
+
+/**
+ * @brief Sends UNMAP with the collected ranges and waits for the CSW. The sense data of a failed command is
+ * 		  requested and passed to usb_unit.h, e.g. a medium change.
+ * @param opcode OPCODE_UNMAP or OPCODE_REQUEST_SENSE.
+ */
+static USBH_StatusTypeDef USB_TRIM_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+	USBH_StatusTypeDef status = USBH_MSC_ExecuteSync(phost, lun, USB_TRIM_Command, &opcode, USB_TRIM_COMMAND_TIMEOUT_MS);
+
+	if(opcode == OPCODE_UNMAP && status == USBH_FAIL && phost->device.is_connected != 0U
+			&& USB_TRIM_Execute(phost, lun, OPCODE_REQUEST_SENSE) == USBH_OK)
+		USB_UNIT_Sense(lun, &MSC_Handle->unit[lun].sense);
+	return status;
+}
+
+static USBH_StatusTypeDef USB_TRIM_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *opcode)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	if(*(uint8_t*)opcode == OPCODE_UNMAP)
+		return USBH_MSC_SCSI_Unmap(phost, lun, pendingRanges, pendingCount);
+	return USBH_MSC_SCSI_RequestSense(phost, lun, &MSC_Handle->unit[lun].sense);
+}
+
+/**
+ * @brief Collects the sectors of a run of free clusters.
+ * @param first first free cluster.
+ * @param last last free cluster of the run.
+ */
+static void USB_TRIM_AddClusters(USBH_HandleTypeDef *phost, uint8_t lun, FATFS *fs, uint32_t first, uint32_t last)
+{
+	USB_TRIM_Add(phost, lun, fs->database + (first - 2) * fs->csize, fs->database + (last - 1) * fs->csize - 1);
+}
+
+/**
+ * @brief Rounds a block up to the next unmap granule, granules start at alignment + n * granularity.
+ */
+static uint64_t USB_TRIM_AlignUp(uint64_t block, uint32_t granularity, uint32_t alignment)
+{
+	alignment %= granularity;
+	if(block <= alignment)
+		return alignment;
+	return alignment + (block - alignment + granularity - 1) / granularity * granularity;
+}
+
+static uint64_t USB_TRIM_AlignDown(uint64_t block, uint32_t granularity, uint32_t alignment)
+{
+	alignment %= granularity;
+	if(block < alignment)
+		return 0;
+	return alignment + (block - alignment) / granularity * granularity;
+}
+
+/**
+ * @brief Checks the state of a cluster in the sector of USB_VOLUME_AllocSector, which is in sectorBuffer.
+ */
+static BOOL USB_TRIM_ClusterFree(FATFS *fs, uint32_t cluster)
+{
+	const uint8_t *entry;
+
+	switch(fs->fs_type)
+	{
+	case FS_EXFAT:
+		return (sectorBuffer[(cluster - 2) / 8 % USB_VOLUME_SECTOR_SIZE(fs)] & (1 << ((cluster - 2) % 8))) == 0;
+	case FS_FAT32:
+		entry = &sectorBuffer[cluster * 4 % USB_VOLUME_SECTOR_SIZE(fs)];
+		return ((entry[0] | ((uint32_t)entry[1] << 8) | ((uint32_t)entry[2] << 16) | ((uint32_t)entry[3] << 24)) & 0x0FFFFFFF) == 0;
+	default:
+		entry = &sectorBuffer[cluster * 2 % USB_VOLUME_SECTOR_SIZE(fs)];
+		return (entry[0] | (entry[1] << 8)) == 0;
+	}
+}
@@ -0,0 +1,270 @@
+/*
+ * usb_tuning.c
+ *
+ *  Transfer size and alignment tuning per device, see usb_tuning.h.
+ */
+
+#include "usb_tuning.h"
+#include "usb_time_measurement.h"
+#include "usbh_msc.h"
+#include "usb_attach.h"
+#include <string.h>
+
+/* Active tuning, read by USBH_read and USBH_write */
+USB_TRANSFER_TUNING usbTransferTuning = { 0, 0, "", USB_TUNING_DEVICE_MAX_SECTORS, 1, 0, 0, FALSE };
+
+static USB_TRANSFER_TUNING tuningCache[USB_TUNING_CACHE_ENTRIES];
+static uint32_t tuningCacheNext = 0;		/* Entry replaced next */
+static USB_TRANSFER_TUNING attachedDevice;	/* Key of the attached device */
+static BOOL deviceAttached = FALSE;
+static uint32_t deviceMaxSectors = USB_TUNING_DEVICE_MAX_SECTORS;	/* Maximum transfer length of the attached device */
+static uint32_t deviceOptimalSectors = 0;	/* Block Limits VPD page of the attached device, 0 if not reported */
+static uint32_t deviceGranularity = 0;
+
+/** Internally defined **/
+static USBH_StatusTypeDef USB_TUNING_Measure(USBH_HandleTypeDef *phost, uint8_t lun, BOOL write, uint32_t sector,
+		uint32_t sectors, uint32_t commands, uint8_t *buffer, uint32_t blockSize, uint32_t *kbs);
+static USB_TRANSFER_TUNING *USB_TUNING_Find(const USB_TRANSFER_TUNING *key);
+static void USB_TUNING_Store(const USB_TRANSFER_TUNING *tuning);
+static void USB_TUNING_SetDefaults(USB_TRANSFER_TUNING *tuning);
+static void USB_TUNING_Apply(const USB_TRANSFER_TUNING *tuning);
+
+/** Helper functions **/
+static BOOL USB_TUNING_SameDevice(const USB_TRANSFER_TUNING *a, const USB_TRANSFER_TUNING *b);
+static uint32_t USB_TUNING_CombinedKBs(uint32_t writeKBs, uint32_t readKBs);
+
+
+/**
+ * @brief Takes the VID, PID and serial number of the device when the MSC class is active and applies
+ * 		  the cached tuning of the device. Unknown devices start with the defaults, which follow the optimal
+ * 		  transfer length and granularity if the device reports them.
+ * @param phost host handle in the state HOST_CLASS.
+ */
+void USB_TUNING_Attach(USBH_HandleTypeDef *phost)
+{
+	memset(&attachedDevice, 0x00, sizeof(attachedDevice));
+	attachedDevice.m_VendorID = phost->device.DevDesc.idVendor;
+	attachedDevice.m_ProductID = phost->device.DevDesc.idProduct;
+	USB_ATTACH_GetSerial(attachedDevice.m_Serial);
+	deviceAttached = TRUE;
+	deviceMaxSectors = USBH_MSC_GetMaxTransfer(phost, 0);
+	USBH_MSC_GetOptimalTransfer(phost, 0, &deviceOptimalSectors, &deviceGranularity);
+
+	USB_TRANSFER_TUNING *cached = USB_TUNING_Find(&attachedDevice);
+	if(cached)
+		USB_TUNING_Apply(cached);
+	else
+	{
+		USB_TRANSFER_TUNING defaults = attachedDevice;
+		USB_TUNING_SetDefaults(&defaults);
+		USB_TUNING_Apply(&defaults);
+	}
+}
+
+/**
+ * @brief Falls back to the defaults after the device was removed. The cache is kept.
+ */
+void USB_TUNING_Detach()
+{
+	deviceAttached = FALSE;
+	deviceMaxSectors = USB_TUNING_DEVICE_MAX_SECTORS;
+	deviceOptimalSectors = 0;
+	deviceGranularity = 0;
+	memset(&usbTransferTuning, 0x00, sizeof(usbTransferTuning));
+	USB_TUNING_SetDefaults(&usbTransferTuning);
+}
+
+/**
+ * @brief Measures the write and read throughput of the transfer sizes from USB_TUNING_MIN_BYTES up to the buffer
+ * 		  size, each aligned to the transfer size and shifted by one sector. The result is applied and cached
+ * 		  for the attached device. The area is overwritten.
+ * @param phost host handle in the state HOST_CLASS.
+ * @param lun logical unit.
+ * @param sector first sector of the scratch area.
+ * @param sectorCount size of the scratch area, at least USB_TUNING_AREA_SIZE(bufferSize) bytes.
+ * @param buffer data buffer of the commands, 4 byte aligned for DMA.
+ * @param bufferSize size of the buffer, the largest probed transfer size.
+ * @param report Output: measured throughput of each transfer size, may be NULL.
+ * @return USBH_OK if all commands were successful, USBH_NOT_SUPPORTED if the area or the buffer is too small.
+ */
+USBH_StatusTypeDef USB_TUNING_Probe(USBH_HandleTypeDef *phost, uint8_t lun, uint32_t sector, uint32_t sectorCount,
+		uint8_t *buffer, uint32_t bufferSize, USB_TUNING_REPORT *report)
+{
+	USB_TUNING_SAMPLE samples[USB_TUNING_SIZES];
+	MSC_LUNTypeDef info;
+	USBH_StatusTypeDef status;
+	uint32_t sampleCount = 0;
+
+	if(USBH_MSC_GetLUNInfo(phost, lun, &info) != USBH_OK || info.capacity.block_size == 0)
+		return USBH_FAIL;
+
+	uint32_t blockSize = info.capacity.block_size;
+	uint32_t maxSectors = bufferSize / blockSize;
+	if(maxSectors > USBH_MSC_GetMaxTransfer(phost, lun))
+		maxSectors = USBH_MSC_GetMaxTransfer(phost, lun);
+	uint32_t probeSectors = USB_TUNING_PROBE_BYTES / blockSize;
+	uint32_t minSectors = (USB_TUNING_MIN_BYTES > blockSize) ? USB_TUNING_MIN_BYTES / blockSize : 1;
+	if(maxSectors < minSectors || sectorCount < probeSectors + 2 * maxSectors)
+		return USBH_NOT_SUPPORTED;
+
+	for(uint32_t sectors = minSectors; sectors <= maxSectors && sampleCount < USB_TUNING_SIZES; sectors *= 2)
+	{
+		USB_TUNING_SAMPLE *sample = &samples[sampleCount++];
+		uint32_t commands = (probeSectors > sectors) ? probeSectors / sectors : 1;
+		uint32_t base = (sector + sectors - 1) / sectors * sectors;
+
+		sample->m_Sectors = sectors;
+		if((status = USB_TUNING_Measure(phost, lun, TRUE, base, sectors, commands, buffer, blockSize, &sample->m_WriteKBs)) != USBH_OK
+				|| (status = USB_TUNING_Measure(phost, lun, FALSE, base, sectors, commands, buffer, blockSize, &sample->m_ReadKBs)) != USBH_OK
+				|| (status = USB_TUNING_Measure(phost, lun, TRUE, base + 1, sectors, commands, buffer, blockSize, &sample->m_UnalignedWriteKBs)) != USBH_OK
+				|| (status = USB_TUNING_Measure(phost, lun, FALSE, base + 1, sectors, commands, buffer, blockSize, &sample->m_UnalignedReadKBs)) != USBH_OK)
+			return status;
+	}
+
+	// Smallest transfer size which reaches the threshold of the best combined throughput
+	uint32_t best = 0, chosen = 0;
+	for(uint32_t i = 0; i < sampleCount; i++)
+	{
+		uint32_t kbs = USB_TUNING_CombinedKBs(samples[i].m_WriteKBs, samples[i].m_ReadKBs);
+		if(kbs > best)
+			best = kbs;
+	}
+	while((uint64_t)USB_TUNING_CombinedKBs(samples[chosen].m_WriteKBs, samples[chosen].m_ReadKBs) * 100
+			< (uint64_t)best * USB_TUNING_THRESHOLD_PERCENT)
+		chosen++;
+
+	USB_TRANSFER_TUNING tuning = attachedDevice;
+	USB_TUNING_SAMPLE *sample = &samples[chosen];
+	tuning.m_MaxSectors = sample->m_Sectors;
+	tuning.m_AlignSectors = 1;
+	if((uint64_t)USB_TUNING_CombinedKBs(sample->m_UnalignedWriteKBs, sample->m_UnalignedReadKBs) * 100
+			< (uint64_t)USB_TUNING_CombinedKBs(sample->m_WriteKBs, sample->m_ReadKBs) * USB_TUNING_ALIGN_PERCENT)
+		tuning.m_AlignSectors = sample->m_Sectors;
+	tuning.m_WriteKBs = sample->m_WriteKBs;
+	tuning.m_ReadKBs = sample->m_ReadKBs;
+	tuning.m_Calibrated = TRUE;
+	USB_TUNING_Set(&tuning);
+
+	if(report)
+	{
+		report->m_SampleCount = sampleCount;
+		memcpy(report->m_Samples, samples, sampleCount * sizeof(USB_TUNING_SAMPLE));
+	}
+	return USBH_OK;
+}
+
+/**
+ * @brief Copies the active tuning. Contains the VID, PID and serial number of the attached device.
+ * @param tuning returns the copy.
+ */
+void USB_TUNING_Get(USB_TRANSFER_TUNING *tuning)
+{
+	*tuning = usbTransferTuning;
+}
+
+/**
+ * @brief Stores a tuning in the cache, e.g. a result of USB_TUNING_Probe persisted by the application.
+ * 		  It is applied immediately if it belongs to the attached device.
+ * @param tuning tuning and key of the device. A m_MaxSectors of 0 and a m_AlignSectors of 0 select the defaults.
+ * 		  m_MaxSectors is limited to the maximum transfer length of the device when the tuning is applied.
+ */
+void USB_TUNING_Set(const USB_TRANSFER_TUNING *tuning)
+{
+	USB_TRANSFER_TUNING entry = *tuning;
+	entry.m_Serial[USB_SERIAL_LENGTH - 1] = '\0';
+	if(entry.m_MaxSectors == 0)
+		entry.m_MaxSectors = USB_TUNING_DEVICE_MAX_SECTORS;
+	if(entry.m_AlignSectors == 0)
+		entry.m_AlignSectors = 1;
+
+	USB_TUNING_Store(&entry);
+	if(deviceAttached && USB_TUNING_SameDevice(&entry, &attachedDevice))
+		USB_TUNING_Apply(&entry);
+}
+
+/**
+ * @brief Times a sequence of commands of the same size at consecutive addresses.
+ * @param kbs returns the throughput in KB/s.
+ */
+static USBH_StatusTypeDef USB_TUNING_Measure(USBH_HandleTypeDef *phost, uint8_t lun, BOOL write, uint32_t sector,
+		uint32_t sectors, uint32_t commands, uint8_t *buffer, uint32_t blockSize, uint32_t *kbs)
+{
+	USBH_StatusTypeDef status = USBH_OK;
+	uint64_t start = USB_GetTimeUs();
+
+	for(uint32_t i = 0; i < commands && status == USBH_OK; i++)
+	{
+		if(write)
+			status = USBH_MSC_Write(phost, lun, sector + i * sectors, buffer, sectors);
+		else
+			status = USBH_MSC_Read(phost, lun, sector + i * sectors, buffer, sectors);
+	}
+
+	uint64_t us = USB_GetTimeUs() - start;
+	uint64_t bytes = (uint64_t)commands * sectors * blockSize;
+	*kbs = (uint32_t)(bytes * 1000000 / 1024 / (us ? us : 1));
+	return status;
+}
+
+static USB_TRANSFER_TUNING *USB_TUNING_Find(const USB_TRANSFER_TUNING *key)
+{
+	for(uint32_t i = 0; i < USB_TUNING_CACHE_ENTRIES; i++)
+	{
+		if(tuningCache[i].m_MaxSectors && USB_TUNING_SameDevice(&tuningCache[i], key))
+			return &tuningCache[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief Replaces the entry of the device or the oldest entry of the cache.
+ */
+static void USB_TUNING_Store(const USB_TRANSFER_TUNING *tuning)
+{
+	USB_TRANSFER_TUNING *entry = USB_TUNING_Find(tuning);
+	if(!entry)
+	{
+		entry = &tuningCache[tuningCacheNext];
+		tuningCacheNext = (tuningCacheNext + 1) % USB_TUNING_CACHE_ENTRIES;
+	}
+	*entry = *tuning;
+}
+
+/**
+ * @brief Uncalibrated devices are split at the optimal transfer length and granularity of the Block Limits
+ * 		  VPD page, devices without the page only at their maximum transfer length.
+ */
+static void USB_TUNING_SetDefaults(USB_TRANSFER_TUNING *tuning)
+{
+	tuning->m_MaxSectors = deviceOptimalSectors ? deviceOptimalSectors : USB_TUNING_DEVICE_MAX_SECTORS;
+	tuning->m_AlignSectors = (deviceGranularity > 1) ? deviceGranularity : 1;
+	tuning->m_WriteKBs = 0;
+	tuning->m_ReadKBs = 0;
+	tuning->m_Calibrated = FALSE;
+}
+
+/**
+ * @brief Activates a tuning, commands are not larger than the maximum transfer length of the device.
+ */
+static void USB_TUNING_Apply(const USB_TRANSFER_TUNING *tuning)
+{
+	usbTransferTuning = *tuning;
+	if(usbTransferTuning.m_MaxSectors > deviceMaxSectors)
+		usbTransferTuning.m_MaxSectors = deviceMaxSectors;
+}
+
+static BOOL USB_TUNING_SameDevice(const USB_TRANSFER_TUNING *a, const USB_TRANSFER_TUNING *b)
+{
+	return a->m_VendorID == b->m_VendorID && a->m_ProductID == b->m_ProductID
+			&& strncmp(a->m_Serial, b->m_Serial, USB_SERIAL_LENGTH) == 0;
+}
+
+/**
+ * @brief Throughput of writing and reading the same amount of data.
+ */
+static uint32_t USB_TUNING_CombinedKBs(uint32_t writeKBs, uint32_t readKBs)
+{
+	if(writeKBs == 0 || readKBs == 0)
+		return 0;
+	return (uint32_t)(2 * (uint64_t)writeKBs * readKBs / ((uint64_t)writeKBs + readKBs));
+}
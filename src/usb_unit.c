@@ -0,0 +1,244 @@
+/*
+ * usb_unit.c
+ *
+ *  Event driven ready state of the logical units, see usb_unit.h.
+ */
+
+#include "usb_unit.h"
+#include "usb_attach.h"
+#include "usbh_diskio_dma.h"
+
+extern Disk_drvTypeDef disk;
+
+static USB_UNIT_INFO unitInfo[MAX_SUPPORTED_LUN];
+static BOOL capacityStale[MAX_SUPPORTED_LUN];	/* READ CAPACITY data is from the previous medium */
+static uint32_t lastPollTimer = 0;
+static uint8_t lastPollLun = 0;
+
+/** Internally defined **/
+static void USB_UNIT_MediumChanged(uint8_t lun);
+static USBH_StatusTypeDef USB_UNIT_ReadCapacity(USBH_HandleTypeDef *phost, uint8_t lun);
+static USBH_StatusTypeDef USB_UNIT_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode);
+static USBH_StatusTypeDef USB_UNIT_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *opcode);
+
+/** Helper functions **/
+static void USB_UNIT_Reinitialize(uint8_t lun);
+static DSTATUS USB_UNIT_StateToStatus(USB_UNIT_STATE state);
+
+
+/**
+ * @brief Called when the class initialization of a unit completed with READ CAPACITY.
+ */
+void USB_UNIT_Attached(uint8_t lun)
+{
+	// A medium was inserted into an empty unit, found by a poll
+	if(unitInfo[lun].m_State == USB_UNIT_NO_MEDIUM)
+		USB_UNIT_MediumChanged(lun);
+	capacityStale[lun] = FALSE;
+	if(unitInfo[lun].m_State != USB_UNIT_MEDIUM_CHANGED)
+		unitInfo[lun].m_State = USB_UNIT_READY;
+}
+
+/**
+ * @brief Called when a command of the unit completed successfully. A unit without medium which becomes ready
+ * 		  has a new medium, a failed unit recovered.
+ */
+void USB_UNIT_Ready(uint8_t lun)
+{
+	switch(unitInfo[lun].m_State)
+	{
+	case USB_UNIT_READY:
+	case USB_UNIT_MEDIUM_CHANGED:
+		break;
+	case USB_UNIT_NO_MEDIUM:
+		USB_UNIT_MediumChanged(lun);
+		break;
+	default:
+		// Not ready or failed, e.g. the unit answers again after a recovery
+		unitInfo[lun].m_State = USB_UNIT_READY;
+		break;
+	}
+}
+
+/**
+ * @brief Updates the state from the sense data of a failed command.
+ * @param sense response of REQUEST SENSE.
+ */
+void USB_UNIT_Sense(uint8_t lun, const SCSI_SenseTypeDef *sense)
+{
+	USB_UNIT_INFO *unit = &unitInfo[lun];
+
+	unit->m_SenseKey = sense->key;
+	unit->m_ASC = sense->asc;
+	unit->m_ASCQ = sense->ascq;
+	if(sense->key == SCSI_SENSE_KEY_NOT_READY)
+		unit->m_State = (sense->asc == SCSI_ASC_MEDIUM_NOT_PRESENT) ? USB_UNIT_NO_MEDIUM : USB_UNIT_NOT_READY;
+	else if(sense->key == SCSI_SENSE_KEY_UNIT_ATTENTION && sense->asc == SCSI_ASC_NOT_READY_TO_READY_CHANGE)
+		USB_UNIT_MediumChanged(lun);
+}
+
+/**
+ * @brief Called when the recovery of a failed command failed.
+ */
+void USB_UNIT_Failed(uint8_t lun)
+{
+	unitInfo[lun].m_State = USB_UNIT_FAILED;
+}
+
+/**
+ * @brief Called when the MSC class is deinitialized, i.e. when the device was detached.
+ */
+void USB_UNIT_Detached()
+{
+	for(uint8_t lun = 0; lun < MAX_SUPPORTED_LUN; lun++)
+	{
+		unitInfo[lun].m_State = USB_UNIT_NOT_PRESENT;
+		capacityStale[lun] = FALSE;
+	}
+}
+
+/**
+ * @brief Called in the idle state of the MSC class. Selects a unit which is not ready, has no medium or failed,
+ * 		  at most every USB_UNIT_POLL_MS. The class state machine sends TEST UNIT READY and READ CAPACITY.
+ * @param lun returns the unit to poll.
+ * @return TRUE if a unit has to be polled.
+ */
+BOOL USB_UNIT_PollDue(USBH_HandleTypeDef *phost, uint8_t *lun)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	if((phost->Timer - lastPollTimer) < USB_UNIT_POLL_MS)
+		return FALSE;
+	lastPollTimer = phost->Timer;
+
+	// Round robin, so that a unit which is never ready does not starve the others
+	for(uint8_t i = 1; i <= MSC_Handle->max_lun; i++)
+	{
+		uint8_t next = (uint8_t)((lastPollLun + i) % MSC_Handle->max_lun);
+		USB_UNIT_STATE state = unitInfo[next].m_State;
+		if((state != USB_UNIT_NOT_READY && state != USB_UNIT_NO_MEDIUM && state != USB_UNIT_FAILED)
+				|| MSC_Handle->unit[next].state != MSC_IDLE)
+			continue;
+		unitInfo[next].m_Polls++;
+		lastPollLun = next;
+		*lun = next;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Returns the status of a unit for disk_status without a bus transaction.
+ */
+DSTATUS USB_UNIT_Status(uint8_t lun)
+{
+	if(lun >= MAX_SUPPORTED_LUN)
+		return STA_NOINIT;
+	unitInfo[lun].m_StatusQueries++;
+	return USB_UNIT_StateToStatus(unitInfo[lun].m_State);
+}
+
+/**
+ * @brief Called by disk_initialize when FatFs mounts the volume. Acknowledges a medium change, READ CAPACITY
+ * 		  is repeated if the change was reported by a read or write. The unit stays in USB_UNIT_MEDIUM_CHANGED
+ * 		  until the capacity of the new medium was read.
+ */
+DSTATUS USB_UNIT_Initialize(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	if(lun >= MAX_SUPPORTED_LUN)
+		return STA_NOINIT;
+	if(unitInfo[lun].m_State == USB_UNIT_MEDIUM_CHANGED)
+	{
+		// FatFs must not mount the new medium with the capacity of the old one, the next mount tries again
+		if(capacityStale[lun])
+		{
+			if(!USBH_MSC_IsIdle(phost, lun) || USB_UNIT_ReadCapacity(phost, lun) != USBH_OK)
+			{
+				USB_UNIT_Reinitialize(lun);
+				return STA_NOINIT;
+			}
+			capacityStale[lun] = FALSE;
+		}
+		unitInfo[lun].m_State = USB_UNIT_READY;
+	}
+	return USB_UNIT_StateToStatus(unitInfo[lun].m_State);
+}
+
+void USB_UNIT_GetInfo(uint8_t lun, USB_UNIT_INFO *info)
+{
+	*info = unitInfo[lun];
+}
+
+static void USB_UNIT_MediumChanged(uint8_t lun)
+{
+	unitInfo[lun].m_State = USB_UNIT_MEDIUM_CHANGED;
+	unitInfo[lun].m_MediaChanges++;
+	capacityStale[lun] = TRUE;
+	// INQUIRY and READ CAPACITY data of the fast attach cache belong to the old medium
+	USB_ATTACH_Invalidate(lun);
+	USB_UNIT_Reinitialize(lun);
+}
+
+/**
+ * @brief READ CAPACITY(10), followed by READ CAPACITY(16) if the unit has more than 2^32 blocks.
+ */
+static USBH_StatusTypeDef USB_UNIT_ReadCapacity(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+	USBH_StatusTypeDef status = USB_UNIT_Execute(phost, lun, OPCODE_READ_CAPACITY10);
+	if(status == USBH_OK && MSC_Handle->unit[lun].capacity.block_nbr == SCSI_CDB10_MAX_LBA)
+		status = USB_UNIT_Execute(phost, lun, OPCODE_READ_CAPACITY16);
+	return status;
+}
+
+/**
+ * @brief Sends a command without data phase or with a response to the class buffers and waits for the CSW.
+ * @param opcode OPCODE_TEST_UNIT_READY, OPCODE_READ_CAPACITY10, OPCODE_READ_CAPACITY16 or OPCODE_REQUEST_SENSE.
+ */
+static USBH_StatusTypeDef USB_UNIT_Execute(USBH_HandleTypeDef *phost, uint8_t lun, uint8_t opcode)
+{
+	return USBH_MSC_ExecuteSync(phost, lun, USB_UNIT_Command, &opcode, USB_UNIT_COMMAND_TIMEOUT_MS);
+}
+
+static USBH_StatusTypeDef USB_UNIT_Command(USBH_HandleTypeDef *phost, uint8_t lun, void *opcode)
+{
+	MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+	switch(*(uint8_t*)opcode)
+	{
+	case OPCODE_TEST_UNIT_READY:
+		return USBH_MSC_SCSI_TestUnitReady(phost, lun);
+	case OPCODE_READ_CAPACITY10:
+		return USBH_MSC_SCSI_ReadCapacity(phost, lun, &MSC_Handle->unit[lun].capacity);
+	case OPCODE_READ_CAPACITY16:
+		return USBH_MSC_SCSI_ReadCapacity16(phost, lun, &MSC_Handle->unit[lun].capacity);
+	default:
+		return USBH_MSC_SCSI_RequestSense(phost, lun, &MSC_Handle->unit[lun].sense);
+	}
+}
+
+/**
+ * @brief The FatFs glue calls disk_initialize of a drive only once. Lets the next mount of the drives linked
+ * 		  to the unit reach USB_UNIT_Initialize, which acknowledges the medium change.
+ */
+static void USB_UNIT_Reinitialize(uint8_t lun)
+{
+	for(uint8_t i = 0; i < disk.nbr; i++)
+	{
+		if(disk.drv[i] == &USBH_Driver && disk.lun[i] == lun)
+			disk.is_initialized[i] = 0;
+	}
+}
+
+static DSTATUS USB_UNIT_StateToStatus(USB_UNIT_STATE state)
+{
+	switch(state)
+	{
+	case USB_UNIT_READY:
+		return 0;
+	case USB_UNIT_NO_MEDIUM:
+		return STA_NOINIT | STA_NODISK;
+	default:
+		return STA_NOINIT;
+	}
+}
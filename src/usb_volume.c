@@ -0,0 +1,250 @@
+/*
+ * usb_volume.c
+ *
+ *  Warm remount of known volumes, see usb_volume.h.
+ */
+
+#include "usb_volume.h"
+#include "usb_record_log.h"
+#include "usb_time_measurement.h"
+#include "diskio.h"
+#include <string.h>
+
+#define USB_VOLUME_UNKNOWN			0xFFFFFFFF	/* Free cluster count or hint not known to FatFs. */
+
+/* Offsets of the volume serial number in the boot sector */
+#define USB_VOLUME_SERIAL_FAT		39
+#define USB_VOLUME_SERIAL_FAT32		67
+#define USB_VOLUME_SERIAL_EXFAT		100
+
+typedef struct {
+	/* Key, compared when the volume is mounted */
+	uint32_t m_VolumeSerial;
+	uint32_t m_BootCRC;
+	uint8_t m_FsType;
+	uint32_t m_VolBase;
+	uint32_t m_FatBase;
+	uint32_t m_DataBase;
+	uint32_t m_FatSize;
+	uint32_t m_Entries;
+	uint32_t m_ClusterSize;
+	/* Allocation state at the capture */
+	uint32_t m_FreeClusters;
+	uint32_t m_LastCluster;
+	BOOL m_FsInfoSynced;		/* FAT32: FSINFO on the media holds m_FreeClusters. */
+	uint32_t m_Samples[USB_VOLUME_SAMPLES];
+	uint32_t m_SampleCRC;
+	BOOL m_Valid;
+} USB_VOLUME_FINGERPRINT;
+
+static USB_VOLUME_FINGERPRINT volumeCache[USB_VOLUME_CACHE_ENTRIES];
+static uint32_t volumeCacheNext = 0;		/* Entry replaced next */
+static USB_VOLUME_FINGERPRINT mountedKey;	/* Key of the mounted volume, m_Valid is FALSE if unknown */
+static uint8_t sectorBuffer[_MAX_SS];
+static USB_VOLUME_STATS volumeStats;
+
+/** Internally defined **/
+static BOOL USB_VOLUME_Check(FATFS *fs);
+static BOOL USB_VOLUME_ReadKey(FATFS *fs, USB_VOLUME_FINGERPRINT *key);
+static BOOL USB_VOLUME_SampleCRC(FATFS *fs, const uint32_t *samples, uint32_t *crc);
+static USB_VOLUME_FINGERPRINT *USB_VOLUME_Find(const USB_VOLUME_FINGERPRINT *key);
+
+/** Helper functions **/
+static BOOL USB_VOLUME_Known(uint32_t value, FATFS *fs);
+
+
+/**
+ * @brief Mounts a volume with f_mount and restores the free cluster count and the allocation hint if the
+ * 		  fingerprint of the volume matches.
+ * @param fs file system object.
+ * @param path logical drive.
+ * @return result of f_mount. Errors of the fingerprint check fall back to a cold mount.
+ */
+FRESULT USB_VOLUME_Mount(FATFS *fs, const TCHAR *path)
+{
+	uint64_t start = USB_GetTimeUs();
+	FRESULT res = f_mount(fs, path, 1);
+	mountedKey.m_Valid = FALSE;
+	if(res != FR_OK)
+		return res;
+
+	volumeStats.m_Mounts++;
+	volumeStats.m_LastWarm = USB_VOLUME_Check(fs);
+	if(volumeStats.m_LastWarm)
+		volumeStats.m_WarmMounts++;
+	volumeStats.m_LastMountUs = (uint32_t)(USB_GetTimeUs() - start);
+	return res;
+}
+
+/**
+ * @brief Takes the fingerprint of the mounted volume. Called after the FAT and the bitmap were written back,
+ * 		  i.e. after f_close or f_sync, skipped while the sector window of FatFs is dirty. Sectors are only
+ * 		  read if clusters were allocated or freed since the last capture.
+ * @param fs file system object.
+ */
+void USB_VOLUME_Capture(FATFS *fs)
+{
+	if(!mountedKey.m_Valid || !fs->fs_type || fs->wflag)
+		return;
+	if(!USB_VOLUME_Known(fs->free_clst, fs) && !USB_VOLUME_Known(fs->last_clst, fs))
+		return;
+
+	USB_VOLUME_FINGERPRINT *entry = USB_VOLUME_Find(&mountedKey);
+	if(entry && entry->m_FreeClusters == fs->free_clst && entry->m_LastCluster == fs->last_clst)
+	{
+		if(fs->fs_type == FS_FAT32 && fs->fsi_flag == 0)
+			entry->m_FsInfoSynced = TRUE;
+		return;
+	}
+	if(!entry)
+	{
+		entry = &volumeCache[volumeCacheNext];
+		volumeCacheNext = (volumeCacheNext + 1) % USB_VOLUME_CACHE_ENTRIES;
+	}
+
+	*entry = mountedKey;
+	entry->m_Valid = FALSE;
+	entry->m_FreeClusters = fs->free_clst;
+	entry->m_LastCluster = fs->last_clst;
+	entry->m_FsInfoSynced = (fs->fs_type == FS_FAT32 && fs->fsi_flag == 0);
+	entry->m_Samples[0] = USB_VOLUME_AllocSector(fs, 2);
+	entry->m_Samples[1] = USB_VOLUME_AllocSector(fs, USB_VOLUME_Known(fs->last_clst, fs) ? fs->last_clst : 2);
+	entry->m_Samples[2] = USB_VOLUME_AllocSector(fs, fs->n_fatent - 1);
+	if(!USB_VOLUME_SampleCRC(fs, entry->m_Samples, &entry->m_SampleCRC))
+		return;
+	entry->m_Valid = TRUE;
+	volumeStats.m_Captures++;
+}
+
+void USB_VOLUME_GetStats(USB_VOLUME_STATS *stats)
+{
+	*stats = volumeStats;
+}
+
+/**
+ * @brief Returns the FAT sector or, on exFAT, the allocation bitmap sector of a cluster. FatFs expects
+ * 		  the bitmap in the first cluster of the data area. A FAT12 entry may span two sectors, the
+ * 		  sector of its first byte is returned.
+ */
+uint32_t USB_VOLUME_AllocSector(FATFS *fs, uint32_t cluster)
+{
+	switch(fs->fs_type)
+	{
+	case FS_EXFAT:
+		return fs->database + (cluster - 2) / 8 / USB_VOLUME_SECTOR_SIZE(fs);
+	case FS_FAT32:
+		return fs->fatbase + cluster * 4 / USB_VOLUME_SECTOR_SIZE(fs);
+	case FS_FAT16:
+		return fs->fatbase + cluster * 2 / USB_VOLUME_SECTOR_SIZE(fs);
+	default:
+		return fs->fatbase + (cluster + cluster / 2) / USB_VOLUME_SECTOR_SIZE(fs);
+	}
+}
+
+/**
+ * @brief Compares the mounted volume with its fingerprint and restores the allocation state.
+ * @return TRUE if the mount is warm.
+ */
+static BOOL USB_VOLUME_Check(FATFS *fs)
+{
+	if(!USB_VOLUME_ReadKey(fs, &mountedKey))
+		return FALSE;
+	mountedKey.m_Valid = TRUE;
+
+	USB_VOLUME_FINGERPRINT *entry = USB_VOLUME_Find(&mountedKey);
+	if(!entry)
+		return FALSE;
+
+	// A different free cluster count in a synced FSINFO sector was written by another host
+	uint32_t crc;
+	BOOL match = !(entry->m_FsInfoSynced && fs->free_clst != entry->m_FreeClusters);
+	if(match)
+		match = USB_VOLUME_SampleCRC(fs, entry->m_Samples, &crc) && crc == entry->m_SampleCRC;
+	if(!match)
+	{
+		entry->m_Valid = FALSE;
+		volumeStats.m_Mismatches++;
+		return FALSE;
+	}
+
+	// FSINFO was not written back before the device was removed
+	if(fs->fs_type == FS_FAT32 && !(fs->fsi_flag & 0x80) && fs->free_clst != entry->m_FreeClusters)
+		fs->fsi_flag |= 1;
+	fs->free_clst = entry->m_FreeClusters;
+	fs->last_clst = entry->m_LastCluster;
+	return TRUE;
+}
+
+/**
+ * @brief Reads the boot sector and fills the key of the fingerprint.
+ */
+static BOOL USB_VOLUME_ReadKey(FATFS *fs, USB_VOLUME_FINGERPRINT *key)
+{
+	uint32_t offset;
+
+	memset(key, 0x00, sizeof(USB_VOLUME_FINGERPRINT));
+	if(disk_read(fs->drv, sectorBuffer, fs->volbase, 1) != RES_OK)
+		return FALSE;
+
+	switch(fs->fs_type)
+	{
+	case FS_EXFAT:
+		offset = USB_VOLUME_SERIAL_EXFAT;
+		break;
+	case FS_FAT32:
+		offset = USB_VOLUME_SERIAL_FAT32;
+		break;
+	default:
+		offset = USB_VOLUME_SERIAL_FAT;
+		break;
+	}
+	key->m_VolumeSerial = (uint32_t)sectorBuffer[offset] | ((uint32_t)sectorBuffer[offset + 1] << 8)
+			| ((uint32_t)sectorBuffer[offset + 2] << 16) | ((uint32_t)sectorBuffer[offset + 3] << 24);
+	key->m_BootCRC = USB_CalculateCRC32(0, sectorBuffer, USB_VOLUME_SECTOR_SIZE(fs));
+	key->m_FsType = fs->fs_type;
+	key->m_VolBase = fs->volbase;
+	key->m_FatBase = fs->fatbase;
+	key->m_DataBase = fs->database;
+	key->m_FatSize = fs->fsize;
+	key->m_Entries = fs->n_fatent;
+	key->m_ClusterSize = fs->csize;
+	return TRUE;
+}
+
+/**
+ * @brief Calculates the CRC of the sampled FAT or bitmap sectors on the media.
+ */
+static BOOL USB_VOLUME_SampleCRC(FATFS *fs, const uint32_t *samples, uint32_t *crc)
+{
+	*crc = 0;
+	for(uint32_t i = 0; i < USB_VOLUME_SAMPLES; i++)
+	{
+		if(disk_read(fs->drv, sectorBuffer, samples[i], 1) != RES_OK)
+			return FALSE;
+		*crc = USB_CalculateCRC32(*crc, sectorBuffer, USB_VOLUME_SECTOR_SIZE(fs));
+	}
+	return TRUE;
+}
+
+static USB_VOLUME_FINGERPRINT *USB_VOLUME_Find(const USB_VOLUME_FINGERPRINT *key)
+{
+	for(uint32_t i = 0; i < USB_VOLUME_CACHE_ENTRIES; i++)
+	{
+		USB_VOLUME_FINGERPRINT *entry = &volumeCache[i];
+		if(entry->m_Valid && entry->m_VolumeSerial == key->m_VolumeSerial && entry->m_BootCRC == key->m_BootCRC
+				&& entry->m_FsType == key->m_FsType && entry->m_VolBase == key->m_VolBase
+				&& entry->m_FatBase == key->m_FatBase && entry->m_DataBase == key->m_DataBase
+				&& entry->m_FatSize == key->m_FatSize && entry->m_Entries == key->m_Entries
+				&& entry->m_ClusterSize == key->m_ClusterSize)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Checks if a free cluster count or an allocation hint of FatFs is valid.
+ */
+static BOOL USB_VOLUME_Known(uint32_t value, FATFS *fs)
+{
+	return value != USB_VOLUME_UNKNOWN && value < fs->n_fatent;
+}
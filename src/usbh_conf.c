@@ -19,6 +19,8 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_hal.h"
 #include "usbh_core.h"
+#include "usb_trace.h"
+#include "usb_attach.h"
 
 /* Private define ------------------------------------------------------------*/
 #define HOST_POWERSW_PORT                 GPIOC
@@ -156,6 +158,7 @@ void HAL_HCD_PortDisabled_Callback(HCD_HandleTypeDef *hhcd)
 void HAL_HCD_HC_NotifyURBChange_Callback(HCD_HandleTypeDef *hhcd, uint8_t chnum, HCD_URBStateTypeDef urb_state)
 {
   /* To be used with OS to sync URB state with the global state machine */  
+  USB_TRACE(USB_TRACE_URB_DONE, chnum, urb_state, hhcd->hc[chnum].xfer_count);
 }
 
 /*******************************************************************************
@@ -353,7 +356,7 @@ USBH_StatusTypeDef USBH_LL_SubmitURB(USBH_HandleTypeDef *phost,
                                      uint16_t length,
                                      uint8_t do_ping ) 
 {
-
+  USB_TRACE(USB_TRACE_URB_SUBMIT, pipe, length, ((uint32_t)direction << 8) | ep_type);
   HAL_HCD_HC_SubmitRequest(phost->pData,pipe, 
                            direction,
                            ep_type,  
@@ -417,7 +420,11 @@ USBH_StatusTypeDef USBH_LL_DriverVBUS(USBH_HandleTypeDef *phost, uint8_t state)
     HAL_GPIO_WritePin(HOST_POWERSW_PORT, HOST_POWERSW_VBUS, GPIO_PIN_RESET);
   }
   
-  HAL_Delay(200);
+  /* The fast attach waits for the connect debounce interval instead */
+  if ((0 == state) || !USB_ATTACH_IsFast())
+  {
+    HAL_Delay(200);
+  }
   return USBH_OK;  
 }
 
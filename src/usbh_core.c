@@ -20,6 +20,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "usbh_core.h"
+#include "usb_attach.h"
 
 
 /** @addtogroup USBH_LIB
@@ -471,11 +472,20 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
 
       if (phost->device.is_connected)
       {
+        /* Fast attach: wait for the connect debounce interval without blocking */
+        if (!USB_ATTACH_Debounced())
+        {
+          break;
+        }
         USBH_UsrLog("USB Device Connected");
 
         /* Wait for 200 ms after connection */
         phost->gState = HOST_DEV_WAIT_FOR_ATTACHMENT;
-        USBH_Delay(200U);
+        if (!USB_ATTACH_IsFast())
+        {
+          USBH_Delay(200U);
+        }
+        USB_ATTACH_Mark(USB_ATTACH_PHASE_RESET);
         USBH_LL_ResetPort(phost);
 
         /* Make sure to start with Default address */
@@ -497,6 +507,11 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
 
       if (phost->device.PortEnabled == 1U)
       {
+        /* Fast attach: wait for the reset recovery time without blocking */
+        if (!USB_ATTACH_ResetRecovered())
+        {
+          break;
+        }
         USBH_UsrLog("USB Device Reset Completed");
         phost->device.RstCnt = 0U;
         phost->gState = HOST_DEV_ATTACHED;
@@ -517,6 +532,10 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
             phost->gState = HOST_IDLE;
           }
         }
+        else if (USB_ATTACH_IsFast())
+        {
+          phost->Timeout = USB_ATTACH_ElapsedMs();
+        }
         else
         {
           phost->Timeout += 10U;
@@ -540,8 +559,12 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
         phost->pUser(phost, HOST_USER_CONNECTION);
       }
 
-      /* Wait for 100 ms after Reset */
-      USBH_Delay(100U);
+      /* Wait for 100 ms after Reset, the fast attach already waited for the reset recovery time */
+      if (!USB_ATTACH_IsFast())
+      {
+        USBH_Delay(100U);
+      }
+      USB_ATTACH_Mark(USB_ATTACH_PHASE_ENUMERATION);
 
       phost->device.speed = USBH_LL_GetSpeed(phost);
 
@@ -577,6 +600,7 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
       {
         /* The function shall return USBH_OK when full enumeration is complete */
         USBH_UsrLog("Enumeration done.");
+        USB_ATTACH_Mark(USB_ATTACH_PHASE_CLASS);
 
         phost->device.current_interface = 0U;
 
@@ -760,6 +784,7 @@ USBH_StatusTypeDef  USBH_Process(USBH_HandleTypeDef *phost)
 
     case HOST_DEV_DISCONNECTED :
       phost->device.is_disconnected = 0U;
+      USB_ATTACH_Disconnected();
 
       DeInitStateMachine(phost);
 
@@ -912,7 +937,8 @@ static USBH_StatusTypeDef USBH_HandleEnum(USBH_HandleTypeDef *phost)
 
         /* user callback for device address assigned */
         USBH_UsrLog("Address (#%d) assigned.", phost->device.address);
-        phost->EnumState = ENUM_GET_CFG_DESC;
+        /* Fast attach: the serial number selects the cached configuration descriptor */
+        phost->EnumState = USB_ATTACH_IsFast() ? ENUM_GET_SERIALNUM_STRING_DESC : ENUM_GET_CFG_DESC;
 
         /* modify control channels to update device address */
         USBH_OpenPipe(phost, phost->Control.pipe_in, 0x80U,  phost->device.address,
@@ -978,7 +1004,15 @@ static USBH_StatusTypeDef USBH_HandleEnum(USBH_HandleTypeDef *phost)
       ReqStatus = USBH_Get_CfgDesc(phost, phost->device.CfgDesc.wTotalLength);
       if (ReqStatus == USBH_OK)
       {
-        phost->EnumState = ENUM_GET_MFC_STRING_DESC;
+        if (USB_ATTACH_IsFast())
+        {
+          /* Fast attach: the serial number was already read, the other strings are skipped */
+          Status = USBH_OK;
+        }
+        else
+        {
+          phost->EnumState = ENUM_GET_MFC_STRING_DESC;
+        }
       }
       else if (ReqStatus == USBH_NOT_SUPPORTED)
       {
@@ -1120,11 +1154,13 @@ static USBH_StatusTypeDef USBH_HandleEnum(USBH_HandleTypeDef *phost)
         {
           /* User callback for Serial number string */
           USBH_UsrLog("Serial Number : %s", (char *)(void *)phost->device.Data);
+          USB_ATTACH_SetSerial((char *)(void *)phost->device.Data);
           Status = USBH_OK;
         }
         else if (ReqStatus == USBH_NOT_SUPPORTED)
         {
           USBH_UsrLog("Serial Number : N/A");
+          USB_ATTACH_SetSerial("");
           Status = USBH_OK;
         }
         else
@@ -1135,8 +1171,16 @@ static USBH_StatusTypeDef USBH_HandleEnum(USBH_HandleTypeDef *phost)
       else
       {
         USBH_UsrLog("Serial Number : N/A");
+        USB_ATTACH_SetSerial("");
         Status = USBH_OK;
       }
+
+      /* Fast attach: skip the configuration descriptor requests of a known device */
+      if ((Status == USBH_OK) && USB_ATTACH_IsFast() && !USB_ATTACH_RestoreConfig(phost))
+      {
+        phost->EnumState = ENUM_GET_CFG_DESC;
+        Status = USBH_BUSY;
+      }
       break;
 
     default:
@@ -20,13 +20,22 @@
 /* Includes ------------------------------------------------------------------*/
 #include "ff_gen_drv.h"
 #include "usbh_diskio_dma.h"
+#include "usb_tuning.h"
+#include "usb_unit.h"
+#include "usb_trim.h"
+#include "usb_cache.h"
+#include "usb_iosched.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 
-#define USB_DEFAULT_BLOCK_SIZE 512
+/* Erase block of typical USB flash drives without Block Limits VPD page, volumes are aligned to it like
+   partitioning tools do. Units smaller than USB_ERASE_BLOCK_MIN_COUNT erase blocks are not aligned. */
+#define USB_ERASE_BLOCK_BYTES     (1024U * 1024U)
+#define USB_ERASE_BLOCK_MIN_COUNT 32U
 
 /* Private variables ---------------------------------------------------------*/
+/* One sector of the largest supported block size for unaligned DMA buffers */
 static DWORD scratch[_MAX_SS / 4];
 extern USBH_HandleTypeDef  hUSBHost;
 
@@ -41,6 +50,7 @@ DRESULT USBH_read (BYTE, BYTE*, DWORD, UINT);
 
 #if _USE_IOCTL == 1
   DRESULT USBH_ioctl (BYTE, BYTE, void*);
+static DWORD USBH_erase_block (const MSC_LUNTypeDef*);
 #endif /* _USE_IOCTL == 1 */
 
 const Diskio_drvTypeDef  USBH_Driver =
@@ -67,7 +77,8 @@ DSTATUS USBH_initialize(BYTE lun)
 {
   /* CAUTION : USB Host library has to be initialized in the application */
 
-  return RES_OK;
+  /* Acknowledges a medium change when FatFs mounts the volume again */
+  return USB_UNIT_Initialize(&hUSBHost, lun);
 }
 
 /**
@@ -77,18 +88,8 @@ DSTATUS USBH_initialize(BYTE lun)
   */
 DSTATUS USBH_status(BYTE lun)
 {
-  DRESULT res = RES_ERROR;
-
-  if(USBH_MSC_UnitIsReady(&hUSBHost, lun))
-  {
-    res = RES_OK;
-  }
-  else
-  {
-    res = RES_ERROR;
-  }
-
-  return res;
+  /* Called for every file system access, answered from the tracked state without a bus transaction */
+  return USB_UNIT_Status(lun);
 }
 /**
   * @brief  Reads Sector(s)
@@ -103,16 +104,27 @@ DRESULT USBH_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
   DRESULT res = RES_ERROR;
   MSC_LUNTypeDef info;
   USBH_StatusTypeDef  status = USBH_OK;
+  UINT ss = USBH_MSC_GetBlockSize(&hUSBHost, lun);
+
+  /* Sectors are logical blocks of the unit, 512 to _MAX_SS bytes */
+  if (ss > _MAX_SS)
+  {
+    return RES_PARERR;
+  }
+
+  /* Bulk request of the I/O scheduler, urgent requests are served between its commands */
+  USB_IOSCHED_BulkBegin(sector);
 
   if (((DWORD)buff & 3) && (((HCD_HandleTypeDef *)hUSBHost.pData)->Init.dma_enable))
   {
     while ((count--)&&(status == USBH_OK))
     {
+      USB_IOSCHED_Yield(&hUSBHost);
       status = USBH_MSC_Read(&hUSBHost, lun, sector + count, (uint8_t *)scratch, 1);
 
       if(status == USBH_OK)
       {
-        memcpy (&buff[count * _MAX_SS] ,scratch, _MAX_SS);
+        memcpy (&buff[count * ss] ,scratch, ss);
       }
       else
       {
@@ -122,8 +134,19 @@ DRESULT USBH_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
   }
   else
   {
-    status = USBH_MSC_Read(&hUSBHost, lun, sector, buff, count);
+    /* Split into commands of the tuned size and alignment, see usb_tuning.h */
+    while ((count > 0U) && (status == USBH_OK))
+    {
+      UINT chunk = USB_IOSCHED_ChunkSectors(ss, USB_TUNING_ChunkSectors(sector, count));
+
+      USB_IOSCHED_Yield(&hUSBHost);
+      status = USBH_MSC_Read(&hUSBHost, lun, sector, buff, chunk);
+      sector += chunk;
+      buff += chunk * ss;
+      count -= chunk;
+    }
   }
+  USB_IOSCHED_BulkEnd(status == USBH_OK);
 
   if(status == USBH_OK)
   {
@@ -165,15 +188,30 @@ DRESULT USBH_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
   DRESULT res = RES_ERROR;
   MSC_LUNTypeDef info;
   USBH_StatusTypeDef  status = USBH_OK;
+  UINT ss = USBH_MSC_GetBlockSize(&hUSBHost, lun);
+  BOOL fua;
+
+  if (ss > _MAX_SS)
+  {
+    return RES_PARERR;
+  }
+
+  /* Collected TRIM ranges of reallocated clusters must not unmap the new data */
+  USB_TRIM_Write(&hUSBHost, lun, sector, count);
+  /* Metadata from the window may bypass the write cache, other data is flushed at CTRL_SYNC */
+  fua = USB_CACHE_Write(&hUSBHost, lun, buff);
+  USB_IOSCHED_BulkBegin(sector);
 
   if (((DWORD)buff & 3) && (((HCD_HandleTypeDef *)hUSBHost.pData)->Init.dma_enable))
   {
 
     while (count--)
     {
-      memcpy (scratch, &buff[count * _MAX_SS], _MAX_SS);
+      memcpy (scratch, &buff[count * ss], ss);
 
-      status = USBH_MSC_Write(&hUSBHost, lun, sector + count, (BYTE *)scratch, 1) ;
+      USB_IOSCHED_Yield(&hUSBHost);
+      status = fua ? USBH_MSC_WriteFUA(&hUSBHost, lun, sector + count, (BYTE *)scratch, 1)
+                   : USBH_MSC_Write(&hUSBHost, lun, sector + count, (BYTE *)scratch, 1);
       if(status == USBH_FAIL)
       {
         break;
@@ -182,8 +220,20 @@ DRESULT USBH_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
   }
   else
   {
-    status = USBH_MSC_Write(&hUSBHost, lun, sector, (BYTE *)buff, count);
+    /* Split into commands of the tuned size and alignment, see usb_tuning.h */
+    while ((count > 0U) && (status == USBH_OK))
+    {
+      UINT chunk = USB_IOSCHED_ChunkSectors(ss, USB_TUNING_ChunkSectors(sector, count));
+
+      USB_IOSCHED_Yield(&hUSBHost);
+      status = fua ? USBH_MSC_WriteFUA(&hUSBHost, lun, sector, (BYTE *)buff, chunk)
+                   : USBH_MSC_Write(&hUSBHost, lun, sector, (BYTE *)buff, chunk);
+      sector += chunk;
+      buff += chunk * ss;
+      count -= chunk;
+    }
   }
+  USB_IOSCHED_BulkEnd(status == USBH_OK);
 
   if(status == USBH_OK)
   {
@@ -234,6 +284,15 @@ DRESULT USBH_ioctl(BYTE lun, BYTE cmd, void *buff)
   {
   /* Make sure that no pending write process */
   case CTRL_SYNC:
+    /* Collected TRIM ranges, a failed UNMAP leaves the blocks mapped */
+    USB_TRIM_Flush(&hUSBHost);
+    /* Written data has to be on the medium, not only in the write cache of the device */
+    res = (USB_CACHE_Sync(&hUSBHost, lun) == USBH_OK) ? RES_OK : RES_ERROR;
+    break;
+
+  /* Inform device that the data on the block of sectors is no longer used (DWORD[2]) */
+  case CTRL_TRIM:
+    USB_TRIM_Add(&hUSBHost, lun, ((DWORD*)buff)[0], ((DWORD*)buff)[1]);
     res = RES_OK;
     break;
 
@@ -241,7 +300,8 @@ DRESULT USBH_ioctl(BYTE lun, BYTE cmd, void *buff)
   case GET_SECTOR_COUNT :
     if(USBH_MSC_GetLUNInfo(&hUSBHost, lun, &info) == USBH_OK)
     {
-      *(DWORD*)buff = info.capacity.block_nbr;
+      /* FatFs addresses 32 bit sectors */
+      *(DWORD*)buff = (info.capacity.block_nbr > 0xFFFFFFFFU) ? 0xFFFFFFFFU : (DWORD)info.capacity.block_nbr;
       res = RES_OK;
     }
     else
@@ -254,7 +314,8 @@ DRESULT USBH_ioctl(BYTE lun, BYTE cmd, void *buff)
   case GET_SECTOR_SIZE :
     if(USBH_MSC_GetLUNInfo(&hUSBHost, lun, &info) == USBH_OK)
     {
-      *(DWORD*)buff = info.capacity.block_size;
+      /* FatFs passes a WORD, needed with _MAX_SS larger than _MIN_SS */
+      *(WORD*)buff = (WORD)info.capacity.block_size;
       res = RES_OK;
     }
     else
@@ -268,7 +329,7 @@ DRESULT USBH_ioctl(BYTE lun, BYTE cmd, void *buff)
 
     if(USBH_MSC_GetLUNInfo(&hUSBHost, lun, &info) == USBH_OK)
     {
-      *(DWORD*)buff = info.capacity.block_size / USB_DEFAULT_BLOCK_SIZE;
+      *(DWORD*)buff = USBH_erase_block(&info);
       res = RES_OK;
     }
     else
@@ -277,12 +338,65 @@ DRESULT USBH_ioctl(BYTE lun, BYTE cmd, void *buff)
     }
     break;
 
+    /* Get optimal transfer length and alignment in unit of sector (DWORD[2]) */
+  case GET_OPTIMAL_TRANSFER :
+
+    if(USBH_MSC_GetLUNInfo(&hUSBHost, lun, &info) != USBH_OK)
+    {
+      res = RES_ERROR;
+    }
+    else if(lun == 0)
+    {
+      /* Commands of USBH_read and USBH_write: calibration, Block Limits VPD page or maximum transfer length */
+      ((DWORD*)buff)[0] = usbTransferTuning.m_MaxSectors;
+      ((DWORD*)buff)[1] = usbTransferTuning.m_AlignSectors;
+      res = RES_OK;
+    }
+    else
+    {
+      /* The transfer tuning is calibrated on LUN 0, other units report their own Block Limits VPD page */
+      uint32_t length, granularity;
+      if(!USBH_MSC_GetOptimalTransfer(&hUSBHost, lun, &length, &granularity) || length == 0)
+      {
+        length = USBH_MSC_GetMaxTransfer(&hUSBHost, lun);
+      }
+      ((DWORD*)buff)[0] = length;
+      ((DWORD*)buff)[1] = (granularity > 1) ? granularity : 1;
+      res = RES_OK;
+    }
+    break;
+
   default:
     res = RES_PARERR;
   }
 
   return res;
 }
+
+/**
+  * @brief  Returns the erase block which f_mkfs aligns the data area to
+  * @param  info: LUN info
+  * @retval Erase block in unit of sector
+  */
+static DWORD USBH_erase_block(const MSC_LUNTypeDef *info)
+{
+  DWORD blocks;
+
+  /* Optimal transfer length granularity of the Block Limits VPD page */
+  if (info->limits.optimal_granularity > 1U)
+  {
+    return info->limits.optimal_granularity;
+  }
+
+  /* Rotating media have no erase blocks */
+  if ((info->limits.rotation_rate > 1U) || (info->capacity.block_size == 0U))
+  {
+    return 1U;
+  }
+
+  blocks = USB_ERASE_BLOCK_BYTES / info->capacity.block_size;
+  return (info->capacity.block_nbr >= (uint64_t)blocks * USB_ERASE_BLOCK_MIN_COUNT) ? blocks : 1U;
+}
 #endif /* _USE_IOCTL == 1 */
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -40,6 +40,12 @@ EndBSPDependencies */
 #include "usbh_msc.h"
 #include "usbh_msc_bot.h"
 #include "usbh_msc_scsi.h"
+#include "usb_trace.h"
+#include "usb_latency.h"
+#include "usb_time_measurement.h"
+#include "usb_attach.h"
+#include "usb_recovery.h"
+#include "usb_unit.h"
 
 
 /** @addtogroup USBH_LIB
@@ -106,6 +112,14 @@ static USBH_StatusTypeDef USBH_MSC_SOFProcess(USBH_HandleTypeDef *phost);
 
 static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_t lun);
 
+static void USBH_MSC_CapacityRead(USBH_HandleTypeDef *phost);
+
+static void USBH_MSC_LUNAttached(USBH_HandleTypeDef *phost);
+
+static void USBH_MSC_FinishPoll(USBH_HandleTypeDef *phost);
+
+static uint8_t USBH_MSC_NextVPDPage(const SCSI_BlockLimitsTypeDef *limits, uint8_t page);
+
 USBH_ClassTypeDef  USBH_msc =
 {
   "MSC",
@@ -232,6 +246,8 @@ static USBH_StatusTypeDef USBH_MSC_InterfaceDeInit(USBH_HandleTypeDef *phost)
 {
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
 
+  USB_UNIT_Detached();
+
   if (MSC_Handle->OutPipe)
   {
     USBH_ClosePipe(phost, MSC_Handle->OutPipe);
@@ -273,8 +289,15 @@ static USBH_StatusTypeDef USBH_MSC_ClassRequest(USBH_HandleTypeDef *phost)
   {
     case MSC_REQ_IDLE:
     case MSC_REQ_GET_MAX_LUN:
-      /* Issue GetMaxLUN request */
-      status = USBH_MSC_BOT_REQ_GetMaxLUN(phost, &MSC_Handle->max_lun);
+      /* Issue GetMaxLUN request, the fast attach restores the response of a known device */
+      if (USB_ATTACH_CachedMaxLUN(&MSC_Handle->max_lun))
+      {
+        status = USBH_OK;
+      }
+      else
+      {
+        status = USBH_MSC_BOT_REQ_GetMaxLUN(phost, &MSC_Handle->max_lun);
+      }
 
       /* When devices do not support the GetMaxLun request, this should
          be considred as only one logical unit is supported */
@@ -324,13 +347,16 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
   USBH_StatusTypeDef error = USBH_BUSY;
   USBH_StatusTypeDef scsi_status = USBH_BUSY;
   USBH_StatusTypeDef ready_status = USBH_BUSY;
+  uint8_t lun;
 
   switch (MSC_Handle->state)
   {
     case MSC_INIT:
+    case MSC_PERIODIC_CHECK:
 
       if (MSC_Handle->current_lun < MSC_Handle->max_lun)
       {
+        lun = (uint8_t)MSC_Handle->current_lun;
 
         MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_NOT_READY;
         /* Switch MSC REQ state machine */
@@ -338,7 +364,15 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
         {
           case MSC_INIT:
             USBH_UsrLog("LUN #%d: ", MSC_Handle->current_lun);
-            MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_READ_INQUIRY;
+            /* Fast attach: skip INQUIRY of a known device */
+            if (USB_ATTACH_CachedLUN((uint8_t)MSC_Handle->current_lun, &MSC_Handle->unit[MSC_Handle->current_lun].inquiry, NULL, NULL))
+            {
+              MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_TEST_UNIT_READY;
+            }
+            else
+            {
+              MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_READ_INQUIRY;
+            }
             MSC_Handle->timer = phost->Timer;
             break;
 
@@ -383,6 +417,14 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
               MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_READ_CAPACITY10;
               MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_OK;
               MSC_Handle->unit[MSC_Handle->current_lun].prev_ready_state = USBH_OK;
+
+              /* Fast attach: skip READ CAPACITY of a known device, a polled unit may have a new medium */
+              if ((MSC_Handle->state == MSC_INIT) &&
+                  USB_ATTACH_CachedLUN((uint8_t)MSC_Handle->current_lun, NULL, &MSC_Handle->unit[MSC_Handle->current_lun].capacity,
+                                       &MSC_Handle->unit[MSC_Handle->current_lun].limits))
+              {
+                USBH_MSC_LUNAttached(phost);
+              }
             }
             if (ready_status == USBH_FAIL)
             {
@@ -422,9 +464,13 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
                 USBH_UsrLog("Block number : %lu", (int32_t)(MSC_Handle->unit[MSC_Handle->current_lun].capacity.block_nbr));
                 USBH_UsrLog("Block Size   : %lu", (int32_t)(MSC_Handle->unit[MSC_Handle->current_lun].capacity.block_size));
               }
-              MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
-              MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_OK;
-              MSC_Handle->current_lun++;
+              /* More than 2^32 blocks are reported by Read Capacity(16) */
+              if (MSC_Handle->unit[MSC_Handle->current_lun].capacity.block_nbr == SCSI_CDB10_MAX_LBA)
+              {
+                MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_READ_CAPACITY16;
+                break;
+              }
+              USBH_MSC_CapacityRead(phost);
             }
             else if (scsi_status == USBH_FAIL)
             {
@@ -440,17 +486,80 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
             }
             break;
 
+          case MSC_READ_CAPACITY16:
+            scsi_status = USBH_MSC_SCSI_ReadCapacity16(phost, (uint8_t)MSC_Handle->current_lun, &MSC_Handle->unit[MSC_Handle->current_lun].capacity);
+
+            if (scsi_status == USBH_OK)
+            {
+              USBH_MSC_CapacityRead(phost);
+            }
+            else if (scsi_status == USBH_FAIL)
+            {
+              MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_REQUEST_SENSE;
+            }
+            else
+            {
+              if (scsi_status == USBH_UNRECOVERED_ERROR)
+              {
+                MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
+                MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_ERROR;
+              }
+            }
+            break;
+
+          case MSC_READ_VPD:
+            scsi_status = USBH_MSC_SCSI_InquiryVPD(phost, (uint8_t)MSC_Handle->current_lun, MSC_Handle->unit[MSC_Handle->current_lun].vpd_page,
+                                                   &MSC_Handle->unit[MSC_Handle->current_lun].limits);
+
+            /* A page which is not implemented fails with ILLEGAL REQUEST, its fields stay 0 */
+            if ((scsi_status == USBH_OK) || (scsi_status == USBH_FAIL))
+            {
+              MSC_Handle->unit[MSC_Handle->current_lun].vpd_page = USBH_MSC_NextVPDPage(&MSC_Handle->unit[MSC_Handle->current_lun].limits,
+                                                                                         MSC_Handle->unit[MSC_Handle->current_lun].vpd_page);
+              if (MSC_Handle->unit[MSC_Handle->current_lun].vpd_page == SCSI_VPD_PAGE_SUPPORTED)
+              {
+                USBH_UsrLog("Optimal transfer : %lu blocks, granularity %lu blocks",
+                            (uint32_t)MSC_Handle->unit[MSC_Handle->current_lun].limits.optimal_transfer_blocks,
+                            (uint32_t)MSC_Handle->unit[MSC_Handle->current_lun].limits.optimal_granularity);
+                USBH_MSC_LUNAttached(phost);
+              }
+            }
+            else
+            {
+              if (scsi_status == USBH_UNRECOVERED_ERROR)
+              {
+                MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
+                MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_ERROR;
+              }
+            }
+            break;
+
           case MSC_REQUEST_SENSE:
             scsi_status = USBH_MSC_SCSI_RequestSense(phost, (uint8_t)MSC_Handle->current_lun, &MSC_Handle->unit[MSC_Handle->current_lun].sense);
 
             if (scsi_status == USBH_OK)
             {
+              /* The medium changed or was removed, do not use cached LUN info. UNIT ATTENTION after the
+                 power on or the port reset (29h) keeps it. */
+              if ((MSC_Handle->unit[MSC_Handle->current_lun].sense.asc == SCSI_ASC_NOT_READY_TO_READY_CHANGE) ||
+                  (MSC_Handle->unit[MSC_Handle->current_lun].sense.asc == SCSI_ASC_MEDIUM_NOT_PRESENT))
+              {
+                USB_ATTACH_Invalidate((uint8_t)MSC_Handle->current_lun);
+              }
+              /* A poll repeats TEST UNIT READY only after a UNIT ATTENTION, a unit which is not ready is
+                 polled again after USB_UNIT_POLL_MS */
               if ((MSC_Handle->unit[MSC_Handle->current_lun].sense.key == SCSI_SENSE_KEY_UNIT_ATTENTION) ||
-                  (MSC_Handle->unit[MSC_Handle->current_lun].sense.key == SCSI_SENSE_KEY_NOT_READY))
+                  ((MSC_Handle->unit[MSC_Handle->current_lun].sense.key == SCSI_SENSE_KEY_NOT_READY) &&
+                   (MSC_Handle->state == MSC_INIT)))
               {
 
                 if ((phost->Timer - MSC_Handle->timer) < 10000U)
                 {
+                  if (MSC_Handle->state == MSC_PERIODIC_CHECK)
+                  {
+                    /* Reports a medium change */
+                    USB_UNIT_Sense((uint8_t)MSC_Handle->current_lun, &MSC_Handle->unit[MSC_Handle->current_lun].sense);
+                  }
                   MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_TEST_UNIT_READY;
                   break;
                 }
@@ -459,6 +568,7 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
               USBH_UsrLog("Sense Key  : %x", MSC_Handle->unit[MSC_Handle->current_lun].sense.key);
               USBH_UsrLog("Additional Sense Code : %x", MSC_Handle->unit[MSC_Handle->current_lun].sense.asc);
               USBH_UsrLog("Additional Sense Code Qualifier: %x", MSC_Handle->unit[MSC_Handle->current_lun].sense.ascq);
+              USB_UNIT_Sense((uint8_t)MSC_Handle->current_lun, &MSC_Handle->unit[MSC_Handle->current_lun].sense);
               MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
               MSC_Handle->current_lun++;
             }
@@ -478,6 +588,7 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
             break;
 
           case MSC_UNRECOVERED_ERROR:
+            USB_UNIT_Failed((uint8_t)MSC_Handle->current_lun);
             MSC_Handle->current_lun++;
             break;
 
@@ -485,6 +596,15 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
             break;
         }
 
+        /* A poll of USB_UNIT_PollDue ends with the polled unit */
+        if ((MSC_Handle->state == MSC_PERIODIC_CHECK) &&
+            ((MSC_Handle->current_lun != lun) || (MSC_Handle->unit[lun].state == MSC_IDLE)))
+        {
+          MSC_Handle->unit[lun].state = MSC_IDLE;
+          MSC_Handle->current_lun = 0U;
+          MSC_Handle->state = MSC_IDLE;
+        }
+
 #if (USBH_USE_OS == 1U)
         phost->os_msg = (uint32_t)USBH_CLASS_EVENT;
 #if (osCMSIS < 0x20000U)
@@ -507,11 +627,21 @@ static USBH_StatusTypeDef USBH_MSC_Process(USBH_HandleTypeDef *phost)
         (void)osMessageQueuePut(phost->os_event, &phost->os_msg, 0U, NULL);
 #endif
 #endif
+        USB_ATTACH_Ready(phost);
         phost->pUser(phost, HOST_USER_CLASS_ACTIVE);
       }
       break;
 
     case MSC_IDLE:
+      /* Readiness is tracked from command results, only units which are not ready are polled. The poll
+         runs through the TEST UNIT READY state of the initialization without blocking the host. */
+      if (USB_UNIT_PollDue(phost, &lun))
+      {
+        MSC_Handle->current_lun = lun;
+        MSC_Handle->unit[lun].state = MSC_TEST_UNIT_READY;
+        MSC_Handle->timer = phost->Timer;
+        MSC_Handle->state = MSC_PERIODIC_CHECK;
+      }
       error = USBH_OK;
       break;
 
@@ -557,6 +687,7 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
 
       if (scsi_status == USBH_OK)
       {
+        USB_UNIT_Ready(lun);
         MSC_Handle->unit[lun].state = MSC_IDLE;
         error = USBH_OK;
       }
@@ -568,8 +699,8 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
       {
         if (scsi_status == USBH_UNRECOVERED_ERROR)
         {
+          /* Transport error after the reset recovery of the BOT state machine */
           MSC_Handle->unit[lun].state = MSC_UNRECOVERED_ERROR;
-          error = USBH_FAIL;
         }
       }
 
@@ -588,6 +719,7 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
 
       if (scsi_status == USBH_OK)
       {
+        USB_UNIT_Ready(lun);
         MSC_Handle->unit[lun].state = MSC_IDLE;
         error = USBH_OK;
       }
@@ -599,8 +731,8 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
       {
         if (scsi_status == USBH_UNRECOVERED_ERROR)
         {
+          /* Transport error after the reset recovery of the BOT state machine */
           MSC_Handle->unit[lun].state = MSC_UNRECOVERED_ERROR;
-          error = USBH_FAIL;
         }
       }
 
@@ -622,10 +754,20 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
         USBH_UsrLog("Sense Key  : %x", MSC_Handle->unit[lun].sense.key);
         USBH_UsrLog("Additional Sense Code : %x", MSC_Handle->unit[lun].sense.asc);
         USBH_UsrLog("Additional Sense Code Qualifier: %x", MSC_Handle->unit[lun].sense.ascq);
-        MSC_Handle->unit[lun].state = MSC_IDLE;
-        MSC_Handle->unit[lun].error = MSC_ERROR;
+        USB_UNIT_Sense(lun, &MSC_Handle->unit[lun].sense);
 
-        error = USBH_FAIL;
+        if (USB_RECOVERY_SenseRetry(&MSC_Handle->unit[lun].sense))
+        {
+          /* Transient condition, send the command again */
+          USB_RECOVERY_Resend(phost, lun);
+        }
+        else
+        {
+          MSC_Handle->unit[lun].state = MSC_IDLE;
+          MSC_Handle->unit[lun].error = MSC_ERROR;
+
+          error = USBH_FAIL;
+        }
       }
       if (scsi_status == USBH_FAIL)
       {
@@ -636,7 +778,6 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
         if (scsi_status == USBH_UNRECOVERED_ERROR)
         {
           MSC_Handle->unit[lun].state = MSC_UNRECOVERED_ERROR;
-          error = USBH_FAIL;
         }
       }
 
@@ -650,6 +791,26 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
 #endif
       break;
 
+    case MSC_UNRECOVERED_ERROR:
+      /* Recovery ladder, see usb_recovery.h */
+      scsi_status = USB_RECOVERY_Process(phost);
+
+      if (scsi_status == USBH_OK)
+      {
+        USB_RECOVERY_Resend(phost, lun);
+      }
+      else if (scsi_status == USBH_FAIL)
+      {
+        USB_UNIT_Failed(lun);
+        MSC_Handle->unit[lun].state = MSC_IDLE;
+        MSC_Handle->unit[lun].error = MSC_ERROR;
+        error = USBH_FAIL;
+      }
+      else
+      {
+      }
+      break;
+
     default:
       break;
 
@@ -657,6 +818,103 @@ static USBH_StatusTypeDef USBH_MSC_RdWrProcess(USBH_HandleTypeDef *phost, uint8_
   return error;
 }
 
+/**
+  * @brief  USBH_MSC_CapacityRead
+  *         The function continues the initialization of the current LUN after
+  *         READ CAPACITY. The VPD pages are only requested from devices which
+  *         implement SPC-3, many flash drives fail or hang on EVPD requests.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void USBH_MSC_CapacityRead(USBH_HandleTypeDef *phost)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  MSC_LUNTypeDef *unit = &MSC_Handle->unit[MSC_Handle->current_lun];
+
+  USBH_memset(&unit->limits, 0, sizeof(SCSI_BlockLimitsTypeDef));
+  if (unit->inquiry.version >= SCSI_VERSION_SPC3)
+  {
+    unit->vpd_page = SCSI_VPD_PAGE_SUPPORTED;
+    unit->state = MSC_READ_VPD;
+  }
+  else
+  {
+    USBH_MSC_LUNAttached(phost);
+  }
+}
+
+/**
+  * @brief  USBH_MSC_LUNAttached
+  *         The function completes the initialization of the current LUN.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void USBH_MSC_LUNAttached(USBH_HandleTypeDef *phost)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+  USB_UNIT_Attached((uint8_t)MSC_Handle->current_lun);
+  MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
+  MSC_Handle->unit[MSC_Handle->current_lun].error = MSC_OK;
+  MSC_Handle->current_lun++;
+}
+
+/**
+  * @brief  USBH_MSC_FinishPoll
+  *         The function completes a running poll of USB_UNIT_PollDue before
+  *         a command is sent outside of the class state machine. A poll
+  *         takes a few commands, it is aborted after USB_UNIT_POLL_TIMEOUT_MS.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void USBH_MSC_FinishPoll(USBH_HandleTypeDef *phost)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint32_t timeout = phost->Timer;
+
+  if (MSC_Handle == NULL)
+  {
+    return;
+  }
+  while (MSC_Handle->state == MSC_PERIODIC_CHECK)
+  {
+    if (((phost->Timer - timeout) > USB_UNIT_POLL_TIMEOUT_MS) || (phost->device.is_connected == 0U))
+    {
+      MSC_Handle->unit[MSC_Handle->current_lun].state = MSC_IDLE;
+      MSC_Handle->hbot.state = BOT_SEND_CBW;
+      MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+      MSC_Handle->current_lun = 0U;
+      MSC_Handle->state = MSC_IDLE;
+      break;
+    }
+    (void)USBH_MSC_Process(phost);
+  }
+}
+
+/**
+  * @brief  USBH_MSC_NextVPDPage
+  *         The function returns the page which is requested after a page, the
+  *         Supported VPD Pages page lists the pages of the device.
+  * @param  limits: limits read so far
+  * @param  page: page which was requested
+  * @retval Next page, SCSI_VPD_PAGE_SUPPORTED if all pages were read
+  */
+static uint8_t USBH_MSC_NextVPDPage(const SCSI_BlockLimitsTypeDef *limits, uint8_t page)
+{
+  /* In ascending order of the page codes */
+  static const uint8_t vpd_pages[] = { SCSI_VPD_PAGE_BLOCK_LIMITS, SCSI_VPD_PAGE_BLOCK_CHARACTERISTICS, SCSI_VPD_PAGE_PROVISIONING };
+  static const uint8_t vpd_bits[] = { SCSI_VPD_BLOCK_LIMITS, SCSI_VPD_BLOCK_CHARACTERISTICS, SCSI_VPD_PROVISIONING };
+
+  for (uint8_t i = 0U; i < sizeof(vpd_pages); i++)
+  {
+    if ((vpd_pages[i] > page) && ((limits->pages & vpd_bits[i]) != 0U))
+    {
+      return vpd_pages[i];
+    }
+  }
+  return SCSI_VPD_PAGE_SUPPORTED;
+}
+
 /**
   * @brief  USBH_MSC_IsReady
   *         The function check if the MSC function is ready
@@ -668,7 +926,8 @@ uint8_t  USBH_MSC_IsReady(USBH_HandleTypeDef *phost)
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
   uint8_t res;
 
-  if ((phost->gState == HOST_CLASS) && (MSC_Handle->state == MSC_IDLE))
+  if ((phost->gState == HOST_CLASS) &&
+      ((MSC_Handle->state == MSC_IDLE) || (MSC_Handle->state == MSC_PERIODIC_CHECK)))
   {
     res = 1U;
   }
@@ -690,7 +949,8 @@ uint8_t  USBH_MSC_GetMaxLUN(USBH_HandleTypeDef *phost)
 {
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
 
-  if ((phost->gState == HOST_CLASS) && (MSC_Handle->state == MSC_IDLE))
+  if ((phost->gState == HOST_CLASS) &&
+      ((MSC_Handle->state == MSC_IDLE) || (MSC_Handle->state == MSC_PERIODIC_CHECK)))
   {
     return (uint8_t)MSC_Handle->max_lun;
   }
@@ -743,6 +1003,90 @@ USBH_StatusTypeDef USBH_MSC_GetLUNInfo(USBH_HandleTypeDef *phost, uint8_t lun, M
   }
 }
 
+/**
+  * @brief  USBH_MSC_GetMaxTransfer
+  *         The function returns the largest number of blocks of a read or write command,
+  *         larger requests have to be split by the caller.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @retval Maximum transfer length reported by the device, limited by the data length
+  *         of the CBW. Without report the transfer length field of Read10/Write10.
+  */
+uint32_t USBH_MSC_GetMaxTransfer(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint32_t max_blocks = SCSI_CDB10_MAX_BLOCKS;
+  uint32_t cbw_blocks;
+
+  if ((MSC_Handle == NULL) || (MSC_Handle->unit[lun].capacity.block_size == 0U))
+  {
+    return max_blocks;
+  }
+
+  cbw_blocks = 0xFFFFFFFFU / MSC_Handle->unit[lun].capacity.block_size;
+  if (MSC_Handle->unit[lun].limits.max_transfer_blocks != 0U)
+  {
+    max_blocks = MSC_Handle->unit[lun].limits.max_transfer_blocks;
+  }
+  return (max_blocks < cbw_blocks) ? max_blocks : cbw_blocks;
+}
+
+/**
+  * @brief  USBH_MSC_GetBlockSize
+  *         The function returns the logical block size of the LUN, the unit of the
+  *         address and length of USBH_MSC_Read and USBH_MSC_Write.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @retval Block size in bytes, 0 if the capacity is not known
+  */
+uint32_t USBH_MSC_GetBlockSize(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+  MSC_HandleTypeDef *MSC_Handle;
+
+  if ((phost->pActiveClass == NULL) || (lun >= MAX_SUPPORTED_LUN))
+  {
+    return 0U;
+  }
+
+  MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  return (MSC_Handle == NULL) ? 0U : MSC_Handle->unit[lun].capacity.block_size;
+}
+
+/**
+  * @brief  USBH_MSC_GetOptimalTransfer
+  *         The function returns the optimal transfer length and granularity of the
+  *         Block Limits VPD page. Transfers should be multiples of the granularity
+  *         and not exceed the optimal length.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @param  length: optimal transfer length in blocks, limited to the maximum transfer length, 0 if not reported
+  * @param  granularity: optimal transfer length granularity in blocks, 0 if not reported
+  * @retval 1 if the device reported the Block Limits VPD page
+  */
+uint8_t USBH_MSC_GetOptimalTransfer(USBH_HandleTypeDef *phost, uint8_t lun,
+                                    uint32_t *length, uint32_t *granularity)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint32_t max_blocks;
+
+  *length = 0U;
+  *granularity = 0U;
+  if ((MSC_Handle == NULL) || (lun >= MAX_SUPPORTED_LUN) ||
+      ((MSC_Handle->unit[lun].limits.pages & SCSI_VPD_BLOCK_LIMITS) == 0U))
+  {
+    return 0U;
+  }
+
+  max_blocks = USBH_MSC_GetMaxTransfer(phost, lun);
+  *length = MSC_Handle->unit[lun].limits.optimal_transfer_blocks;
+  if (*length > max_blocks)
+  {
+    *length = max_blocks;
+  }
+  *granularity = MSC_Handle->unit[lun].limits.optimal_granularity;
+  return 1U;
+}
+
 /**
   * @brief  USBH_MSC_Read
   *         The function performs a Read operation
@@ -760,12 +1104,20 @@ USBH_StatusTypeDef USBH_MSC_Read(USBH_HandleTypeDef *phost,
                                  uint32_t length)
 {
   uint32_t timeout;
+  uint64_t start = USB_GetCycles();
+  USBH_StatusTypeDef status;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
 
+  USB_TRACE(USB_TRACE_MSC_READ_BEGIN, lun, length, address);
+  USBH_MSC_FinishPoll(phost);
+
   if ((phost->device.is_connected == 0U) ||
       (phost->gState != HOST_CLASS) ||
-      (MSC_Handle->unit[lun].state != MSC_IDLE))
+      (MSC_Handle->unit[lun].state != MSC_IDLE) ||
+      (length > USBH_MSC_GetMaxTransfer(phost, lun)))
   {
+    USB_LATENCY_Record(lun, USB_LATENCY_READ, length, 0U, FALSE);
+    USB_TRACE(USB_TRACE_MSC_READ_END, lun, USBH_FAIL, 0);
     return  USBH_FAIL;
   }
 
@@ -773,21 +1125,39 @@ USBH_StatusTypeDef USBH_MSC_Read(USBH_HandleTypeDef *phost,
   MSC_Handle->unit[lun].state = MSC_READ;
   MSC_Handle->rw_lun = lun;
 
+  USB_RECOVERY_Begin(address, pbuf, length);
   USBH_MSC_SCSI_Read(phost, lun, address, pbuf, length);
 
   timeout = phost->Timer;
 
-  while (USBH_MSC_RdWrProcess(phost, lun) == USBH_BUSY)
+  while ((status = USBH_MSC_RdWrProcess(phost, lun)) == USBH_BUSY)
   {
     if (((phost->Timer - timeout) > (10000U * length)) || (phost->device.is_connected == 0U))
     {
+      /* The timeout starts the recovery ladder with the reset recovery */
+      if ((phost->device.is_connected != 0U) && USB_RECOVERY_Timeout(phost, lun))
+      {
+        timeout = phost->Timer;
+        continue;
+      }
+      USB_UNIT_Failed(lun);
       MSC_Handle->state = MSC_IDLE;
+      MSC_Handle->unit[lun].state = MSC_IDLE;
+      MSC_Handle->hbot.state = BOT_SEND_CBW;
+      MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+      USB_RECOVERY_End(phost, USBH_FAIL);
+      USB_LATENCY_Record(lun, USB_LATENCY_READ, length, 0U, FALSE);
+      USB_TRACE(USB_TRACE_MSC_READ_END, lun, USBH_FAIL, 0);
       return USBH_FAIL;
     }
   }
   MSC_Handle->state = MSC_IDLE;
+  USB_RECOVERY_End(phost, status);
+  USB_LATENCY_Record(lun, USB_LATENCY_READ, length,
+                     (uint32_t)USB_CyclesToUs(USB_GetCycles() - start), status == USBH_OK);
+  USB_TRACE(USB_TRACE_MSC_READ_END, lun, status, 0);
 
-  return USBH_OK;
+  return status;
 }
 
 /**
@@ -807,12 +1177,20 @@ USBH_StatusTypeDef USBH_MSC_Write(USBH_HandleTypeDef *phost,
                                   uint32_t length)
 {
   uint32_t timeout;
+  uint64_t start = USB_GetCycles();
+  USBH_StatusTypeDef status;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
 
+  USB_TRACE(USB_TRACE_MSC_WRITE_BEGIN, lun, length, address);
+  USBH_MSC_FinishPoll(phost);
+
   if ((phost->device.is_connected == 0U) ||
       (phost->gState != HOST_CLASS) ||
-      (MSC_Handle->unit[lun].state != MSC_IDLE))
+      (MSC_Handle->unit[lun].state != MSC_IDLE) ||
+      (length > USBH_MSC_GetMaxTransfer(phost, lun)))
   {
+    USB_LATENCY_Record(lun, USB_LATENCY_WRITE, length, 0U, FALSE);
+    USB_TRACE(USB_TRACE_MSC_WRITE_END, lun, USBH_FAIL, 0);
     return  USBH_FAIL;
   }
 
@@ -820,19 +1198,121 @@ USBH_StatusTypeDef USBH_MSC_Write(USBH_HandleTypeDef *phost,
   MSC_Handle->unit[lun].state = MSC_WRITE;
   MSC_Handle->rw_lun = lun;
 
+  USB_RECOVERY_Begin(address, pbuf, length);
   USBH_MSC_SCSI_Write(phost, lun, address, pbuf, length);
 
   timeout = phost->Timer;
-  while (USBH_MSC_RdWrProcess(phost, lun) == USBH_BUSY)
+  while ((status = USBH_MSC_RdWrProcess(phost, lun)) == USBH_BUSY)
   {
     if (((phost->Timer - timeout) > (10000U * length)) || (phost->device.is_connected == 0U))
     {
+      /* The timeout starts the recovery ladder with the reset recovery */
+      if ((phost->device.is_connected != 0U) && USB_RECOVERY_Timeout(phost, lun))
+      {
+        timeout = phost->Timer;
+        continue;
+      }
+      USB_UNIT_Failed(lun);
       MSC_Handle->state = MSC_IDLE;
+      MSC_Handle->unit[lun].state = MSC_IDLE;
+      MSC_Handle->hbot.state = BOT_SEND_CBW;
+      MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+      USB_RECOVERY_End(phost, USBH_FAIL);
+      USB_LATENCY_Record(lun, USB_LATENCY_WRITE, length, 0U, FALSE);
+      USB_TRACE(USB_TRACE_MSC_WRITE_END, lun, USBH_FAIL, 0);
       return USBH_FAIL;
     }
   }
   MSC_Handle->state = MSC_IDLE;
-  return USBH_OK;
+  USB_RECOVERY_End(phost, status);
+  USB_LATENCY_Record(lun, USB_LATENCY_WRITE, length,
+                     (uint32_t)USB_CyclesToUs(USB_GetCycles() - start), status == USBH_OK);
+  USB_TRACE(USB_TRACE_MSC_WRITE_END, lun, status, 0);
+  return status;
+}
+
+/**
+  * @brief  USBH_MSC_WriteFUA
+  *         The function performs a Write operation with force unit access, the
+  *         command completes when the data is on the medium. Recovery resends
+  *         the command with the FUA bit, too.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @param  address: sector address
+  * @param  pbuf: pointer to data
+  * @param  length: number of sector to write
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_WriteFUA(USBH_HandleTypeDef *phost,
+                                     uint8_t lun,
+                                     uint32_t address,
+                                     uint8_t *pbuf,
+                                     uint32_t length)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  USBH_StatusTypeDef status;
+
+  MSC_Handle->unit[lun].write_fua = 1U;
+  status = USBH_MSC_Write(phost, lun, address, pbuf, length);
+  MSC_Handle->unit[lun].write_fua = 0U;
+
+  return status;
+}
+
+/**
+  * @brief  USBH_MSC_IsIdle
+  *         The function checks that no command is in progress, so that a
+  *         command of USBH_MSC_ExecuteSync can be sent. A running poll of a
+  *         unit which is not ready is completed first.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @retval 1 if idle, 0 otherwise
+  */
+uint8_t USBH_MSC_IsIdle(USBH_HandleTypeDef *phost, uint8_t lun)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+
+  USBH_MSC_FinishPoll(phost);
+  if ((phost->gState != HOST_CLASS) || (phost->device.is_connected == 0U) || (MSC_Handle == NULL) ||
+      (lun >= MAX_SUPPORTED_LUN))
+  {
+    return 0U;
+  }
+  return ((MSC_Handle->state == MSC_IDLE) && (MSC_Handle->unit[lun].state == MSC_IDLE)) ? 1U : 0U;
+}
+
+/**
+  * @brief  USBH_MSC_ExecuteSync
+  *         The function sends a command outside of the class state machine
+  *         and waits for the CSW. The bulk-only transport is reset if the
+  *         command times out or the device is detached.
+  * @param  phost: Host handle
+  * @param  lun: logical Unit Number
+  * @param  command: non-blocking SCSI command, e.g. a wrapper of
+  *         USBH_MSC_SCSI_TestUnitReady
+  * @param  arg: argument passed to the command
+  * @param  timeout: timeout in ms
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_ExecuteSync(USBH_HandleTypeDef *phost, uint8_t lun,
+                                        USBH_MSC_CommandTypeDef command, void *arg, uint32_t timeout)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint32_t start = phost->Timer;
+  USBH_StatusTypeDef status;
+
+  do
+  {
+    status = command(phost, lun, arg);
+    if ((status == USBH_BUSY) && (((phost->Timer - start) > timeout) || (phost->device.is_connected == 0U)))
+    {
+      MSC_Handle->hbot.state = BOT_SEND_CBW;
+      MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+      status = USBH_FAIL;
+    }
+  } while (status == USBH_BUSY);
+
+  return status;
 }
 
 /**
@@ -27,6 +27,8 @@ EndBSPDependencies */
 /* Includes ------------------------------------------------------------------*/
 #include "usbh_msc_bot.h"
 #include "usbh_msc.h"
+#include "usb_trace.h"
+#include "usb_recovery.h"
 
 /** @addtogroup USBH_LIB
 * @{
@@ -177,11 +179,15 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
   USBH_URBStateTypeDef URB_Status = USBH_URB_IDLE;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
   uint8_t toggle = 0U;
+#if USB_TRACE_ENABLE
+  BOT_StateTypeDef prevState = MSC_Handle->hbot.state;
+#endif
 
   switch (MSC_Handle->hbot.state)
   {
     case BOT_SEND_CBW:
       MSC_Handle->hbot.cbw.field.LUN = lun;
+      MSC_Handle->hbot.prev_state = BOT_SEND_CBW;
       MSC_Handle->hbot.state = BOT_SEND_CBW_WAIT;
       USBH_BulkSendData(phost, MSC_Handle->hbot.cbw.data,
                         BOT_CBW_LENGTH, MSC_Handle->OutPipe, 1U);
@@ -253,6 +259,11 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
 #endif
 #endif
         }
+        else if (URB_Status == USBH_URB_ERROR)
+        {
+          /* Transaction error, the state of the device is unknown */
+          MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+        }
       }
       break;
 
@@ -325,6 +336,10 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
 #endif
 #endif
       }
+      else if (URB_Status == USBH_URB_ERROR)
+      {
+        MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+      }
       else
       {
       }
@@ -411,6 +426,10 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
 #endif
 #endif
       }
+      else if (URB_Status == USBH_URB_ERROR)
+      {
+        MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+      }
       else
       {
       }
@@ -439,6 +458,12 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
         {
           status = USBH_OK;
         }
+        else if (CSW_Status == BOT_CSW_PHASE_ERROR)
+        {
+          /* Phase error or invalid CSW, the device requires the reset recovery (BOT 5.3.3, 6.5) */
+          MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+          MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
+        }
         else
         {
           status = USBH_FAIL;
@@ -455,7 +480,17 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
       }
       else if (URB_Status == USBH_URB_STALL)
       {
-        MSC_Handle->hbot.state  = BOT_ERROR_IN;
+        /* The CSW is requested again after the halt was cleared, a second STALL
+        requires the reset recovery (BOT 6.7.2) */
+        if (MSC_Handle->hbot.prev_state == BOT_RECEIVE_CSW_WAIT)
+        {
+          MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+        }
+        else
+        {
+          MSC_Handle->hbot.state  = BOT_ERROR_IN;
+          MSC_Handle->hbot.prev_state = BOT_RECEIVE_CSW_WAIT;
+        }
 
 #if (USBH_USE_OS == 1U)
         phost->os_msg = (uint32_t)USBH_URB_EVENT;
@@ -466,6 +501,10 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
 #endif
 #endif
       }
+      else if (URB_Status == USBH_URB_ERROR)
+      {
+        MSC_Handle->hbot.state = BOT_UNRECOVERED_ERROR;
+      }
       else
       {
       }
@@ -510,16 +549,26 @@ USBH_StatusTypeDef USBH_MSC_BOT_Process(USBH_HandleTypeDef *phost, uint8_t lun)
 
 
     case BOT_UNRECOVERED_ERROR:
-      status = USBH_MSC_BOT_REQ_Reset(phost);
-      if (status == USBH_OK)
+      /* Reset recovery, the command fails and is sent again by the recovery
+      ladder of the MSC class (usb_recovery.h) */
+      error = USB_RECOVERY_ResetRecovery(phost);
+      if (error != USBH_BUSY)
       {
         MSC_Handle->hbot.state = BOT_SEND_CBW;
+        MSC_Handle->hbot.cmd_state = BOT_CMD_SEND;
+        status = USBH_UNRECOVERED_ERROR;
       }
       break;
 
     default:
       break;
   }
+#if USB_TRACE_ENABLE
+  if (MSC_Handle->hbot.state != prevState)
+  {
+    USB_TRACE(USB_TRACE_BOT_STATE, lun, MSC_Handle->hbot.state, prevState);
+  }
+#endif
   return status;
 }
 
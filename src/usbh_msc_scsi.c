@@ -74,6 +74,9 @@ EndBSPDependencies */
 /** @defgroup USBH_MSC_SCSI_Private_FunctionPrototypes
   * @{
   */
+static void USBH_MSC_SCSI_PutBE(uint8_t *field, uint64_t value, uint8_t size);
+static uint32_t USBH_MSC_SCSI_GetBE32(const uint8_t *field);
+static uint8_t USBH_MSC_SCSI_NeedsCdb16(uint64_t address, uint32_t length);
 /**
   * @}
   */
@@ -88,38 +91,95 @@ EndBSPDependencies */
   */
 
 
+/** @defgroup USBH_MSC_SCSI_Private_Variables
+  * @{
+  */
+static const SCSI_CdbDescTypeDef SCSI_CdbTable[SCSI_CDB_COUNT] =
+{
+  /* opcode                     length dir             fixed field                          LBA      length   flags */
+  { OPCODE_TEST_UNIT_READY,      6U,  USB_EP_DIR_OUT, 0U, 0U,                              0U, 0U,  0U, 0U,  SCSI_CDB_FLAG_NO_DATA },
+  { OPCODE_REQUEST_SENSE,        6U,  USB_EP_DIR_IN,  0U, 0U,                              0U, 0U,  4U, 1U,  SCSI_CDB_FLAG_LUN },
+  { OPCODE_INQUIRY,              6U,  USB_EP_DIR_IN,  0U, 0U,                              0U, 0U,  4U, 1U,  SCSI_CDB_FLAG_LUN },
+  { OPCODE_INQUIRY,              6U,  USB_EP_DIR_IN,  1U, INQUIRY_EVPD,                    2U, 1U,  3U, 2U,  0U },  /* page code as LBA */
+  { OPCODE_MODE_SENSE6,          6U,  USB_EP_DIR_IN,  2U, MODE_SENSE_ALL_PAGES,            0U, 0U,  4U, 1U,  0U },
+  { OPCODE_MODE_SENSE6,          6U,  USB_EP_DIR_IN,  1U, MODE_SENSE_DBD,                  2U, 1U,  4U, 1U,  0U },  /* page code as LBA */
+  { OPCODE_READ_CAPACITY10,      10U, USB_EP_DIR_IN,  0U, 0U,                              0U, 0U,  0U, 0U,  0U },
+  { OPCODE_READ_CAPACITY16,      16U, USB_EP_DIR_IN,  1U, SERVICE_ACTION_READ_CAPACITY16,  0U, 0U,  10U, 4U, 0U },
+  { OPCODE_READ10,               10U, USB_EP_DIR_IN,  0U, 0U,                              2U, 4U,  7U, 2U,  SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_WRITE10,              10U, USB_EP_DIR_OUT, 0U, 0U,                              2U, 4U,  7U, 2U,  SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_READ16,               16U, USB_EP_DIR_IN,  0U, 0U,                              2U, 8U,  10U, 4U, SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_WRITE16,              16U, USB_EP_DIR_OUT, 0U, 0U,                              2U, 8U,  10U, 4U, SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_WRITE10,              10U, USB_EP_DIR_OUT, 1U, WRITE_FUA,                       2U, 4U,  7U, 2U,  SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_WRITE16,              16U, USB_EP_DIR_OUT, 1U, WRITE_FUA,                       2U, 8U,  10U, 4U, SCSI_CDB_FLAG_BLOCKS },
+  { OPCODE_SYNCHRONIZE_CACHE10,  10U, USB_EP_DIR_OUT, 0U, 0U,                              2U, 4U,  7U, 2U,  SCSI_CDB_FLAG_BLOCKS | SCSI_CDB_FLAG_NO_DATA },
+  { OPCODE_UNMAP,                10U, USB_EP_DIR_OUT, 0U, 0U,                              0U, 0U,  7U, 2U,  0U },
+};
+/**
+  * @}
+  */
+
+
 /** @defgroup USBH_MSC_SCSI_Private_Functions
   * @{
   */
 
 
 /**
-  * @brief  USBH_MSC_SCSI_TestUnitReady
-  *         Issue TestUnitReady command.
+  * @brief  USBH_MSC_SCSI_Submit
+  *         Issue a command of the CDB table, all commands are sent through this function.
   * @param  phost: Host handle
   * @param  lun: Logical Unit Number
+  * @param  cdb: command
+  * @param  address: logical block address, ignored by commands without LBA field
+  * @param  length: number of blocks, or number of bytes of the data phase for commands
+  *         whose length field does not count blocks
+  * @param  pbuf: pointer to the data of the data phase
   * @retval USBH Status
   */
-USBH_StatusTypeDef USBH_MSC_SCSI_TestUnitReady(USBH_HandleTypeDef *phost,
-                                               uint8_t lun)
+USBH_StatusTypeDef USBH_MSC_SCSI_Submit(USBH_HandleTypeDef *phost,
+                                        uint8_t lun,
+                                        SCSI_CdbTypeDef cdb,
+                                        uint64_t address,
+                                        uint32_t length,
+                                        uint8_t *pbuf)
 {
   USBH_StatusTypeDef    error = USBH_FAIL ;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  const SCSI_CdbDescTypeDef *desc = &SCSI_CdbTable[cdb];
 
   switch (MSC_Handle->hbot.cmd_state)
   {
     case BOT_CMD_SEND:
 
       /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = DATA_LEN_MODE_TEST_UNIT_READY;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_OUT;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
+      if ((desc->flags & SCSI_CDB_FLAG_NO_DATA) != 0U)
+      {
+        MSC_Handle->hbot.cbw.field.DataTransferLength = 0U;
+      }
+      else if ((desc->flags & SCSI_CDB_FLAG_BLOCKS) != 0U)
+      {
+        MSC_Handle->hbot.cbw.field.DataTransferLength = length * MSC_Handle->unit[lun].capacity.block_size;
+      }
+      else
+      {
+        MSC_Handle->hbot.cbw.field.DataTransferLength = length;
+      }
+      MSC_Handle->hbot.cbw.field.Flags = desc->direction;
+      MSC_Handle->hbot.cbw.field.CBLength = desc->length;
 
       USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_CB_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_TEST_UNIT_READY;
+      MSC_Handle->hbot.cbw.field.CB[0] = desc->opcode;
+      MSC_Handle->hbot.cbw.field.CB[desc->fixed_offset] |= desc->fixed_value;
+      if ((desc->flags & SCSI_CDB_FLAG_LUN) != 0U)
+      {
+        MSC_Handle->hbot.cbw.field.CB[1] |= (uint8_t)(lun << 5);
+      }
+      USBH_MSC_SCSI_PutBE(&MSC_Handle->hbot.cbw.field.CB[desc->lba_offset], address, desc->lba_size);
+      USBH_MSC_SCSI_PutBE(&MSC_Handle->hbot.cbw.field.CB[desc->len_offset], length, desc->len_size);
 
       MSC_Handle->hbot.state = BOT_SEND_CBW;
       MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
+      MSC_Handle->hbot.pbuf = pbuf;
       error = USBH_BUSY;
       break;
 
@@ -134,6 +194,19 @@ USBH_StatusTypeDef USBH_MSC_SCSI_TestUnitReady(USBH_HandleTypeDef *phost,
   return error;
 }
 
+/**
+  * @brief  USBH_MSC_SCSI_TestUnitReady
+  *         Issue TestUnitReady command.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_TestUnitReady(USBH_HandleTypeDef *phost,
+                                               uint8_t lun)
+{
+  return USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_TEST_UNIT_READY, 0U, DATA_LEN_MODE_TEST_UNIT_READY, NULL);
+}
+
 /**
   * @brief  USBH_MSC_SCSI_ReadCapacity
   *         Issue Read Capacity command.
@@ -146,45 +219,122 @@ USBH_StatusTypeDef USBH_MSC_SCSI_ReadCapacity(USBH_HandleTypeDef *phost,
                                               uint8_t lun,
                                               SCSI_CapacityTypeDef *capacity)
 {
-  USBH_StatusTypeDef    error = USBH_BUSY ;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
 
-  switch (MSC_Handle->hbot.cmd_state)
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_READ_CAPACITY10, 0U, DATA_LEN_READ_CAPACITY10, data);
+
+  if (error == USBH_OK)
   {
-    case BOT_CMD_SEND:
+    /*assign the capacity*/
+    capacity->block_nbr = USBH_MSC_SCSI_GetBE32(&data[0]);
 
-      /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = DATA_LEN_READ_CAPACITY10;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_IN;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
+    /*assign the page length*/
+    capacity->block_size = (uint16_t)USBH_MSC_SCSI_GetBE32(&data[4]);
+  }
 
-      USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_CB_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_READ_CAPACITY10;
+  return error;
+}
 
-      MSC_Handle->hbot.state = BOT_SEND_CBW;
+/**
+  * @brief  USBH_MSC_SCSI_ReadCapacity16
+  *         Issue Read Capacity(16) command, needed if Read Capacity(10)
+  *         returns the largest LBA 0xFFFFFFFF.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  capacity: pointer to the capacity structure
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_ReadCapacity16(USBH_HandleTypeDef *phost,
+                                                uint8_t lun,
+                                                SCSI_CapacityTypeDef *capacity)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
 
-      MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
-      MSC_Handle->hbot.pbuf = (uint8_t *)(void *)MSC_Handle->hbot.data;
-      error = USBH_BUSY;
-      break;
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_READ_CAPACITY16, 0U, DATA_LEN_READ_CAPACITY16, data);
 
-    case BOT_CMD_WAIT:
+  if (error == USBH_OK)
+  {
+    capacity->block_nbr = ((uint64_t)USBH_MSC_SCSI_GetBE32(&data[0]) << 32U) | USBH_MSC_SCSI_GetBE32(&data[4]);
+    capacity->block_size = (uint16_t)USBH_MSC_SCSI_GetBE32(&data[8]);
+  }
 
-      error = USBH_MSC_BOT_Process(phost, lun);
+  return error;
+}
 
-      if (error == USBH_OK)
-      {
-        /*assign the capacity*/
-        capacity->block_nbr = MSC_Handle->hbot.pbuf[3] | ((uint32_t)MSC_Handle->hbot.pbuf[2] << 8U) | \
-                              ((uint32_t)MSC_Handle->hbot.pbuf[1] << 16U) | ((uint32_t)MSC_Handle->hbot.pbuf[0] << 24U);
+/**
+  * @brief  USBH_MSC_SCSI_ModeSense6
+  *         Issue Mode Sense(6) command and return the write protection of the medium.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  write_protect: set to 1 if the medium is write protected
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_ModeSense6(USBH_HandleTypeDef *phost,
+                                            uint8_t lun,
+                                            uint8_t *write_protect)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
 
-        /*assign the page length*/
-        capacity->block_size = (uint16_t)(MSC_Handle->hbot.pbuf[7] | ((uint32_t)MSC_Handle->hbot.pbuf[6] << 8U));
-      }
-      break;
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_MODE_SENSE6, 0U, DATA_LEN_MODE_SENSE6, data);
 
-    default:
-      break;
+  if (error == USBH_OK)
+  {
+    /* WP bit of the device specific parameter */
+    *write_protect = (uint8_t)(data[2] >> 7);
+  }
+
+  return error;
+}
+
+/**
+  * @brief  USBH_MSC_SCSI_ModeSenseCaching
+  *         Issue Mode Sense6 command for the caching mode page.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  caching: SCSI_CACHING_xxx bits, SCSI_CACHING_PAGE is not set if
+  *         the device did not return the page
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_ModeSenseCaching(USBH_HandleTypeDef *phost,
+                                                 uint8_t lun,
+                                                 uint8_t *caching)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
+  uint32_t page;
+
+  if (MSC_Handle->hbot.cmd_state == BOT_CMD_SEND)
+  {
+    /* Short responses leave the remaining bytes 0 */
+    USBH_memset(data, 0, DATA_LEN_MODE_SENSE_CACHING);
+  }
+
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_MODE_SENSE6_PAGE, SCSI_MODE_PAGE_CACHING,
+                               DATA_LEN_MODE_SENSE_CACHING, data);
+
+  if (error == USBH_OK)
+  {
+    /* DPOFUA bit of the device specific parameter */
+    *caching = ((data[2] & 0x10U) != 0U) ? SCSI_CACHING_DPOFUA : 0U;
+
+    /* The page follows the block descriptors, which the device may return despite DBD */
+    page = 4U + data[3];
+    if (((page + 3U) <= ((uint32_t)data[0] + 1U)) && ((page + 3U) <= DATA_LEN_MODE_SENSE_CACHING) &&
+        ((data[page] & 0x3FU) == SCSI_MODE_PAGE_CACHING))
+    {
+      *caching |= SCSI_CACHING_PAGE;
+      if ((data[page + 2U] & 0x04U) != 0U)
+      {
+        *caching |= SCSI_CACHING_WCE;
+      }
+    }
   }
 
   return error;
@@ -201,61 +351,117 @@ USBH_StatusTypeDef USBH_MSC_SCSI_ReadCapacity(USBH_HandleTypeDef *phost,
 USBH_StatusTypeDef USBH_MSC_SCSI_Inquiry(USBH_HandleTypeDef *phost, uint8_t lun,
                                          SCSI_StdInquiryDataTypeDef *inquiry)
 {
-  USBH_StatusTypeDef error = USBH_FAIL;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
 
-  switch (MSC_Handle->hbot.cmd_state)
-  {
-    case BOT_CMD_SEND:
-
-      /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = DATA_LEN_INQUIRY;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_IN;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
-
-      USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_INQUIRY;
-      MSC_Handle->hbot.cbw.field.CB[1]  = (lun << 5);
-      MSC_Handle->hbot.cbw.field.CB[2]  = 0U;
-      MSC_Handle->hbot.cbw.field.CB[3]  = 0U;
-      MSC_Handle->hbot.cbw.field.CB[4]  = 0x24U;
-      MSC_Handle->hbot.cbw.field.CB[5]  = 0U;
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_INQUIRY, 0U, DATA_LEN_INQUIRY, data);
 
-      MSC_Handle->hbot.state = BOT_SEND_CBW;
+  if (error == USBH_OK)
+  {
+    USBH_memset(inquiry, 0, sizeof(SCSI_StdInquiryDataTypeDef));
+    /*assign Inquiry Data */
+    inquiry->DeviceType = data[0] & 0x1FU;
+    inquiry->PeripheralQualifier = data[0] >> 5U;
+    inquiry->version = data[2];
+
+    if (((uint32_t)data[1] & 0x80U) == 0x80U)
+    {
+      inquiry->RemovableMedia = 1U;
+    }
+    else
+    {
+      inquiry->RemovableMedia = 0U;
+    }
+
+    USBH_memcpy(inquiry->vendor_id, &data[8], 8U);
+    USBH_memcpy(inquiry->product_id, &data[16], 16U);
+    USBH_memcpy(inquiry->revision_id, &data[32], 4U);
+  }
 
-      MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
-      MSC_Handle->hbot.pbuf = (uint8_t *)(void *)MSC_Handle->hbot.data;
-      error = USBH_BUSY;
-      break;
+  return error;
+}
 
-    case BOT_CMD_WAIT:
+/**
+  * @brief  USBH_MSC_SCSI_InquiryVPD
+  *         Issue Inquiry command for a vital product data page and parse the
+  *         Supported VPD Pages, Block Limits, Block Device Characteristics or
+  *         Logical Block Provisioning page.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  page: SCSI_VPD_PAGE_xxx
+  * @param  limits: pointer to the limits structure, the fields of the page are updated
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_InquiryVPD(USBH_HandleTypeDef *phost,
+                                            uint8_t lun,
+                                            uint8_t page,
+                                            SCSI_BlockLimitsTypeDef *limits)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
+  uint32_t page_end;
 
-      error = USBH_MSC_BOT_Process(phost, lun);
+  if (MSC_Handle->hbot.cmd_state == BOT_CMD_SEND)
+  {
+    /* Fields beyond a short response read as not reported */
+    USBH_memset(data, 0, DATA_LEN_VPD);
+  }
 
-      if (error == USBH_OK)
-      {
-        USBH_memset(inquiry, 0, sizeof(SCSI_StdInquiryDataTypeDef));
-        /*assign Inquiry Data */
-        inquiry->DeviceType = MSC_Handle->hbot.pbuf[0] & 0x1FU;
-        inquiry->PeripheralQualifier = MSC_Handle->hbot.pbuf[0] >> 5U;
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_INQUIRY_VPD, page, DATA_LEN_VPD, data);
 
-        if (((uint32_t)MSC_Handle->hbot.pbuf[1] & 0x80U) == 0x80U)
-        {
-          inquiry->RemovableMedia = 1U;
-        }
-        else
+  if ((error == USBH_OK) && (data[1] == page))
+  {
+    page_end = 4U + (((uint32_t)data[2] << 8U) | data[3]);
+    if (page_end > DATA_LEN_VPD)
+    {
+      page_end = DATA_LEN_VPD;
+    }
+
+    switch (page)
+    {
+      case SCSI_VPD_PAGE_SUPPORTED:
+        limits->pages = 0U;
+        for (uint32_t i = 4U; i < page_end; i++)
         {
-          inquiry->RemovableMedia = 0U;
+          if (data[i] == SCSI_VPD_PAGE_BLOCK_LIMITS)
+          {
+            limits->pages |= SCSI_VPD_BLOCK_LIMITS;
+          }
+          else if (data[i] == SCSI_VPD_PAGE_BLOCK_CHARACTERISTICS)
+          {
+            limits->pages |= SCSI_VPD_BLOCK_CHARACTERISTICS;
+          }
+          else if (data[i] == SCSI_VPD_PAGE_PROVISIONING)
+          {
+            limits->pages |= SCSI_VPD_PROVISIONING;
+          }
         }
-
-        USBH_memcpy(inquiry->vendor_id, &MSC_Handle->hbot.pbuf[8], 8U);
-        USBH_memcpy(inquiry->product_id, &MSC_Handle->hbot.pbuf[16], 16U);
-        USBH_memcpy(inquiry->revision_id, &MSC_Handle->hbot.pbuf[32], 4U);
-      }
-      break;
-
-    default:
-      break;
+        break;
+
+      case SCSI_VPD_PAGE_BLOCK_LIMITS:
+        limits->optimal_granularity = (uint16_t)(((uint32_t)data[6] << 8U) | data[7]);
+        limits->max_transfer_blocks = USBH_MSC_SCSI_GetBE32(&data[8]);
+        limits->optimal_transfer_blocks = USBH_MSC_SCSI_GetBE32(&data[12]);
+        limits->max_unmap_blocks = USBH_MSC_SCSI_GetBE32(&data[20]);
+        limits->max_unmap_descriptors = USBH_MSC_SCSI_GetBE32(&data[24]);
+        limits->unmap_granularity = USBH_MSC_SCSI_GetBE32(&data[28]);
+        /* UGAVALID bit */
+        limits->unmap_alignment = ((data[32] & 0x80U) != 0U) ? (USBH_MSC_SCSI_GetBE32(&data[32]) & 0x7FFFFFFFU) : 0U;
+        break;
+
+      case SCSI_VPD_PAGE_BLOCK_CHARACTERISTICS:
+        limits->rotation_rate = (uint16_t)(((uint32_t)data[4] << 8U) | data[5]);
+        break;
+
+      case SCSI_VPD_PAGE_PROVISIONING:
+        limits->provisioning = data[5] & (SCSI_LBP_UNMAP | SCSI_LBP_WRITE_SAME16 | SCSI_LBP_ZEROED);
+        break;
+
+      default:
+        break;
+    }
   }
 
   return error;
@@ -273,46 +479,17 @@ USBH_StatusTypeDef USBH_MSC_SCSI_RequestSense(USBH_HandleTypeDef *phost,
                                               uint8_t lun,
                                               SCSI_SenseTypeDef *sense_data)
 {
-  USBH_StatusTypeDef    error = USBH_FAIL ;
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  USBH_StatusTypeDef error;
 
-  switch (MSC_Handle->hbot.cmd_state)
-  {
-    case BOT_CMD_SEND:
-
-      /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = DATA_LEN_REQUEST_SENSE;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_IN;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
-
-      USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_CB_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_REQUEST_SENSE;
-      MSC_Handle->hbot.cbw.field.CB[1]  = (lun << 5);
-      MSC_Handle->hbot.cbw.field.CB[2]  = 0U;
-      MSC_Handle->hbot.cbw.field.CB[3]  = 0U;
-      MSC_Handle->hbot.cbw.field.CB[4]  = DATA_LEN_REQUEST_SENSE;
-      MSC_Handle->hbot.cbw.field.CB[5]  = 0U;
-
-      MSC_Handle->hbot.state = BOT_SEND_CBW;
-      MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
-      MSC_Handle->hbot.pbuf = (uint8_t *)(void *)MSC_Handle->hbot.data;
-      error = USBH_BUSY;
-      break;
-
-    case BOT_CMD_WAIT:
-
-      error = USBH_MSC_BOT_Process(phost, lun);
-
-      if (error == USBH_OK)
-      {
-        sense_data->key  = MSC_Handle->hbot.pbuf[2] & 0x0FU;
-        sense_data->asc  = MSC_Handle->hbot.pbuf[12];
-        sense_data->ascq = MSC_Handle->hbot.pbuf[13];
-      }
-      break;
+  error = USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_REQUEST_SENSE, 0U, DATA_LEN_REQUEST_SENSE, data);
 
-    default:
-      break;
+  if (error == USBH_OK)
+  {
+    sense_data->key  = data[2] & 0x0FU;
+    sense_data->asc  = data[12];
+    sense_data->ascq = data[13];
   }
 
   return error;
@@ -320,7 +497,9 @@ USBH_StatusTypeDef USBH_MSC_SCSI_RequestSense(USBH_HandleTypeDef *phost,
 
 /**
   * @brief  USBH_MSC_SCSI_Write
-  *         Issue write10 command.
+  *         Issue write10 command, or write16 if the address or the
+  *         length do not fit into the fields of write10. The FUA bit is
+  *         set while the unit has write_fua set.
   * @param  phost: Host handle
   * @param  lun: Logical Unit Number
   * @param  address: sector address
@@ -330,58 +509,29 @@ USBH_StatusTypeDef USBH_MSC_SCSI_RequestSense(USBH_HandleTypeDef *phost,
   */
 USBH_StatusTypeDef USBH_MSC_SCSI_Write(USBH_HandleTypeDef *phost,
                                        uint8_t lun,
-                                       uint32_t address,
+                                       uint64_t address,
                                        uint8_t *pbuf,
                                        uint32_t length)
 {
-  USBH_StatusTypeDef    error = USBH_FAIL ;
-
   MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  SCSI_CdbTypeDef cdb;
 
-  switch (MSC_Handle->hbot.cmd_state)
+  if (MSC_Handle->unit[lun].write_fua != 0U)
   {
-    case BOT_CMD_SEND:
-
-      /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = length * MSC_Handle->unit[0].capacity.block_size;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_OUT;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
-
-      USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_CB_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_WRITE10;
-
-      /*logical block address*/
-      MSC_Handle->hbot.cbw.field.CB[2]  = (((uint8_t *)(void *)&address)[3]);
-      MSC_Handle->hbot.cbw.field.CB[3]  = (((uint8_t *)(void *)&address)[2]);
-      MSC_Handle->hbot.cbw.field.CB[4]  = (((uint8_t *)(void *)&address)[1]);
-      MSC_Handle->hbot.cbw.field.CB[5]  = (((uint8_t *)(void *)&address)[0]);
-
-
-      /*Transfer length */
-      MSC_Handle->hbot.cbw.field.CB[7]  = (((uint8_t *)(void *)&length)[1]) ;
-      MSC_Handle->hbot.cbw.field.CB[8]  = (((uint8_t *)(void *)&length)[0]) ;
-
-
-      MSC_Handle->hbot.state = BOT_SEND_CBW;
-      MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
-      MSC_Handle->hbot.pbuf = pbuf;
-      error = USBH_BUSY;
-      break;
-
-    case BOT_CMD_WAIT:
-      error = USBH_MSC_BOT_Process(phost, lun);
-      break;
-
-    default:
-      break;
+    cdb = USBH_MSC_SCSI_NeedsCdb16(address, length) ? SCSI_CDB_WRITE16_FUA : SCSI_CDB_WRITE10_FUA;
+  }
+  else
+  {
+    cdb = USBH_MSC_SCSI_NeedsCdb16(address, length) ? SCSI_CDB_WRITE16 : SCSI_CDB_WRITE10;
   }
 
-  return error;
+  return USBH_MSC_SCSI_Submit(phost, lun, cdb, address, length, pbuf);
 }
 
 /**
   * @brief  USBH_MSC_SCSI_Read
-  *         Issue Read10 command.
+  *         Issue Read10 command, or Read16 if the address or the
+  *         length do not fit into the fields of Read10.
   * @param  phost: Host handle
   * @param  lun: Logical Unit Number
   * @param  address: sector address
@@ -391,52 +541,104 @@ USBH_StatusTypeDef USBH_MSC_SCSI_Write(USBH_HandleTypeDef *phost,
   */
 USBH_StatusTypeDef USBH_MSC_SCSI_Read(USBH_HandleTypeDef *phost,
                                       uint8_t lun,
-                                      uint32_t address,
+                                      uint64_t address,
                                       uint8_t *pbuf,
                                       uint32_t length)
 {
-  USBH_StatusTypeDef    error = USBH_FAIL ;
-  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
-
-  switch (MSC_Handle->hbot.cmd_state)
-  {
-    case BOT_CMD_SEND:
-
-      /*Prepare the CBW and relevent field*/
-      MSC_Handle->hbot.cbw.field.DataTransferLength = length * MSC_Handle->unit[0].capacity.block_size;
-      MSC_Handle->hbot.cbw.field.Flags = USB_EP_DIR_IN;
-      MSC_Handle->hbot.cbw.field.CBLength = CBW_LENGTH;
-
-      USBH_memset(MSC_Handle->hbot.cbw.field.CB, 0, CBW_CB_LENGTH);
-      MSC_Handle->hbot.cbw.field.CB[0]  = OPCODE_READ10;
-
-      /*logical block address*/
-      MSC_Handle->hbot.cbw.field.CB[2]  = (((uint8_t *)(void *)&address)[3]);
-      MSC_Handle->hbot.cbw.field.CB[3]  = (((uint8_t *)(void *)&address)[2]);
-      MSC_Handle->hbot.cbw.field.CB[4]  = (((uint8_t *)(void *)&address)[1]);
-      MSC_Handle->hbot.cbw.field.CB[5]  = (((uint8_t *)(void *)&address)[0]);
+  SCSI_CdbTypeDef cdb = USBH_MSC_SCSI_NeedsCdb16(address, length) ? SCSI_CDB_READ16 : SCSI_CDB_READ10;
 
+  return USBH_MSC_SCSI_Submit(phost, lun, cdb, address, length, pbuf);
+}
 
-      /*Transfer length */
-      MSC_Handle->hbot.cbw.field.CB[7]  = (((uint8_t *)(void *)&length)[1]) ;
-      MSC_Handle->hbot.cbw.field.CB[8]  = (((uint8_t *)(void *)&length)[0]) ;
+/**
+  * @brief  USBH_MSC_SCSI_SynchronizeCache
+  *         Issue Synchronize Cache(10) command.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  address: first sector to write back
+  * @param  length: number of sectors, 0 writes back the whole cache from address
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_SynchronizeCache(USBH_HandleTypeDef *phost,
+                                                  uint8_t lun,
+                                                  uint32_t address,
+                                                  uint16_t length)
+{
+  return USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_SYNCHRONIZE_CACHE10, address, length, NULL);
+}
 
+/**
+  * @brief  USBH_MSC_SCSI_Unmap
+  *         Issue Unmap command, the parameter list is built in the data buffer of the BOT handle.
+  * @param  phost: Host handle
+  * @param  lun: Logical Unit Number
+  * @param  ranges: sectors to unmap
+  * @param  count: number of ranges, 1..SCSI_UNMAP_MAX_RANGES
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef USBH_MSC_SCSI_Unmap(USBH_HandleTypeDef *phost,
+                                       uint8_t lun,
+                                       const SCSI_UnmapRangeTypeDef *ranges,
+                                       uint8_t count)
+{
+  MSC_HandleTypeDef *MSC_Handle = (MSC_HandleTypeDef *) phost->pActiveClass->pData;
+  uint8_t *data = (uint8_t *)(void *)MSC_Handle->hbot.data;
+  uint32_t param_length = DATA_LEN_UNMAP_HEADER + ((uint32_t)count * DATA_LEN_UNMAP_DESCRIPTOR);
 
-      MSC_Handle->hbot.state = BOT_SEND_CBW;
-      MSC_Handle->hbot.cmd_state = BOT_CMD_WAIT;
-      MSC_Handle->hbot.pbuf = pbuf;
-      error = USBH_BUSY;
-      break;
+  if (MSC_Handle->hbot.cmd_state == BOT_CMD_SEND)
+  {
+    if ((count == 0U) || (count > SCSI_UNMAP_MAX_RANGES))
+    {
+      return USBH_FAIL;
+    }
+    USBH_memset(data, 0, param_length);
+    USBH_MSC_SCSI_PutBE(&data[0], param_length - 2U, 2U);
+    USBH_MSC_SCSI_PutBE(&data[2], param_length - DATA_LEN_UNMAP_HEADER, 2U);
+    for (uint8_t i = 0U; i < count; i++)
+    {
+      uint8_t *desc = &data[DATA_LEN_UNMAP_HEADER + (i * DATA_LEN_UNMAP_DESCRIPTOR)];
+      USBH_MSC_SCSI_PutBE(&desc[0], ranges[i].address, 8U);
+      USBH_MSC_SCSI_PutBE(&desc[8], ranges[i].length, 4U);
+    }
+  }
 
-    case BOT_CMD_WAIT:
-      error = USBH_MSC_BOT_Process(phost, lun);
-      break;
+  return USBH_MSC_SCSI_Submit(phost, lun, SCSI_CDB_UNMAP, 0U, param_length, data);
+}
 
-    default:
-      break;
+/**
+  * @brief  USBH_MSC_SCSI_PutBE
+  *         Store a big endian field of a CDB or a parameter list.
+  * @param  field: first byte of the field
+  * @param  value: value, truncated to the size of the field
+  * @param  size: size of the field in bytes, 0 stores nothing
+  * @retval None
+  */
+static void USBH_MSC_SCSI_PutBE(uint8_t *field, uint64_t value, uint8_t size)
+{
+  while (size > 0U)
+  {
+    size--;
+    field[size] = (uint8_t)value;
+    value >>= 8U;
   }
+}
 
-  return error;
+static uint32_t USBH_MSC_SCSI_GetBE32(const uint8_t *field)
+{
+  return ((uint32_t)field[0] << 24U) | ((uint32_t)field[1] << 16U) | ((uint32_t)field[2] << 8U) | field[3];
+}
+
+/**
+  * @brief  USBH_MSC_SCSI_NeedsCdb16
+  *         Check if a read or write needs the 16 byte CDB.
+  * @param  address: first sector
+  * @param  length: number of sectors
+  * @retval 1 if the LBA or the transfer length do not fit into the 10 byte CDB
+  */
+static uint8_t USBH_MSC_SCSI_NeedsCdb16(uint64_t address, uint32_t length)
+{
+  return ((length > SCSI_CDB10_MAX_BLOCKS) ||
+          ((address + length) > ((uint64_t)SCSI_CDB10_MAX_LBA + 1U))) ? 1U : 0U;
 }
 
 